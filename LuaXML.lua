@@ -30,7 +30,8 @@ local _M = require("LuaXML_lib")
 
 --[[-- saves a Lua var as XML file.
 Basically this simply exports the string representation `xml.str(var)`
-(or `var:str()`), plus a standard header.
+(or `var:str()`), plus a standard header. The file gets compressed if its
+name ends with ".gz" (gzip) or ".zst" (zstd), see `write`.
 
 @function save
 @param var  the variable to be saved, normally a table
@@ -49,106 +50,49 @@ you don't want any header at all, otherwise it should preferably end with a
 newline. Defaults to the standard XML 1.0 declaration:
 	<?xml version="1.0"?>\n
 
+@tparam ?table options  options for `str` (e.g. `{threads = true}`) and `write`
+
 @usage
 var:save("simple.xml")
 var:save("no-comment.xml", nil, "")
 var:save("custom.xml", "a+", "<!-- append mode, no header -->\n", "")
 ]]
-function _M.save(var, filename, filemode, comment, header)
+function _M.save(var, filename, filemode, comment, header, options)
 	if var and filename and #filename > 0 then
-		local file, err = io.open(filename, filemode or "w")
-		if not file then
-			error('error opening "' .. filename .. '" for saving: ' .. err)
-		end
-		file:write(header or '<?xml version="1.0"?>\n')
-		file:write(comment or
-			'<!-- file "' .. filename .. '", generated by LuaXML -->\n\n')
-		file:write(_M.str(var))
-		file:close()
+		_M.write(var, filename, filemode, (header or '<?xml version="1.0"?>\n')
+			.. (comment or '<!-- file "' .. filename .. '", generated by LuaXML -->\n\n'),
+			options)
 	end
 end
 
---[[-- iterate subelements ("XML children") as _key - value_ pairs.
-This function is meant to be called in a generic `for` loop, similar to what
-`ipairs(var)` would do. However you can easily specify additional criteria
-to `match` against here, possibly reducing the overhead needed to test for
-specific subelements.
-
-For the resulting `(k, v)` pairs, note that `k` is just a sequential number
-in the array of matched child elements, and has no direct relation to the
-actual "position" (subtag index) within each `v`'s parent object.
-
-@function children
-
-@param var  the table (LuaXML object) to work on
-@tparam ?string tag  XML tag to be matched
-@tparam ?string key  attribute key to be matched
-@param value  (optional) attribute value to be matched
-
-@tparam ?number maxdepth
-maximum depth allowed, defaults to 1 (only immediate children).
-You can pass 0 or `true` to iterate _all_ children recursively.
-
-@return Lua iterator function and initial state (Lua-internal use) - suitable
-for a `for` loop
-
-@see match
+--[[-- parses XML like `eval`, but yields in between.
+This is meant to be used from within a coroutine (e.g. in an event loop with
+cooperative scheduling): after each slice of (about) `slice` bytes of input,
+it calls `coroutine.yield()` - so other tasks get to run, while the converted
+data stays where it is. Parsing continues when the coroutine gets resumed.
+(If your scheduler expects certain values to be yielded, use `parser` and
+its `step` method directly.)
+
+@function evalyield
+@tparam string xml  the XML to be converted
+@tparam ?number mode  whitespace handling mode, defaults to `WS_TRIM`
+@tparam ?table options  parsing options, see `eval`
+@tparam ?number slice  number of bytes to process between yields,
+defaults to 65536
+@return  a LuaXML object containing the XML data, just like `eval`
 
 @usage
-local xml = require("LuaXML")
-local foobar = xml.eval('<foo><a /><b bar="no" /><c bar="yes" /><a /></foo>')
-
--- iterate over those children that have a "bar" attribute:
-for k, v in foobar:children(nil, "bar") do
-	print(k, v:tag(), v.bar)
-end
--- will print
--- 1       b       no
--- 2       c       yes
-
--- require "bar" to be "yes":
-for k, v in foobar:children(nil, "bar", "yes") do
-	print(k, v:tag(), v.bar)
-end
--- will print
--- 1       c       yes
-
--- iterate "a" tags: (the first and fourth child will match)
-for k, v in foobar:children("a") do
-	print(k, v:tag(), v.bar)
-end
--- will print
--- 1       a       nil
--- 2       a       nil
-
+local co = coroutine.wrap(function() return xml.evalyield(str, nil, nil, 100000) end)
+local result
+repeat result = co() until result -- (or let your event loop resume it)
 ]]
-function _M.children(var, tag, key, value, maxdepth)
-
-	local function get_children(var, tag, key, value, maxdepth)
-		-- pass maxdepth = 1 to retrieve only immediate child nodes
-		local result = {}
-		_M.iterate(var,
-			function(node, depth)
-				-- add matching node to result table
-				if depth > 0 then table.insert(result, node); end
-			end,
-			tag, key, value, true, maxdepth)
-		return result
+function _M.evalyield(xml, mode, options, slice)
+	local parser = _M.parser(xml, mode, options)
+	while true do
+		local done, result = parser:step(slice)
+		if done then return result end
+		coroutine.yield()
 	end
-
-	local function child_iterator(matched, k)
-		k = (k or 0) + 1
-		local v = matched[k]
-		return v and k, v -- key/value pair from matches, or `nil` if no value
-	end
-
-	maxdepth = maxdepth or 1 -- default to 1...
-	-- ...but enumerate all children if it was set to 0 or `true`
-	if maxdepth == 0 or maxdepth == true then maxdepth = nil; end
-
-	-- our "invariant state" will be a table of matched children
-	return child_iterator,
-		get_children(var, tag, key, value, maxdepth)
 end
 
 return _M -- return module (table)
@@ -30,10 +30,29 @@ THE SOFTWARE.
 #include "LuaXML_lib.h"
 
 #include <ctype.h>
+#include <errno.h>
+#include <math.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+#if !defined(_WIN32) && !defined(LUAXML_NO_THREADS)
+# define LUAXML_THREADS // support parallel serialization (see str)
+# include <pthread.h>
+#endif
+#ifdef LUAXML_ZLIB
+# include <zlib.h>
+#endif
+#ifdef LUAXML_ZSTD
+# include <zstd.h>
+#endif
 
 /* compatibility with older Lua versions (<5.2) */
 #if LUA_VERSION_NUM < 502
@@ -47,6 +66,10 @@ THE SOFTWARE.
 		luaL_register(L, NULL, funcs); \
 	} while (0)
 
+	// userdata environments take the role of "user values"
+	#define lua_getuservalue(L, index)	lua_getfenv(L, index)
+	#define lua_setuservalue(L, index)	lua_setfenv(L, index)
+
 #endif
 /* API changes for 5.2+ */
 #if LUA_VERSION_NUM >= 502
@@ -61,16 +84,88 @@ THE SOFTWARE.
 	// luaL_optinteger() has replaced luaL_optint()
 	#define luaL_optint(L, arg, d)	luaL_optinteger(L, arg, d)
 
+	// (byte) positions in messages, lua_pushfstring() supports "%I" now
+	#define POS_FMT	"%I"
+	#define POS_ARG(pos)	((lua_Integer)(pos))
+#else
+	#define POS_FMT	"%f"
+	#define POS_ARG(pos)	((lua_Number)(pos))
 #endif
 
 
+// Module state is kept in the registry (using these names), i.e. separately
+// for each Lua state - so independent states may use LuaXML concurrently.
 #define LUAXML_META	"LuaXML" // name to be used for metatable
+#define LUAXML_CHILDREN	"LuaXML_Children" // metatable for children() state
+#define LUAXML_STRCACHE	"LuaXML_StrCache" // (weak) cached str() results
+#define LUAXML_PARENTS	"LuaXML_Parents" // (weak) parent links for touch()
+#define LUAXML_HASHES	"LuaXML_Hashes" // (weak) cached subtree hashes for diff()
+#define LUAXML_NAMES	"LuaXML_Names" // (weak) resolved names, for namespace mode
+#define LUAXML_PARSECACHE	"LuaXML_ParseCache" // state of the parse cache
+#define LUAXML_PARSER	"LuaXML_Parser" // metatable for resumable parsers
+#define LUAXML_CODES	"LuaXML_Codes" // special chars and their XML encodings
 
 //--- auxliary functions -------------------------------------------
 
-static size_t find(const char *s, const char *pattern, size_t start) {
-	const char *found = strstr(s + start, pattern);
-	return found ? (size_t)(found - s) : strlen(s);
+// search for pattern within the first `size` bytes of s, returns `size` if
+// not found (so the result is never beyond the end of the searched data)
+static size_t find(const char *s, size_t size, const char *pattern, size_t start) {
+	size_t len = strlen(pattern);
+	while (start + len <= size) {
+		const char *p = memchr(s + start, *pattern, size - start - len + 1);
+		if (!p) break;
+		if (memcmp(p, pattern, len) == 0) return (size_t)(p - s);
+		start = (size_t)(p - s) + 1;
+	}
+	return size;
+}
+
+// tests if the value at given index is a LuaXML object (has our metatable)
+static bool is_xml_object(lua_State *L, int index) {
+	if (!lua_getmetatable(L, index)) return false;
+	luaL_getmetatable(L, LUAXML_META);
+	bool result = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return result;
+}
+
+// Snapshot elements (proxies, see attach) are accepted by the read-only
+// functions too. These are defined with the snapshot code, further below.
+static bool is_proxy(lua_State *L, int index);
+static void proxy_rawget(lua_State *L, int index);
+static void proxy_totable(lua_State *L, int index, int maxdepth);
+
+// tests if the value at given index is an element: a table, or a proxy
+static inline bool is_element(lua_State *L, int index) {
+	return lua_istable(L, index) || is_proxy(L, index);
+}
+
+// like lua_rawget(), for an element
+static inline void element_rawget(lua_State *L, int index) {
+	if (lua_istable(L, index))
+		lua_rawget(L, index);
+	else
+		proxy_rawget(L, index);
+}
+
+// like lua_rawgeti(), for an element
+static void element_rawgeti(lua_State *L, int index, lua_Integer n) {
+	if (lua_istable(L, index)) {
+		lua_rawgeti(L, index, n);
+		return;
+	}
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	lua_pushinteger(L, n);
+	proxy_rawget(L, index);
+}
+
+// push a new table with weak keys
+static void push_weaktable(lua_State *L) {
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
 }
 
 // push (arbitrary Lua) value to be used as tag key, placing it on top of stack
@@ -86,6 +181,31 @@ static inline void push_TAG_key(lua_State *L) {
 	lua_pushinteger(L, 0);
 }
 
+// The resolved names of elements parsed in namespace mode (see eval) are kept
+// apart from the elements, in the LUAXML_NAMES table (with weak keys). Its
+// entry for an element is the expanded "{uri}local" name of the tag - or, if
+// the element has prefixed attributes, a table that maps their expanded names
+// to the qualified ones, with the expanded tag name at index 0. (There's no
+// expanded tag name for elements without namespace.)
+
+// push the LUAXML_NAMES entry of the element at stack index `var` (or `nil`)
+static void push_names(lua_State *L, int var) {
+	if (var < 0) var += lua_gettop(L) + 1; // relative to absolute index
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_NAMES);
+	lua_pushvalue(L, var);
+	lua_rawget(L, -2);
+	lua_remove(L, -2);
+}
+
+// push the expanded tag name of the element at stack index `var` (or `nil`)
+static void push_name(lua_State *L, int var) {
+	push_names(L, var);
+	if (lua_istable(L, -1)) {
+		lua_rawgeti(L, -1, 0);
+		lua_remove(L, -2);
+	}
+}
+
 // convert Lua table at given index to an XML "object", by setting its metatable
 static void make_xml_object(lua_State *L, int index) {
 	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
@@ -97,17 +217,166 @@ static void make_xml_object(lua_State *L, int index) {
 	lua_setmetatable(L, index); // assign metatable
 }
 
-// push an indentation string for the given level to the Lua stack
-static void push_indentStr(lua_State *L, int level) {
-	if (level <= 0) {
-		lua_pushliteral(L, "");
-		return;
+// Push a new table that is presized to hold the contents of the table at
+// stack index `index`. Returns its array size (the length of the source).
+static size_t push_presized(lua_State *L, int index) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	size_t narr = lua_rawlen(L, index), count = 0;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		count++;
+		lua_pop(L, 1);
 	}
-	luaL_Buffer b;
-	luaL_buffinit(L, &b);
-	//while (level-- > 0) luaL_addlstring(&b, "  ", 2);
-	while (level-- > 0) luaL_addchar(&b, '\t'); // one TAB char per level
-	luaL_pushresult(&b);
+	lua_createtable(L, narr, count > narr ? count - narr : 0);
+	return narr;
+}
+
+/*
+ * Push a copy of the table at stack index `index`. Subelements (= the array
+ * part) get copied too, up to the given depth (or unlimited if `maxdepth` < 0).
+ * Any deeper subelements, as well as other table values, are shared with the
+ * original. All copies receive the LuaXML metatable.
+ *
+ * This works iteratively, keeping the tables that still have to be filled in
+ * a Lua table (as triples of source, copy and depth), so there is no limit on
+ * the nesting depth.
+ */
+static void push_clone(lua_State *L, int index, int maxdepth) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	push_presized(L, index); // (the result)
+	int result = lua_gettop(L);
+	luaL_getmetatable(L, LUAXML_META);
+	int meta = result + 1;
+	lua_newtable(L); // pending triples
+	int pending = result + 2;
+	lua_pushvalue(L, index);
+	lua_rawseti(L, pending, 1);
+	lua_pushvalue(L, result);
+	lua_rawseti(L, pending, 2);
+	lua_pushinteger(L, 0);
+	lua_rawseti(L, pending, 3);
+	int count = 1; // number of pending triples
+
+	while (count > 0) {
+		count--;
+		lua_rawgeti(L, pending, 3 * count + 1); // source
+		lua_rawgeti(L, pending, 3 * count + 2); // copy
+		lua_rawgeti(L, pending, 3 * count + 3);
+		int depth = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		int src = pending + 1, dst = pending + 2;
+		bool deep = maxdepth < 0 || depth < maxdepth;
+		lua_pushvalue(L, meta);
+		lua_setmetatable(L, dst);
+
+		// subelements
+		size_t narr = lua_rawlen(L, src);
+		for (size_t k = 1; k <= narr; k++) {
+			lua_rawgeti(L, src, k);
+			if (deep && lua_istable(L, -1)) {
+				// queue (source, copy, depth), and replace value with the copy
+				push_presized(L, -1);
+				lua_pushvalue(L, -2);
+				lua_rawseti(L, pending, 3 * count + 1);
+				lua_pushvalue(L, -1);
+				lua_rawseti(L, pending, 3 * count + 2);
+				lua_pushinteger(L, depth + 1);
+				lua_rawseti(L, pending, 3 * count + 3);
+				count++;
+				lua_replace(L, -2);
+			}
+			lua_rawseti(L, dst, k);
+		}
+		// tag, attributes and any other (non-array) keys
+		lua_pushnil(L);
+		while (lua_next(L, src)) {
+			if (lua_type(L, -2) == LUA_TNUMBER) {
+				lua_Number key = lua_tonumber(L, -2);
+				if (key >= 1 && key <= narr && key == (size_t)key) {
+					lua_pop(L, 1); // (already copied)
+					continue;
+				}
+			}
+			lua_pushvalue(L, -2); // key
+			lua_insert(L, -2);
+			lua_rawset(L, dst);
+		}
+		lua_settop(L, pending);
+	}
+	lua_settop(L, result);
+}
+
+/*
+ * Approximate memory use of Lua values, for sizeof() and the `maxmemory`
+ * option of eval(). These are typical sizes of Lua's internal structures for
+ * 64-bit builds (of Lua 5.3), the actual numbers vary between versions.
+ */
+#define SIZEOF_TABLE	56
+#define SIZEOF_SLOT	16 // entry of a table's array part
+#define SIZEOF_NODE	32 // entry of a table's hash part
+#define SIZEOF_STRING(len)	(24 + (len) + 1)
+
+// round up to a power of 2 (Lua uses such sizes for the parts of tables)
+static size_t ceil_pow2(size_t n) {
+	size_t result = 1;
+	while (result < n) result *= 2;
+	return result;
+}
+
+// Helper for value_size(): returns the size of the value at `index` if it's
+// a string that wasn't seen before. New tables get appended to `pending`.
+static size_t value_size_add(lua_State *L, int seen, int pending, int index) {
+	int type = lua_type(L, index);
+	if (type != LUA_TSTRING && type != LUA_TTABLE) return 0;
+	lua_pushvalue(L, index);
+	lua_rawget(L, seen);
+	bool known = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if (known) return 0;
+	lua_pushvalue(L, index);
+	lua_pushboolean(L, true);
+	lua_rawset(L, seen);
+	if (type == LUA_TSTRING) return SIZEOF_STRING(lua_rawlen(L, index));
+	lua_pushvalue(L, index);
+	lua_rawseti(L, pending, lua_rawlen(L, pending) + 1);
+	return 0;
+}
+
+/*
+ * Estimate the memory held by the value at the given index. Tables count with
+ * their array and hash parts, plus all keys and values (recursively). Strings
+ * and tables that occur multiple times are counted only once. Metatables are
+ * considered shared, so they don't count. This works iteratively, there's no
+ * limit on the nesting depth.
+ */
+static size_t value_size(lua_State *L, int index) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	lua_newtable(L);
+	int seen = lua_gettop(L);
+	lua_newtable(L);
+	int pending = lua_gettop(L);
+	size_t size = value_size_add(L, seen, pending, index);
+	int n;
+	while ((n = lua_rawlen(L, pending)) > 0) {
+		lua_rawgeti(L, pending, n);
+		lua_pushnil(L);
+		lua_rawseti(L, pending, n);
+		int table = lua_gettop(L);
+		size_t narr = lua_rawlen(L, table), count = 0;
+		lua_pushnil(L);
+		while (lua_next(L, table)) {
+			count++;
+			size += value_size_add(L, seen, pending, -2);
+			size += value_size_add(L, seen, pending, -1);
+			lua_pop(L, 1);
+		}
+		size += SIZEOF_TABLE;
+		if (narr) size += ceil_pow2(narr) * SIZEOF_SLOT;
+		if (count > narr) size += ceil_pow2(count - narr) * SIZEOF_NODE;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+	return size;
 }
 
 // tests if a string consists entirely of whitespace
@@ -199,8 +468,183 @@ enum whitespace_mode {
 #define OPN	28	/* "open", start of tag */
 #define CLS	29	/* closes opening tag, actual content follows */
 
+//--- output buffer ------------------------------------------------
+
+/*
+ * A growable byte buffer, used to assemble (potentially huge) output strings.
+ * Unlike a luaL_Buffer it doesn't occupy the Lua stack while in use, so we're
+ * free to push and pop values between appends - which the serializer needs
+ * when walking nested tables. The buffer gets allocated as a userdata, so the
+ * garbage collector will take care of releasing its memory, even in case of
+ * an error.
+ * (The same structure also serves as a simple growable array of C structs.)
+ */
+#define LUAXML_BUFFER	"LuaXML_Buffer" // metatable name for buffer userdata
+
+typedef struct Buffer_s {
+	/// buffer data (malloc'ed)
+	char *data;
+	/// number of bytes in use
+	size_t size;
+	/// number of bytes allocated
+	size_t capacity;
+	/// (optional) function that takes the content when the buffer is full,
+	/// so the buffer can be reused - see Buffer_reserve()
+	void (*sink)(lua_State *L, struct Buffer_s *buf);
+	void *sink_ud;
+} Buffer;
+
+static int Buffer_gc(lua_State *L) {
+	Buffer *buf = lua_touserdata(L, 1);
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = buf->capacity = 0;
+	return 0;
+}
+
+// create a new (empty) buffer, leaving the userdata on top of the Lua stack
+static Buffer *Buffer_push(lua_State *L) {
+	Buffer *buf = lua_newuserdata(L, sizeof(Buffer));
+	buf->data = NULL;
+	buf->size = buf->capacity = 0;
+	buf->sink = NULL;
+	if (luaL_newmetatable(L, LUAXML_BUFFER)) {
+		lua_pushcfunction(L, Buffer_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	return buf;
+}
+
+// Make sure there is room for (at least) `n` more bytes. If the buffer has a
+// sink, this passes the current content to it first (and empties the buffer).
+static void Buffer_reserve(lua_State *L, Buffer *buf, size_t n) {
+	if (buf->size + n > buf->capacity && buf->sink && buf->size > 0) {
+		buf->sink(L, buf);
+		buf->size = 0;
+	}
+	if (buf->size + n > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity : 256;
+		while (capacity < buf->size + n) capacity *= 2;
+		char *data = realloc(buf->data, capacity);
+		if (!data) luaL_error(L, "LuaXML: out of memory (buffer)");
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+}
+
+static void Buffer_add(lua_State *L, Buffer *buf, const char *s, size_t len) {
+	Buffer_reserve(L, buf, len);
+	memcpy(buf->data + buf->size, s, len);
+	buf->size += len;
+}
+
+static inline void Buffer_addchar(lua_State *L, Buffer *buf, char c) {
+	if (buf->size >= buf->capacity) Buffer_reserve(L, buf, 1);
+	buf->data[buf->size++] = c;
+}
+
+static inline void Buffer_addstring(lua_State *L, Buffer *buf, const char *s) {
+	Buffer_add(L, buf, s, strlen(s));
+}
+
+// append the string on top of the Lua stack, and pop it
+static void Buffer_addvalue(lua_State *L, Buffer *buf) {
+	size_t len;
+	const char *s = lua_tolstring(L, -1, &len);
+	Buffer_add(L, buf, s, len);
+	lua_pop(L, 1);
+}
+
+// add an indentation string for the given level
+static void Buffer_addindent(lua_State *L, Buffer *buf, int level) {
+	if (level <= 0) return;
+	Buffer_reserve(L, buf, level);
+	memset(buf->data + buf->size, '\t', level); // one TAB char per level
+	buf->size += level;
+}
+
+// push the buffer content as a Lua string (releasing the buffer memory)
+static void Buffer_pushresult(lua_State *L, Buffer *buf) {
+	lua_pushlstring(L, buf->data ? buf->data : "", buf->size);
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = buf->capacity = 0;
+}
+
 //--- internal tokenizer -------------------------------------------
 
+#define LUAXML_TOKENIZER	"LuaXML_Tokenizer" // metatable name for tokenizers
+
+#ifndef LUAXML_CHUNKSIZE
+// (minimum) number of bytes to read at a time, when tokenizing a stream
+# define LUAXML_CHUNKSIZE	65536
+#endif
+
+// state of UTF-8 validation, to continue with the next chunk of input
+typedef struct {
+	/// number of continuation bytes still expected
+	int need;
+	/// valid range for the next (continuation) byte
+	unsigned char lo, hi;
+} Utf8State;
+
+/*
+ * Validate UTF-8 as per RFC 3629, i.e. reject overlong forms, surrogates and
+ * code points beyond U+10FFFF. A sequence may continue in the next chunk (see
+ * `state`). Returns the offset of the first invalid byte, or `size` if there
+ * is none. Runs of ASCII characters get checked eight bytes at a time.
+ */
+static size_t utf8_validate(Utf8State *state, const unsigned char *s, size_t size) {
+	size_t i = 0;
+	while (i < size) {
+		unsigned char c = s[i];
+		if (state->need) { // continuation byte
+			if (c < state->lo || c > state->hi) return i;
+			state->need--;
+			state->lo = 0x80;
+			state->hi = 0xBF;
+			i++;
+			continue;
+		}
+		if (c < 0x80) {
+			i++;
+			for (; i + 8 <= size; i += 8) {
+				uint64_t bytes;
+				memcpy(&bytes, s + i, 8);
+				if (bytes & 0x8080808080808080ULL) break;
+			}
+			continue;
+		}
+		state->lo = 0x80;
+		state->hi = 0xBF;
+		if (c >= 0xC2 && c <= 0xDF)
+			state->need = 1;
+		else if (c >= 0xE0 && c <= 0xEF) {
+			state->need = 2;
+			if (c == 0xE0) state->lo = 0xA0; // (overlong)
+			if (c == 0xED) state->hi = 0x9F; // (surrogates)
+		}
+		else if (c >= 0xF0 && c <= 0xF4) {
+			state->need = 3;
+			if (c == 0xF0) state->lo = 0x90; // (overlong)
+			if (c == 0xF4) state->hi = 0x8F; // (beyond U+10FFFF)
+		}
+		else return i;
+		i++;
+	}
+	return size;
+}
+
+/*
+ * Function to read (up to) `size` bytes of input into `buffer`, for streaming
+ * tokenizers. Returns the number of bytes actually read, 0 = end of input.
+ * READER_ERROR signals that the input couldn't be read (e.g. corrupt data).
+ */
+typedef size_t (*Tokenizer_reader)(void *ud, char *buffer, size_t size);
+
+#define READER_ERROR	((size_t)-1)
+
 typedef struct Tokenizer_s  {
 	/// stores string to be tokenized
 	const char *s;
@@ -224,26 +668,197 @@ typedef struct Tokenizer_s  {
 	size_t m_token_capacity;
 	/// whitespace handling
 	enum whitespace_mode mode;
+	/// flag to discard text content (up to the next tag) without tokenizing
+	int skip_text;
+
+	// When streaming, `s` is a window of the input, that gets refilled from
+	// `reader` as needed. Input that has been processed gets discarded, so
+	// `base` is the offset of `s` within the overall input.
+	Tokenizer_reader reader;
+	void *reader_ud;
+	/// (optional) function to release `reader_ud`
+	void (*reader_close)(void *ud);
+	/// buffer for the input window, and its capacity
+	char *window;
+	size_t window_capacity;
+	size_t base;
+	/// the reader has signaled the end of input, or an error
+	int eof, failed;
+	/// a buffer (input window or token) couldn't be allocated, which ends
+	/// the input as well
+	int nomem;
+
+	/// validate UTF-8 input? (see Tokenizer_validate)
+	int validate;
+	Utf8State utf8;
+	/// position of the first invalid byte, within the overall input
+	size_t invalid;
+
+	/// maximum window capacity (0 = no limit), and if reading exceeded it
+	size_t max_window;
+	int exceeded;
 } Tokenizer;
 
-Tokenizer *Tokenizer_new(const char *str, size_t str_size,
-		enum whitespace_mode mode)
+#define NO_POS	((size_t)-1) // (for `invalid`)
+
+// Release all resources of a tokenizer. It's safe to call this repeatedly.
+void Tokenizer_delete(Tokenizer *tok) {
+	free(tok->m_token);
+	tok->m_token = NULL;
+	tok->m_token_size = tok->m_token_capacity = 0;
+	free(tok->window);
+	tok->window = NULL;
+	if (tok->reader_close) tok->reader_close(tok->reader_ud);
+	tok->reader_close = NULL;
+	tok->reader = NULL;
+	tok->s = NULL;
+	tok->s_size = tok->i = 0;
+}
+
+static int Tokenizer_gc(lua_State *L) {
+	Tokenizer_delete(luaL_checkudata(L, 1, LUAXML_TOKENIZER));
+	return 0;
+}
+
+/*
+ * Create a tokenizer for the given string, or - if `reader` isn't NULL - for
+ * the input supplied by it. The tokenizer is a userdata that gets pushed onto
+ * the Lua stack, so it will be freed by the garbage collector (even if an
+ * error occurs). A UTF-8 BOM at the start of input gets skipped.
+ */
+Tokenizer *Tokenizer_new(lua_State *L, const char *str, size_t str_size,
+		enum whitespace_mode mode, Tokenizer_reader reader, void *reader_ud,
+		void (*reader_close)(void *ud))
 {
-	Tokenizer *tok = calloc(1, sizeof(Tokenizer));
-	tok->s_size = str_size;
-	tok->s = str;
+	Tokenizer *tok = lua_newuserdata(L, sizeof(Tokenizer));
+	memset(tok, 0, sizeof(Tokenizer));
+	tok->reader_close = reader_close; // (set early, in case of errors)
+	tok->reader_ud = reader_ud;
+	if (luaL_newmetatable(L, LUAXML_TOKENIZER)) {
+		lua_pushcfunction(L, Tokenizer_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
 	tok->mode = mode;
+	tok->invalid = NO_POS;
+	if (reader) {
+		tok->reader = reader;
+		tok->s = "";
+	} else {
+		tok->s_size = str_size;
+		tok->s = str;
+		tok->eof = 1;
+	}
 	return tok;
 }
 
-void Tokenizer_delete(Tokenizer *tok) {
-	free(tok->m_token);
-	free(tok);
+// Read more input, so the window holds (at least) `size` bytes. Existing
+// positions remain valid, but `tok->s` may change. Returns `false` if the
+// input ends before that.
+static bool Tokenizer_read(Tokenizer *tok, size_t size) {
+	while (tok->s_size < size && !tok->eof) {
+		size_t needed = size - tok->s_size;
+		if (needed < LUAXML_CHUNKSIZE) needed = LUAXML_CHUNKSIZE;
+		if (tok->s_size + needed > tok->window_capacity) {
+			size_t capacity = tok->window_capacity ? tok->window_capacity : LUAXML_CHUNKSIZE;
+			while (tok->s_size + needed > capacity) capacity *= 2;
+			if (tok->max_window && capacity > tok->max_window) {
+				tok->exceeded = 1; // (memory budget, stop reading)
+				tok->eof = 1;
+				break;
+			}
+			char *window = realloc(tok->window, capacity);
+			if (!window) {
+				tok->nomem = 1; // (out of memory, stop reading)
+				tok->eof = 1;
+				break;
+			}
+			tok->window = window;
+			tok->window_capacity = capacity;
+			tok->s = tok->window;
+		}
+		size_t count = tok->reader(tok->reader_ud, tok->window + tok->s_size,
+			tok->window_capacity - tok->s_size);
+		if (count == READER_ERROR) {
+			tok->failed = 1;
+			count = 0;
+		}
+		if (tok->validate) {
+			size_t valid = utf8_validate(&tok->utf8,
+				(unsigned char *)tok->window + tok->s_size, count);
+			if (valid < count || (count == 0 && tok->utf8.need)) {
+				// stop at the invalid byte (or incomplete sequence)
+				tok->invalid = tok->base + tok->s_size + valid;
+				tok->validate = 0;
+				count = valid;
+				tok->eof = 1;
+			}
+		}
+		if (count == 0) tok->eof = 1;
+		tok->s_size += count;
+	}
+	return tok->s_size >= size;
+}
+
+// test if the input byte at position `i` is available (reading it if needed)
+static inline bool Tokenizer_has(Tokenizer *tok, size_t i) {
+	return i < tok->s_size || (!tok->eof && Tokenizer_read(tok, i + 1));
+}
+
+// Discard the input before the current read position, if that's worth it.
+// This invalidates any other positions, so it may only be used in between
+// tokens.
+static void Tokenizer_compact(Tokenizer *tok) {
+	if (tok->reader && tok->i >= LUAXML_CHUNKSIZE / 2 && tok->i >= tok->s_size / 2) {
+		memmove(tok->window, tok->window + tok->i, tok->s_size - tok->i);
+		tok->base += tok->i;
+		tok->s_size -= tok->i;
+		tok->i = 0;
+	}
+}
+
+// Start validating UTF-8 input, which must happen before anything is read.
+// If there's invalid input, the tokenizer stops there, and sets `invalid`.
+static void Tokenizer_validate(Tokenizer *tok) {
+	tok->validate = 1;
+	if (!tok->reader) { // string input, check it right away
+		size_t valid = utf8_validate(&tok->utf8, (unsigned char *)tok->s, tok->s_size);
+		if (valid < tok->s_size || tok->utf8.need) {
+			tok->invalid = valid;
+			tok->s_size = valid;
+		}
+		tok->validate = 0;
+	}
+}
+
+// current position within the overall input (e.g. for error messages)
+static inline size_t Tokenizer_pos(Tokenizer *tok) {
+	return tok->base + tok->i;
+}
+
+// skip a UTF-8 BOM (byte order mark) at the current position
+static void Tokenizer_skipBOM(Tokenizer *tok) {
+	if (Tokenizer_has(tok, tok->i + 2)
+			&& memcmp(tok->s + tok->i, "\xEF\xBB\xBF", 3) == 0)
+		tok->i += 3;
+}
+
+// Search `pattern` from position `start` on, reading more input as needed.
+// Returns the position of the match, or the input size if there's none.
+static size_t Tokenizer_find(Tokenizer *tok, const char *pattern, size_t start) {
+	size_t len = strlen(pattern);
+	for (;;) {
+		size_t pos = find(tok->s, tok->s_size, pattern, start);
+		if (pos < tok->s_size || tok->eof) return pos;
+		// continue with more input (a match might span the old end)
+		if (tok->s_size + 1 > start + len) start = tok->s_size + 1 - len;
+		Tokenizer_read(tok, tok->s_size + 1);
+	}
 }
 
 #if LUAXML_DEBUG
 void Tokenizer_print(Tokenizer *tok) {
-	printf("  @%u %s\n", tok->i,
+	printf("  @%u %s\n", (unsigned)Tokenizer_pos(tok),
 		!tok->m_token ? "(null)" :
 		(tok->m_token[0] == ESC) ? "(esc)" :
 		(tok->m_token[0] == OPN) ? "(open)" :
@@ -255,24 +870,67 @@ void Tokenizer_print(Tokenizer *tok) {
 # define Tokenizer_print(tok)	/* ignore */
 #endif
 
+// Make sure the token buffer can hold `size` more chars (plus NUL). Returns
+// `false` if it can't be enlarged, which sets `nomem` (and ends tokenizing).
+static bool Tokenizer_reserve(Tokenizer *tok, size_t size) {
+	if (tok->m_token_size + size >= tok->m_token_capacity) {
+		size_t capacity = tok->m_token_capacity ? tok->m_token_capacity : 16;
+		while (tok->m_token_size + size >= capacity) capacity *= 2;
+		char *token = realloc(tok->m_token, capacity);
+		if (!token) {
+			tok->nomem = 1;
+			tok->eof = 1;
+			return false;
+		}
+		tok->m_token = token;
+		tok->m_token_capacity = capacity;
+	}
+	return true;
+}
+
+static void Tokenizer_appendn(Tokenizer *tok, const char *s, size_t size) {
+	if (!Tokenizer_reserve(tok, size)) return;
+	memcpy(tok->m_token + tok->m_token_size, s, size);
+	tok->m_token_size += size;
+	tok->m_token[tok->m_token_size] = 0;
+}
+
+static void Tokenizer_append(Tokenizer *tok, char ch) {
+	if (!Tokenizer_reserve(tok, 1)) return;
+	tok->m_token[tok->m_token_size] = ch;
+	tok->m_token[++tok->m_token_size] = 0;
+}
+
 static const char *Tokenizer_set(Tokenizer *tok, const char *s, size_t size) {
 	if (!size || !s) return NULL;
-	free(tok->m_token);
-	tok->m_token = malloc(size + 1);
-	strncpy(tok->m_token, s, size);
-	tok->m_token[size] = 0;
-	tok->m_token_size = tok->m_token_capacity = size;
+	tok->m_token_size = 0;
+	Tokenizer_appendn(tok, s, size);
+	if (tok->nomem) return NULL;
 	Tokenizer_print(tok);
 	return tok->m_token;
 }
 
-static void Tokenizer_append(Tokenizer *tok, char ch) {
-	if (tok->m_token_size + 1 >= tok->m_token_capacity) {
-		tok->m_token_capacity = tok->m_token_capacity ? tok->m_token_capacity * 2 : 16;
-		tok->m_token = realloc(tok->m_token, tok->m_token_capacity);
-	}
-	tok->m_token[tok->m_token_size] = ch;
-	tok->m_token[++tok->m_token_size] = 0;
+// end of the whitespace run starting at `i` (only the characters the
+// tokenizer treats as separators: space, tab, CR and LF)
+static size_t Tokenizer_spaceRun(Tokenizer *tok, size_t i) {
+	while (Tokenizer_has(tok, i))
+		switch (tok->s[i]) {
+		case ' ': case '\t': case '\r': case '\n':
+			i++;
+			continue;
+		default:
+			return i;
+		}
+	return i;
+}
+
+// tests if position `i` is the end of a text token, i.e. either the end of
+// input or a '<' that starts a tag (not a comment, CDATA or meta information)
+static bool Tokenizer_atTag(Tokenizer *tok, size_t i) {
+	if (!Tokenizer_has(tok, i)) return true;
+	if (tok->s[i] != '<') return false;
+	return !Tokenizer_has(tok, i + 1)
+		|| (tok->s[i + 1] != '!' && tok->s[i + 1] != '?');
 }
 
 const char *Tokenizer_next(Tokenizer *tok) {
@@ -281,22 +939,28 @@ const char *Tokenizer_next(Tokenizer *tok) {
 	static const char OPEN_str[] = {OPN, 0};
 	static const char CLOSE_str[] = {CLS, 0};
 
-	if (tok->m_token) {
-		free(tok->m_token);
-		tok->m_token = NULL;
-		tok->m_token_size = tok->m_token_capacity = 0;
-	}
+	// (the token buffer gets reused, it's only freed by Tokenizer_delete)
+	tok->m_token_size = 0;
+	Tokenizer_compact(tok);
 
 	char quotMode = 0;
 	int tokenComplete = 0;
-	while (tok->m_next_size || (tok->i < tok->s_size)) {
+	while (!tok->nomem && (tok->m_next_size || Tokenizer_has(tok, tok->i))) {
 		tok->cdata = 0;
 
 		if (tok->m_next_size) {
-			Tokenizer_set(tok, tok->m_next, tok->m_next_size);
+			const char *token = Tokenizer_set(tok, tok->m_next, tok->m_next_size);
 			tok->m_next = NULL;
 			tok->m_next_size = 0;
-			return tok->m_token;
+			return token;
+		}
+
+		if (tok->skip_text && !tok->tagMode && tok->s[tok->i] != '<') {
+			// discard text, advancing to the next tag (or end of input)
+			const char *lt = memchr(tok->s + tok->i, '<', tok->s_size - tok->i);
+			tok->i = lt ? (size_t)(lt - tok->s) : tok->s_size;
+			Tokenizer_compact(tok);
+			continue;
 		}
 
 		switch (tok->s[tok->i]) {
@@ -313,10 +977,10 @@ const char *Tokenizer_next(Tokenizer *tok) {
 			break;
 
 		case '<':
-			if (!quotMode && (tok->i + 4 < tok->s_size)
+			if (!quotMode && Tokenizer_has(tok, tok->i + 4)
 						&& (strncmp(tok->s + tok->i, "<!--", 4) == 0))
-				tok->i = find(tok->s, "-->", tok->i + 4) + 2; // strip comments
-			else if (!quotMode && (tok->i + 9 < tok->s_size)
+				tok->i = Tokenizer_find(tok, "-->", tok->i + 4) + 2; // strip comments
+			else if (!quotMode && Tokenizer_has(tok, tok->i + 9)
 						&& (strncmp(tok->s + tok->i, "<![CDATA[", 9) ==0)) {
 				if (tok->m_token_size > 0)
 					// finish current token first, after that reparse CDATA
@@ -324,7 +988,7 @@ const char *Tokenizer_next(Tokenizer *tok) {
 				else {
 					// interpret CDATA
 					size_t b = tok->i + 9;
-					tok->i = find(tok->s, "]]>", b) + 3;
+					tok->i = Tokenizer_find(tok, "]]>", b) + 3;
 					size_t cdata_len = tok->i - b - 3;
 					if (cdata_len > 0) {
 						tok->cdata = 1; // mark as "raw" byte sequence
@@ -333,17 +997,17 @@ const char *Tokenizer_next(Tokenizer *tok) {
 				}
 				--tok->i;
 			}
-			else if (!quotMode && (tok->i + 1 < tok->s_size)
+			else if (!quotMode && Tokenizer_has(tok, tok->i + 1)
 						&& ((tok->s[tok->i + 1] == '?')
 							|| (tok->s[tok->i + 1] == '!')))
-				tok->i=find(tok->s, ">", tok->i + 2); // strip meta information
+				tok->i = Tokenizer_find(tok, ">", tok->i + 2); // strip meta information
 			else if (!quotMode && !tok->tagMode) {
-				if ((tok->i + 1 < tok->s_size)
+				if (Tokenizer_has(tok, tok->i + 1)
 						&& (tok->s[tok->i + 1] == '/')) {
 					// "</" sequence that starts a closing tag
 					tok->m_next = ESC_str;
 					tok->m_next_size = 1;
-					tok->i = find(tok->s, ">", tok->i + 2);
+					tok->i = Tokenizer_find(tok, ">", tok->i + 2);
 				} else {
 					// regular '<' opening a new tag
 					tok->m_next = OPEN_str;
@@ -358,7 +1022,7 @@ const char *Tokenizer_next(Tokenizer *tok) {
 		case '/':
 			if (tok->tagMode && !quotMode) {
 				tokenComplete = 1;
-				if ((tok->i + 1 < tok->s_size)
+				if (Tokenizer_has(tok, tok->i + 1)
 						&& (tok->s[tok->i + 1] == '>')) {
 					// "/>" sequence = end of 'empty' tag
 					tok->tagMode = 0;
@@ -389,17 +1053,36 @@ const char *Tokenizer_next(Tokenizer *tok) {
 			if (tok->tagMode && !quotMode) {
 				// within a tag, any unquoted whitespace ends the current token (= attribute)
 				if (tok->m_token_size) tokenComplete = 1;
+				tok->i = Tokenizer_spaceRun(tok, tok->i) - 1;
+			}
+			else if (tok->tagMode) // (quoted)
+				Tokenizer_append(tok, tok->s[tok->i]);
+			else {
+				// process the entire whitespace run at once
+				size_t end = Tokenizer_spaceRun(tok, tok->i);
+				if (tok->mode == WHITESPACE_NORMALIZE && !tok->m_token_size
+						&& (tok->s[tok->i] == '\n' || tok->s[tok->i] == '\r')) {
+					// A "lead in" token might follow. Look for the end of the
+					// whitespace (including \v and \f, as is_lead_token does).
+					while (Tokenizer_has(tok, end) && isspace(tok->s[end])) end++;
+					if (Tokenizer_atTag(tok, end)) {
+						tok->i = end - 1; // discard the whole token
+						break;
+					}
+				}
+				if (tok->mode != WHITESPACE_TRIM
+						|| (tok->m_token_size && !Tokenizer_atTag(tok, end)))
+					Tokenizer_appendn(tok, tok->s + tok->i, end - tok->i);
+				// (TRIM mode drops leading and trailing whitespace runs)
+				tok->i = end - 1;
 			}
-			else
-				if (tok->m_token_size || tok->mode != WHITESPACE_TRIM)
-					Tokenizer_append(tok, tok->s[tok->i]);
 			break;
 
 		default:
 			Tokenizer_append(tok, tok->s[tok->i]);
 		}
 		++tok->i;
-		if (tok->i >= tok->s_size || (tokenComplete && tok->m_token_size)) {
+		if (!Tokenizer_has(tok, tok->i) || (tokenComplete && tok->m_token_size)) {
 			tokenComplete = 0;
 			if (tok->mode == WHITESPACE_TRIM) // trim whitespace
 				while (tok->m_token_size && isspace(tok->m_token[tok->m_token_size - 1]))
@@ -407,84 +1090,929 @@ const char *Tokenizer_next(Tokenizer *tok) {
 			if (tok->m_token_size) break;
 		}
 	}
+	if (tok->nomem) return NULL; // (the token is incomplete)
 	Tokenizer_print(tok);
-	return tok->m_token;
+	return tok->m_token_size ? tok->m_token : NULL;
 }
 
-//--- local variables ----------------------------------------------
-
-// 'private' table mapping between special chars and their XML substitutions
-static int sv_code_ref; // (will receive a LUA reference)
-
-//--- public methods -----------------------------------------------
-
-/** sets or returns tag of a LuaXML object.
-This method is just "syntactic sugar" (using a typical Lua term) that allows
-the writing of clearer code. LuaXML stores the tag value of an XML statement
-at table index 0, hence it can be simply accessed or altered by `var[0]`.
-However, writing `var:tag()` for access or `var:tag("newTag")` for altering
-may be more self explanatory (and future-proof in case LuaXML's tag handling
-should ever change).
+// Skip to the end of the current start tag (past its '>'), honoring quoted
+// attribute values. Returns `true` for an empty-element tag ("/>").
+static bool Tokenizer_skipTag(Tokenizer *tok) {
+	char quotMode = 0, prev = 0;
+	while (Tokenizer_has(tok, tok->i)) {
+		char c = tok->s[tok->i++];
+		if (quotMode) {
+			if (c == quotMode) quotMode = 0;
+		}
+		else if (c == '"' || c == '\'') quotMode = c;
+		else if (c == '>') return prev == '/';
+		prev = c;
+	}
+	return false;
+}
 
-@function tag
-@param var  the variable whose tag should be accessed, a LuaXML object
-@tparam ?string tag  the new tag to be set
-@return  If you have passed a new tag, the function will return `var` (with
-its tag changed); otherwise the result will be the current tag of `var`
-(normally a string).
-*/
-int Xml_tag(lua_State *L) {
-	// the function will only operate on tables
-	if lua_istable(L, 1) {
-		lua_settop(L, 2);
-		push_TAG_key(L); // place tag key on top of stack (#3)
-		if (lua_type(L, 2) == LUA_TSTRING) {
-			lua_pushvalue(L, 2); // duplicate the value
-			lua_rawset(L, 1);
-			// we return the (modified) table
-			lua_settop(L, 1);
-			return 1;
+/*
+ * Skip the remainder of the current element, whose tag has just been read -
+ * including all of its content. This doesn't produce any tokens, but merely
+ * counts the nesting level of tags. Apart from comments, CDATA sections and
+ * quoted attribute values (which may contain '<' or '>') no further parsing
+ * happens, so it's *much* faster than tokenizing.
+ */
+static void Tokenizer_skipElement(Tokenizer *tok) {
+	int depth;
+	if (tok->m_next_size && *tok->m_next == ESC)
+		depth = 0; // "/>" has been seen already, the element is empty
+	else if (tok->m_next_size && *tok->m_next == CLS)
+		depth = 1; // '>' has been seen already, content follows
+	else
+		depth = Tokenizer_skipTag(tok) ? 0 : 1;
+	tok->m_next = NULL;
+	tok->m_next_size = 0;
+	tok->tagMode = 0;
+
+	while (depth > 0 && Tokenizer_has(tok, tok->i)) {
+		Tokenizer_compact(tok);
+		const char *lt = memchr(tok->s + tok->i, '<', tok->s_size - tok->i);
+		if (!lt) {
+			tok->i = tok->s_size; // (will read more input, if available)
+			continue;
+		}
+		size_t i = lt - tok->s;
+		tok->i = i;
+		if (Tokenizer_has(tok, i + 3) && strncmp(tok->s + i, "<!--", 4) == 0)
+			i = Tokenizer_find(tok, "-->", i + 4) + 3;
+		else if (Tokenizer_has(tok, i + 8) && strncmp(tok->s + i, "<![CDATA[", 9) == 0)
+			i = Tokenizer_find(tok, "]]>", i + 9) + 3;
+		else if (Tokenizer_has(tok, i + 1) && (tok->s[i + 1] == '?' || tok->s[i + 1] == '!'))
+			i = Tokenizer_find(tok, ">", i + 2) + 1;
+		else if (Tokenizer_has(tok, i + 1) && tok->s[i + 1] == '/') {
+			depth--; // closing tag
+			i = Tokenizer_find(tok, ">", i + 2) + 1;
 		} else {
-			// "tag" is empty or wrong type, retrieve the current tag
-			lua_rawget(L, 1);
-			return 1;
+			tok->i = i + 1;
+			if (!Tokenizer_skipTag(tok)) depth++; // (non-empty) opening tag
+			continue;
 		}
+		tok->i = i < tok->s_size ? i : tok->s_size;
 	}
-	return 0;
 }
 
-/** creates a LuaXML "object", and optionally sets its tag.
-The function either sets the metatable of an existing Lua table, or creates a
-new (empty) "object". If you pass an optional` tag` string, it will be assigned
-to the result.
-
-(It's also possible to call this as `new(tag)`, which creates a new XML object
-with the given tag and is equivalent to `new({}, tag)`.)
+//--- UTF-16 input -------------------------------------------------
 
-Note that it's not mandatory to use this function in order to treat a Lua table
-as LuaXML object. Setting the metatable just allows the usage of a more 
-object-oriented syntax (e.g. `xmlvar:str()` instead of `xml.str(xmlvar)`).
-XML objects created by `load` or `eval` automatically offer the
-object-oriented syntax.
+// input encodings (for the `encoding` option of eval() and load())
+enum encoding {
+	ENCODING_AUTO,
+	ENCODING_UTF8,
+	ENCODING_UTF16,
+	ENCODING_UTF16LE,
+	ENCODING_UTF16BE
+};
+static const char *const encodings[] = {"", "utf-8", "utf-16", "utf-16le", "utf-16be", NULL};
+
+// Get the `encoding` from the options (table or nil) at the given stack index.
+// Names are case-insensitive.
+static enum encoding encoding_option(lua_State *L, int options) {
+	if (!lua_istable(L, options)) return ENCODING_AUTO;
+	lua_getfield(L, options, "encoding");
+	enum encoding result = ENCODING_AUTO;
+	if (!lua_isnil(L, -1)) {
+		const char *name = luaL_checkstring(L, -1);
+		char lower[16];
+		size_t i;
+		for (i = 0; name[i] && i < sizeof(lower) - 1; i++) lower[i] = tolower(name[i]);
+		lower[i] = 0;
+		while (encodings[++result] && strcmp(lower, encodings[result]));
+		if (!encodings[result] || name[i])
+			luaL_error(L, "LuaXML ERROR: unsupported encoding \"%s\"", name);
+	}
+	lua_pop(L, 1);
+	return result;
+}
 
-@function new
-@param arg (optional)  _(1)_ a table to be converted to a LuaXML object,
-or _(2)_ the tag of the new LuaXML object
-@tparam ?string tag  a tag value that will be assigned to the object
-@return  LuaXML object, either newly created or the conversion of `arg`;
-optionally tagged as requested
-*/
-int Xml_new(lua_State *L) {
-	if (!lua_istable(L, 1)) {
-		// create a new table and move it to the bottom of the stack (#1),
-		// possibly shifting other elements "one up"
-		lua_newtable(L);
-		lua_insert(L, 1);
+// Determine the actual encoding (UTF-8, UTF-16LE or UTF-16BE) for input that
+// starts with the given bytes. This checks for a UTF-16 BOM, or a '<' encoded
+// as UTF-16 (see appendix F of the XML specification).
+static enum encoding detect_encoding(const char *s, size_t size, enum encoding encoding) {
+	const unsigned char *u = (const unsigned char *)s;
+	if (encoding == ENCODING_UTF8 || encoding == ENCODING_UTF16LE
+			|| encoding == ENCODING_UTF16BE)
+		return encoding;
+	if (size >= 2) {
+		if ((u[0] == 0xFF && u[1] == 0xFE) || (u[0] == '<' && u[1] == 0))
+			return ENCODING_UTF16LE;
+		if ((u[0] == 0xFE && u[1] == 0xFF) || (u[0] == 0 && u[1] == '<'))
+			return ENCODING_UTF16BE;
 	}
-	// element at #1 now is a table, convert to "object"
-	make_xml_object(L, 1);
+	return encoding == ENCODING_UTF16 ? ENCODING_UTF16BE : ENCODING_UTF8;
+}
 
-	if (lua_type(L, 2) == LUA_TSTRING) {
+/*
+ * A reader (for streaming tokenizers) that transcodes UTF-16 to UTF-8. The
+ * UTF-16 input is either a string, or comes from another reader. Malformed
+ * input (unpaired surrogates, an odd number of bytes) results in U+FFFD.
+ */
+typedef struct {
+	/// the UTF-16 input (or a buffer of it), size, and current position
+	const char *s;
+	size_t size, pos;
+	/// offset of the low-order byte within a code unit (0 = LE, 1 = BE)
+	int lo;
+	/// mask to test four code units for ASCII at once
+	uint64_t ascii_mask;
+	/// UTF-8 bytes of a character that didn't fit the previous output
+	unsigned char pending[4];
+	int pending_size, pending_pos;
+	/// source reader (if any), with its input buffer
+	Tokenizer_reader reader;
+	void *reader_ud;
+	void (*reader_close)(void *ud);
+	char *buffer;
+	size_t capacity;
+	int eof, failed;
+} Utf16Reader;
+
+// make sure there are (at least) 4 bytes of input, if possible
+static void utf16_fill(Utf16Reader *u) {
+	while (u->size - u->pos < 4 && u->reader && !u->eof) {
+		size_t rest = u->size - u->pos;
+		memmove(u->buffer, u->s + u->pos, rest);
+		size_t count = u->reader(u->reader_ud, u->buffer + rest, u->capacity - rest);
+		if (count == READER_ERROR) {
+			u->failed = 1;
+			count = 0;
+		}
+		if (count == 0) u->eof = 1;
+		u->s = u->buffer;
+		u->size = rest + count;
+		u->pos = 0;
+	}
+}
+
+// encode the code point `c` as UTF-8, returns the number of bytes
+static int utf8_encode(unsigned char *out, unsigned long c) {
+	if (c < 0x80) {
+		out[0] = c;
+		return 1;
+	}
+	if (c < 0x800) {
+		out[0] = 0xC0 | (c >> 6);
+		out[1] = 0x80 | (c & 0x3F);
+		return 2;
+	}
+	if (c < 0x10000) {
+		out[0] = 0xE0 | (c >> 12);
+		out[1] = 0x80 | ((c >> 6) & 0x3F);
+		out[2] = 0x80 | (c & 0x3F);
+		return 3;
+	}
+	out[0] = 0xF0 | (c >> 18);
+	out[1] = 0x80 | ((c >> 12) & 0x3F);
+	out[2] = 0x80 | ((c >> 6) & 0x3F);
+	out[3] = 0x80 | (c & 0x3F);
+	return 4;
+}
+
+static size_t utf16_reader(void *ud, char *buffer, size_t size) {
+	Utf16Reader *u = ud;
+	unsigned char *out = (unsigned char *)buffer, *end = out + size;
+	// flush pending bytes first
+	while (u->pending_pos < u->pending_size && out < end)
+		*out++ = u->pending[u->pending_pos++];
+
+	while (out < end) {
+		utf16_fill(u);
+		const unsigned char *s = (const unsigned char *)u->s + u->pos;
+		const unsigned char *s_end = (const unsigned char *)u->s + u->size;
+		// fast path: runs of ASCII characters, four code units at a time
+		while (s + 8 <= s_end && out + 4 <= end) {
+			uint64_t units;
+			memcpy(&units, s, 8);
+			if (units & u->ascii_mask) break;
+			out[0] = s[u->lo];
+			out[1] = s[u->lo + 2];
+			out[2] = s[u->lo + 4];
+			out[3] = s[u->lo + 6];
+			s += 8;
+			out += 4;
+		}
+		u->pos = (const char *)s - u->s;
+		if (out == end) break;
+
+		// a single code unit (or surrogate pair), or the last byte of input
+		utf16_fill(u);
+		s = (const unsigned char *)u->s + u->pos;
+		s_end = (const unsigned char *)u->s + u->size;
+		if (s == s_end) break; // end of input
+
+		unsigned long c = 0xFFFD; // (replacement character)
+		size_t used = s_end - s < 2 ? 1 : 2;
+		if (used == 2) {
+			c = s[u->lo] | (s[1 - u->lo] << 8);
+			if (c >= 0xD800 && c <= 0xDFFF) {
+				unsigned long c2 = s_end - s < 4 ? 0 : s[2 + u->lo] | (s[3 - u->lo] << 8);
+				if (c <= 0xDBFF && c2 >= 0xDC00 && c2 <= 0xDFFF) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+					used = 4;
+				} else
+					c = 0xFFFD;
+			}
+		}
+		u->pos += used;
+		if (c < 0x80) {
+			*out++ = c;
+			continue;
+		}
+		unsigned char utf8[4];
+		int len = utf8_encode(utf8, c);
+		if (out + len <= end) {
+			memcpy(out, utf8, len);
+			out += len;
+		} else {
+			// doesn't fit, keep the remaining bytes for the next call
+			int fits = end - out;
+			memcpy(out, utf8, fits);
+			out += fits;
+			memcpy(u->pending, utf8 + fits, len - fits);
+			u->pending_size = len - fits;
+			u->pending_pos = 0;
+		}
+	}
+	if ((char *)out == buffer && u->failed) return READER_ERROR;
+	return (char *)out - buffer;
+}
+
+static void utf16_close(void *ud) {
+	Utf16Reader *u = ud;
+	if (u->reader_close) u->reader_close(u->reader_ud);
+	free(u->buffer);
+	free(u);
+}
+
+/*
+ * Create a tokenizer for UTF-16 input with the given byte order, that gets
+ * transcoded to UTF-8 on the fly. The input is either a string, or comes
+ * from `reader` - see Tokenizer_new().
+ */
+static Tokenizer *Tokenizer_newUTF16(lua_State *L, const char *str, size_t str_size,
+		enum whitespace_mode mode, enum encoding encoding, Tokenizer_reader reader,
+		void *reader_ud, void (*reader_close)(void *ud))
+{
+	// (the tokenizer comes first, so the garbage collector releases the wrapped
+	// reader - and `u`, once it takes over - even if an error occurs)
+	Tokenizer *tok = Tokenizer_new(L, NULL, 0, mode, utf16_reader, reader_ud,
+		reader_close);
+	Utf16Reader *u = calloc(1, sizeof(Utf16Reader));
+	if (!u) luaL_error(L, "LuaXML: out of memory (UTF-16 reader)");
+	u->lo = encoding == ENCODING_UTF16BE ? 1 : 0;
+	// (the low-order bytes may be ASCII, the high-order bytes must be zero)
+	static const unsigned char mask_le[8] = {0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF};
+	static const unsigned char mask_be[8] = {0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80, 0xFF, 0x80};
+	memcpy(&u->ascii_mask, u->lo ? mask_be : mask_le, 8);
+	u->reader = reader;
+	u->reader_ud = reader_ud;
+	u->reader_close = reader_close;
+	tok->reader_ud = u;
+	tok->reader_close = utf16_close;
+	if (reader) {
+		u->capacity = LUAXML_CHUNKSIZE < 16 ? 16 : LUAXML_CHUNKSIZE;
+		u->buffer = malloc(u->capacity);
+		if (!u->buffer) luaL_error(L, "LuaXML: out of memory (UTF-16 reader)");
+		u->s = u->buffer;
+	} else {
+		u->s = str;
+		u->size = str_size;
+	}
+	return tok;
+}
+
+//--- parse cache --------------------------------------------------
+
+/*
+ * The parse cache (see parsecache()) is a Lua table in the registry, using the
+ * fields below. Entries are kept in a doubly linked list, ordered from most to
+ * least recently used ("head" to "tail"). They get looked up via "keys", which
+ * holds one table per lookup type: the whitespace mode for eval() (1 .. 3),
+ * and the same + 3 for load(). eval() uses the XML string itself as key, so
+ * Lua's string hashing (and comparison) will do the content matching.
+ */
+enum {
+	PC_TREE = 1,	// the parsed XML (table)
+	PC_SIZE,	// memory size (see value_size), as accounted for the budget
+	PC_PREV,	// previous (= more recently used) entry
+	PC_NEXT,	// next (= less recently used) entry
+	PC_LOOKUP,	// lookup type (index into "keys")
+	PC_KEY		// lookup key
+};
+#define PC_LOOKUPS	6
+
+static lua_Integer pcache_getint(lua_State *L, int state, const char *field) {
+	lua_getfield(L, state, field);
+	lua_Integer result = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
+static void pcache_setint(lua_State *L, int state, const char *field,
+		lua_Integer value)
+{
+	lua_pushinteger(L, value);
+	lua_setfield(L, state, field);
+}
+
+// Push the state table of the parse cache, if it is enabled. Returns `false`
+// (and pushes nothing) otherwise.
+static bool pcache_push(lua_State *L) {
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_PARSECACHE);
+	if (lua_istable(L, -1)) return true;
+	lua_pop(L, 1);
+	return false;
+}
+
+// Discard all entries of the parse cache (state at stack index `state`).
+// The configuration and the hit / miss statistics are kept.
+static void pcache_clear(lua_State *L, int state) {
+	lua_createtable(L, PC_LOOKUPS, 0);
+	for (int i = 1; i <= PC_LOOKUPS; i++) {
+		lua_newtable(L);
+		lua_rawseti(L, -2, i);
+	}
+	lua_setfield(L, state, "keys");
+	lua_pushnil(L);
+	lua_setfield(L, state, "head");
+	lua_pushnil(L);
+	lua_setfield(L, state, "tail");
+	pcache_setint(L, state, "count", 0);
+	pcache_setint(L, state, "size", 0);
+}
+
+// remove the entry (at stack index `entry`) from the linked list
+static void pcache_unlink(lua_State *L, int state, int entry) {
+	lua_rawgeti(L, entry, PC_PREV);
+	lua_rawgeti(L, entry, PC_NEXT);
+	// prev.next = next (or head = next)
+	lua_pushvalue(L, -1);
+	if (lua_istable(L, -3))
+		lua_rawseti(L, -3, PC_NEXT);
+	else
+		lua_setfield(L, state, "head");
+	// next.prev = prev (or tail = prev)
+	lua_pushvalue(L, -2);
+	if (lua_istable(L, -2))
+		lua_rawseti(L, -2, PC_PREV);
+	else
+		lua_setfield(L, state, "tail");
+	lua_pop(L, 2);
+}
+
+// insert the entry (at stack index `entry`) as head of the linked list
+static void pcache_link(lua_State *L, int state, int entry) {
+	lua_pushnil(L);
+	lua_rawseti(L, entry, PC_PREV);
+	lua_getfield(L, state, "head");
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, entry, PC_NEXT);
+	if (lua_istable(L, -1)) {
+		lua_pushvalue(L, entry);
+		lua_rawseti(L, -2, PC_PREV);
+	} else {
+		lua_pushvalue(L, entry);
+		lua_setfield(L, state, "tail");
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, entry);
+	lua_setfield(L, state, "head");
+}
+
+// Push the result for an entry, depending on the "shared" setting
+static void pcache_pushresult(lua_State *L, int state, int entry) {
+	lua_rawgeti(L, entry, PC_TREE);
+	lua_getfield(L, state, "shared");
+	bool shared = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if (!shared) {
+		push_clone(L, -1, -1);
+		lua_remove(L, -2);
+	}
+}
+
+/*
+ * Look up the key at stack index `key` (using the given lookup type) in the
+ * parse cache. If an entry exists, push its result and return `true`. The
+ * parse cache state has to be on top of the stack.
+ */
+static bool pcache_get(lua_State *L, int lookup, int key) {
+	int state = lua_gettop(L);
+	lua_getfield(L, state, "keys");
+	lua_rawgeti(L, -1, lookup);
+	lua_pushvalue(L, key);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 3);
+		pcache_setint(L, state, "misses", pcache_getint(L, state, "misses") + 1);
+		return false;
+	}
+	int entry = lua_gettop(L);
+	pcache_setint(L, state, "hits", pcache_getint(L, state, "hits") + 1);
+	pcache_unlink(L, state, entry); // move entry to front
+	pcache_link(L, state, entry);
+	pcache_pushresult(L, state, entry);
+	lua_replace(L, state + 1); // (replacing "keys")
+	lua_settop(L, state + 1);
+	return true;
+}
+
+/*
+ * Add the XML table on top of the stack to the parse cache, using the key at
+ * stack index `key`. The entry accounts for the memory held by the table and
+ * the key (as estimated by sizeof). In "copy" mode the cache will keep a copy
+ * of the table, so it remains private. Least recently used entries get
+ * dropped to stay within the budget. The parse cache state has to be directly
+ * below the XML table, and will be removed from the stack.
+ */
+static void pcache_put(lua_State *L, int lookup, int key) {
+	int state = lua_gettop(L) - 1;
+	lua_Integer budget = pcache_getint(L, state, "budget");
+	size_t size = value_size(L, state + 1) + value_size(L, key);
+	if ((lua_Integer)size <= budget) {
+		lua_createtable(L, 6, 0); // entry
+		int entry = lua_gettop(L);
+		lua_getfield(L, state, "shared");
+		if (lua_toboolean(L, -1))
+			lua_pushvalue(L, state + 1);
+		else
+			push_clone(L, state + 1, -1);
+		lua_rawseti(L, entry, PC_TREE);
+		lua_pop(L, 1);
+		lua_pushinteger(L, size);
+		lua_rawseti(L, entry, PC_SIZE);
+		lua_pushinteger(L, lookup);
+		lua_rawseti(L, entry, PC_LOOKUP);
+		lua_pushvalue(L, key);
+		lua_rawseti(L, entry, PC_KEY);
+		lua_getfield(L, state, "keys");
+		lua_rawgeti(L, -1, lookup);
+		lua_pushvalue(L, key);
+		lua_pushvalue(L, entry);
+		lua_rawset(L, -3); // keys[lookup][key] = entry
+		lua_pop(L, 2);
+		pcache_link(L, state, entry);
+		lua_pop(L, 1);
+
+		lua_Integer total = pcache_getint(L, state, "size") + size;
+		int count = pcache_getint(L, state, "count") + 1;
+		while (total > budget) { // evict from tail
+			lua_getfield(L, state, "tail");
+			entry = lua_gettop(L);
+			pcache_unlink(L, state, entry);
+			lua_getfield(L, state, "keys");
+			lua_rawgeti(L, entry, PC_LOOKUP);
+			lua_rawget(L, -2);
+			lua_rawgeti(L, entry, PC_KEY);
+			lua_pushnil(L);
+			lua_rawset(L, -3);
+			lua_rawgeti(L, entry, PC_SIZE);
+			total -= lua_tointeger(L, -1);
+			count--;
+			lua_settop(L, entry - 1);
+		}
+		pcache_setint(L, state, "size", total);
+		pcache_setint(L, state, "count", count);
+	}
+	lua_remove(L, state);
+}
+
+//--- compressed files ---------------------------------------------
+
+/*
+ * load() and save() support gzip and zstd compressed files, with the data
+ * getting (de)compressed in chunks while parsing / serializing. This needs
+ * building with LUAXML_ZLIB and/or LUAXML_ZSTD defined (and linking zlib /
+ * libzstd), which the Makefile does if the libraries are available.
+ */
+enum compression {
+	COMPRESSION_AUTO,
+	COMPRESSION_NONE,
+	COMPRESSION_GZIP,
+	COMPRESSION_ZSTD
+};
+static const char *const compressions[] = {"auto", "none", "gzip", "zstd", NULL};
+
+// Get the `compression` from the options (table or nil) at the given stack
+// index. Raises an error if the library support for it isn't available.
+static enum compression compression_option(lua_State *L, int options) {
+	if (!lua_istable(L, options)) return COMPRESSION_AUTO;
+	lua_getfield(L, options, "compression");
+	enum compression result = COMPRESSION_AUTO;
+	if (!lua_isnil(L, -1)) {
+		const char *name = luaL_checkstring(L, -1);
+		while (compressions[result] && strcmp(name, compressions[result])) result++;
+		if (!compressions[result])
+			luaL_error(L, "LuaXML ERROR: unsupported compression \"%s\"", name);
+	}
+	lua_pop(L, 1);
+	return result;
+}
+
+// determine the compression of a file that starts with the given bytes
+static enum compression detect_compression(const unsigned char *s, size_t size) {
+	if (size >= 2 && s[0] == 0x1F && s[1] == 0x8B)
+		return COMPRESSION_GZIP;
+	if (size >= 4 && s[0] == 0x28 && s[1] == 0xB5 && s[2] == 0x2F && s[3] == 0xFD)
+		return COMPRESSION_ZSTD;
+	return COMPRESSION_NONE;
+}
+
+// raise an error if there's no support for the given compression
+static void check_compression(lua_State *L, enum compression compression) {
+#ifndef LUAXML_ZLIB
+	if (compression == COMPRESSION_GZIP)
+		luaL_error(L, "LuaXML ERROR: gzip support not available");
+#endif
+#ifndef LUAXML_ZSTD
+	if (compression == COMPRESSION_ZSTD)
+		luaL_error(L, "LuaXML ERROR: zstd support not available");
+#endif
+	(void)L, (void)compression;
+}
+
+/*
+ * A reader (for streaming tokenizers) that decompresses a file. Corrupt or
+ * truncated data makes it return READER_ERROR.
+ */
+typedef struct {
+	FILE *file;
+	enum compression compression;
+	/// buffer for the compressed input
+	char *in;
+	size_t in_size, in_pos;
+	/// decompressed bytes that were peeked at, see Xml_tokenizerCompressed()
+	char head[2];
+	size_t head_size, head_pos;
+	bool eof, done, failed;
+#ifdef LUAXML_ZLIB
+	z_stream z;
+#endif
+#ifdef LUAXML_ZSTD
+	ZSTD_DStream *zstd;
+	/// result of the last decompression call, 0 = at the end of a frame
+	size_t zstd_hint;
+#endif
+} Inflater;
+
+// read more compressed input (if there's none left), returns `false` at EOF
+static bool inflater_fill(Inflater *inf) {
+	if (inf->in_pos < inf->in_size) return true;
+	if (inf->eof) return false;
+	inf->in_size = fread(inf->in, 1, LUAXML_CHUNKSIZE, inf->file);
+	inf->in_pos = 0;
+	if (inf->in_size == 0) inf->eof = true;
+	return inf->in_size > 0;
+}
+
+static size_t inflater_reader(void *ud, char *buffer, size_t size) {
+	Inflater *inf = ud;
+	size_t count = inf->head_size - inf->head_pos;
+	if (count > 0) {
+		if (count > size) count = size;
+		memcpy(buffer, inf->head + inf->head_pos, count);
+		inf->head_pos += count;
+		return count;
+	}
+	while (count == 0 && !inf->done && !inf->failed) {
+		bool more = inflater_fill(inf);
+#ifdef LUAXML_ZLIB
+		if (inf->compression == COMPRESSION_GZIP) {
+			// (without more input, this flushes any pending output)
+			inf->z.next_in = (Bytef *)inf->in + inf->in_pos;
+			inf->z.avail_in = inf->in_size - inf->in_pos;
+			inf->z.next_out = (Bytef *)buffer;
+			inf->z.avail_out = size;
+			int ret = inflate(&inf->z, Z_NO_FLUSH);
+			inf->in_pos = inf->in_size - inf->z.avail_in;
+			count = size - inf->z.avail_out;
+			if (ret == Z_STREAM_END) {
+				// another member may follow (concatenated gzip files)
+				if (inflater_fill(inf))
+					inflateReset(&inf->z);
+				else
+					inf->done = true;
+			} else if ((ret != Z_OK && ret != Z_BUF_ERROR) || (!more && count == 0))
+				inf->failed = true; // (corrupt, or truncated)
+		}
+#endif
+#ifdef LUAXML_ZSTD
+		if (inf->compression == COMPRESSION_ZSTD) {
+			if (!more && inf->zstd_hint == 0) { // (at the end of a frame)
+				inf->done = true;
+				break;
+			}
+			ZSTD_inBuffer in = {inf->in, inf->in_size, inf->in_pos};
+			ZSTD_outBuffer out = {buffer, size, 0};
+			inf->zstd_hint = ZSTD_decompressStream(inf->zstd, &out, &in);
+			inf->in_pos = in.pos;
+			count = out.pos;
+			if (ZSTD_isError(inf->zstd_hint))
+				inf->failed = true;
+			else if (!more && count == 0) {
+				inf->failed = inf->zstd_hint != 0; // (truncated frame)
+				inf->done = true;
+			}
+		}
+#endif
+		(void)more;
+	}
+	return count == 0 && inf->failed ? READER_ERROR : count;
+}
+
+static void inflater_close(void *ud) {
+	Inflater *inf = ud;
+#ifdef LUAXML_ZLIB
+	if (inf->compression == COMPRESSION_GZIP) inflateEnd(&inf->z);
+#endif
+#ifdef LUAXML_ZSTD
+	if (inf->zstd) ZSTD_freeDStream(inf->zstd);
+#endif
+	fclose(inf->file);
+	free(inf->in);
+	free(inf);
+}
+
+// Create an Inflater for `file` (which it takes ownership of). Returns NULL
+// on failure.
+static Inflater *inflater_new(FILE *file, enum compression compression) {
+	Inflater *inf = calloc(1, sizeof(Inflater));
+	char *in = malloc(LUAXML_CHUNKSIZE);
+	if (!inf || !in) {
+		free(inf);
+		free(in);
+		fclose(file);
+		return NULL;
+	}
+	inf->file = file;
+	inf->compression = compression;
+	inf->in = in;
+	bool ok = false;
+#ifdef LUAXML_ZLIB
+	// (15 + 32 = maximum window size, with automatic gzip/zlib header detection)
+	if (compression == COMPRESSION_GZIP)
+		ok = inflateInit2(&inf->z, 15 + 32) == Z_OK;
+#endif
+#ifdef LUAXML_ZSTD
+	if (compression == COMPRESSION_ZSTD) {
+		inf->zstd = ZSTD_createDStream();
+		ok = inf->zstd && !ZSTD_isError(inf->zstd_hint = ZSTD_initDStream(inf->zstd));
+	}
+#endif
+	if (!ok) {
+#ifdef LUAXML_ZSTD
+		if (inf->zstd) ZSTD_freeDStream(inf->zstd);
+#endif
+		fclose(file);
+		free(in);
+		free(inf);
+		return NULL;
+	}
+	return inf;
+}
+
+/*
+ * A writer (for save) that compresses its output, if requested. Buffers can
+ * have this as a "sink", to stream the output while serializing.
+ */
+#define LUAXML_WRITER	"LuaXML_Writer" // metatable name for writers
+
+typedef struct {
+	FILE *file;
+	const char *filename;
+	enum compression compression;
+	/// buffer for the compressed output
+	char *out;
+#ifdef LUAXML_ZLIB
+	z_stream z;
+	bool z_init;
+#endif
+#ifdef LUAXML_ZSTD
+	ZSTD_CStream *zstd;
+#endif
+} Writer;
+
+static int Writer_gc(lua_State *L) {
+	Writer *w = lua_touserdata(L, 1);
+#ifdef LUAXML_ZLIB
+	if (w->z_init) deflateEnd(&w->z);
+	w->z_init = false;
+#endif
+#ifdef LUAXML_ZSTD
+	if (w->zstd) ZSTD_freeCStream(w->zstd);
+	w->zstd = NULL;
+#endif
+	if (w->file) fclose(w->file);
+	w->file = NULL;
+	free(w->out);
+	w->out = NULL;
+	return 0;
+}
+
+static void Writer_output(lua_State *L, Writer *w, const char *data, size_t size) {
+	if (size > 0 && fwrite(data, 1, size, w->file) != size)
+		luaL_error(L, "LuaXML ERROR: error writing \"%s\"", w->filename);
+}
+
+// write `size` bytes of data, `finish` marks the end of output
+static void Writer_write(lua_State *L, Writer *w, const char *data, size_t size,
+		bool finish)
+{
+#ifdef LUAXML_ZLIB
+	if (w->compression == COMPRESSION_GZIP) {
+		w->z.next_in = (Bytef *)data;
+		w->z.avail_in = size;
+		int ret;
+		do {
+			w->z.next_out = (Bytef *)w->out;
+			w->z.avail_out = LUAXML_CHUNKSIZE;
+			ret = deflate(&w->z, finish ? Z_FINISH : Z_NO_FLUSH);
+			if (ret == Z_STREAM_ERROR)
+				luaL_error(L, "LuaXML ERROR: gzip compression failed");
+			Writer_output(L, w, w->out, LUAXML_CHUNKSIZE - w->z.avail_out);
+		} while (w->z.avail_out == 0 || (finish && ret != Z_STREAM_END));
+		return;
+	}
+#endif
+#ifdef LUAXML_ZSTD
+	if (w->compression == COMPRESSION_ZSTD) {
+		ZSTD_inBuffer in = {data, size, 0};
+		size_t remaining;
+		do {
+			ZSTD_outBuffer out = {w->out, LUAXML_CHUNKSIZE, 0};
+			remaining = ZSTD_compressStream2(w->zstd, &out, &in,
+				finish ? ZSTD_e_end : ZSTD_e_continue);
+			if (ZSTD_isError(remaining))
+				luaL_error(L, "LuaXML ERROR: zstd compression failed (%s)",
+					ZSTD_getErrorName(remaining));
+			Writer_output(L, w, w->out, out.pos);
+		} while (finish ? remaining != 0 : in.pos < in.size);
+		return;
+	}
+#endif
+	Writer_output(L, w, data, size);
+}
+
+// Buffer sink: pass the buffer content to the writer
+static void Writer_sink(lua_State *L, Buffer *buf) {
+	Writer_write(L, buf->sink_ud, buf->data, buf->size, false);
+}
+
+// Create a writer for the given file (leaving it on top of the stack), with
+// the `compression` and `level` options from the table at stack index
+// `options`. Without `compression`, this depends on the file name: ".gz"
+// means gzip, ".zst" zstd.
+static Writer *Writer_push(lua_State *L, const char *filename, const char *filemode,
+		int options)
+{
+	enum compression compression = compression_option(L, options);
+	if (compression == COMPRESSION_AUTO) {
+		size_t len = strlen(filename);
+		compression = len > 3 && strcmp(filename + len - 3, ".gz") == 0
+			? COMPRESSION_GZIP
+			: len > 4 && strcmp(filename + len - 4, ".zst") == 0
+			? COMPRESSION_ZSTD : COMPRESSION_NONE;
+	}
+	check_compression(L, compression);
+	int level = 0;
+	if (lua_istable(L, options)) {
+		lua_getfield(L, options, "level");
+		level = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+	}
+
+	Writer *w = lua_newuserdata(L, sizeof(Writer));
+	memset(w, 0, sizeof(Writer));
+	if (luaL_newmetatable(L, LUAXML_WRITER)) {
+		lua_pushcfunction(L, Writer_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	w->filename = filename;
+	w->compression = compression;
+	if (compression != COMPRESSION_NONE) {
+		// (compressed data needs binary mode)
+		lua_pushfstring(L, "%s%s", filemode, strchr(filemode, 'b') ? "" : "b");
+		filemode = lua_tostring(L, -1);
+		w->out = malloc(LUAXML_CHUNKSIZE);
+		if (!w->out) luaL_error(L, "LuaXML: out of memory (write)");
+	}
+	w->file = fopen(filename, filemode);
+	if (!w->file)
+		luaL_error(L, "error opening \"%s\" for saving: %s: %s",
+			filename, filename, strerror(errno));
+	if (compression != COMPRESSION_NONE) lua_pop(L, 1); // (file mode)
+#ifdef LUAXML_ZLIB
+	if (compression == COMPRESSION_GZIP) {
+		// (15 + 16 = maximum window size, with gzip header)
+		w->z_init = deflateInit2(&w->z, level ? level : Z_DEFAULT_COMPRESSION,
+			Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+		if (!w->z_init)
+			luaL_error(L, "LuaXML ERROR: failed to set up gzip compression");
+	}
+#endif
+#ifdef LUAXML_ZSTD
+	if (compression == COMPRESSION_ZSTD) {
+		w->zstd = ZSTD_createCStream();
+		if (!w->zstd || ZSTD_isError(ZSTD_initCStream(w->zstd, level)))
+			luaL_error(L, "LuaXML ERROR: failed to set up zstd compression");
+	}
+#endif
+	(void)level; // (unused without compression support)
+	return w;
+}
+
+//--- public methods -----------------------------------------------
+
+/** sets or returns tag of a LuaXML object.
+This method is just "syntactic sugar" (using a typical Lua term) that allows
+the writing of clearer code. LuaXML stores the tag value of an XML statement
+at table index 0, hence it can be simply accessed or altered by `var[0]`.
+However, writing `var:tag()` for access or `var:tag("newTag")` for altering
+may be more self explanatory (and future-proof in case LuaXML's tag handling
+should ever change).
+
+@function tag
+@param var  the variable whose tag should be accessed, a LuaXML object
+@tparam ?string tag  the new tag to be set
+@return  If you have passed a new tag, the function will return `var` (with
+its tag changed); otherwise the result will be the current tag of `var`
+(normally a string).
+*/
+int Xml_tag(lua_State *L) {
+	if (is_proxy(L, 1)) {
+		if (lua_type(L, 2) == LUA_TSTRING)
+			return luaL_error(L, "LuaXML ERROR: snapshot elements are read-only");
+		push_TAG_key(L);
+		proxy_rawget(L, 1);
+		return 1;
+	}
+	// the function will only operate on tables
+	if lua_istable(L, 1) {
+		lua_settop(L, 2);
+		push_TAG_key(L); // place tag key on top of stack (#3)
+		if (lua_type(L, 2) == LUA_TSTRING) {
+			lua_pushvalue(L, 2); // duplicate the value
+			lua_rawset(L, 1);
+			// (a resolved name no longer applies)
+			push_names(L, 1);
+			if (lua_istable(L, -1)) {
+				lua_pushnil(L);
+				lua_rawseti(L, -2, 0);
+			} else if (!lua_isnil(L, -1)) {
+				lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_NAMES);
+				lua_pushvalue(L, 1);
+				lua_pushnil(L);
+				lua_rawset(L, -3);
+			}
+			// we return the (modified) table
+			lua_settop(L, 1);
+			return 1;
+		} else {
+			// "tag" is empty or wrong type, retrieve the current tag
+			lua_rawget(L, 1);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/** creates a LuaXML "object", and optionally sets its tag.
+The function either sets the metatable of an existing Lua table, or creates a
+new (empty) "object". If you pass an optional` tag` string, it will be assigned
+to the result.
+
+(It's also possible to call this as `new(tag)`, which creates a new XML object
+with the given tag and is equivalent to `new({}, tag)`.)
+
+Note that it's not mandatory to use this function in order to treat a Lua table
+as LuaXML object. Setting the metatable just allows the usage of a more 
+object-oriented syntax (e.g. `xmlvar:str()` instead of `xml.str(xmlvar)`).
+XML objects created by `load` or `eval` automatically offer the
+object-oriented syntax.
+
+@function new
+@param arg (optional)  _(1)_ a table to be converted to a LuaXML object,
+or _(2)_ the tag of the new LuaXML object
+@tparam ?string tag  a tag value that will be assigned to the object
+@return  LuaXML object, either newly created or the conversion of `arg`;
+optionally tagged as requested
+*/
+int Xml_new(lua_State *L) {
+	if (!lua_istable(L, 1)) {
+		// create a new table and move it to the bottom of the stack (#1),
+		// possibly shifting other elements "one up"
+		lua_newtable(L);
+		lua_insert(L, 1);
+	}
+	// element at #1 now is a table, convert to "object"
+	make_xml_object(L, 1);
+
+	if (lua_type(L, 2) == LUA_TSTRING) {
 		lua_pushcfunction(L, Xml_tag);
 		lua_pushvalue(L, 1); // duplicate the object table
 		lua_pushvalue(L, 2); // duplicate the tag (string)
@@ -510,11 +2038,61 @@ int Xml_append(lua_State *L) {
 		lua_call(L, 1, 1); // new(tag)
 		lua_pushvalue(L, -1); // duplicate result
 		lua_rawseti(L, 1, lua_rawlen(L, 1) + 1); // append to parent (elements)
+		// if the parent is cached, link the new child - so touch() on it works
+		lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_PARENTS);
+		lua_pushvalue(L, 1);
+		lua_rawget(L, -2);
+		if (!lua_isnil(L, -1)) {
+			lua_pushvalue(L, -3); // the child
+			lua_pushvalue(L, 1);
+			lua_rawset(L, -4);
+		}
+		lua_pop(L, 2);
 		return 1;
 	}
 	return 0;
 }
 
+/** creates a copy of a LuaXML object.
+The copy includes the tag, attributes and all subelements (recursively, i.e.
+nested LuaXML objects get copied too). This is a convenient way to use an XML
+structure as "template" that gets filled in afterwards.
+
+Only subelements are copied. Any other table values (e.g. table-type
+attributes) are shared between `var` and the result, as are subelements
+exceeding `maxdepth`.
+
+@function clone
+@param var  the table (LuaXML object) to be copied
+@tparam ?number maxdepth  copy subelements only up to this depth, defaults to
+no limit. A value of 0 just copies `var` itself ("shallow copy").
+@return  a new LuaXML object
+@usage
+local item = template:clone()
+item:find("name")[1] = "foo"
+*/
+int Xml_clone(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	push_clone(L, 1, luaL_optint(L, 2, -1));
+	return 1;
+}
+
+/** estimates the memory used by a LuaXML object.
+This adds up the (approximate) sizes of all tables and strings held by `var`,
+including nested elements. Strings and tables that occur multiple times count
+only once. The numbers assume a 64-bit build of Lua 5.3, so they're only
+estimates - but suitable e.g. to size caches.
+
+@function sizeof
+@param var  the value (normally a LuaXML object) to be examined
+@treturn number  the estimated size in bytes
+*/
+int Xml_sizeof(lua_State *L) {
+	luaL_checkany(L, 1);
+	lua_pushinteger(L, value_size(L, 1));
+	return 1;
+}
+
 // Push XML-encoded string for the Lua value at given index.
 // Will automatically use a tostring() conversion first, if necessary.
 static void Xml_pushEncode(lua_State *L, int index) {
@@ -532,7 +2110,7 @@ static void Xml_pushEncode(lua_State *L, int index) {
 	do_gsub(L, -1, "&", "&amp;");
 
 	// encode other special entities
-	lua_rawgeti(L, LUA_REGISTRYINDEX, sv_code_ref);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_CODES);
 	lua_pushnil(L);
 	while (lua_next(L, -2)) {
 		// Lua stack has string to work on (-4), substitution table (-3),
@@ -592,7 +2170,7 @@ static void Xml_pushDecode(lua_State *L, const char *s, int size) {
 	lua_pushcfunction(L, XMLencoding_replacement); // replacement func (arg #3)
 	lua_call(L, 3, 1); // three parameters, one result (the substituted string)
 
-	lua_rawgeti(L, LUA_REGISTRYINDEX, sv_code_ref);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_CODES);
 	lua_pushnil(L);
 	while (lua_next(L, -2)) {
 		// Lua stack has string to work on (-4), substitution table (-3),
@@ -605,566 +2183,6131 @@ static void Xml_pushDecode(lua_State *L, const char *s, int size) {
 	do_gsub(L, -1, "&amp;", "&"); // this should always be done last
 }
 
-/** parses an XML string into a Lua table.
-The table will contain a representation of the XML tag, attributes (and their
-values), and element content / subelements (either as strings or nested LuaXML
-"objects").
-
-Note: Parsing "wide" strings or Unicode (UCS-2, UCS-4, UTF-16) currently is
-__not__ supported. If needed, convert such `xml` data to UTF-8 before passing it
-to `eval()`. UTF-8 should be safe to use, and this function will also recognize
-and ignore a UTF-8 BOM (byte order mark) at the start of `xml`.
-
-@function eval
-
-@tparam string|userdata xml
-the XML to be converted. When passing a userdata type `xml` value, it must
-point to a C-style (NUL-terminated) string.
+/*
+ * Close the element on top of the stack, at the given nesting level. If we're
+ * using a `keep` set, this takes care of leaving a kept element, or discarding
+ * a "skeleton" element that didn't end up with any (kept) content (`siblings`
+ * is the parent's child count).
+ * Returns `false` if the element was the root, i.e. parsing is complete.
+ */
+static bool Xml_evalClose(lua_State *L, Tokenizer *tok, int level, bool keep,
+		int *kept, lua_Integer *siblings)
+{
+	if (level <= 1) return false;
+	if (keep) {
+		if (*kept == level)
+			*kept = 0; // leaving the `keep` element
+		else if (!*kept && lua_rawlen(L, -1) == 0) {
+			// an ancestor without kept content, remove it from its parent
+			lua_pushnil(L);
+			lua_rawseti(L, -3, (*siblings)--);
+		}
+		// the parent element is a skeleton if we're not within a kept one
+		tok->skip_text = !*kept;
+	}
+	lua_pop(L, 1);
+	return true;
+}
 
-@tparam ?number mode
-whitespace handling mode, one of the `WS_*` constants - see [Fields](#Fields).
-defaults to `WS_TRIM` (compatible to previous LuaXML versions)
+// Push a "set" table (mapping strings to `true`) for the option value at the
+// given stack index, which may list the strings as array, or use them as keys
+// already. Pushes `nil` if there's no such option.
+static void push_tagset(lua_State *L, int index) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	if (lua_isnil(L, index)) {
+		lua_pushnil(L);
+		return;
+	}
+	luaL_checktype(L, index, LUA_TTABLE);
+	lua_newtable(L);
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (lua_type(L, -2) == LUA_TSTRING) { // {tag = true}
+			if (lua_toboolean(L, -1)) {
+				lua_pushvalue(L, -2);
+				lua_pushboolean(L, true);
+				lua_rawset(L, -5);
+			}
+		} else if (lua_type(L, -1) == LUA_TSTRING) { // {"tag"}
+			lua_pushboolean(L, true);
+			lua_rawset(L, -4); // (the value is the new key)
+			continue; // (key already on top of the stack)
+		}
+		lua_pop(L, 1);
+	}
+}
 
-@return  a LuaXML object containing the XML data, or `nil` in case of errors
-*/
-int Xml_eval(lua_State *L) {
-	enum whitespace_mode mode = luaL_optint(L, 2, WHITESPACE_TRIM);
-	const char *str;
-	size_t str_size;
-	if (lua_isuserdata(L, 1)) {
-		str = lua_touserdata(L, 1);
-		str_size = strlen(str);
+// test if the value at stack index `key` is part of the set at `set`
+static bool in_set(lua_State *L, int set, int key) {
+	if (key < 0) key += lua_gettop(L) + 1; // relative to absolute index
+	lua_pushvalue(L, key);
+	lua_rawget(L, set);
+	bool result = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
+// value types for the `types` option of eval()
+enum value_type {
+	TYPE_STRING,
+	TYPE_NUMBER,
+	TYPE_INTEGER,
+	TYPE_BOOLEAN
+};
+static const char *const value_types[] = {"string", "number", "integer", "boolean", NULL};
+
+// check the type name at the given stack index (for the given `key`)
+static enum value_type check_type(lua_State *L, int index, const char *key) {
+	const char *name = lua_type(L, index) == LUA_TSTRING ? lua_tostring(L, index) : "?";
+	int type = 0;
+	while (value_types[type] && strcmp(name, value_types[type])) type++;
+	if (!value_types[type])
+		luaL_error(L, "LuaXML ERROR: invalid type \"%s\" for \"%s\"", name, key);
+	return type;
+}
+
+/*
+ * Process the `types` option at the given stack index. This pushes two tables
+ * (or `nil`s, if there's no such option): the first maps attribute names to
+ * their type (as enum value_type), the second maps tags to a similar table
+ * for the attributes of this particular element - where the key "text" stands
+ * for the element's text content.
+ */
+static void push_typeschema(lua_State *L, int index) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	if (lua_isnil(L, index)) {
+		lua_pushnil(L);
+		lua_pushnil(L);
+		return;
 	}
-	else str = luaL_checklstring(L, 1, &str_size);
+	luaL_checktype(L, index, LUA_TTABLE);
+	lua_newtable(L); // attributes
+	lua_newtable(L); // tags
+	int tags = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (lua_type(L, -2) != LUA_TSTRING)
+			luaL_error(L, "LuaXML ERROR: invalid key type %s in types option",
+				luaL_typename(L, -2));
+		const char *key = lua_tostring(L, -2);
+		int type = check_type(L, -1, key);
+		lua_pop(L, 1);
+		lua_pushinteger(L, type);
+
+		const char *sep = strchr(key, '/');
+		if (sep) { // "tag/attribute"
+			lua_pushlstring(L, key, sep - key);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, tags);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -2);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, tags); // tags[tag] = {}
+			}
+			lua_pushstring(L, sep + 1);
+			lua_pushvalue(L, -4); // type
+			lua_rawset(L, -3);
+			lua_pop(L, 3);
+		} else {
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, tags - 1); // attributes[key] = type
+		}
+	}
+}
 
-	if (str_size >= 3 && strncmp(str, "\xEF\xBB\xBF", 3) == 0) {
-		// ignore / skip over UTF-8 BOM (byte order mark)
-		str += 3;
-		str_size -= 3;
+// Look up the type for a key (at stack index `key`), using the schema tables
+// for the current element (`element`) and for all elements (`global`). Either
+// index may be 0 to skip the corresponding table.
+static enum value_type schema_type(lua_State *L, int element, int global, int key) {
+	if (key < 0) key += lua_gettop(L) + 1; // relative to absolute index
+	int type = TYPE_STRING;
+	if (element && lua_istable(L, element)) {
+		lua_pushvalue(L, key);
+		lua_rawget(L, element);
+		if (lua_isnumber(L, -1)) global = 0; // (found it)
+		type = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	if (global) {
+		lua_pushvalue(L, key);
+		lua_rawget(L, global);
+		type = lua_tointeger(L, -1);
+		lua_pop(L, 1);
 	}
+	return type;
+}
 
-	Tokenizer *tok = Tokenizer_new(str, str_size, mode);
-	lua_settop(L, 1);
-	const char *token;
-	int firstStatement = 1;
-	while ((token=Tokenizer_next(tok)))
-		if (*token == OPN) { // new tag found
-			if (lua_gettop(L) > 1) {
-				lua_newtable(L);
-				lua_pushvalue(L, -1); // duplicate table (keep one copy on stack)
-				lua_rawseti(L, -3, lua_rawlen(L, -3) + 1); // set parent subelement
-			} else {
-				if (firstStatement) {
-					lua_newtable(L);
-					firstStatement = 0;
+// Try to push a number for the NUL-terminated string `s`, following the rules
+// of Lua's tonumber(). Returns `false` (without pushing anything) on failure.
+static bool push_number(lua_State *L, const char *s, size_t len, bool integer) {
+#if LUA_VERSION_NUM >= 503
+	if (lua_stringtonumber(L, s) != len + 1) return false;
+	if (!integer || lua_isinteger(L, -1)) return true;
+	lua_Number n = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+#else
+	char *end;
+	lua_Number n = strtod(s, &end);
+	if (end == s) return false;
+	while (isspace(*end)) end++;
+	if (*end) return false; // (trailing garbage)
+	if (!integer) {
+		lua_pushnumber(L, n);
+		return true;
+	}
+#endif
+	// integer: accept numbers that have an exact integer representation
+	const lua_Number limit = (lua_Number)((lua_Integer)1 << (sizeof(lua_Integer) * 8 - 2)) * 2;
+	if (!(n >= -limit && n < limit)) return false; // (out of range, or NaN)
+	lua_Integer i = (lua_Integer)n;
+	if ((lua_Number)i != n) return false;
+	lua_pushinteger(L, i);
+	return true;
+}
+
+/*
+ * Push the XML value `s` (of given size), converted to the given type. This
+ * works directly on the raw bytes, without creating a Lua string first. If
+ * the conversion fails, the result falls back to the (decoded) string - or to
+ * the string as-is, if `raw` is set.
+ */
+static void Xml_pushTyped(lua_State *L, enum value_type type, const char *s,
+		size_t size, bool raw)
+{
+	char number[64]; // (must be NUL-terminated, longer ones aren't valid)
+	switch (type) {
+	case TYPE_BOOLEAN:
+		if ((size == 4 && memcmp(s, "true", 4) == 0) || (size == 1 && *s == '1')) {
+			lua_pushboolean(L, true);
+			return;
+		}
+		if ((size == 5 && memcmp(s, "false", 5) == 0) || (size == 1 && *s == '0')) {
+			lua_pushboolean(L, false);
+			return;
+		}
+		break;
+	case TYPE_NUMBER:
+	case TYPE_INTEGER:
+		if (size < sizeof(number)) {
+			memcpy(number, s, size);
+			number[size] = 0;
+			if (push_number(L, number, size, type == TYPE_INTEGER)) return;
+		}
+		break;
+	default:
+		break;
+	}
+	if (raw)
+		lua_pushlstring(L, s, size);
+	else
+		Xml_pushDecode(L, s, size);
+}
+
+// read function for tokenizing files (`ud` is a `FILE *`)
+static size_t file_reader(void *ud, char *buffer, size_t size) {
+	return fread(buffer, 1, size, ud);
+}
+
+static void file_close(void *ud) {
+	fclose(ud);
+}
+
+// Create a tokenizer for a compressed `file` (see Xml_tokenizer), that
+// decompresses the input while reading.
+static Tokenizer *Xml_tokenizerCompressed(lua_State *L, FILE *file,
+		enum compression compression, enum whitespace_mode mode,
+		enum encoding encoding)
+{
+	Inflater *inf = inflater_new(file, compression);
+	if (!inf) luaL_error(L, "LuaXML ERROR: failed to set up decompression");
+	// decompress the start of input first, to determine the encoding
+	size_t head_size = inflater_reader(inf, inf->head, sizeof(inf->head));
+	inf->head_size = head_size == READER_ERROR ? 0 : head_size;
+	encoding = detect_encoding(inf->head, inf->head_size, encoding);
+	if (encoding != ENCODING_UTF8)
+		return Tokenizer_newUTF16(L, NULL, 0, mode, encoding,
+			inflater_reader, inf, inflater_close);
+	return Tokenizer_new(L, NULL, 0, mode, inflater_reader, inf, inflater_close);
+}
+
+/*
+ * Create a tokenizer (see Tokenizer_new) for either the given string, or the
+ * file `filename` if that isn't NULL. UTF-16 input gets transcoded, depending
+ * on `encoding` and the start of input - see detect_encoding(). Files get
+ * decompressed as needed, depending on `compression`.
+ */
+static Tokenizer *Xml_tokenizer(lua_State *L, const char *str, size_t size,
+		const char *filename, enum whitespace_mode mode, enum encoding encoding,
+		enum compression compression)
+{
+	if (!filename) {
+		encoding = detect_encoding(str, size, encoding);
+		if (encoding != ENCODING_UTF8)
+			return Tokenizer_newUTF16(L, str, size, mode, encoding, NULL, NULL, NULL);
+		return Tokenizer_new(L, str, size, mode, NULL, NULL, NULL);
+	}
+	FILE *file = fopen(filename, "r");
+	if (file) {
+		// check the start of the file to determine compression and encoding
+		char head[4];
+		size_t head_size = fread(head, 1, sizeof(head), file);
+		if (compression == COMPRESSION_AUTO)
+			compression = detect_compression((unsigned char *)head, head_size);
+		if (compression != COMPRESSION_NONE) {
+			// (close before checking, so an error doesn't leak the file)
+			fclose(file);
+			check_compression(L, compression);
+			if (!(file = fopen(filename, "rb")))
+				luaL_error(L, "LuaXML ERROR: \"%s\" file error or file not found!", filename);
+			return Xml_tokenizerCompressed(L, file, compression, mode, encoding);
+		}
+		encoding = detect_encoding(head, head_size, encoding);
+		if (encoding != ENCODING_UTF8)
+			// (reopen in binary mode, text mode might interfere with UTF-16)
+			file = freopen(filename, "rb", file);
+		else
+			rewind(file);
+	}
+	if (!file)
+		luaL_error(L, "LuaXML ERROR: \"%s\" file error or file not found!", filename);
+	// (the tokenizer takes care of closing the file)
+	if (encoding != ENCODING_UTF8)
+		return Tokenizer_newUTF16(L, NULL, 0, mode, encoding, file_reader, file, file_close);
+	return Tokenizer_new(L, NULL, 0, mode, file_reader, file, file_close);
+}
+
+// raise an error if validation (see Tokenizer_validate) found invalid UTF-8
+static void Xml_checkUTF8(lua_State *L, Tokenizer *tok) {
+	if (tok->invalid != NO_POS)
+		luaL_error(L, "LuaXML ERROR: invalid UTF-8 (parser pos " POS_FMT ")",
+			POS_ARG(tok->invalid));
+}
+
+// raise an error if the tokenizer's reader failed (e.g. on corrupt input), or
+// it ran out of memory
+static void Xml_checkRead(lua_State *L, Tokenizer *tok) {
+	if (tok->nomem)
+		luaL_error(L, "LuaXML: out of memory (tokenizer)");
+	if (tok->failed)
+		luaL_error(L, "LuaXML ERROR: error reading input (parser pos " POS_FMT ")",
+			POS_ARG(Tokenizer_pos(tok)));
+}
+
+/*
+ * The state of converting XML (from a tokenizer) to LuaXML objects. While
+ * parsing, the option sets and then the (open) elements are on the Lua stack.
+ */
+#define PARSER_SETS	6 // number of stack slots for the option sets
+
+typedef struct {
+	Tokenizer *tok;
+	/// stack index of the option sets: `keep` set, `drop` set, type schema
+	/// for attributes, the one for tags, the namespace state (see ns_push),
+	/// and the `counts` buffer. Elements are placed above them.
+	int sets;
+	bool keep, drop, typed, strict, namespaces;
+	/// nesting level of the innermost element with namespace declarations,
+	/// 0 = none
+	int nslevel;
+	/// nesting level of the outermost `keep` element, 0 = none (yet)
+	int kept;
+	/// (estimated) memory use of the result, and the budget (0 = none)
+	size_t memory, maxmemory;
+	/// (optional) source positions of the elements, see Parser_record()
+	Buffer *positions;
+	/// number of children of each open element (`lua_Integer`s), so appending
+	/// one doesn't need `lua_rawlen` - see Parser_run()
+	Buffer *counts;
+	/// stack index of a table that collects the recorded elements, and
+	/// the record of the innermost open element
+	int elements;
+	uint32_t current;
+	/// only convert the element on the stack, leaving the remaining input to
+	/// the caller (see transform)
+	bool nested;
+} Parser;
+
+#define RECORD_NONE	UINT32_MAX
+
+// the source span of an element, `end` is 0 while it's still open
+typedef struct {
+	size_t start, end;
+	uint32_t parent; // record index, RECORD_NONE for the root
+	uint32_t id; // (for the caller's use)
+} PosRecord;
+
+// Record the start of a new element (on top of the stack) at input position
+// `pos`. Records are kept in document order, the element tables go to the
+// `elements` table (with record index + 1 as key).
+static void Parser_record(lua_State *L, Parser *p, size_t pos) {
+	uint32_t index = p->positions->size / sizeof(PosRecord);
+	PosRecord rec = {pos, 0, index ? p->current : RECORD_NONE, 0};
+	Buffer_add(L, p->positions, (const char *)&rec, sizeof(rec));
+	p->current = index;
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, p->elements, index + 1);
+}
+
+// record the end of the innermost open element
+static void Parser_recordEnd(Parser *p, size_t pos) {
+	PosRecord *rec = (PosRecord *)p->positions->data + p->current;
+	rec->end = pos;
+	p->current = rec->parent;
+}
+
+// Account for `size` bytes of memory use, raising an error if that exceeds
+// the budget. This includes the buffers of the tokenizer.
+static void Parser_account(lua_State *L, Parser *p, size_t size) {
+	p->memory += size;
+	if (p->tok->exceeded || p->memory + p->tok->window_capacity
+			+ p->tok->m_token_capacity > p->maxmemory)
+		luaL_error(L, "LuaXML ERROR: memory budget exceeded (parser pos " POS_FMT ")",
+			POS_ARG(Tokenizer_pos(p->tok)));
+}
+
+/*
+ * Namespace mode keeps a state table with the current bindings (prefix ->
+ * names table, "" for the default namespace), the names tables by URI, and an
+ * undo log for the bindings: triples of nesting level, prefix and the previous
+ * names table (or `false`). A names table has the URI at index 0, and maps
+ * qualified names to their expanded "{uri}local" form - so each distinct name
+ * gets built (and stored) only once. NS_ELEMENTS refers to LUAXML_NAMES.
+ */
+enum {NS_BINDINGS = 1, NS_URIS, NS_UNDO, NS_ELEMENTS};
+
+// replace the URI on top of the stack with its names table
+static void ns_names(lua_State *L, int state) {
+	lua_rawgeti(L, state, NS_URIS);
+	lua_pushvalue(L, -2);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -3);
+		lua_rawseti(L, -2, 0);
+		lua_pushvalue(L, -3);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+// push the initial namespace state
+static void ns_push(lua_State *L) {
+	lua_createtable(L, 4, 0);
+	int state = lua_gettop(L);
+	lua_newtable(L);
+	lua_rawseti(L, state, NS_URIS);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_NAMES);
+	lua_rawseti(L, state, NS_ELEMENTS);
+	lua_newtable(L);
+	lua_rawseti(L, state, NS_UNDO);
+	lua_newtable(L);
+	// the "xml" prefix is bound by definition
+	lua_pushliteral(L, "http://www.w3.org/XML/1998/namespace");
+	ns_names(L, state);
+	lua_setfield(L, -2, "xml");
+	lua_rawseti(L, state, NS_BINDINGS);
+}
+
+// Bind `prefix` (of length `len`, 0 for the default namespace) to the URI on
+// top of the stack, for the element at nesting level `level`. Pops the URI.
+static void ns_declare(lua_State *L, Parser *p, int level, const char *prefix,
+		size_t len)
+{
+	int state = p->sets + 4, uri = lua_gettop(L);
+	lua_rawgeti(L, state, NS_BINDINGS); // uri + 1
+	lua_rawgeti(L, state, NS_UNDO); // uri + 2
+	size_t n = lua_rawlen(L, uri + 2);
+	lua_pushinteger(L, level);
+	lua_rawseti(L, uri + 2, n + 1);
+	lua_pushlstring(L, prefix, len);
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, uri + 2, n + 2);
+	lua_rawget(L, uri + 1);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushboolean(L, false);
+	}
+	lua_rawseti(L, uri + 2, n + 3);
+	lua_pushlstring(L, prefix, len);
+	lua_pushvalue(L, uri);
+	if (lua_rawlen(L, uri) > 0)
+		ns_names(L, state);
+	else { // (an empty URI undeclares the default namespace)
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+	lua_rawset(L, uri + 1);
+	lua_settop(L, uri - 1);
+	p->nslevel = level;
+}
+
+// undo the namespace declarations of the element at nesting level `level`,
+// when closing it
+static void ns_close(lua_State *L, Parser *p, int level) {
+	if (p->nslevel != level) return;
+	int state = p->sets + 4;
+	lua_rawgeti(L, state, NS_BINDINGS);
+	lua_rawgeti(L, state, NS_UNDO);
+	size_t n = lua_rawlen(L, -1);
+	p->nslevel = 0;
+	while (n > 0) {
+		lua_rawgeti(L, -1, n - 2);
+		int entry = (int)lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		if (entry != level) {
+			p->nslevel = entry;
+			break;
+		}
+		lua_rawgeti(L, -1, n - 1); // prefix
+		lua_rawgeti(L, -2, n); // previous names table
+		if (!lua_toboolean(L, -1)) {
+			lua_pop(L, 1);
+			lua_pushnil(L);
+		}
+		lua_rawset(L, -4);
+		int i;
+		for (i = 0; i < 3; i++) {
+			lua_pushnil(L);
+			lua_rawseti(L, -2, n--);
+		}
+	}
+	lua_pop(L, 2);
+}
+
+// Push the expanded form of the qualified name at stack index `name`, or `nil`
+// if it has no namespace. Raises an error for undeclared prefixes.
+static void ns_resolve(lua_State *L, Parser *p, int name) {
+	if (name < 0) name += lua_gettop(L) + 1; // relative to absolute index
+	size_t len;
+	const char *s = lua_tolstring(L, name, &len);
+	const char *colon = memchr(s, ':', len);
+	lua_rawgeti(L, p->sets + 4, NS_BINDINGS);
+	if (colon) lua_pushlstring(L, s, colon - s);
+	else lua_pushliteral(L, "");
+	lua_rawget(L, -2); // names table
+	if (lua_isnil(L, -1)) {
+		if (colon) {
+			lua_pushlstring(L, s, colon - s);
+			luaL_error(L, "LuaXML ERROR: undeclared namespace prefix '%s'"
+				" (parser pos " POS_FMT ")", lua_tostring(L, -1),
+				POS_ARG(Tokenizer_pos(p->tok)));
+		}
+		lua_remove(L, -2);
+		return;
+	}
+	lua_pushvalue(L, name);
+	lua_rawget(L, -2);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_rawgeti(L, -1, 0);
+		lua_pushfstring(L, "{%s}%s", lua_tostring(L, -1), colon ? colon + 1 : s);
+		lua_remove(L, -2);
+		lua_pushvalue(L, name);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4); // names[qualified] = expanded
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+// Store the resolved names of the element at stack index `element` - with
+// those of its attributes, if any of them have a prefix.
+static void ns_element(lua_State *L, Parser *p, int element, bool prefixed) {
+	push_TAG_key(L);
+	lua_rawget(L, element);
+	ns_resolve(L, p, -1);
+	lua_remove(L, -2);
+	int entry = lua_gettop(L); // (expanded tag name, or `nil`)
+	size_t count = 0;
+	if (prefixed) {
+		lua_newtable(L); // expanded -> qualified attribute names
+		int names = lua_gettop(L);
+		lua_pushvalue(L, entry);
+		lua_rawseti(L, names, 0);
+		lua_pushnil(L);
+		while (lua_next(L, element)) {
+			lua_pop(L, 1);
+			if (lua_type(L, -1) == LUA_TSTRING) {
+				size_t len;
+				const char *s = lua_tolstring(L, -1, &len);
+				const char *colon = memchr(s, ':', len);
+				if (colon && !(colon - s == 5 && memcmp(s, "xmlns", 5) == 0)) {
+					ns_resolve(L, p, lua_gettop(L));
+					lua_pushvalue(L, -2);
+					lua_rawset(L, names);
+					count++;
 				}
-				else return 0;
 			}
-			make_xml_object(L, -1); // assign metatable
+		}
+		lua_replace(L, entry);
+	}
+	if (!lua_isnil(L, entry)) {
+		lua_rawgeti(L, p->sets + 4, NS_ELEMENTS);
+		lua_pushvalue(L, element);
+		lua_pushvalue(L, entry);
+		lua_rawset(L, -3);
+		if (p->maxmemory) Parser_account(L, p, SIZEOF_NODE
+			+ (prefixed ? SIZEOF_TABLE + (count + 1) * SIZEOF_NODE : 0));
+	}
+	lua_settop(L, entry - 1);
+}
+
+// Set up parsing, using the parsing options (table or nil) at stack index
+// `options`. This pushes the option sets (`nil` if unused).
+static void Parser_init(lua_State *L, Parser *p, Tokenizer *tok, int options) {
+	memset(p, 0, sizeof(Parser));
+	p->tok = tok;
+	if (lua_istable(L, options)) {
+		lua_getfield(L, options, "strict");
+		p->strict = lua_toboolean(L, -1);
+		lua_getfield(L, options, "maxmemory");
+		lua_Integer maxmemory = luaL_optinteger(L, -1, 0);
+		luaL_argcheck(L, maxmemory >= 0, options, "invalid maxmemory");
+		tok->max_window = p->maxmemory = maxmemory;
+		lua_pop(L, 2);
+	}
+	if (p->strict) {
+		Tokenizer_validate(tok);
+		Xml_checkUTF8(L, tok); // (string input has been checked already)
+	}
+	Tokenizer_skipBOM(tok);
+
+	p->sets = lua_gettop(L) + 1;
+	if (!lua_isnil(L, options)) {
+		luaL_checktype(L, options, LUA_TTABLE);
+		lua_getfield(L, options, "keep");
+		push_tagset(L, -1);
+		lua_replace(L, -2);
+		lua_getfield(L, options, "drop");
+		push_tagset(L, -1);
+		lua_replace(L, -2);
+		lua_getfield(L, options, "types");
+		push_typeschema(L, -1);
+		lua_remove(L, -3);
+		lua_getfield(L, options, "namespaces");
+		if (lua_toboolean(L, -1)) ns_push(L);
+		else lua_pushnil(L);
+		lua_remove(L, -2);
+	} else
+		lua_settop(L, p->sets + 4);
+	p->counts = Buffer_push(L);
+	p->keep = !lua_isnil(L, p->sets);
+	p->drop = !lua_isnil(L, p->sets + 1);
+	p->typed = !lua_isnil(L, p->sets + 2);
+	p->namespaces = !lua_isnil(L, p->sets + 4);
+}
+
+// the child count of the open element at the given nesting level
+static inline lua_Integer *Parser_children(Parser *p, int level) {
+	return (lua_Integer *)p->counts->data + level - 1;
+}
+
+// close the innermost open element (at the given nesting level), see
+// Xml_evalClose()
+static bool Parser_close(lua_State *L, Parser *p, int level) {
+	if (level <= 1) return false;
+	p->counts->size -= sizeof(lua_Integer);
+	return Xml_evalClose(L, p->tok, level, p->keep, &p->kept,
+		Parser_children(p, level - 1));
+}
+
+/*
+ * Convert XML input, until it's complete - or (if `budget` isn't 0) until at
+ * least `budget` bytes of input have been processed. In the latter case this
+ * returns `false`, and parsing may continue with another call later (with
+ * the same Lua stack layout). Otherwise the tokenizer gets released, and the
+ * root element is on the stack - unless there was none.
+ */
+static bool Parser_run(lua_State *L, Parser *p, size_t budget) {
+	Tokenizer *tok = p->tok;
+	const int keepset = p->sets, dropset = keepset + 1;
+	const int attrtypes = keepset + 2, tagtypes = keepset + 3;
+	const int base = keepset + PARSER_SETS - 1;
+	const bool keep = p->keep, drop = p->drop, typed = p->typed;
+	const size_t limit = budget ? Tokenizer_pos(tok) + budget : (size_t)-1;
+
+	// (re)count the children of the elements that are open already - they may
+	// come from an earlier run, or from the caller (`nested`)
+	Buffer *counts = p->counts;
+	int i, open = lua_gettop(L) - base;
+	counts->size = 0;
+	Buffer_reserve(L, counts, open * sizeof(lua_Integer));
+	for (i = 1; i <= open; i++) *Parser_children(p, i) = lua_rawlen(L, base + i);
+	counts->size = open * sizeof(lua_Integer);
 
-			// parse tag and content:
+	const char *token;
+	for (;;) {
+		if (Tokenizer_pos(tok) >= limit) return false; // (budget exhausted)
+		if (!(token = Tokenizer_next(tok))) break;
+		int level = lua_gettop(L) - base; // number of open elements
+		if (*token == OPN) { // new tag found
+			if (!lua_checkstack(L, 4))
+				return luaL_error(L, "LuaXML ERROR: XML nesting too deep (parser pos " POS_FMT ")",
+					POS_ARG(Tokenizer_pos(tok)));
+			size_t start = Tokenizer_pos(tok) - 1; // (the tokenizer is past the '<')
+			lua_pushstring(L, Tokenizer_next(tok)); // tag
+			size_t tag_size = tok->m_token_size;
+			if (drop && in_set(L, dropset, -1)) {
+				lua_pop(L, 1);
+				Tokenizer_skipElement(tok);
+				if (level == 0) break; // (dropped the root element)
+				continue;
+			}
+			bool skeleton = false; // only an ancestor of `keep` elements?
+			if (keep && !p->kept) {
+				if (in_set(L, keepset, -1))
+					p->kept = level + 1;
+				else
+					skeleton = true;
+			}
+			lua_newtable(L);
+			lua_insert(L, -2);
 			push_TAG_key(L); // place tag key on top of stack
-			lua_pushstring(L, Tokenizer_next(tok));
+			lua_insert(L, -2);
 			lua_rawset(L, -3);
+			if (level > 0) {
+				lua_pushvalue(L, -1); // duplicate table (keep one copy on stack)
+				lua_rawseti(L, -3, ++*Parser_children(p, level)); // set parent subelement
+			}
+			lua_Integer none = 0;
+			Buffer_add(L, counts, (const char *)&none, sizeof(none));
+			make_xml_object(L, -1); // assign metatable
+			if (p->positions) Parser_record(L, p, start);
+			if (p->maxmemory)
+				Parser_account(L, p, SIZEOF_TABLE + SIZEOF_NODE + SIZEOF_SLOT
+					+ SIZEOF_STRING(tag_size));
+			int element = lua_gettop(L);
+			if (typed) { // (element-specific types go to element + 1)
+				push_TAG_key(L);
+				lua_rawget(L, element);
+				lua_rawget(L, tagtypes);
+			}
 
+			// parse tag header
+			bool prefixed = false; // (namespace mode: any prefixed attributes?)
 			while ((token = Tokenizer_next(tok)) && (*token != CLS) && (*token != ESC)) {
-				// parse tag header
-				size_t sepPos = find(token, "=", 0);
-				if (token[sepPos]) { // regular attribute (key="value")
+				size_t sepPos = find(token, tok->m_token_size, "=", 0);
+				if (sepPos + 3 <= tok->m_token_size) { // regular attribute (key="value")
 					const char *aVal = token + sepPos + 2;
+					size_t aLen = tok->m_token_size - sepPos - 3;
 					lua_pushlstring(L, token, sepPos);
-					Xml_pushDecode(L, aVal, strlen(aVal) - 1);
-					lua_rawset(L, -3);
+					if (typed)
+						Xml_pushTyped(L, schema_type(L, element + 1, attrtypes, -1),
+							aVal, aLen, false);
+					else
+						Xml_pushDecode(L, aVal, aLen);
+					lua_rawset(L, element);
+					if (p->maxmemory)
+						Parser_account(L, p, SIZEOF_NODE + SIZEOF_STRING(sepPos)
+							+ SIZEOF_STRING(aLen));
+					if (!p->namespaces) continue;
+					if (sepPos >= 5 && memcmp(token, "xmlns", 5) == 0
+						&& (sepPos == 5 || token[5] == ':'))
+					{
+						Xml_pushDecode(L, aVal, aLen);
+						ns_declare(L, p, level + 1, token + 6,
+							sepPos > 5 ? sepPos - 6 : 0);
+					} else if (memchr(token, ':', sepPos))
+						prefixed = true;
 				}
 			}
+			lua_settop(L, element);
+			if (p->namespaces) ns_element(L, p, element, prefixed);
 			if (!token || (*token == ESC)) {
 				// this tag has no content, only attributes
-				if (lua_gettop(L) > 2) lua_pop(L, 1); else break;
+				if (token && p->positions) // (at the end of input, it stays open)
+					Parser_recordEnd(p, Tokenizer_pos(tok));
+				if (p->namespaces) ns_close(L, p, level + 1);
+				if (!Parser_close(L, p, level + 1)) break;
 			}
+			else tok->skip_text = skeleton; // (skeleton text isn't needed)
 		}
 		else if (*token == ESC) { // previous tag is over
-			if (lua_gettop(L) > 2) lua_pop(L, 1); // pop current table
-			else break;
+			if (p->positions && level > 0) Parser_recordEnd(p, Tokenizer_pos(tok));
+			if (p->namespaces) ns_close(L, p, level);
+			if (!Parser_close(L, p, level)) break;
 		}
 		else { // read elements
-			if (lua_gettop(L) > 1) {
+			if (level > 0) {
 				// when normalizing, we ignore tokens considered "lead-in" type
-				if (mode != WHITESPACE_NORMALIZE || !is_lead_token(token)) {
-					if (tok->cdata) // "raw" mode, don't change token string!
+				if ((!keep || p->kept)
+					&& (tok->mode != WHITESPACE_NORMALIZE || !is_lead_token(token)))
+				{
+					enum value_type type = TYPE_STRING;
+					if (typed) {
+						push_TAG_key(L);
+						lua_rawget(L, -2);
+						lua_rawget(L, tagtypes);
+						lua_pushliteral(L, "text");
+						type = schema_type(L, lua_gettop(L) - 1, 0, -1);
+						lua_pop(L, 2);
+					}
+					if (type != TYPE_STRING)
+						Xml_pushTyped(L, type, token, tok->m_token_size, tok->cdata);
+					else if (tok->cdata) // "raw" mode, don't change token string!
 						lua_pushstring(L, token);
 					else
 						Xml_pushDecode(L, token, -1);
-					lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+					lua_rawseti(L, -2, ++*Parser_children(p, level));
+					if (p->maxmemory)
+						Parser_account(L, p, SIZEOF_SLOT + SIZEOF_STRING(tok->m_token_size));
 				}
 			}
 			else // element stack is empty, i.e. we encountered a token *before* any tag
 				if (!is_whitespace(token))
-					luaL_error(L, "Malformed XML: non-empty string '%s' before any tag (parser pos %d)",
-							   token, (int)tok->i);
+					luaL_error(L, "Malformed XML: non-empty string '%s' before any tag"
+						" (parser pos " POS_FMT ")", token, POS_ARG(Tokenizer_pos(tok)));
+		}
+	}
+	if (p->nested) return true;
+	if (p->maxmemory) Parser_account(L, p, 0); // (tokenizer might have stopped)
+	if (p->strict) {
+		// check the remainder of the input, too
+		while (!tok->eof) {
+			tok->i = tok->s_size;
+			Tokenizer_compact(tok);
+			Tokenizer_read(tok, tok->s_size + 1);
 		}
+		Xml_checkUTF8(L, tok);
+	}
+	Xml_checkRead(L, tok);
 	Tokenizer_delete(tok);
-	return lua_gettop(L) - 1;
+	return true;
 }
 
-/** loads XML data from a file and returns it as table.
-Basically, this is just calling `eval` on the given file's content.
+/*
+ * Convert the XML input of the given tokenizer to LuaXML objects, using the
+ * parsing options (table or nil) at stack index `options`. This pushes the
+ * root element, and returns the number of results (0 if there's no element).
+ */
+static int Xml_parse(lua_State *L, Tokenizer *tok, int options) {
+	Parser p;
+	Parser_init(L, &p, tok, options);
+	Parser_run(L, &p, 0);
+	return lua_gettop(L) - (p.sets + PARSER_SETS - 1);
+}
 
-@function load
-@tparam string filename  the name and path of the file to be loaded
-@tparam ?number mode  whitespace handling mode, defaults to `WS_TRIM`
-@return  a Lua table representing the XML data, or `nil` in case of errors
-*/
-int Xml_load (lua_State *L) {
-	const char *filename = luaL_checkstring(L, 1);
-	FILE *file = fopen(filename, "r");
-	if (!file)
-		return luaL_error(L, "LuaXML ERROR: \"%s\" file error or file not found!", filename);
-
-	fseek(file, 0, SEEK_END);
-	size_t sz = ftell(file);
-	rewind(file);
-	char *buffer = malloc(sz + 1);
-	sz = fread(buffer, 1, sz, file);
-	fclose(file);
-	buffer[sz] = 0;
-	lua_pushlightuserdata(L, buffer);
-	lua_replace(L, 1);
-	int result = Xml_eval(L);
-	free(buffer);
-	return result;
-};
+/** parses an XML string into a Lua table.
+The table will contain a representation of the XML tag, attributes (and their
+values), and element content / subelements (either as strings or nested LuaXML
+"objects").
 
-/** registers a custom code for the conversion between non-standard characters
-and XML character entities.
+Note: The result always uses UTF-8 strings. Apart from UTF-8 input, UTF-16
+(little or big endian) is supported too, and gets transcoded on the fly. It's
+recognized by its BOM (byte order mark), or by the initial `<` - alternatively
+you may use the `encoding` option. Other "wide" strings or Unicode encodings
+(UCS-2, UCS-4) are __not__ supported, convert such `xml` data to UTF-8 before
+passing it to `eval()`. A UTF-8 BOM at the start of `xml` gets ignored.
 
-By default, only the most basic entities are known to LuaXML:
-	" < > '
-On top (and independent) of that, the **ampersand** sign always gets encoded /
-decoded separately: `&amp;` &harr; `&amp;amp;`. Character codes above 127 are
-directly converted to an appropriate XML encoding, representing the character
-number (e.g. `&amp;#160;`). If other special encodings are needed, they can be
-registered using this function.
+@function eval
 
-Note: LuaXML now manages these encodings in a (private) standard Lua table.
-This allows you to replace entries by calling `registerCode()` again, using the
-same `decoded` and a different `encoded`. Encodings may even be removed later,
-by explictly registering a `nil` value: `registerCode(decoded, nil)`.
+@tparam string|userdata xml
+the XML to be converted. When passing a userdata type `xml` value, it must
+point to a C-style (NUL-terminated) string - unless you pass its length as
+third argument: `eval(ud, mode, len [, options])`. In that case, the memory is
+parsed "as is", without copying it. (For full userdata, `len` can't exceed
+the userdata size. From C code, you may use `luaxml_eval_buffer()` instead.)
 
-@function registerCode
-@tparam string decoded  the character (sequence) to be used within Lua
-@tparam string encoded  the character entity to be used in XML
-@see encode, decode
+@tparam ?number mode
+whitespace handling mode, one of the `WS_*` constants - see [Fields](#Fields).
+defaults to `WS_TRIM` (compatible to previous LuaXML versions)
+
+@tparam ?table options
+additional parsing options. The following fields are supported:
+
+- `drop`: a list of tags. Elements having one of these tags are skipped
+completely, including their content. This is done by merely counting nesting
+levels, without any decoding or creating of tables.
+- `keep`: a list of tags. If set, only elements with these tags get
+converted completely (apart from `drop`ped ones). Any other element will only
+be retained (with tag and attributes, but without text content) if it's an
+ancestor of a kept element. This way kept elements preserve their "path"
+within the document, while everything else gets discarded.
+
+(Instead of a list, you may also pass a set-like table `{tag = true}`.)
+
+- `encoding`: the encoding of `xml`, either `"utf-8"`, `"utf-16le"`,
+`"utf-16be"` or `"utf-16"` (which requires a BOM to tell little endian input,
+and otherwise assumes big endian). By default, this gets detected from the
+start of the input. (Userdata `xml` is always considered UTF-8.)
+- `maxmemory`: a memory budget (in bytes) for parsing. This covers the
+(estimated) size of the result - see `sizeof` - plus the tokenizer's buffers.
+If it gets exceeded, parsing stops with an error.
+- `strict`: if `true`, reject malformed UTF-8 input (this includes overlong
+forms, surrogates and code points beyond U+10FFFF). Validation happens while
+reading the input, and covers all of it - even beyond the root element. The
+error message tells the byte offset of the first invalid byte.
+
+- `namespaces`: if `true`, resolve namespace prefixes while parsing. This
+tracks the `xmlns` declarations in scope, and records the expanded names
+(`"{uri}local"`) of tags and prefixed attributes for the elements - each
+distinct name as a single string, shared by all elements using it. They're
+kept in a separate (weak) table, so the elements themselves don't change: tags
+and attributes keep their qualified names (and `str` reproduces them), but
+`match`, `find` and `iterate` accept expanded names too, and `name` returns the
+URI and local name. Undeclared prefixes raise an error. (Copies made with
+`clone` or `undump` don't carry the expanded names.)
+
+- `types`: a table that maps attribute names to value types - either
+`"number"`, `"integer"`, `"boolean"` or `"string"`. Matching attribute values
+get converted directly while parsing, just like `tonumber` would do (booleans
+accept "true", "false", "1" and "0"). Values that can't be converted stay
+strings. A key may also be of the form `"tag/attribute"`, which only applies
+to elements with the given tag (and takes precedence), and `"tag/text"`
+refers to the text content of such elements.
+
+@return  a LuaXML object containing the XML data, or `nil` in case of errors.
+(If you have enabled the `parsecache`, the result might come from there.)
+
+@usage
+-- skip <blob> elements, and retain only <item> elements (plus parents)
+local items = xml.eval(str, nil, {keep = {"item"}, drop = {"blob"}})
+-- <item id="1" price="1.50">2</item> with numeric values
+local items = xml.eval(str, nil, {types = {id = "integer", price = "number",
+	["item/text"] = "integer"}})
+-- find SOAP bodies, whatever prefix the document uses
+local doc = xml.eval(str, nil, {namespaces = true})
+local body = doc:find("{http://schemas.xmlsoap.org/soap/envelope/}Body")
 */
-int Xml_registerCode(lua_State *L) {
-	// We require the "decoded" string, but allow `nil` as argument #2.
-	// That way, users may remove entries from the table again.
-	luaL_checkstring(L, 1);
-	if (!lua_isnoneornil(L, 2)) luaL_checkstring(L, 2);
+int Xml_eval(lua_State *L) {
+	enum whitespace_mode mode = luaL_optint(L, 2, WHITESPACE_TRIM);
+	const char *str;
+	size_t str_size;
+	bool sized = lua_type(L, 1) == LUA_TSTRING;
+	if (lua_isuserdata(L, 1)) {
+		str = lua_touserdata(L, 1);
+		luaL_argcheck(L, str != NULL, 1, "NULL pointer");
+		if (lua_type(L, 3) == LUA_TNUMBER) {
+			// explicit length, the memory needn't be NUL-terminated
+			lua_Integer len = lua_tointeger(L, 3);
+			luaL_argcheck(L, len >= 0 && (lua_type(L, 1) != LUA_TUSERDATA
+				|| (size_t)len <= lua_rawlen(L, 1)), 3, "invalid length");
+			str_size = len;
+			lua_remove(L, 3); // (options follow the length)
+			sized = true;
+		} else
+			str_size = strlen(str);
+	}
+	else str = luaL_checklstring(L, 1, &str_size);
 
-	lua_settop(L, 2);
-	lua_rawgeti(L, LUA_REGISTRYINDEX, sv_code_ref); // get translation table
-	lua_insert(L, 1);
-	lua_rawset(L, 1); // assign key-value pair (k "decoded" -> v "encoded")
-	return 0;
+	// check the parse cache (only for strings, without options)
+	lua_settop(L, 3);
+	bool cacheable = lua_type(L, 1) == LUA_TSTRING && lua_isnil(L, 3)
+		&& mode >= WHITESPACE_TRIM && mode <= WHITESPACE_PRESERVE
+		&& pcache_push(L);
+	if (cacheable) {
+		if (pcache_get(L, mode + 1, 1)) return 1;
+		lua_pop(L, 1);
+	}
+
+	Tokenizer *tok = sized
+		? Xml_tokenizer(L, str, str_size, NULL, mode, encoding_option(L, 3),
+			COMPRESSION_NONE)
+		: Tokenizer_new(L, str, str_size, mode, NULL, NULL, NULL);
+	int result = Xml_parse(L, tok, 3);
+	if (cacheable && result == 1 && pcache_push(L)) {
+		lua_insert(L, -2);
+		pcache_put(L, mode + 1, 1);
+	}
+	return result;
 }
 
-/** converts a string to XML encoding.
-This function transforms` str` by replacing any special characters with
-suitable XML encodings.
+/*
+ * C API: parse `size` bytes of XML data at `p` (which needn't be NUL-terminated)
+ * directly, i.e. without copying them to a Lua string. See LuaXML_lib.h.
+ */
+int _EXPORT luaxml_eval_buffer(lua_State *L, const char *p, size_t size, int mode) {
+	lua_pushnil(L); // (no options)
+	int options = lua_gettop(L);
+	Tokenizer *tok = Xml_tokenizer(L, p, size, NULL, mode, ENCODING_AUTO,
+		COMPRESSION_NONE);
+	int result = Xml_parse(L, tok, options);
+	if (result == 0)
+		lua_pushnil(L);
+	else // (for incomplete XML, only return the root element)
+		lua_pop(L, result - 1);
+	lua_replace(L, options);
+	lua_settop(L, options);
+	return 1;
+}
 
-@usage
-print(xml.encode("<->")) -- "&lt;-&gt;"
+// a resumable parser (see Xml_parser), its user value is a table with
+// the input string, tokenizer, option sets, open elements and the result
+typedef struct {
+	Parser parser;
+	enum {PARSER_READY, PARSER_RUNNING, PARSER_DONE} state;
+} ResumableParser;
 
-@function encode
-@tparam string str  string to be transformed
-@treturn string  the XML-encoded string
-@see decode, registerCode
+enum {RP_INPUT = 1, RP_TOKENIZER, RP_SETS, RP_ELEMENTS = RP_SETS + PARSER_SETS,
+	RP_RESULT};
+
+/** creates a resumable parser.
+This allows to convert XML data in multiple steps, e.g. to avoid blocking
+other tasks for too long. Apart from that, the result is the same as with
+`eval`. (See `evalyield` for an easy way to use this from within coroutines.)
+
+@function parser
+@tparam string xml  the XML to be converted
+@tparam ?number mode  whitespace handling mode, defaults to `WS_TRIM`
+@tparam ?table options  parsing options, see `eval`
+@return  a parser object, with a method `step(bytes)` that processes (at least)
+the given number of bytes of input (defaults to 65536). `step` returns `false`
+while parsing isn't complete, and `true` plus the resulting LuaXML object
+(or `nil`) when it is.
+@usage
+local parser = xml.parser(str)
+repeat local done, result = parser:step(100000) until done
 */
-int Xml_encode(lua_State *L) {
-	luaL_checkstring(L, 1); // make sure arg #1 is a string
-	Xml_pushEncode(L, 1); // and convert it
+int Xml_parser(lua_State *L) {
+	size_t size;
+	const char *str = luaL_checklstring(L, 1, &size);
+	enum whitespace_mode mode = luaL_optint(L, 2, WHITESPACE_TRIM);
+	lua_settop(L, 3);
+	ResumableParser *rp = lua_newuserdata(L, sizeof(ResumableParser)); // #4
+	rp->state = PARSER_DONE; // (until successfully set up)
+	luaL_getmetatable(L, LUAXML_PARSER);
+	lua_setmetatable(L, 4);
+	lua_createtable(L, RP_RESULT, 0); // #5
+	lua_pushvalue(L, 5);
+	lua_setuservalue(L, 4);
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, 5, RP_INPUT);
+
+	Tokenizer *tok = Xml_tokenizer(L, str, size, NULL, mode, encoding_option(L, 3),
+		COMPRESSION_NONE);
+	lua_rawseti(L, 5, RP_TOKENIZER);
+	Parser_init(L, &rp->parser, tok, 3);
+	int i;
+	for (i = PARSER_SETS - 1; i >= 0; i--) lua_rawseti(L, 5, RP_SETS + i);
+	lua_newtable(L);
+	lua_rawseti(L, 5, RP_ELEMENTS);
+	rp->state = PARSER_READY;
+	lua_settop(L, 4);
 	return 1;
 }
 
-/** converts a string from XML encoding.
-This function transforms` str` by replacing any special XML encodings with
-their "plain text" counterparts.
+static int Parser_step(lua_State *L) {
+	ResumableParser *rp = luaL_checkudata(L, 1, LUAXML_PARSER);
+	lua_Integer budget = luaL_optinteger(L, 2, LUAXML_CHUNKSIZE);
+	luaL_argcheck(L, budget > 0, 2, "must be positive");
+	lua_settop(L, 1);
+	lua_getuservalue(L, 1); // #2
+	if (rp->state == PARSER_DONE) {
+		lua_pushboolean(L, true);
+		lua_rawgeti(L, 2, RP_RESULT);
+		return 2;
+	}
+	if (rp->state == PARSER_RUNNING)
+		return luaL_error(L, "LuaXML ERROR: parser can't continue after an error");
+
+	// restore the stack layout: open elements go above the option sets
+	lua_rawgeti(L, 2, RP_ELEMENTS); // #3
+	int i, count = lua_rawlen(L, 3);
+	luaL_checkstack(L, count + 8, "XML nesting too deep");
+	for (i = 0; i < PARSER_SETS; i++) lua_rawgeti(L, 2, RP_SETS + i);
+	rp->parser.sets = 4;
+	for (i = 1; i <= count; i++) lua_rawgeti(L, 3, i);
+
+	rp->state = PARSER_RUNNING; // (in case of errors)
+	bool done = Parser_run(L, &rp->parser, (size_t)budget);
+	int open = lua_gettop(L) - (3 + PARSER_SETS); // number of open elements
+	if (done) {
+		rp->state = PARSER_DONE;
+		lua_settop(L, 4 + PARSER_SETS); // (the root element, if any)
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, 2, RP_RESULT);
+		lua_pushnil(L);
+		lua_rawseti(L, 2, RP_ELEMENTS);
+		lua_pushnil(L);
+		lua_rawseti(L, 2, RP_TOKENIZER); // (no longer needed)
+		lua_pushboolean(L, true);
+		lua_insert(L, -2);
+		return 2;
+	}
+	// save the open elements
+	for (i = count; i > open; i--) {
+		lua_pushnil(L);
+		lua_rawseti(L, 3, i);
+	}
+	for (i = open; i > 0; i--) lua_rawseti(L, 3, i);
+	rp->state = PARSER_READY;
+	lua_pushboolean(L, false);
+	return 1;
+}
+
+/*
+ * Editable documents keep the XML text (in a gap buffer, so that successive
+ * edits at nearby positions are cheap) together with the LuaXML tree, and an
+ * index of the source span of each element. Nodes of the index store their
+ * start relative to their parent, so an edit only has to adjust the lengths
+ * of its ancestors and the start of their following siblings.
+ * The document's user value maps node ids (+ 1) to element tables, and
+ * element tables back to their id + 1.
+ */
+#define LUAXML_DOCUMENT	"LuaXML_Document" // metatable for editable documents
+
+typedef struct {
+	size_t start; // relative to the parent's start (absolute for the root)
+	size_t len;
+	uint32_t parent; // RECORD_NONE for the root (or a free node)
+	uint32_t nkids, kids_capacity;
+	uint32_t *kids; // node ids of the subelements, in document order
+} DocNode;
+
+typedef struct {
+	char *text;
+	size_t size, gap_start, gap_end;
+	DocNode *nodes;
+	uint32_t count, capacity;
+	uint32_t free; // first unused node (linked via `parent`)
+	uint32_t root; // RECORD_NONE if there's no tree
+	int mode; // whitespace mode used for parsing
+} Document;
+
+static int Document_gc(lua_State *L) {
+	Document *doc = lua_touserdata(L, 1);
+	uint32_t i;
+	for (i = 0; i < doc->count; i++) free(doc->nodes[i].kids);
+	free(doc->nodes);
+	free(doc->text);
+	memset(doc, 0, sizeof(Document));
+	return 0;
+}
+
+static inline size_t doc_length(Document *doc) {
+	return doc->size - (doc->gap_end - doc->gap_start);
+}
+
+// move the gap of the text buffer to position `pos`
+static void doc_moveGap(Document *doc, size_t pos) {
+	if (pos < doc->gap_start) {
+		size_t n = doc->gap_start - pos;
+		memmove(doc->text + doc->gap_end - n, doc->text + pos, n);
+		doc->gap_start -= n;
+		doc->gap_end -= n;
+	} else if (pos > doc->gap_start) {
+		size_t n = pos - doc->gap_start;
+		memmove(doc->text + doc->gap_start, doc->text + doc->gap_end, n);
+		doc->gap_start += n;
+		doc->gap_end += n;
+	}
+}
+
+// replace `removed` bytes of text at `offset` by `len` bytes from `s`
+static void doc_edit(lua_State *L, Document *doc, size_t offset, size_t removed,
+		const char *s, size_t len)
+{
+	doc_moveGap(doc, offset);
+	doc->gap_end += removed;
+	if (doc->gap_end - doc->gap_start < len) {
+		size_t tail = doc->size - doc->gap_end;
+		size_t size = doc->size * 2 > doc->size + len + 4096
+			? doc->size * 2 : doc->size + len + 4096;
+		char *text = realloc(doc->text, size);
+		if (!text) luaL_error(L, "LuaXML: out of memory (document)");
+		memmove(text + size - tail, text + doc->gap_end, tail);
+		doc->text = text;
+		doc->gap_end = size - tail;
+		doc->size = size;
+	}
+	memcpy(doc->text + doc->gap_start, s, len);
+	doc->gap_start += len;
+}
+
+// append `len` bytes of text from `pos` to a buffer
+static void doc_copy(lua_State *L, Document *doc, Buffer *buf, size_t pos, size_t len) {
+	if (pos < doc->gap_start) {
+		size_t n = doc->gap_start - pos < len ? doc->gap_start - pos : len;
+		Buffer_add(L, buf, doc->text + pos, n);
+		pos += n;
+		len -= n;
+	}
+	if (len > 0)
+		Buffer_add(L, buf, doc->text + pos + doc->gap_end - doc->gap_start, len);
+}
+
+static uint32_t doc_newNode(lua_State *L, Document *doc) {
+	uint32_t id = doc->free;
+	if (id != RECORD_NONE) {
+		doc->free = doc->nodes[id].parent;
+		return id;
+	}
+	if (doc->count == doc->capacity) {
+		uint32_t capacity = doc->capacity ? doc->capacity * 2 : 64;
+		DocNode *nodes = realloc(doc->nodes, capacity * sizeof(DocNode));
+		if (!nodes) luaL_error(L, "LuaXML: out of memory (document)");
+		doc->nodes = nodes;
+		doc->capacity = capacity;
+	}
+	id = doc->count++;
+	memset(doc->nodes + id, 0, sizeof(DocNode));
+	return id;
+}
+
+static void doc_addKid(lua_State *L, Document *doc, uint32_t parent, uint32_t kid) {
+	DocNode *node = doc->nodes + parent;
+	if (node->nkids == node->kids_capacity) {
+		uint32_t capacity = node->kids_capacity ? node->kids_capacity * 2 : 4;
+		uint32_t *kids = realloc(node->kids, capacity * sizeof(uint32_t));
+		if (!kids) luaL_error(L, "LuaXML: out of memory (document)");
+		node->kids = kids;
+		node->kids_capacity = capacity;
+	}
+	node->kids[node->nkids++] = kid;
+}
+
+// Release the descendants of node `id` (keeping the node itself), and remove
+// their entries from the element map at stack index `elements`.
+static void doc_freeKids(lua_State *L, Document *doc, uint32_t id, int elements) {
+	Buffer *stack = Buffer_push(L); // work list of node ids
+	DocNode *node = doc->nodes + id;
+	Buffer_add(L, stack, (const char *)node->kids, node->nkids * sizeof(uint32_t));
+	node->nkids = 0;
+	while (stack->size > 0) {
+		stack->size -= sizeof(uint32_t);
+		uint32_t kid;
+		memcpy(&kid, stack->data + stack->size, sizeof(uint32_t));
+		node = doc->nodes + kid;
+		Buffer_add(L, stack, (const char *)node->kids, node->nkids * sizeof(uint32_t));
+		free(node->kids);
+		node->kids = NULL;
+		node->nkids = node->kids_capacity = 0;
+		node->parent = doc->free;
+		doc->free = kid;
+		lua_rawgeti(L, elements, kid + 1);
+		lua_pushnil(L);
+		lua_rawset(L, elements); // elements[element] = nil
+		lua_pushnil(L);
+		lua_rawseti(L, elements, kid + 1);
+	}
+	lua_pop(L, 1);
+}
+
+// Create index nodes for parse `records` (see Parser_record), with the
+// element tables in the table at stack index `parsed`. The first record
+// describes node `first` - or a new root, if that's RECORD_NONE. `offset`
+// is the input position of the first record (relative to its parent).
+static void doc_addRecords(lua_State *L, Document *doc, Buffer *records,
+		uint32_t first, size_t offset, int elements, int parsed)
+{
+	PosRecord *rec = (PosRecord *)records->data;
+	uint32_t i, count = records->size / sizeof(PosRecord);
+	for (i = 0; i < count; i++) {
+		uint32_t id = (i == 0 && first != RECORD_NONE) ? first : doc_newNode(L, doc);
+		rec = (PosRecord *)records->data + i;
+		rec->id = id;
+		DocNode *node = doc->nodes + id;
+		if (i == 0) {
+			node->start = offset;
+			if (first == RECORD_NONE) node->parent = RECORD_NONE;
+		} else {
+			PosRecord *parent = (PosRecord *)records->data + rec->parent;
+			node->start = rec->start - parent->start;
+			node->parent = parent->id;
+			doc_addKid(L, doc, parent->id, id);
+		}
+		doc->nodes[id].len = rec->end - rec->start;
+		if (i == 0 && first != RECORD_NONE) continue; // (same table as before)
+		lua_rawgeti(L, parsed, i + 1);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, elements, id + 1);
+		lua_pushinteger(L, id + 1);
+		lua_rawset(L, elements);
+	}
+}
+
+// Parse XML text, recording the element positions. Arguments are the text
+// (light userdata), its size, the whitespace mode, a records buffer and
+// a table for the elements. Returns the element(s) left on the stack.
+static int doc_parse(lua_State *L) {
+	const char *text = lua_touserdata(L, 1);
+	size_t size = (size_t)lua_tointeger(L, 2);
+	int mode = (int)lua_tointeger(L, 3);
+	lua_pushnil(L); // (no options) #6
+	Tokenizer *tok = Tokenizer_new(L, text, size, mode, NULL, NULL, NULL);
+	Parser p;
+	Parser_init(L, &p, tok, 6);
+	p.positions = lua_touserdata(L, 4);
+	p.elements = 5;
+	Parser_run(L, &p, 0);
+	return lua_gettop(L) - (p.sets + PARSER_SETS - 1);
+}
+
+// Parse the whole text of the document at stack index 1, replacing the tree.
+// If that fails, the document is left without a tree, and the error raised.
+static void doc_build(lua_State *L, Document *doc) {
+	uint32_t i;
+	for (i = 0; i < doc->count; i++) free(doc->nodes[i].kids);
+	doc->count = 0;
+	doc->free = doc->root = RECORD_NONE;
+	lua_newtable(L);
+	lua_setuservalue(L, 1);
+
+	size_t length = doc_length(doc);
+	doc_moveGap(doc, length);
+	int top = lua_gettop(L);
+	Buffer *records = Buffer_push(L);
+	lua_newtable(L);
+	lua_pushcfunction(L, doc_parse);
+	lua_pushlightuserdata(L, doc->text);
+	lua_pushinteger(L, length);
+	lua_pushinteger(L, doc->mode);
+	lua_pushvalue(L, top + 1);
+	lua_pushvalue(L, top + 2);
+	if (lua_pcall(L, 5, 1, 0) != 0) lua_error(L);
+	if (records->size > 0) {
+		// elements that are still open extend to the end of the input
+		PosRecord *rec = (PosRecord *)records->data;
+		uint32_t count = records->size / sizeof(PosRecord);
+		for (i = 0; i < count; i++)
+			if (rec[i].end == 0) rec[i].end = length;
+		lua_getuservalue(L, 1);
+		doc_addRecords(L, doc, records, RECORD_NONE, rec->start, top + 4, top + 2);
+		doc->root = rec->id;
+	}
+	lua_settop(L, top);
+}
+
+// Find the innermost element that contains the text range [offset, end),
+// not including its first and last byte - i.e. one whose boundaries are
+// unaffected by changing that range. Sets `start` to its absolute position.
+static uint32_t doc_enclosing(Document *doc, size_t offset, size_t end, size_t *start) {
+	uint32_t id = doc->root;
+	if (id == RECORD_NONE) return RECORD_NONE;
+	size_t base = doc->nodes[id].start;
+	if (!(base < offset && end < base + doc->nodes[id].len)) return RECORD_NONE;
+	for (;;) {
+		DocNode *node = doc->nodes + id;
+		// binary search for the last kid that starts before `offset`
+		uint32_t lo = 0, hi = node->nkids;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (base + doc->nodes[node->kids[mid]].start < offset) lo = mid + 1;
+			else hi = mid;
+		}
+		if (lo == 0) break;
+		DocNode *kid = doc->nodes + node->kids[lo - 1];
+		if (end >= base + kid->start + kid->len) break;
+		id = node->kids[lo - 1];
+		base += kid->start;
+	}
+	*start = base;
+	return id;
+}
+
+// Adjust the ancestors (and their following subelements) after node `id`
+// changed its length by `delta` bytes.
+static void doc_resize(Document *doc, uint32_t id, ptrdiff_t delta) {
+	uint32_t parent;
+	while ((parent = doc->nodes[id].parent) != RECORD_NONE) {
+		DocNode *node = doc->nodes + parent;
+		size_t start = doc->nodes[id].start;
+		uint32_t lo = 0, hi = node->nkids;
+		while (lo < hi) { // find the position of `id`
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (doc->nodes[node->kids[mid]].start <= start) lo = mid + 1;
+			else hi = mid;
+		}
+		for (; lo < node->nkids; lo++) doc->nodes[node->kids[lo]].start += delta;
+		node->len += delta;
+		id = parent;
+	}
+}
+
+// Replace the content of the element table at `index` with the one of the
+// table on top of the stack (which gets popped).
+static void doc_replaceTable(lua_State *L, int index) {
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, index);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, index);
+	}
+	lua_pop(L, 1);
+}
+
+/** creates an editable document.
+The document keeps the XML text along with its LuaXML tree, and the position
+of each element within the text. After changes to the text, `reparse` only
+converts the smallest element that encloses them again.
+
+Documents have the methods `root()` (returns the root element), `text()`
+(the current XML text), `range(element)` (the start and end byte offset of an
+element's text, with the end being exclusive - `nil` if the element isn't part
+of the document) and `reparse(...)`, see `reparse`.
+
+@function document
+@tparam string xml  the XML text, UTF-8 encoded
+@tparam ?number mode  whitespace handling mode, defaults to `WS_TRIM`
+@return  a document object
+@usage
+local doc = xml.document('<list><item>1</item><item>2</item></list>')
+print(doc:range(doc:root()[2])) --> 20 34
+*/
+int Xml_document(lua_State *L) {
+	size_t size;
+	const char *str = luaL_checklstring(L, 1, &size);
+	int mode = luaL_optint(L, 2, WHITESPACE_TRIM);
+	lua_settop(L, 2);
+	Document *doc = lua_newuserdata(L, sizeof(Document)); // #3
+	memset(doc, 0, sizeof(Document));
+	doc->free = doc->root = RECORD_NONE;
+	doc->mode = mode;
+	luaL_getmetatable(L, LUAXML_DOCUMENT);
+	lua_setmetatable(L, 3);
+	lua_replace(L, 1);
+	doc->text = malloc(size + 1);
+	if (!doc->text) return luaL_error(L, "LuaXML: out of memory (document)");
+	memcpy(doc->text, str, size);
+	doc->gap_start = size; // (with a gap of one byte at the end)
+	doc->size = doc->gap_end = size + 1;
+	doc_build(L, doc);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/** applies a text change to a document, and updates its tree.
+This replaces `removed` bytes of the document text at `offset` by `insert`.
+Only the innermost element whose tags enclose the change gets parsed again:
+its table is refilled in place (keeping its identity, and its position in
+the parent), so the effort is proportional to the size of that element.
+If the change affects the structure - i.e. the edited element doesn't parse
+to a single element of the same extent - the whole text is parsed again, which
+replaces the root element.
+
+Subelements of the reparsed element are new tables, former ones are no longer
+part of the document. If even the full parse fails, the error is raised, and
+the document has no tree until a later change makes it valid again. (Its text
+does include the change, though.)
+
+@function reparse
+@param doc  the document, see `document`
+@tparam number offset  byte offset of the change (0-based)
+@tparam number removed  the number of bytes to remove
+@tparam ?string insert  the new text to insert (defaults to none)
+@return  the updated element, and `true` if the whole document was parsed
+@usage
+local doc = xml.document('<list><item>1</item><item>2</item></list>')
+local item, full = doc:reparse(26, 1, "42") --> <item>42</item>, false
+*/
+int Xml_reparse(lua_State *L) {
+	Document *doc = luaL_checkudata(L, 1, LUAXML_DOCUMENT);
+	lua_Integer offset = luaL_checkinteger(L, 2);
+	lua_Integer removed = luaL_checkinteger(L, 3);
+	size_t length = doc_length(doc), ins_len;
+	const char *ins = luaL_optlstring(L, 4, "", &ins_len);
+	luaL_argcheck(L, offset >= 0 && (size_t)offset <= length, 2, "offset out of range");
+	luaL_argcheck(L, removed >= 0 && (size_t)removed <= length - offset, 3,
+		"invalid length");
+	lua_settop(L, 4);
+	lua_getuservalue(L, 1); // #5
+
+	size_t start;
+	uint32_t id = doc_enclosing(doc, offset, offset + removed, &start);
+	if (id != RECORD_NONE) {
+		// parse the changed text of the element on its own
+		size_t len = doc->nodes[id].len, size = len - removed + ins_len;
+		Buffer *buf = Buffer_push(L); // #6
+		doc_copy(L, doc, buf, start, offset - start);
+		Buffer_add(L, buf, ins, ins_len);
+		doc_copy(L, doc, buf, offset + removed, start + len - offset - removed);
+		Buffer *records = Buffer_push(L); // #7
+		lua_newtable(L); // #8
+		lua_pushcfunction(L, doc_parse);
+		lua_pushlightuserdata(L, buf->data);
+		lua_pushinteger(L, size);
+		lua_pushinteger(L, doc->mode);
+		lua_pushvalue(L, 7);
+		lua_pushvalue(L, 8);
+		PosRecord *rec;
+		if (lua_pcall(L, 5, LUA_MULTRET, 0) == 0 && lua_gettop(L) == 9
+				&& (rec = (PosRecord *)records->data)->start == 0
+				&& rec->end == size) {
+			doc_edit(L, doc, offset, removed, ins, ins_len);
+			lua_rawgeti(L, 5, id + 1); // #10
+			lua_pushvalue(L, 9);
+			doc_replaceTable(L, 10);
+			doc_freeKids(L, doc, id, 5);
+			size_t rel = doc->nodes[id].start;
+			doc_addRecords(L, doc, records, id, rel, 5, 8);
+			doc_resize(doc, id, (ptrdiff_t)size - (ptrdiff_t)len);
+			// the cached XML strings of the element and its ancestors are stale
+			lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_STRCACHE); // #11
+			for (; id != RECORD_NONE; id = doc->nodes[id].parent) {
+				lua_rawgeti(L, 5, id + 1);
+				lua_pushnil(L);
+				lua_rawset(L, 11);
+			}
+			lua_pushvalue(L, 10);
+			lua_pushboolean(L, false);
+			return 2;
+		}
+		lua_settop(L, 5);
+	}
+
+	// fall back to parsing the whole (changed) text
+	doc_edit(L, doc, offset, removed, ins, ins_len);
+	doc_build(L, doc);
+	if (doc->root == RECORD_NONE)
+		lua_pushnil(L);
+	else {
+		lua_getuservalue(L, 1);
+		lua_rawgeti(L, -1, doc->root + 1);
+	}
+	lua_pushboolean(L, true);
+	return 2;
+}
+
+static int Document_root(lua_State *L) {
+	Document *doc = luaL_checkudata(L, 1, LUAXML_DOCUMENT);
+	if (doc->root == RECORD_NONE) return 0;
+	lua_getuservalue(L, 1);
+	lua_rawgeti(L, -1, doc->root + 1);
+	return 1;
+}
+
+static int Document_text(lua_State *L) {
+	Document *doc = luaL_checkudata(L, 1, LUAXML_DOCUMENT);
+	size_t length = doc_length(doc);
+	doc_moveGap(doc, length);
+	lua_pushlstring(L, doc->text, length);
+	return 1;
+}
+
+static int Document_range(lua_State *L) {
+	Document *doc = luaL_checkudata(L, 1, LUAXML_DOCUMENT);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_rawget(L, 3);
+	if (lua_isnil(L, -1)) return 1;
+	uint32_t id = (uint32_t)lua_tointeger(L, -1) - 1;
+	size_t start = 0, len = doc->nodes[id].len;
+	for (; id != RECORD_NONE; id = doc->nodes[id].parent)
+		start += doc->nodes[id].start;
+	lua_pushinteger(L, start);
+	lua_pushinteger(L, start + len);
+	return 2;
+}
+
+/** loads XML data from a file and returns it as table.
+This works like `eval` on the given file's content, but reads the file in
+chunks while parsing (instead of loading it into memory as a whole). UTF-16
+files get transcoded the same way, without an intermediate copy.
+
+gzip and zstd compressed files get decompressed while parsing, too (if
+LuaXML was built with zlib / libzstd). The compression is detected from the
+start of the file, unless the `compression` option specifies it ("gzip",
+"zstd" or "none").
+
+@function load
+@tparam string filename  the name and path of the file to be loaded
+@tparam ?number mode  whitespace handling mode, defaults to `WS_TRIM`
+@tparam ?table options  additional parsing options, see `eval` - and
+`compression`
+@return  a Lua table representing the XML data, or `nil` in case of errors
+*/
+int Xml_load (lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	int mode = luaL_optint(L, 2, WHITESPACE_TRIM);
+	lua_settop(L, 3);
+
+	// check the parse cache, using file name, size and modification time as key
+	struct stat st;
+	bool cacheable = lua_isnil(L, 3)
+		&& mode >= WHITESPACE_TRIM && mode <= WHITESPACE_PRESERVE
+		&& stat(filename, &st) == 0 && pcache_push(L);
+	if (cacheable) {
+		lua_pushfstring(L, "%s\n%f\n%f", filename,
+			(lua_Number)st.st_size, (lua_Number)st.st_mtime);
+		lua_insert(L, 4); // key
+		if (pcache_get(L, mode + 4, 4)) return 1;
+		lua_pop(L, 1);
+	}
+
+	Tokenizer *tok = Xml_tokenizer(L, NULL, 0, filename, mode, encoding_option(L, 3),
+		compression_option(L, 3));
+	int result = Xml_parse(L, tok, 3);
+	if (result == 0)
+		lua_pushnil(L);
+	else // (for incomplete XML, only return the root element)
+		lua_pop(L, result - 1);
+	if (cacheable && lua_istable(L, -1) && pcache_push(L)) {
+		lua_insert(L, -2);
+		pcache_put(L, mode + 4, 4);
+	}
+	return 1;
+}
+
+/*
+ * Stack layout for `Xml_columns`: the lookup tables for row attributes and
+ * child elements, the result table, the column arrays (by field index), the
+ * field types, the tokenizer - and (starting above COL_VALUES) one slot per
+ * field, holding its pending value for the current row.
+ */
+enum {COL_ROWATTRS = 5, COL_CHILDREN, COL_RESULT, COL_ARRAYS, COL_TYPES,
+	COL_TOKENIZER, COL_VALUES = COL_TOKENIZER};
+
+#define COL_TEXT	"text()" // lookup key for text content
+
+// Count the (likely) start tags `<rowtag` within an XML string. This is just
+// an estimate to presize the column arrays.
+static int columns_estimate(const char *s, size_t size, const char *rowtag) {
+	size_t len = strlen(rowtag);
+	int count = 0;
+	const char *end = s + size;
+	while ((s = memchr(s, '<', end - s))) {
+		s++;
+		if ((size_t)(end - s) > len && memcmp(s, rowtag, len) == 0
+				&& (isspace(s[len]) || s[len] == '>' || s[len] == '/'))
+			count++;
+	}
+	return count;
+}
+
+// Set the pending value of field `index` from the value on top of the stack
+// (popping it). Text content that's already there gets appended to.
+static void columns_set(lua_State *L, int index, bool text) {
+	if (text && !lua_isnil(L, COL_VALUES + index)) {
+		lua_pushvalue(L, COL_VALUES + index);
+		lua_insert(L, -2);
+		lua_concat(L, 2);
+	}
+	lua_replace(L, COL_VALUES + index);
+}
+
+// Read the attributes of the current tag, storing the ones that have a field
+// index in the lookup table at `lookup` (0 = ignore all). Returns `true` if
+// the tag was an empty-element one, i.e. there's no content.
+static bool columns_header(lua_State *L, Tokenizer *tok, int lookup) {
+	const char *token;
+	while ((token = Tokenizer_next(tok)) && (*token != CLS) && (*token != ESC)) {
+		if (!lookup) continue;
+		size_t sepPos = find(token, tok->m_token_size, "=", 0);
+		if (sepPos + 3 <= tok->m_token_size) {
+			lua_pushlstring(L, token, sepPos);
+			lua_rawget(L, lookup);
+			int index = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if (index) {
+				Xml_pushDecode(L, token + sepPos + 2, tok->m_token_size - sepPos - 3);
+				columns_set(L, index, false);
+			}
+		}
+	}
+	return !token || *token == ESC;
+}
+
+// test if the lookup table at `index` has a field for the text content
+static bool columns_wantText(lua_State *L, int index) {
+	lua_pushliteral(L, COL_TEXT);
+	lua_rawget(L, index);
+	bool result = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	return result;
+}
+
+// Append the pending values of the current row to the column arrays, and
+// clear them (for the next row).
+static void columns_commit(lua_State *L, int fields, int row) {
+	const enum value_type *types = lua_touserdata(L, COL_TYPES);
+	int i;
+	for (i = 1; i <= fields; i++) {
+		if (lua_isnil(L, COL_VALUES + i)) continue;
+		lua_rawgeti(L, COL_ARRAYS, i);
+		if (types[i - 1] != TYPE_STRING) {
+			size_t size;
+			const char *s = lua_tolstring(L, COL_VALUES + i, &size);
+			Xml_pushTyped(L, types[i - 1], s, size, true);
+		} else
+			lua_pushvalue(L, COL_VALUES + i);
+		lua_rawseti(L, -2, row);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_replace(L, COL_VALUES + i);
+	}
+}
+
+// Build the lookup tables (and column arrays) from the list of field specs.
+static int columns_fields(lua_State *L, int presize) {
+	int fields = lua_rawlen(L, 3);
+	lua_newtable(L); // COL_ROWATTRS
+	lua_newtable(L); // COL_CHILDREN
+	lua_newtable(L); // COL_RESULT
+	lua_createtable(L, fields, 0); // COL_ARRAYS
+	enum value_type *types = lua_newuserdata(L, fields * sizeof(enum value_type) + 1);
+	int i;
+	for (i = 1; i <= fields; i++) {
+		lua_rawgeti(L, 3, i);
+		if (lua_type(L, -1) != LUA_TSTRING)
+			luaL_error(L, "LuaXML ERROR: field #%d must be a string", i);
+		const char *spec = lua_tostring(L, -1);
+		// column type, from the (optional) types table
+		types[i - 1] = TYPE_STRING;
+		if (!lua_isnil(L, 4)) {
+			lua_pushvalue(L, -1);
+			lua_gettable(L, 4);
+			if (!lua_isnil(L, -1))
+				types[i - 1] = check_type(L, -1, spec);
+			lua_pop(L, 1);
+		}
+		// the column array, and its entry in the result table
+		lua_createtable(L, presize, 0);
+		lua_pushvalue(L, -2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, COL_RESULT);
+		lua_rawseti(L, COL_ARRAYS, i);
+
+		int lookup = COL_ROWATTRS;
+		const char *slash = strchr(spec, '/');
+		if (slash) {
+			if (strchr(slash + 1, '/'))
+				luaL_error(L, "LuaXML ERROR: unsupported field \"%s\"", spec);
+			// child element, get (or create) its lookup table
+			lua_pushlstring(L, spec, slash - spec);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, COL_CHILDREN);
+			if (lua_isnil(L, -1)) {
+				lua_pop(L, 1);
+				lua_newtable(L);
+				lua_pushvalue(L, -1);
+				lua_insert(L, -3);
+				lua_rawset(L, COL_CHILDREN);
+			} else
+				lua_remove(L, -2);
+			lookup = lua_gettop(L);
+			spec = slash + 1;
+		}
+		if (*spec == '@') spec++;
+		if (!*spec)
+			luaL_error(L, "LuaXML ERROR: invalid field #%d", i);
+		lua_pushstring(L, spec); // (attribute name or "text()")
+		lua_pushinteger(L, i);
+		lua_rawset(L, lookup);
+		lua_settop(L, COL_TYPES);
+	}
+	return fields;
+}
+
+/** extracts fields of "row" elements into column arrays.
+
+This streams through the XML input once, looking for elements with the given
+`rowtag`, and collects the requested fields of each row. Rather than creating
+LuaXML objects (or any other per-row tables), it returns one Lua array per
+field, which makes it well suited for large "record" files. All other content
+gets skipped. (Row elements nested within rows are skipped, too.)
+
+A field may be
+- `"attr"` or `"@attr"`: an attribute of the row element
+- `"text()"`: the text content of the row element
+- `"child/attr"` or `"child/@attr"`: an attribute of the first child element
+with tag `child`
+- `"child/text()"`: the text content of that child element
+
+(Text content gets concatenated, and is subject to `WS_TRIM` handling. UTF-16
+input is detected and transcoded just like `eval` does.)
+
+@function columns
+@param xml  either a string with XML data, or the name of a file to read
+(any string that doesn't contain a `<` is considered a file name)
+@tparam string rowtag  the tag of row elements
+@tparam table fields  a list of field names
+@tparam ?table types  a table that maps field names to value types, see the
+`types` option of `eval`. Values that can't be converted stay strings.
+@treturn table  a table with the column arrays, using the field names as keys.
+Missing values are `nil`, i.e. the arrays might have "holes".
+@treturn number  the number of rows
+@usage
+local cols, n = xml.columns("data.xml", "item", {"id", "name/text()"}, {id = "integer"})
+for i = 1, n do print(cols.id[i], cols["name/text()"][i]) end
+*/
+int Xml_columns(lua_State *L) {
+	size_t size;
+	const char *str = luaL_checklstring(L, 1, &size);
+	const char *rowtag = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 4)) luaL_checktype(L, 4, LUA_TTABLE);
+	lua_settop(L, 4);
+
+	bool is_file = !memchr(str, '<', size);
+	int fields = columns_fields(L, is_file ? 0 : columns_estimate(str, size, rowtag));
+	Tokenizer *tok = Xml_tokenizer(L, str, size, is_file ? str : NULL,
+		WHITESPACE_TRIM, ENCODING_AUTO, COMPRESSION_AUTO);
+	Tokenizer_skipBOM(tok);
+	luaL_checkstack(L, fields + 4, "too many fields");
+	lua_settop(L, COL_VALUES + fields); // (pending values are nil)
+	int child = 0; // stack index of the current child's lookup table
+	bool rowText = columns_wantText(L, COL_ROWATTRS);
+
+	// `depth` is the nesting level relative to the current row element, 0 if
+	// outside of rows (1 = within row, 2 = within a child of the row)
+	int depth = 0, rows = 0;
+	const char *token;
+	tok->skip_text = true;
+	while ((token = Tokenizer_next(tok))) {
+		if (*token == OPN) {
+			const char *tag = Tokenizer_next(tok);
+			if (!tag) break;
+			if (depth == 0) {
+				if (strcmp(tag, rowtag) == 0) {
+					if (columns_header(L, tok, COL_ROWATTRS))
+						columns_commit(L, fields, ++rows); // (empty row element)
+					else {
+						depth = 1;
+						tok->skip_text = !rowText;
+					}
+				} else
+					columns_header(L, tok, 0);
+				continue;
+			}
+			if (depth == 1) {
+				// a child of the row, do we want to look at it?
+				lua_pushstring(L, tag);
+				lua_rawget(L, COL_CHILDREN);
+				if (lua_istable(L, -1)) {
+					// (only the first child with this tag counts, so we're
+					// marking the lookup table with the row number)
+					lua_rawgeti(L, -1, 0);
+					bool seen = lua_tointeger(L, -1) == rows + 1;
+					lua_pop(L, 1);
+					if (!seen) {
+						lua_pushinteger(L, rows + 1);
+						lua_rawseti(L, -2, 0);
+						child = lua_gettop(L);
+						if (!columns_header(L, tok, child)) {
+							depth = 2;
+							tok->skip_text = !columns_wantText(L, child);
+						} else {
+							lua_pop(L, 1);
+							child = 0;
+						}
+						continue;
+					}
+				}
+				lua_pop(L, 1);
+			}
+			Tokenizer_skipElement(tok); // (anything else)
+		}
+		else if (*token == ESC) { // closing tag
+			if (depth == 2) {
+				lua_settop(L, COL_VALUES + fields);
+				child = 0;
+				depth = 1;
+				tok->skip_text = !rowText;
+			}
+			else if (depth == 1) {
+				columns_commit(L, fields, ++rows);
+				depth = 0;
+				tok->skip_text = true;
+			}
+		}
+		else if (depth > 0) { // text content
+			lua_pushliteral(L, COL_TEXT);
+			lua_rawget(L, depth == 1 ? COL_ROWATTRS : child);
+			int index = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if (index) {
+				if (tok->cdata)
+					lua_pushstring(L, token);
+				else
+					Xml_pushDecode(L, token, -1);
+				columns_set(L, index, true);
+			}
+		}
+	}
+	Xml_checkRead(L, tok);
+	Tokenizer_delete(tok);
+	lua_pushvalue(L, COL_RESULT);
+	lua_pushinteger(L, rows);
+	return 2;
+}
+
+/** configures the parse cache, and returns its statistics.
+
+The parse cache allows `eval` and `load` to skip parsing entirely, if they have
+seen the same input before. It's disabled by default. `eval` looks up the XML
+string itself (so there's no need to hash or compare anything beyond what Lua
+does for table keys), `load` uses the combination of filename, file size and
+modification time. Calls that pass parsing `options` aren't cached.
+
+Cached entries are dropped (least recently used first) to keep their total
+size within a given budget. This is the memory held by the parsed tables (and
+keys), as estimated by `sizeof`. Registering a code with `registerCode`
+discards all entries, as they were decoded with the previous codes.
+
+@function parsecache
+
+@tparam ?table|boolean options
+pass `false` to disable the cache (discarding all entries). Otherwise a table
+(re)enables the cache, with the following optional fields:
+
+- `budget`: maximum size (in bytes, see `sizeof`) of cached entries,
+defaults to 8 MiB.
+- `shared`: if `true`, all cache hits return the very same table. This is
+fastest, but the result must then be treated as read-only. By default each hit
+returns a (private) copy instead.
+
+Configuring the cache this way will discard all previous entries. Calling
+`parsecache()` without arguments leaves the current configuration untouched.
+
+@treturn table
+statistics, with the fields `hits`, `misses`, `count` (number of entries),
+`size` (total size of entries), `budget` and `shared`
+
+@usage
+xml.parsecache({budget = 64 * 1024 * 1024})
+local config = xml.load("config.xml") -- (repeated calls will hit the cache)
+print(xml.parsecache().hits)
+*/
+int Xml_parsecache(lua_State *L) {
+	if (!lua_isnoneornil(L, 1)) {
+		if (lua_isboolean(L, 1) && !lua_toboolean(L, 1))
+			lua_pushnil(L); // disable
+		else {
+			luaL_checktype(L, 1, LUA_TTABLE);
+			lua_getfield(L, 1, "budget");
+			lua_Integer budget = luaL_optinteger(L, -1, 8 * 1024 * 1024);
+			lua_getfield(L, 1, "shared");
+			bool shared = lua_toboolean(L, -1);
+			lua_newtable(L); // (new) parse cache state
+			pcache_setint(L, lua_gettop(L), "budget", budget);
+			lua_pushboolean(L, shared);
+			lua_setfield(L, -2, "shared");
+			pcache_clear(L, lua_gettop(L));
+		}
+		lua_setfield(L, LUA_REGISTRYINDEX, LUAXML_PARSECACHE);
+	}
+
+	lua_createtable(L, 0, 6); // statistics
+	int stats = lua_gettop(L);
+	bool enabled = pcache_push(L);
+	int state = lua_gettop(L);
+	const char *fields[] = {"hits", "misses", "count", "size", "budget"};
+	for (int i = 0; i < 5; i++)
+		pcache_setint(L, stats, fields[i],
+			enabled ? pcache_getint(L, state, fields[i]) : 0);
+	if (enabled) lua_getfield(L, state, "shared");
+	lua_pushboolean(L, enabled && lua_toboolean(L, -1));
+	lua_setfield(L, stats, "shared");
+	lua_settop(L, stats);
+	return 1;
+}
+
+/** registers a custom code for the conversion between non-standard characters
+and XML character entities.
+
+By default, only the most basic entities are known to LuaXML:
+	" < > '
+On top (and independent) of that, the **ampersand** sign always gets encoded /
+decoded separately: `&amp;` &harr; `&amp;amp;`. Character codes above 127 are
+directly converted to an appropriate XML encoding, representing the character
+number (e.g. `&amp;#160;`). If other special encodings are needed, they can be
+registered using this function.
+
+Note: LuaXML now manages these encodings in a (private) standard Lua table.
+This allows you to replace entries by calling `registerCode()` again, using the
+same `decoded` and a different `encoded`. Encodings may even be removed later,
+by explictly registering a `nil` value: `registerCode(decoded, nil)`.
+Any `str` results kept by `cache`, and the entries of the parse cache, get
+discarded - as they used the old codes.
+
+@function registerCode
+@tparam string decoded  the character (sequence) to be used within Lua
+@tparam string encoded  the character entity to be used in XML
+@see encode, decode
+*/
+int Xml_registerCode(lua_State *L) {
+	// We require the "decoded" string, but allow `nil` as argument #2.
+	// That way, users may remove entries from the table again.
+	luaL_checkstring(L, 1);
+	if (!lua_isnoneornil(L, 2)) luaL_checkstring(L, 2);
+
+	lua_settop(L, 2);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_CODES); // get translation table
+	lua_insert(L, 1);
+	lua_rawset(L, 1); // assign key-value pair (k "decoded" -> v "encoded")
+	// cached str() results used the previous codes, discard them
+	push_weaktable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, LUAXML_STRCACHE);
+	// and so did parse cache entries
+	if (pcache_push(L)) pcache_clear(L, lua_gettop(L));
+	return 0;
+}
+
+/** converts a string to XML encoding.
+This function transforms` str` by replacing any special characters with
+suitable XML encodings.
+
+@usage
+print(xml.encode("<->")) -- "&lt;-&gt;"
+
+@function encode
+@tparam string str  string to be transformed
+@treturn string  the XML-encoded string
+@see decode, registerCode
+*/
+int Xml_encode(lua_State *L) {
+	luaL_checkstring(L, 1); // make sure arg #1 is a string
+	Xml_pushEncode(L, 1); // and convert it
+	return 1;
+}
+
+/** converts a string from XML encoding.
+This function transforms` str` by replacing any special XML encodings with
+their "plain text" counterparts.
+
+@usage
+print((xml.decode("&lt;-&gt;")) -- "<->"
+
+@function decode
+@tparam string str  string to be transformed
+@treturn string  the decoded string
+@see encode, registerCode
+*/
+int Xml_decode(lua_State *L) {
+	size_t size;
+	luaL_checklstring(L, 1, &size); // make sure arg #1 is a string
+	Xml_pushDecode(L, lua_tostring(L, 1), size); // and convert it
+	return 1;
+}
+
+// Output a "flat" Lua value (= non-table) as XML, using either the given tag
+// or the type name of the value.
+static void Xml_serializeValue(lua_State *L, Buffer *buf, int index, int indent,
+		const char *tag)
+{
+	if (!tag) tag = luaL_typename(L, index);
+	Buffer_addindent(L, buf, indent);
+	Buffer_addchar(L, buf, '<');
+	Buffer_addstring(L, buf, tag);
+	Buffer_addchar(L, buf, '>');
+	Xml_pushEncode(L, index); // encode(tostring(value))
+	Buffer_addvalue(L, buf);
+	Buffer_add(L, buf, "</", 2);
+	Buffer_addstring(L, buf, tag);
+	Buffer_add(L, buf, ">\n", 2);
+}
+
+// serializer state for a table (= nesting level) that's currently being output
+typedef struct {
+	int indent;
+	/// number of (array) sub-elements, and the current one
+	size_t count, k;
+	/// number of 'extended' (table-type) attributes, and the current one
+	size_t ext_count, ext_k;
+	/// buffer position where the element's output started (for caching)
+	size_t start;
+} StrFrame;
+
+/*
+ * Serialization cache (see cache() and touch()): The registry table
+ * LUAXML_STRCACHE maps elements to their XML string, LUAXML_PARENTS maps
+ * elements to their parent element (or `true` for the root that caching was
+ * enabled on). Both use weak keys. An element is "cached" if it has an entry
+ * in LUAXML_PARENTS.
+ */
+
+// Look up the element at stack index `node` in the cache (at stack index
+// `cache`). If there is an entry for the given indentation, add it to the
+// buffer and return `true`.
+static bool cache_lookup(lua_State *L, Buffer *buf, int cache, int node,
+		int indent)
+{
+	size_t len;
+	lua_pushvalue(L, node);
+	lua_rawget(L, cache);
+	const char *s = lua_tolstring(L, -1, &len);
+	// The string starts with the tabs for the indentation it was rendered at,
+	// followed by '<'. Only accept an exact match of that level.
+	bool hit = s && (size_t)indent < len && s[indent] == '<';
+	for (int i = 0; hit && i < indent; i++) hit = s[i] == '\t';
+	if (hit) Buffer_add(L, buf, s, len);
+	lua_pop(L, 1);
+	return hit;
+}
+
+// Store the output for the element at stack index `node` (from buffer position
+// `start` onwards) to the cache. This only happens for elements with an
+// 'implicit' tag, as the result otherwise depends on the context.
+static void cache_store(lua_State *L, Buffer *buf, int cache, int node,
+		size_t start)
+{
+	push_TAG_key(L);
+	lua_rawget(L, node);
+	if (lua_type(L, -1) == LUA_TSTRING) {
+		lua_pushvalue(L, node);
+		lua_pushlstring(L, buf->data + start, buf->size - start);
+		lua_rawset(L, cache);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Output the opening tag (including simple attributes) for the table at stack
+ * index `node`. The `tag` slot has to contain the explicit tag (or `nil`) upon
+ * entry, it will receive the actual tag string. Table-type ('extended')
+ * attributes get collected into a table at `ext` as key-value sequence.
+ * Returns `true` if the element has content that still needs to be processed,
+ * `false` if it's complete already.
+ */
+static bool Xml_serializeOpen(lua_State *L, Buffer *buf, int node, int tag, int ext,
+		StrFrame *frame)
+{
+	// order of precedence: value[0], explicit tag string, Lua type name
+	push_TAG_key(L);
+	lua_rawget(L, node);
+	if (lua_tostring(L, -1))
+		lua_replace(L, tag);
+	else {
+		lua_pop(L, 1);
+		if (!lua_tostring(L, tag)) {
+			lua_pushstring(L, lua_typename(L, LUA_TTABLE));
+			lua_replace(L, tag);
+		}
+	}
+	Buffer_addindent(L, buf, frame->indent);
+	Buffer_addchar(L, buf, '<');
+	Buffer_addstring(L, buf, lua_tostring(L, tag));
+
+	// Iterate over string keys (= attributes)
+	frame->ext_count = frame->ext_k = 0;
+	lua_pushnil(L);
+	while (lua_next(L, node)) {
+		// (k, v) pair on the stack
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			// (the "_M" test here is to avoid recursion on module tables)
+			if (lua_istable(L, -1) && strcmp(lua_tostring(L, -2), "_M")) {
+				if (frame->ext_count == 0) {
+					lua_newtable(L);
+					lua_replace(L, ext);
+				}
+				lua_pushvalue(L, -2); // duplicate "k"
+				lua_rawseti(L, ext, 2 * frame->ext_count + 1);
+				lua_pushvalue(L, -1); // duplicate "v"
+				lua_rawseti(L, ext, 2 * frame->ext_count + 2);
+				frame->ext_count++;
+			} else {
+				Buffer_addchar(L, buf, ' ');
+				Buffer_addstring(L, buf, lua_tostring(L, -2));
+				Buffer_add(L, buf, "=\"", 2);
+				Xml_pushEncode(L, -1); // encode(tostring(v))
+				Buffer_addvalue(L, buf);
+				Buffer_addchar(L, buf, '"');
+			}
+		}
+		lua_pop(L, 1); // pop <v>alue, leaving <k>ey for next iteration
+	}
+
+	frame->count = lua_rawlen(L, node); // number of "array" (sub)elements
+	frame->k = 0;
+	if (frame->count == 0 && frame->ext_count == 0) {
+		// no sub-elements and no extended attr -> close tag and we're done
+		Buffer_add(L, buf, " />\n", 4);
+		return false;
+	}
+	Buffer_addchar(L, buf, '>'); // close opening tag
+	if (frame->count == 1 && frame->ext_count == 0) {
+		// single subelement, no extended attributes
+		lua_rawgeti(L, node, 1); // value[1]
+		if (!lua_istable(L, -1)) {
+			// output as single string, then close tag
+			Xml_pushEncode(L, -1); // encode(tostring(value[1]))
+			Buffer_addvalue(L, buf);
+			lua_pop(L, 1);
+			Buffer_add(L, buf, "</", 2);
+			Buffer_addstring(L, buf, lua_tostring(L, tag));
+			Buffer_add(L, buf, ">\n", 2);
+			return false;
+		}
+		lua_pop(L, 1); // discard (table) value, to realign stack
+	}
+	Buffer_addchar(L, buf, '\n');
+	return true;
+}
+
+/*
+ * Output the XML representation of the value at stack index `index` to `buf`.
+ * `tagindex` refers to an (optional) explicit tag.
+ *
+ * Nested tables are processed iteratively - not with recursive calls - to
+ * avoid any limits on the nesting depth. Each (open) nesting level keeps a
+ * StrFrame, and the corresponding Lua values (table, tag and extended
+ * attributes) get stored to an auxiliary table.
+ *
+ * If caching was enabled for the table (or its ancestors), the output of
+ * unchanged subelements gets copied from the cache - see cache().
+ */
+static void Xml_serialize(lua_State *L, Buffer *buf, int index, int indent,
+		int tagindex)
+{
+	if (is_proxy(L, index)) { // (snapshot elements get converted first)
+		proxy_totable(L, index, -1);
+		Xml_serialize(L, buf, lua_gettop(L), indent, tagindex);
+		lua_pop(L, 1);
+		return;
+	}
+	if (!lua_istable(L, index)) {
+		// a "flat" Lua value, format to XML as a single string
+		Xml_serializeValue(L, buf, index, indent, lua_tostring(L, tagindex));
+		return;
+	}
+	lua_newtable(L); // auxiliary table, 3 entries per nesting level
+	int stack = lua_gettop(L);
+	Buffer *frames = Buffer_push(L);
+	lua_pushvalue(L, index);
+	lua_pushvalue(L, tagindex);
+	lua_pushnil(L);
+	int node = stack + 2, tag = stack + 3, ext = stack + 4;
+
+	// check if caching is enabled, and push the tables for it
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_STRCACHE);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_PARENTS);
+	int cache = stack + 5, parents = stack + 6;
+	lua_pushvalue(L, node);
+	lua_rawget(L, parents);
+	bool cached = !lua_isnil(L, -1) && indent >= 0;
+	lua_pop(L, 1);
+	if (cached && cache_lookup(L, buf, cache, node, indent)) {
+		lua_settop(L, stack - 1);
+		return;
+	}
+
+	size_t depth = 0;
+	Buffer_reserve(L, frames, sizeof(StrFrame));
+	StrFrame *frame = (StrFrame *)frames->data;
+	frame->indent = indent;
+	frame->start = buf->size;
+	if (!Xml_serializeOpen(L, buf, node, tag, ext, frame)) {
+		if (cached) cache_store(L, buf, cache, node, frame->start);
+	} else {
+		for (;;) {
+			frame = (StrFrame *)frames->data + depth;
+			if (frame->k < frame->count || frame->ext_k < frame->ext_count) {
+				if (frame->k < frame->count) {
+					lua_rawgeti(L, node, ++frame->k);
+					if (is_proxy(L, -1)) { // (may remain from totable)
+						proxy_totable(L, -1, -1);
+						lua_remove(L, -2);
+					}
+					if (lua_type(L, -1) == LUA_TSTRING) {
+						Buffer_addindent(L, buf, frame->indent + 1);
+						Xml_pushEncode(L, -1);
+						Buffer_addvalue(L, buf);
+						Buffer_addchar(L, buf, '\n');
+						lua_pop(L, 1);
+						continue;
+					}
+					if (!lua_istable(L, -1)) {
+						Xml_serializeValue(L, buf, -1, frame->indent + 1, NULL);
+						lua_pop(L, 1);
+						continue;
+					}
+					lua_pushnil(L); // (no explicit tag)
+				} else {
+					// The "extended" attributes are output after the regular
+					// sub-elements, in order not to affect their numbering.
+					lua_rawgeti(L, ext, 2 * frame->ext_k + 2); // value
+					lua_rawgeti(L, ext, 2 * frame->ext_k + 1); // key = tag
+					frame->ext_k++;
+				}
+				if (cached) { // link child to its parent
+					lua_pushvalue(L, -2);
+					lua_pushvalue(L, node);
+					lua_rawset(L, parents);
+				}
+				// descend into the table (value) from stack position -2
+				lua_pushvalue(L, node);
+				lua_rawseti(L, stack, 3 * depth + 1);
+				lua_pushvalue(L, tag);
+				lua_rawseti(L, stack, 3 * depth + 2);
+				lua_pushvalue(L, ext);
+				lua_rawseti(L, stack, 3 * depth + 3);
+				lua_replace(L, tag);
+				lua_replace(L, node);
+				lua_pushnil(L);
+				lua_replace(L, ext);
+
+				int child_indent = frame->indent + 1;
+				frames->size = (depth + 1) * sizeof(StrFrame);
+				Buffer_reserve(L, frames, sizeof(StrFrame));
+				frame = (StrFrame *)frames->data + depth + 1;
+				frame->indent = child_indent;
+				frame->start = buf->size;
+				if (!cached || !cache_lookup(L, buf, cache, node, child_indent)) {
+					if (Xml_serializeOpen(L, buf, node, tag, ext, frame)) {
+						depth++;
+						continue;
+					}
+					if (cached) cache_store(L, buf, cache, node, frame->start);
+				}
+				// the child was complete, fall through to restore our values
+			} else {
+				// closing tag
+				Buffer_addindent(L, buf, frame->indent);
+				Buffer_add(L, buf, "</", 2);
+				Buffer_addstring(L, buf, lua_tostring(L, tag));
+				Buffer_add(L, buf, ">\n", 2);
+				if (cached) cache_store(L, buf, cache, node, frame->start);
+				if (depth == 0) break;
+				depth--;
+			}
+			// restore table, tag and extended attributes for current depth
+			lua_rawgeti(L, stack, 3 * depth + 1);
+			lua_replace(L, node);
+			lua_rawgeti(L, stack, 3 * depth + 2);
+			lua_replace(L, tag);
+			lua_rawgeti(L, stack, 3 * depth + 3);
+			lua_replace(L, ext);
+		}
+	}
+	lua_settop(L, stack - 1);
+}
+
+/*
+ * Parallel serialization (see the `threads` option of str()): The calling
+ * thread converts the Lua tree into a native representation first - with
+ * any tostring() conversions done, and the encoding table captured. Worker
+ * threads then output chunks of the root's subelements into separate buffers
+ * (without touching the Lua state), which finally get concatenated in order.
+ * This mirrors Xml_serializeOpen() / Xml_serialize() exactly, so the result
+ * is identical to the serial output.
+ */
+#ifdef LUAXML_THREADS
+
+#define SER_MAXTHREADS	64
+
+enum {SER_TEXT, SER_VALUE, SER_ELEMENT};
+
+typedef struct {
+	const char *tag;
+	uint32_t attr, nattr; // (first index and count in `attrs`)
+	uint32_t item, nitem; // (first index and count in `items`)
+	bool single; // content is a single (non-table) value, output inline
+} SerNode;
+
+typedef struct {
+	const char *key, *value;
+} SerAttr;
+
+typedef struct {
+	int kind;
+	const char *text; // (or type name for SER_VALUE)
+	const char *value; // SER_VALUE only
+	uint32_t node; // SER_ELEMENT only
+} SerItem;
+
+// the native tree, and the encoding table
+typedef struct {
+	SerNode *nodes;
+	SerAttr *attrs;
+	SerItem *items;
+	const char **codes; // pairs of (decoded, encoded), starting with "&"
+	size_t ncodes;
+	bool special[256]; // first characters of the `codes` patterns
+} SerTree;
+
+// output buffer for worker threads (these can't raise Lua errors)
+typedef struct {
+	char *data;
+	size_t size, capacity;
+	bool failed;
+} SerOut;
+
+static bool SerOut_reserve(SerOut *out, size_t n) {
+	if (out->size + n + 1 > out->capacity) {
+		size_t capacity = out->capacity ? out->capacity : 4096;
+		while (capacity < out->size + n + 1) capacity *= 2;
+		char *data = realloc(out->data, capacity);
+		if (!data) {
+			out->failed = true;
+			return false;
+		}
+		out->data = data;
+		out->capacity = capacity;
+	}
+	return true;
+}
+
+static void SerOut_add(SerOut *out, const char *s, size_t len) {
+	if (!SerOut_reserve(out, len)) return;
+	memcpy(out->data + out->size, s, len);
+	out->size += len;
+}
+
+static inline void SerOut_addstring(SerOut *out, const char *s) {
+	SerOut_add(out, s, strlen(s));
+}
+
+static void SerOut_addindent(SerOut *out, int level) {
+	if (level <= 0 || !SerOut_reserve(out, level)) return;
+	memset(out->data + out->size, '\t', level);
+	out->size += level;
+}
+
+// Add the XML encoding of `s`, like Xml_pushEncode() does: substitute each
+// of the codes in turn (`scratch` provides two temporary buffers), then
+// encode characters with MSB set.
+static void SerOut_encode(SerOut *out, const SerTree *tree, const char *s,
+		SerOut *scratch)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	while (*p && *p < 128 && !tree->special[*p]) p++;
+	if (!*p) { // fast path, nothing to encode
+		SerOut_add(out, s, (const char *)p - s);
+		return;
+	}
+	int current = 0;
+	for (size_t i = 0; i < tree->ncodes; i++) {
+		const char *from = tree->codes[2 * i], *to = tree->codes[2 * i + 1];
+		size_t from_len = strlen(from), to_len = strlen(to);
+		const char *match = from_len ? strstr(s, from) : NULL;
+		if (!match) continue;
+		SerOut *dst = &scratch[current];
+		dst->size = 0;
+		do {
+			SerOut_add(dst, s, match - s);
+			SerOut_add(dst, to, to_len);
+			s = match + from_len;
+		} while ((match = strstr(s, from)));
+		SerOut_addstring(dst, s);
+		if (dst->failed) {
+			out->failed = true;
+			return;
+		}
+		dst->data[dst->size] = '\0';
+		s = dst->data;
+		current = 1 - current;
+	}
+	for (p = (const unsigned char *)s; *p; p++) {
+		if (*p < 128) {
+			const unsigned char *q = p;
+			while (q[1] && q[1] < 128) q++;
+			SerOut_add(out, (const char *)p, q - p + 1);
+			p = q;
+		} else {
+			char buf[8];
+			SerOut_add(out, buf, snprintf(buf, sizeof(buf), "&#%d;", *p));
+		}
+	}
+}
+
+// Output the given items of `node` (i.e. its content) at `indent` level,
+// descending into subelements iteratively.
+static void ser_items(SerOut *out, const SerTree *tree, uint32_t first,
+		uint32_t last, int indent, SerOut *scratch)
+{
+	typedef struct {uint32_t item, last; int indent;} Level;
+	Level *stack = malloc(16 * sizeof(Level));
+	size_t depth = 0, capacity = 16;
+	if (!stack) {
+		out->failed = true;
+		return;
+	}
+	stack[0] = (Level){first, last, indent};
+	for (;;) {
+		Level *level = &stack[depth];
+		if (level->item >= level->last) {
+			if (depth == 0) break;
+			// closing tag of the parent
+			depth--;
+			const SerNode *parent = &tree->nodes[tree->items[stack[depth].item - 1].node];
+			SerOut_addindent(out, stack[depth].indent);
+			SerOut_add(out, "</", 2);
+			SerOut_addstring(out, parent->tag);
+			SerOut_add(out, ">\n", 2);
+			continue;
+		}
+		const SerItem *item = &tree->items[level->item++];
+		int ind = level->indent;
+		if (item->kind == SER_TEXT) {
+			SerOut_addindent(out, ind);
+			SerOut_encode(out, tree, item->text, scratch);
+			SerOut_add(out, "\n", 1);
+			continue;
+		}
+		if (item->kind == SER_VALUE) {
+			SerOut_addindent(out, ind);
+			SerOut_add(out, "<", 1);
+			SerOut_addstring(out, item->text);
+			SerOut_add(out, ">", 1);
+			SerOut_encode(out, tree, item->value, scratch);
+			SerOut_add(out, "</", 2);
+			SerOut_addstring(out, item->text);
+			SerOut_add(out, ">\n", 2);
+			continue;
+		}
+		// opening tag, see Xml_serializeOpen()
+		const SerNode *node = &tree->nodes[item->node];
+		SerOut_addindent(out, ind);
+		SerOut_add(out, "<", 1);
+		SerOut_addstring(out, node->tag);
+		for (uint32_t i = node->attr; i < node->attr + node->nattr; i++) {
+			SerOut_add(out, " ", 1);
+			SerOut_addstring(out, tree->attrs[i].key);
+			SerOut_add(out, "=\"", 2);
+			SerOut_encode(out, tree, tree->attrs[i].value, scratch);
+			SerOut_add(out, "\"", 1);
+		}
+		if (node->nitem == 0) {
+			SerOut_add(out, " />\n", 4);
+			continue;
+		}
+		SerOut_add(out, ">", 1);
+		if (node->single) {
+			const SerItem *value = &tree->items[node->item];
+			SerOut_encode(out, tree,
+				value->kind == SER_VALUE ? value->value : value->text, scratch);
+			SerOut_add(out, "</", 2);
+			SerOut_addstring(out, node->tag);
+			SerOut_add(out, ">\n", 2);
+			continue;
+		}
+		SerOut_add(out, "\n", 1);
+		if (++depth == capacity) {
+			Level *grown = realloc(stack, 2 * capacity * sizeof(Level));
+			if (!grown) {
+				out->failed = true;
+				break;
+			}
+			stack = grown;
+			capacity *= 2;
+		}
+		stack[depth] = (Level){node->item, node->item + node->nitem, ind + 1};
+	}
+	free(stack);
+}
+
+// a chunk of the root's subelements, and its output
+typedef struct {
+	uint32_t first, last;
+	SerOut out;
+} SerChunk;
+
+typedef struct {
+	const SerTree *tree;
+	SerChunk *chunks;
+	size_t count, next; // (number of chunks, next one to process)
+	int indent;
+	pthread_mutex_t lock;
+} SerJob;
+
+// worker thread: process chunks until there are none left
+static void *ser_worker(void *arg) {
+	SerJob *job = arg;
+	SerOut scratch[2] = {{NULL, 0, 0, false}, {NULL, 0, 0, false}};
+	for (;;) {
+		pthread_mutex_lock(&job->lock);
+		size_t n = job->next++;
+		pthread_mutex_unlock(&job->lock);
+		if (n >= job->count) break;
+		SerChunk *chunk = &job->chunks[n];
+		ser_items(&chunk->out, job->tree, chunk->first, chunk->last, job->indent,
+			scratch);
+	}
+	free(scratch[0].data);
+	free(scratch[1].data);
+	return NULL;
+}
+
+// append `size` zeroed records to the array in buffer `buf`, returns index
+static uint32_t ser_append(lua_State *L, Buffer *buf, size_t record, size_t size) {
+	size_t n = buf->size / record;
+	if (n + size > UINT32_MAX)
+		luaL_error(L, "LuaXML ERROR: document too large for parallel str()");
+	Buffer_reserve(L, buf, record * size);
+	memset(buf->data + buf->size, 0, record * size);
+	buf->size += record * size;
+	return n;
+}
+
+// pointer to the tostring() result for the value at stack index `index`,
+// storing any new string to the `anchor` table
+static const char *ser_tostring(lua_State *L, int index, int anchor) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	if (lua_type(L, index) == LUA_TSTRING) return lua_tostring(L, index);
+	lua_getglobal(L, "tostring");
+	lua_pushvalue(L, index);
+	lua_call(L, 1, 1);
+	const char *s = lua_tostring(L, -1);
+	if (!s) luaL_error(L, "'tostring' must return a string");
+	lua_rawseti(L, anchor, lua_rawlen(L, anchor) + 1);
+	return s;
+}
+
+/*
+ * Convert the table at stack index `index` (with the explicit tag at
+ * `tagindex`) to the native tree. The arrays get built in Buffer userdata
+ * `nodes`, `attrs` and `items`, strings that aren't part of the Lua tree are
+ * stored to `anchor`. Tables get processed from a work list (`pending`,
+ * holding triples of table, explicit tag and node index).
+ */
+static void ser_convert(lua_State *L, int index, int tagindex, Buffer *nodes,
+		Buffer *attrs, Buffer *items, int anchor)
+{
+	lua_newtable(L);
+	int pending = lua_gettop(L);
+	lua_pushvalue(L, index);
+	lua_rawseti(L, pending, 1);
+	lua_pushvalue(L, tagindex);
+	lua_rawseti(L, pending, 2);
+	lua_pushinteger(L, ser_append(L, nodes, sizeof(SerNode), 1));
+	lua_rawseti(L, pending, 3);
+	size_t count = 1;
+
+	while (count > 0) {
+		count--;
+		lua_rawgeti(L, pending, 3 * count + 1); // node
+		lua_rawgeti(L, pending, 3 * count + 2); // explicit tag
+		lua_rawgeti(L, pending, 3 * count + 3);
+		uint32_t n = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+		lua_newtable(L); // extended attributes, as key-value sequence
+		int node = pending + 1, tag = pending + 2, ext = pending + 3;
+		size_t ext_count = 0;
+
+		const char *tagname;
+		push_TAG_key(L);
+		lua_rawget(L, node);
+		bool converted = lua_type(L, -1) == LUA_TNUMBER;
+		if (lua_tostring(L, -1)) {
+			tagname = lua_tostring(L, -1);
+			if (converted)
+				lua_rawseti(L, anchor, lua_rawlen(L, anchor) + 1);
+			else
+				lua_pop(L, 1);
+		} else {
+			lua_pop(L, 1);
+			tagname = lua_tostring(L, tag);
+			if (!tagname) tagname = lua_typename(L, LUA_TTABLE);
+		}
+
+		uint32_t first_attr = attrs->size / sizeof(SerAttr);
+		lua_pushnil(L);
+		while (lua_next(L, node)) {
+			if (lua_type(L, -2) == LUA_TSTRING) {
+				if (lua_istable(L, -1) && strcmp(lua_tostring(L, -2), "_M")) {
+					lua_pushvalue(L, -2);
+					lua_rawseti(L, ext, 2 * ext_count + 1);
+					lua_pushvalue(L, -1);
+					lua_rawseti(L, ext, 2 * ext_count + 2);
+					ext_count++;
+				} else {
+					uint32_t i = ser_append(L, attrs, sizeof(SerAttr), 1);
+					SerAttr *attr = (SerAttr *)attrs->data + i;
+					attr->key = lua_tostring(L, -2);
+					attr->value = ser_tostring(L, -1, anchor);
+				}
+			}
+			lua_pop(L, 1);
+		}
+
+		size_t narr = lua_rawlen(L, node);
+		uint32_t first_item = ser_append(L, items, sizeof(SerItem), narr + ext_count);
+		SerNode *rec = (SerNode *)nodes->data + n;
+		rec->tag = tagname;
+		rec->attr = first_attr;
+		rec->nattr = attrs->size / sizeof(SerAttr) - first_attr;
+		rec->item = first_item;
+		rec->nitem = narr + ext_count;
+
+		for (size_t k = 1; k <= narr + ext_count; k++) {
+			if (k <= narr) {
+				lua_rawgeti(L, node, k);
+				if (is_proxy(L, -1)) { // (converted, and kept alive by `anchor`)
+					proxy_totable(L, -1, -1);
+					lua_remove(L, -2);
+					lua_pushvalue(L, -1);
+					lua_rawseti(L, anchor, lua_rawlen(L, anchor) + 1);
+				}
+				lua_pushnil(L); // (no explicit tag)
+			} else {
+				lua_rawgeti(L, ext, 2 * (k - narr));
+				lua_rawgeti(L, ext, 2 * (k - narr) - 1);
+			}
+			SerItem *item = (SerItem *)items->data + first_item + k - 1;
+			if (lua_istable(L, -2)) {
+				item->kind = SER_ELEMENT;
+				uint32_t child = ser_append(L, nodes, sizeof(SerNode), 1);
+				item = (SerItem *)items->data + first_item + k - 1;
+				item->node = child;
+				lua_rawseti(L, pending, 3 * count + 2);
+				lua_rawseti(L, pending, 3 * count + 1);
+				lua_pushinteger(L, child);
+				lua_rawseti(L, pending, 3 * count + 3);
+				count++;
+				continue;
+			}
+			lua_pop(L, 1);
+			if (lua_type(L, -1) == LUA_TSTRING) {
+				item->kind = SER_TEXT;
+				item->text = lua_tostring(L, -1);
+			} else {
+				item->kind = SER_VALUE;
+				item->text = luaL_typename(L, -1);
+				const char *value = ser_tostring(L, -1, anchor);
+				item = (SerItem *)items->data + first_item + k - 1;
+				item->value = value;
+			}
+			lua_pop(L, 1);
+		}
+		rec = (SerNode *)nodes->data + n;
+		rec->single = narr == 1 && ext_count == 0
+			&& ((SerItem *)items->data)[first_item].kind != SER_ELEMENT;
+		lua_settop(L, pending);
+	}
+	lua_settop(L, pending - 1);
+}
+
+/*
+ * Output the table at stack index `index` like Xml_serialize(), using up to
+ * `threads` threads. The root element gets split into chunks of subelements,
+ * that the threads then take from a shared work list.
+ */
+static void Xml_serializeParallel(lua_State *L, Buffer *buf, int index, int indent,
+		int tagindex, int threads)
+{
+	int top = lua_gettop(L);
+	Buffer *nodes = Buffer_push(L);
+	Buffer *attrs = Buffer_push(L);
+	Buffer *items = Buffer_push(L);
+	lua_newtable(L);
+	int anchor = lua_gettop(L);
+	// (an item referring to the root, so ser_items() can output all of it)
+	uint32_t root_item = ser_append(L, items, sizeof(SerItem), 1);
+	ser_convert(L, index, tagindex, nodes, attrs, items, anchor);
+	((SerItem *)items->data)[root_item].kind = SER_ELEMENT;
+
+	SerTree tree;
+	tree.nodes = (SerNode *)nodes->data;
+	tree.attrs = (SerAttr *)attrs->data;
+	tree.items = (SerItem *)items->data;
+
+	// capture the encoding table, in the order that Xml_pushEncode() uses
+	Buffer *codes = Buffer_push(L);
+	const char *amp[2] = {"&", "&amp;"};
+	Buffer_add(L, codes, (const char *)amp, sizeof(amp));
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_CODES);
+	lua_rawseti(L, anchor, lua_rawlen(L, anchor) + 1); // (keeps the strings)
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_CODES);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		const char *code[2] = {lua_tostring(L, -2), lua_tostring(L, -1)};
+		Buffer_add(L, codes, (const char *)code, sizeof(code));
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	tree.codes = (const char **)codes->data;
+	tree.ncodes = codes->size / sizeof(amp);
+	memset(tree.special, 0, sizeof(tree.special));
+	for (size_t i = 0; i < tree.ncodes; i++)
+		tree.special[(unsigned char)tree.codes[2 * i][0]] = true;
+	tree.special[0] = false;
+
+	// opening tag of the root (with an empty range of items), chunks of
+	// subelements, then closing tag (from the range that completes the root)
+	const SerNode *root = &tree.nodes[0];
+	size_t count = root->single ? 0 : (root->nitem + 63) / 64;
+	if (count > 16 * (size_t)threads) count = 16 * threads;
+	Buffer *chunkbuf = Buffer_push(L);
+	Buffer_reserve(L, chunkbuf, (count + 2) * sizeof(SerChunk));
+	memset(chunkbuf->data, 0, (count + 2) * sizeof(SerChunk));
+	SerChunk *chunks = (SerChunk *)chunkbuf->data;
+	SerJob job = {&tree, chunks + 1, count, 0, indent + 1, PTHREAD_MUTEX_INITIALIZER};
+	for (size_t i = 0; i < count; i++) {
+		chunks[i + 1].first = root->item + root->nitem * i / count;
+		chunks[i + 1].last = root->item + root->nitem * (i + 1) / count;
+	}
+
+	SerOut scratch[2] = {{NULL, 0, 0, false}, {NULL, 0, 0, false}};
+	if (count == 0) // (nothing to split, output the root at once)
+		ser_items(&chunks[0].out, &tree, root_item, root_item + 1, indent, scratch);
+	else {
+		// Output the root, but stop before its subelements: the closing tag
+		// is output separately, from a copy of the root without content.
+		SerNode head = *root;
+		head.nitem = 0;
+		SerItem head_item = {SER_ELEMENT, NULL, NULL, 0};
+		SerTree head_tree = tree;
+		head_tree.nodes = &head;
+		head_tree.items = &head_item;
+		ser_items(&chunks[0].out, &head_tree, 0, 1, indent, scratch);
+		// (replace " />\n" by ">\n")
+		if (chunks[0].out.size >= 4) {
+			chunks[0].out.size -= 4;
+			SerOut_add(&chunks[0].out, ">\n", 2);
+		}
+		SerOut_addindent(&chunks[count + 1].out, indent);
+		SerOut_add(&chunks[count + 1].out, "</", 2);
+		SerOut_addstring(&chunks[count + 1].out, root->tag);
+		SerOut_add(&chunks[count + 1].out, ">\n", 2);
+
+		pthread_t thread[SER_MAXTHREADS];
+		int started = 0;
+		while (started < threads - 1
+				&& pthread_create(&thread[started], NULL, ser_worker, &job) == 0)
+			started++;
+		ser_worker(&job); // (the calling thread works too)
+		for (int i = 0; i < started; i++)
+			pthread_join(thread[i], NULL);
+		pthread_mutex_destroy(&job.lock);
+	}
+	free(scratch[0].data);
+	free(scratch[1].data);
+
+	bool failed = false;
+	size_t total = 0;
+	for (size_t i = 0; i < count + 2; i++) {
+		failed |= chunks[i].out.failed;
+		total += chunks[i].out.size;
+	}
+	if (!failed) {
+		Buffer_reserve(L, buf, total);
+		for (size_t i = 0; i < count + 2; i++)
+			if (chunks[i].out.size) {
+				memcpy(buf->data + buf->size, chunks[i].out.data, chunks[i].out.size);
+				buf->size += chunks[i].out.size;
+			}
+	}
+	for (size_t i = 0; i < count + 2; i++)
+		free(chunks[i].out.data);
+	if (failed) luaL_error(L, "LuaXML: out of memory (str)");
+	lua_settop(L, top);
+}
+
+// number of threads for the `threads` option of str() at stack index `index`
+// (`true` means "one per CPU")
+static int ser_threads(lua_State *L, int index) {
+	if (lua_isboolean(L, index) || lua_isnil(L, index)) {
+		if (!lua_toboolean(L, index)) return 1;
+		long n = sysconf(_SC_NPROCESSORS_ONLN);
+		return n < 1 ? 1 : n > SER_MAXTHREADS ? SER_MAXTHREADS : n;
+	}
+	lua_Integer n = luaL_checkinteger(L, index);
+	return n < 1 ? 1 : n > SER_MAXTHREADS ? SER_MAXTHREADS : n;
+}
+
+#endif // LUAXML_THREADS
+
+/*
+ * Output the value at stack index `index` like Xml_serialize(), using the
+ * `threads` option from the options (table or nil) at stack index `options`.
+ * If caching is enabled for the value, the output mustn't go to a sink (as
+ * the cache takes it from the buffer), so the buffer will hold all of it.
+ */
+static void Xml_serializeOptions(lua_State *L, Buffer *buf, int index, int indent,
+		int tagindex, int options)
+{
+	bool cached = false;
+	if (lua_istable(L, index)) {
+		lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_PARENTS);
+		lua_pushvalue(L, index);
+		lua_rawget(L, -2);
+		cached = !lua_isnil(L, -1);
+		lua_pop(L, 2);
+	}
+#ifdef LUAXML_THREADS
+	int threads = 1;
+	if (lua_istable(L, options)) {
+		lua_getfield(L, options, "threads");
+		threads = ser_threads(L, -1);
+		lua_pop(L, 1);
+	}
+	// (cached output is only supported by the serial implementation)
+	if (threads > 1 && lua_istable(L, index) && !cached) {
+		Xml_serializeParallel(L, buf, index, indent, tagindex, threads);
+		return;
+	}
+#endif
+	void (*sink)(lua_State *L, Buffer *buf) = buf->sink;
+	if (cached) buf->sink = NULL;
+	Xml_serialize(L, buf, index, indent, tagindex);
+	buf->sink = sink;
+}
+
+/** converts any Lua value to an XML string.
+@function str
+
+@param value
+the value to be converted, normally a table (LuaXML object). However this
+function will 'encapsulate' other Lua values (of arbitrary type) in a way that
+should make them valid XML.
+<br>Note: Passing no `value` will cause the function to return `nil`.
+
+@tparam ?number indent
+indentation level for 'pretty' output. Mainly for internal use, defaults to 0.
+
+@tparam ?string tag
+the tag to be used in case `value` doesn't already have an 'implicit' tag.
+Mainly for internal use.
+
+@tparam ?table options
+`threads` = number of threads to use for the conversion, or `true` for one
+per CPU. With more than one thread, the subelements of `value` get converted
+in parallel, which speeds up documents with many (top-level) subelements. The
+result is identical to the serial conversion. (Not available on Windows, and
+not used for tables that have caching enabled - see `cache`.)
+
+@treturn string
+an XML string, or `nil` in case of errors.
+*/
+int Xml_str(lua_State *L) {
+	lua_settop(L, 4);
+	if (lua_isnil(L, 1)) return 0;
+
+	Buffer *buf = Buffer_push(L);
+	Xml_serializeOptions(L, buf, 1, lua_tointeger(L, 2), 3, 4);
+	Buffer_pushresult(L, buf);
+	return 1;
+}
+
+/** writes the XML string for a Lua value to a file.
+This is what `save` uses, after composing the header. The output gets
+written (and compressed) in chunks while converting `var`, instead of
+building the complete string in memory first.
+
+@function write
+@param var  the value to be converted, see `str`
+@tparam string filename  the name of the file to be written
+@tparam ?string filemode  the file mode to use (see `io.open`), defaults to "w"
+@tparam ?string prefix  a string to write before the XML, e.g. a header
+@tparam ?table options  options for `str`, and `compression` = "gzip",
+"zstd" or "none". By default, this depends on the file name: ".gz" means
+gzip, ".zst" zstd. `level` sets the compression level.
+*/
+int Xml_write(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 2);
+	const char *filemode = luaL_optstring(L, 3, "w");
+	size_t prefix_len = 0;
+	const char *prefix = luaL_optlstring(L, 4, "", &prefix_len);
+	lua_settop(L, 5);
+	Writer *w = Writer_push(L, filename, filemode, 5); // #6
+
+	Buffer *buf = Buffer_push(L);
+	Buffer_reserve(L, buf, LUAXML_CHUNKSIZE);
+	buf->sink = Writer_sink;
+	buf->sink_ud = w;
+	Buffer_add(L, buf, prefix, prefix_len);
+	lua_pushnil(L); // (no explicit tag)
+	Xml_serializeOptions(L, buf, 1, 0, lua_gettop(L), 5);
+	Writer_write(L, w, buf->data, buf->size, true);
+	FILE *file = w->file;
+	w->file = NULL;
+	if (fclose(file) != 0)
+		return luaL_error(L, "LuaXML ERROR: error writing \"%s\"", filename);
+	return 0;
+}
+
+/*
+ * Stack layout for `Xml_transform`: the rules (drop set, tag renames,
+ * attribute rules and callbacks), the tokenizer, the writer and buffers, and
+ * a `nil` - followed by the option sets of the parser that converts elements
+ * for callbacks.
+ */
+enum {TF_DROP = 5, TF_RENAME, TF_ATTRIBUTES, TF_CALLBACKS, TF_TOKENIZER,
+	TF_WRITER, TF_OUTPUT, TF_PENDING, TF_FRAMES, TF_TAGS, TF_NIL};
+
+// output state of an element that transform() has started
+typedef struct {
+	/// offset of the (output) tag in the tags buffer
+	size_t tag;
+	/// start tag still open, single text pending, or (other) content
+	enum {FRAME_OPEN, FRAME_TEXT, FRAME_CONTENT} state;
+} TransformFrame;
+
+typedef struct {
+	Buffer *out, *pending, *frames, *tags;
+	/// chars that require decoding and encoding, tokens without them can be
+	/// copied to the output as they are
+	bool special[256];
+} Transform;
+
+static void transform_special(lua_State *L, Transform *tf) {
+	int c;
+	for (c = 0; c < 256; c++) tf->special[c] = c >= 128 || c == '&';
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_CODES);
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_type(L, -2) == LUA_TSTRING && lua_rawlen(L, -2) > 0)
+			tf->special[*(unsigned char *)lua_tostring(L, -2)] = true;
+		// (an encoding without '&' means that decoding may change plain text)
+		if (lua_type(L, -1) != LUA_TSTRING || !strchr(lua_tostring(L, -1), '&'))
+			for (c = 0; c < 256; c++) tf->special[c] = true;
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+static inline size_t transform_depth(Transform *tf) {
+	return tf->frames->size / sizeof(TransformFrame);
+}
+
+// add a (raw) attribute value or text token to `buf`, XML-encoded
+static void transform_add(lua_State *L, Transform *tf, Buffer *buf,
+		const char *s, size_t size, bool cdata)
+{
+	if (!cdata) {
+		size_t i = 0;
+		while (i < size && !tf->special[(unsigned char)s[i]]) i++;
+		if (i == size) {
+			Buffer_add(L, buf, s, size);
+			return;
+		}
+		Xml_pushDecode(L, s, size);
+	} else
+		lua_pushlstring(L, s, size);
+	Xml_pushEncode(L, -1);
+	Buffer_addvalue(L, buf);
+	lua_pop(L, 1);
+}
+
+// The current element gets content that can't go on a single line with it
+// (a subelement, or more than one text) - finish its start tag.
+static void transform_content(lua_State *L, Transform *tf) {
+	size_t depth = transform_depth(tf);
+	if (depth == 0) return;
+	TransformFrame *frame = (TransformFrame *)tf->frames->data + depth - 1;
+	if (frame->state == FRAME_CONTENT) return;
+	Buffer_add(L, tf->out, ">\n", 2);
+	if (frame->state == FRAME_TEXT) {
+		Buffer_addindent(L, tf->out, depth);
+		Buffer_add(L, tf->out, tf->pending->data, tf->pending->size);
+		Buffer_addchar(L, tf->out, '\n');
+	}
+	frame->state = FRAME_CONTENT;
+}
+
+static void transform_text(lua_State *L, Transform *tf, const char *token,
+		size_t size, bool cdata)
+{
+	size_t depth = transform_depth(tf);
+	if (depth == 0) return; // (outside of the root element)
+	TransformFrame *frame = (TransformFrame *)tf->frames->data + depth - 1;
+	if (frame->state == FRAME_OPEN) { // (might become `<tag>text</tag>`)
+		tf->pending->size = 0;
+		transform_add(L, tf, tf->pending, token, size, cdata);
+		frame->state = FRAME_TEXT;
+		return;
+	}
+	transform_content(L, tf);
+	Buffer_addindent(L, tf->out, depth);
+	transform_add(L, tf, tf->out, token, size, cdata);
+	Buffer_addchar(L, tf->out, '\n');
+}
+
+static void transform_close(lua_State *L, Transform *tf) {
+	size_t depth = transform_depth(tf) - 1;
+	TransformFrame *frame = (TransformFrame *)tf->frames->data + depth;
+	if (frame->state == FRAME_OPEN)
+		Buffer_add(L, tf->out, " />\n", 4);
+	else {
+		if (frame->state == FRAME_TEXT) {
+			Buffer_addchar(L, tf->out, '>');
+			Buffer_add(L, tf->out, tf->pending->data, tf->pending->size);
+		} else
+			Buffer_addindent(L, tf->out, depth);
+		Buffer_add(L, tf->out, "</", 2);
+		Buffer_addstring(L, tf->out, tf->tags->data + frame->tag);
+		Buffer_add(L, tf->out, ">\n", 2);
+	}
+	tf->tags->size = frame->tag;
+	tf->frames->size -= sizeof(TransformFrame);
+}
+
+// Look up the rule for an attribute (with the given element tag at stack
+// index `tag`), trying "tag/name" first if `scoped`. Pushes the rule.
+static void transform_attrRule(lua_State *L, int tag, const char *name,
+		size_t len, bool scoped)
+{
+	if (scoped) {
+		lua_pushvalue(L, tag);
+		lua_pushliteral(L, "/");
+		lua_pushlstring(L, name, len);
+		lua_concat(L, 3);
+		lua_rawget(L, TF_ATTRIBUTES);
+		if (!lua_isnil(L, -1)) return;
+		lua_pop(L, 1);
+	}
+	lua_pushlstring(L, name, len);
+	lua_rawget(L, TF_ATTRIBUTES);
+}
+
+// Output the start tag of an element (with its tag on top of the stack),
+// applying the rename and attribute rules. Returns `true` if the element is
+// complete already, otherwise it becomes the current one.
+static bool transform_open(lua_State *L, Transform *tf, Tokenizer *tok,
+		bool scoped)
+{
+	int tag = lua_gettop(L);
+	transform_content(L, tf);
+	size_t depth = transform_depth(tf);
+	lua_pushvalue(L, tag);
+	if (lua_istable(L, TF_RENAME)) {
+		lua_rawget(L, TF_RENAME);
+		if (lua_type(L, -1) != LUA_TSTRING) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, tag);
+		}
+	}
+	size_t len;
+	const char *name = lua_tolstring(L, -1, &len);
+	Buffer_addindent(L, tf->out, depth);
+	Buffer_addchar(L, tf->out, '<');
+	Buffer_add(L, tf->out, name, len);
+	TransformFrame frame = {tf->tags->size, FRAME_OPEN};
+	Buffer_add(L, tf->tags, name, len + 1); // (including the NUL)
+	lua_pop(L, 1);
+
+	const char *token;
+	bool attributes = lua_istable(L, TF_ATTRIBUTES);
+	while ((token = Tokenizer_next(tok)) && (*token != CLS) && (*token != ESC)) {
+		size_t sepPos = find(token, tok->m_token_size, "=", 0);
+		if (sepPos + 3 > tok->m_token_size) continue; // (no key="value")
+		name = token;
+		len = sepPos;
+		if (attributes) {
+			transform_attrRule(L, tag, token, sepPos, scoped);
+			if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+				lua_pop(L, 1); // (dropped)
+				continue;
+			}
+			if (lua_type(L, -1) == LUA_TSTRING)
+				name = lua_tolstring(L, -1, &len);
+		}
+		Buffer_addchar(L, tf->out, ' ');
+		Buffer_add(L, tf->out, name, len);
+		Buffer_add(L, tf->out, "=\"", 2);
+		transform_add(L, tf, tf->out, token + sepPos + 2,
+			tok->m_token_size - sepPos - 3, false);
+		Buffer_addchar(L, tf->out, '"');
+		lua_settop(L, tag);
+	}
+	if (!token || *token == ESC) {
+		Buffer_add(L, tf->out, " />\n", 4);
+		tf->tags->size = frame.tag;
+		return true;
+	}
+	Buffer_add(L, tf->frames, (const char *)&frame, sizeof(frame));
+	return false;
+}
+
+// Convert the current element (with its tag on top of the stack) to a LuaXML
+// object, which replaces the tag. The parser continues with its content.
+static void transform_element(lua_State *L, Parser *p) {
+	Tokenizer *tok = p->tok;
+	int element = lua_gettop(L);
+	lua_newtable(L);
+	push_TAG_key(L);
+	lua_pushvalue(L, element);
+	lua_rawset(L, -3);
+	lua_replace(L, element);
+	make_xml_object(L, element);
+	const char *token;
+	while ((token = Tokenizer_next(tok)) && (*token != CLS) && (*token != ESC)) {
+		size_t sepPos = find(token, tok->m_token_size, "=", 0);
+		if (sepPos + 3 > tok->m_token_size) continue;
+		lua_pushlstring(L, token, sepPos);
+		Xml_pushDecode(L, token + sepPos + 2, tok->m_token_size - sepPos - 3);
+		lua_rawset(L, element);
+	}
+	if (token && *token == CLS) {
+		Parser_run(L, p, 0);
+		lua_settop(L, element);
+	}
+}
+
+/** converts an XML file to another one, streaming.
+Unlike `load`ing the input, changing the resulting table and `save`ing it,
+this processes the input as it gets read, and writes the output right away -
+so the memory use doesn't depend on the size of the document. The `rules`
+table describes the changes, with these (optional) fields:
+
+- `drop`: a list (or set) of tags, elements having one of these get skipped
+entirely (as with the option for `eval`)
+- `rename`: a table that maps tags to new ones
+- `attributes`: a table that maps attribute names to new ones, or to `false`
+to drop the attribute. Like with the `types` option of `eval`, a name may be
+of the form `"tag/attribute"` to only apply to elements with the given tag.
+- `callbacks`: a table that maps tags to functions. Elements with those tags
+get converted to LuaXML objects, and passed to the function. Its result
+replaces the element in the output: `nil` keeps the (possibly modified)
+element, `false` drops it, any other value gets output as with `str`. Other
+rules don't apply within these elements.
+
+The output looks like that of `save`: The tags are the same as `str` would
+produce - however attributes keep their order. Just like `load`, this only
+handles the root element, and discards comments and processing instructions.
+
+@function transform
+@tparam string input  the name of the input file, or an XML string. (Files
+get decompressed as with `load`.)
+@tparam string output  the name of the output file, ".gz" or ".zst" files
+get compressed (see `write`)
+@tparam table rules  the changes to apply
+@tparam ?table options  `mode` is the whitespace handling mode (see `eval`),
+`header` a string to write before the XML (defaults to `<?xml version="1.0"?>`),
+plus `compression` and `level` as for `write`
+@usage
+xml.transform("in.xml.gz", "out.xml", {
+	drop = {"debug"}, rename = {item = "entry"},
+	attributes = {internal = false, ["entry/id"] = "key"},
+	callbacks = {price = function(p) p[1] = p[1] * 1.19 end},
+})
+*/
+int Xml_transform(lua_State *L) {
+	size_t size;
+	const char *input = luaL_checklstring(L, 1, &size);
+	const char *output = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	if (!lua_isnoneornil(L, 4)) luaL_checktype(L, 4, LUA_TTABLE);
+	lua_settop(L, 4);
+	int mode = WHITESPACE_TRIM;
+	if (lua_istable(L, 4)) {
+		lua_getfield(L, 4, "mode");
+		mode = luaL_optint(L, -1, WHITESPACE_TRIM);
+		lua_pop(L, 1);
+	}
+
+	lua_getfield(L, 3, "drop");
+	push_tagset(L, -1);
+	lua_replace(L, TF_DROP);
+	static const char *rules[] = {"rename", "attributes", "callbacks"};
+	int i;
+	for (i = 0; i < 3; i++) {
+		lua_getfield(L, 3, rules[i]);
+		if (!lua_isnil(L, -1) && !lua_istable(L, -1))
+			return luaL_error(L, "LuaXML ERROR: transform rule \"%s\" must be a table",
+				rules[i]);
+	}
+	bool scoped = false; // any "tag/attribute" names?
+	if (lua_istable(L, TF_ATTRIBUTES)) {
+		lua_pushnil(L);
+		while (lua_next(L, TF_ATTRIBUTES)) {
+			lua_pop(L, 1);
+			if (lua_type(L, -1) == LUA_TSTRING && strchr(lua_tostring(L, -1), '/'))
+				scoped = true;
+		}
+	}
+
+	bool is_file = !memchr(input, '<', size);
+	Tokenizer *tok = Xml_tokenizer(L, input, size, is_file ? input : NULL,
+		mode, ENCODING_AUTO, COMPRESSION_AUTO);
+	Writer *w = Writer_push(L, output, "w", 4);
+	Transform tf;
+	tf.out = Buffer_push(L);
+	Buffer_reserve(L, tf.out, LUAXML_CHUNKSIZE);
+	tf.out->sink = Writer_sink;
+	tf.out->sink_ud = w;
+	tf.pending = Buffer_push(L);
+	tf.frames = Buffer_push(L);
+	tf.tags = Buffer_push(L);
+	lua_pushnil(L); // TF_NIL
+	Parser p;
+	Parser_init(L, &p, tok, TF_NIL);
+	p.nested = true;
+	const int base = lua_gettop(L);
+	transform_special(L, &tf);
+
+	if (lua_istable(L, 4)) lua_getfield(L, 4, "header");
+	else lua_pushnil(L);
+	if (lua_isnil(L, -1)) Buffer_addstring(L, tf.out, "<?xml version=\"1.0\"?>\n");
+	else Buffer_addvalue(L, tf.out);
+	lua_settop(L, base);
+
+	const char *token;
+	while ((token = Tokenizer_next(tok))) {
+		size_t depth = transform_depth(&tf);
+		if (*token == OPN) {
+			const char *tag = Tokenizer_next(tok);
+			if (!tag) break;
+			lua_pushstring(L, tag); // base + 1
+			if (!lua_isnil(L, TF_DROP) && in_set(L, TF_DROP, -1)) {
+				lua_settop(L, base);
+				Tokenizer_skipElement(tok);
+				if (depth == 0) break;
+				continue;
+			}
+			bool callback = false;
+			if (lua_istable(L, TF_CALLBACKS)) {
+				lua_pushvalue(L, -1);
+				lua_rawget(L, TF_CALLBACKS);
+				callback = !lua_isnil(L, -1);
+				lua_pop(L, 1);
+			}
+			if (callback) {
+				transform_element(L, &p);
+				push_TAG_key(L);
+				lua_rawget(L, base + 1);
+				lua_rawget(L, TF_CALLBACKS);
+				lua_pushvalue(L, base + 1);
+				lua_call(L, 1, 1); // base + 2
+				if (!lua_isboolean(L, -1) || lua_toboolean(L, -1)) {
+					transform_content(L, &tf);
+					Xml_serialize(L, tf.out, lua_isnil(L, -1) ? base + 1 : base + 2,
+						depth, TF_NIL);
+				}
+				lua_settop(L, base);
+				if (depth == 0) break;
+				continue;
+			}
+			bool complete = transform_open(L, &tf, tok, scoped);
+			lua_settop(L, base);
+			if (complete && depth == 0) break;
+		}
+		else if (*token == ESC) {
+			if (depth == 0) continue;
+			transform_close(L, &tf);
+			if (depth == 1) break;
+		}
+		else if (tok->mode != WHITESPACE_NORMALIZE || !is_lead_token(token))
+			transform_text(L, &tf, token, tok->m_token_size, tok->cdata);
+	}
+	while (transform_depth(&tf) > 0) transform_close(L, &tf); // (incomplete input)
+	Xml_checkRead(L, tok);
+	Tokenizer_delete(tok);
+
+	Writer_write(L, w, tf.out->data, tf.out->size, true);
+	FILE *file = w->file;
+	w->file = NULL;
+	if (fclose(file) != 0)
+		return luaL_error(L, "LuaXML ERROR: error writing \"%s\"", output);
+	return 0;
+}
+
+// is the value at stack index `index` a name in "{uri}local" notation?
+static inline bool is_expanded(lua_State *L, int index) {
+	return lua_type(L, index) == LUA_TSTRING && *lua_tostring(L, index) == '{';
+}
+
+// Test if the element at stack index `var` has the expanded name at stack
+// index `name` ("{}local" stands for a name without namespace, which matches
+// the tag of elements that have no resolved name).
+static bool name_match(lua_State *L, int var, int name) {
+	push_name(L, var);
+	if (!lua_isnil(L, -1)) {
+		bool equal = lua_rawequal(L, -1, name);
+		lua_pop(L, 1);
+		return equal;
+	}
+	lua_pop(L, 1);
+	size_t len, tag_len;
+	const char *s = lua_tolstring(L, name, &len);
+	if (len < 2 || s[1] != '}') return false;
+	push_TAG_key(L);
+	element_rawget(L, var);
+	const char *tag = lua_tolstring(L, -1, &tag_len);
+	bool equal = tag && tag_len == len - 2 && memcmp(tag, s + 2, tag_len) == 0;
+	lua_pop(L, 1);
+	return equal;
+}
+
+// push the qualified name of the attribute of `var` with the expanded name at
+// stack index `name` (or `nil` if there's none)
+static void push_attrname(lua_State *L, int var, int name) {
+	const char *s = lua_tostring(L, name);
+	if (s[1] == '}') {
+		lua_pushstring(L, s + 2); // (no namespace)
+		return;
+	}
+	push_names(L, var);
+	if (lua_istable(L, -1)) {
+		lua_pushvalue(L, name);
+		lua_rawget(L, -2);
+		lua_remove(L, -2);
+	}
+	else {
+		lua_pop(L, 1);
+		lua_pushnil(L);
+	}
+}
+
+// test the value at stack index `var` against the (optional) match criteria
+// at stack indices `tag`, `key` and `value` - see Xml_match()
+static bool is_match(lua_State *L, int var, int tag, int key, int value) {
+	if (!is_element(L, var)) return false;
+	if (var < 0) var += lua_gettop(L) + 1; // relative to absolute index
+	if (is_expanded(L, tag)) {
+		if (!name_match(L, var, tag)) return false;
+	}
+	else if (!lua_isnoneornil(L, tag)) {
+		push_TAG_key(L);
+		element_rawget(L, var); // get the tag value from var
+		bool equal = lua_equal(L, -1, tag);
+		lua_pop(L, 1); // realign stack
+		if (!equal) return false; // tag mismatch
+	}
+	if (lua_type(L, key) == LUA_TSTRING) {
+		if (is_expanded(L, key))
+			push_attrname(L, var, key);
+		else
+			lua_pushvalue(L, key); // duplicate attribute key
+		element_rawget(L, var); // try to get value from var
+		bool match = !lua_isnil(L, -1) // attribute exists...
+			// ...and (if requested) its value is equal
+			&& (lua_isnoneornil(L, value) || lua_equal(L, -1, value));
+		lua_pop(L, 1);
+		if (!match) return false;
+	}
+	return true;
+}
+
+/** match XML entity against given (optional) criteria.
+Passing `nil` for one of the` tag`, `key`, or `value` parameters means "don't
+care" (i.e. match anything for that particular aspect). So for example
+	var:match(nil, "text", nil)
+	-- or shorter, but identical:  var:match(nil, "text")
+will look for an XML attribute (name) "text" to be present in `var`, but won't
+consider its value or the tag of `var`.
+
+Note: If you want to test for a specific attribute `value`, so also have to
+supply a `key` - otherwise `value` will be ignored.
+
+@usage
+-- each of these will either return `x`, or `nil` in case of no match
+
+x:match("foo") -- test for x:tag() == "foo"
+x:match(nil, "bar") -- test if x has a "bar" attribute
+x:match(nil, "foo", "bar") -- test if x has a "foo" attribute that equals "bar"
+x:match("foobar", "foo", "bar") -- test for "foobar" tag, and attr "foo" == "bar"
+-- namespace mode, e.g. for <atom:link xlink:href="..."/>
+x:match("{http://www.w3.org/2005/Atom}link", "{http://www.w3.org/1999/xlink}href")
+
+@function match
+
+@param var
+the variable to test, normally a Lua table or LuaXML object - or a snapshot
+element (see `attach`). (For other types, the test always fails.)
+
+@tparam ?string tag
+If set, has to match the XML `tag` (i.e. must be equal to the `tag(var, nil)`
+result). For elements parsed with the `namespaces` option (see `eval`), you
+may also pass an expanded name `"{uri}local"`, which matches the namespace URI
+and local name regardless of the prefix. `"{}local"` matches a name without
+namespace.
+
+@tparam ?string key
+If set, a corresponding **attribute key** needs to be present (exact name match).
+This may be an expanded name too, like `tag`.
+
+@param value (optional)
+arbitrary Lua value. If set, the **attribute value** for `key` has to match it.
+
+@return
+either `nil` for no match; or the `var` argument properly converted to a
+LuaXML object, equivalent to `xml.new(var)`. (Snapshot elements are returned
+as they are.)
+
+This allows you to either make direct use of the matched LuaXML object, or to
+use the return value in a boolean test (`if xml.match(...)`), which is a common
+Lua idiom.
+*/
+int Xml_match(lua_State *L) {
+	if (is_match(L, 1, 2, 3, 4)) {
+		lua_settop(L, 1);
+		if (lua_istable(L, 1)) make_xml_object(L, 1);
+		return 1;
+	}
+	return 0;
+}
+
+/** returns the namespace URI and local name of an element, or of an attribute.
+This uses the names resolved by parsing with the `namespaces` option (see
+`eval`), so there's no need to look up prefixes and `xmlns` declarations.
+
+@function name
+@param var  the table (LuaXML object)
+@tparam ?string key  the (qualified) name of an attribute, e.g. `"xlink:href"`.
+If omitted, this refers to the tag of `var`.
+@treturn ?string  the namespace URI, or `nil` for names without namespace
+@treturn string  the local name (the name itself, if it has no namespace)
+@usage
+local feed = xml.eval(str, nil, {namespaces = true})
+print(feed:name()) --> http://www.w3.org/2005/Atom   feed
+*/
+int Xml_name(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 2);
+	if (lua_isnil(L, 2)) {
+		push_name(L, 1);
+		if (lua_isnil(L, -1)) {
+			lua_pushnil(L);
+			push_TAG_key(L);
+			lua_rawget(L, 1);
+			return 2;
+		}
+	} else {
+		luaL_checktype(L, 2, LUA_TSTRING);
+		lua_pushnil(L); // (default: no expanded name)
+		push_names(L, 1);
+		if (lua_istable(L, -1)) {
+			lua_pushnil(L);
+			while (lua_next(L, -2)) {
+				if (lua_type(L, -2) == LUA_TSTRING && lua_rawequal(L, -1, 2)) {
+					lua_pop(L, 1);
+					lua_replace(L, 3);
+					break;
+				}
+				lua_pop(L, 1);
+			}
+		}
+		lua_settop(L, 3);
+		if (lua_isnil(L, 3)) {
+			lua_pushvalue(L, 2);
+			return 2;
+		}
+	}
+	// split the "{uri}local" name
+	size_t len;
+	const char *s = lua_tolstring(L, -1, &len);
+	const char *brace = memchr(s, '}', len);
+	if (*s != '{' || !brace) return luaL_error(L, "LuaXML ERROR: invalid name '%s'", s);
+	lua_pushlstring(L, s + 1, brace - s - 1);
+	lua_pushlstring(L, brace + 1, len - (brace + 1 - s));
+	return 2;
+}
+
+/*
+ * Visitor function for Xml_walk(), receiving the (absolute) stack index of a
+ * subelement and its depth. The visitor may use the Lua stack, but has to
+ * leave it balanced. Returning `false` stops the walk.
+ */
+typedef bool (*Xml_visitor)(lua_State *L, int index, int depth, void *ud);
+
+/*
+ * Walk all subelements of the table at stack index `var` recursively (depth
+ * first, in document order), invoking `visit` for each of them. `depth` is the
+ * depth of var, subelements deeper than `maxdepth` (if >= 0) are skipped.
+ * Returns `false` if a visitor requested to stop, `true` otherwise.
+ *
+ * We do this iteratively (= without nested calls), keeping an explicit stack
+ * of the parent tables (in a Lua table) and the current subelement index for
+ * each level (in a Buffer used as size_t array).
+ */
+static bool Xml_walk(lua_State *L, int var, int depth, int maxdepth,
+		Xml_visitor visit, void *ud)
+{
+	if (!is_element(L, var)) return true;
+	if (var < 0) var += lua_gettop(L) + 1; // relative to absolute index
+	lua_newtable(L); // parents
+	int parents = lua_gettop(L);
+	Buffer *index = Buffer_push(L);
+	lua_pushvalue(L, var); // current table
+	int current = parents + 2;
+	int level = 0; // nesting level, relative to `var`
+	Buffer_reserve(L, index, sizeof(size_t));
+	*(size_t *)index->data = 0;
+
+	bool cont = true;
+	while (cont) {
+		size_t *k = (size_t *)index->data + level;
+		if (maxdepth >= 0 && depth + level + 1 > maxdepth)
+			lua_pushnil(L); // depth limit, don't enter subelements
+		else
+			element_rawgeti(L, current, ++*k);
+		if (lua_isnil(L, -1)) {
+			// no element var[k], return to parent level (or exit loop)
+			lua_pop(L, 1);
+			if (level == 0) break;
+			lua_rawgeti(L, parents, level--);
+			lua_replace(L, current);
+			continue;
+		}
+		cont = visit(L, lua_gettop(L), depth + level + 1, ud);
+		if (cont && is_element(L, -1)) {
+			// descend into subelement
+			lua_pushvalue(L, current);
+			lua_rawseti(L, parents, ++level); // store parent table
+			lua_replace(L, current);
+			index->size = level * sizeof(size_t);
+			Buffer_reserve(L, index, sizeof(size_t));
+			((size_t *)index->data)[level] = 0;
+		}
+		else lua_pop(L, 1);
+	}
+	lua_settop(L, parents - 1);
+	return cont;
+}
+
+// Call the iterate() callback (at stack index 2) for the matched element at
+// the given index, which gets converted to a LuaXML object first. Returns
+// `false` if the callback requested to stop the iteration.
+static bool iterate_callback(lua_State *L, int index, int depth) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	if (lua_istable(L, index)) make_xml_object(L, index);
+	lua_pushvalue(L, 2); // duplicate function
+	lua_pushvalue(L, index);
+	lua_pushinteger(L, depth);
+	lua_call(L, 2, 1);
+	lua_pushboolean(L, false);
+	bool cont = !lua_equal(L, -1, -2);
+	lua_pop(L, 2);
+	return cont;
+}
+
+// Xml_walk() visitor for iterate(), `ud` points to the counter of matches
+static bool iterate_visitor(lua_State *L, int index, int depth, void *ud) {
+	if (!is_match(L, index, 3, 4, 5)) return true;
+	++*(int *)ud;
+	return iterate_callback(L, index, depth);
+}
+
+/** iterates a LuaXML object,
+invoking a callback function for all matching (sub)elements.
+
+The iteration starts with the variable `var` itself (= default depth 0).
+A callback function `cb` gets invoked for each `match`, depending on the
+specified criteria. If the `r` flag is set, the process will
+repeat **recursively** for the subelements of `var` (at depth + 1). You can
+limit the scope by setting a maximum depth, or have the callback function
+explicitly request to stop the iteration (by returning `false`).
+
+@function iterate
+
+@param var  the table (LuaXML object) to iterate
+
+@tparam function cb
+callback function. `callback(var, depth)` will be called for each matching
+element.<br>
+The function may return `false` to request a stop; if its result is
+any other value (including `nil`), the iteration will continue.
+
+@tparam ?string tag  XML tag to be matched
+@tparam ?string key  attribute key to be matched
+@param value  (optional) attribute value to be matched
+
+@tparam ?boolean r
+recursive operation. If `true`, also iterate over the subelements of `var`
+
+@tparam ?number max  maximum depth allowed
+@tparam ?number d  initial depth value, defaults to 0
+
+@return
+The function returns two values: a counter representing the number of elements
+that were successfully matched (and processed), and a boolean completion flag.
+The latter is `true` for an exhaustive iteration, and `false` if was stopped
+from the callback.
+
+@see match
+*/
+int Xml_iterate(lua_State *L) {
+	lua_settop(L, 8);
+	luaL_checktype(L, 2, LUA_TFUNCTION); // callback must be a function
+	int maxdepth = luaL_optint(L, 7, -1); // default (< 0) indicates "no limit"
+	int depth = lua_tointeger(L, 8);
+	int count = 0;
+	bool cont = true;
+
+	// examine "var" element first
+	if (is_match(L, 1, 3, 4, 5)) { // "var" matches, invoke callback
+		count = 1;
+		cont = iterate_callback(L, 1, depth);
+	}
+	if (cont && lua_toboolean(L, 6)) // process "children" / sub-elements
+		cont = Xml_walk(L, 1, depth, maxdepth, iterate_visitor, &count);
+
+	lua_pushinteger(L, count);
+	lua_pushboolean(L, cont);
+	return 2;
+}
+
+// stack indices used by index_visitor()
+typedef struct {
+	int index, tag, attr, value;
+} IndexState;
+
+// Xml_walk() visitor that adds a matching element to an attribute index
+static bool index_visitor(lua_State *L, int node, int depth, void *ud) {
+	const IndexState *st = ud;
+	if (!lua_istable(L, node) || !is_match(L, node, st->tag, st->attr, st->value))
+		return true;
+	make_xml_object(L, node);
+	lua_pushvalue(L, st->attr);
+	lua_rawget(L, node); // attribute value = index key
+	lua_pushvalue(L, -1);
+	lua_rawget(L, st->index); // existing entry
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, node);
+		lua_rawset(L, st->index); // index[value] = node
+	} else if (is_xml_object(L, -1)) {
+		// a duplicate, convert entry to a list of elements
+		lua_createtable(L, 2, 0);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, 1);
+		lua_pushvalue(L, node);
+		lua_rawseti(L, -2, 2);
+		lua_rawset(L, st->index); // index[value] = {existing, node}
+	} else {
+		// already a list, append to it
+		lua_pushvalue(L, node);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_pop(L, 2);
+	}
+	return true;
+}
+
+// push the metatable of the index table at stack index `index`, which holds
+// its parameters (raises an error for anything else)
+static void index_params(lua_State *L, int index) {
+	luaL_checktype(L, index, LUA_TTABLE);
+	if (lua_getmetatable(L, index)) {
+		lua_getfield(L, -1, "attr");
+		bool valid = lua_type(L, -1) == LUA_TSTRING;
+		lua_pop(L, 1);
+		if (valid) return;
+	}
+	luaL_error(L, "LuaXML ERROR: invalid index table (see indexby)");
+}
+
+// add the element at stack index `node` and all its subelements to the index
+// table at stack index `index`
+static void index_scan(lua_State *L, int index, int node) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	if (node < 0) node += lua_gettop(L) + 1;
+	index_params(L, index);
+	lua_getfield(L, -1, "tag");
+	lua_getfield(L, -2, "attr");
+	lua_pushnil(L); // (value = "don't care")
+	int top = lua_gettop(L);
+	IndexState st = {index, top - 2, top - 1, top};
+	index_visitor(L, node, 0, &st);
+	Xml_walk(L, node, 0, -1, index_visitor, &st);
+	lua_pop(L, 4);
+}
+
+/** builds an index of (sub)elements by attribute value.
+This function traverses `var` once, and returns a table that maps the values of
+a given attribute to the elements having them. Looking up an element by its
+`id` attribute is then simply `idx[id]`, instead of repeated (and expensive)
+calls to `find`.
+
+If an attribute value occurs more than once, the corresponding index entry is
+a plain list (array) of all these elements, in document order. Otherwise it's
+the LuaXML object itself.
+
+The index is a plain table, any attribute value is a valid key. To update it
+after changes to the document, see `indexadd` and `indexrebuild`.
+
+@function indexby
+@param var  the table (LuaXML object) to index
+@tparam string attr  the attribute key (= exact name) to index by
+@tparam ?string tag  XML tag to be matched, only elements having it get indexed
+@treturn table  the index, mapping attribute values to elements
+
+@usage
+local idx = xml.load("test.xml"):indexby("id")
+print(idx["dopplerVelocity"][1]) -- "330.0"
+-- index only <resource> elements, and add a new one later
+local res = doc:find("resources")
+local resources = res:indexby("id", "resource")
+local new = res:append("resource")
+new.id = "42"
+xml.indexadd(resources, new)
+
+@see find, indexadd, indexrebuild
+*/
+int Xml_indexby(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checkstring(L, 2);
+	lua_settop(L, 3);
+	lua_newtable(L); // #4, will become the index
+	// each index gets its own metatable, storing the parameters
+	lua_createtable(L, 0, 3);
+	lua_pushvalue(L, 1);
+	lua_setfield(L, -2, "root");
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, "attr");
+	lua_pushvalue(L, 3);
+	lua_setfield(L, -2, "tag");
+	lua_setmetatable(L, 4);
+	index_scan(L, 4, 1);
+	return 1;
+}
+
+/** adds elements to an index created by `indexby`.
+This adds `node` and its subelements, i.e. a subtree that you have appended to
+the document after indexing it. (It doesn't check for elements already
+indexed, so only pass new ones!)
+
+@function indexadd
+@tparam table idx  the index
+@param node  the table (LuaXML object) to add
+@treturn table  the index
+@see indexby
+*/
+int Xml_indexadd(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	index_scan(L, 1, 2);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/** rebuilds an index created by `indexby`.
+This clears the index and scans the original `var` again.
+
+@function indexrebuild
+@tparam table idx  the index
+@treturn table  the index
+@see indexby
+*/
+int Xml_indexrebuild(lua_State *L) {
+	index_params(L, 1);
+	lua_settop(L, 1);
+	// clear all entries (assigning `nil` to existing fields is safe here)
+	lua_pushnil(L);
+	while (lua_next(L, 1)) {
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, 1);
+	}
+	index_params(L, 1);
+	lua_getfield(L, -1, "root");
+	index_scan(L, 1, -1);
+	lua_settop(L, 1);
+	return 1;
+}
+
+// state of a children() iteration, kept as userdata (upvalue #5)
+typedef struct {
+	/// maximum depth, < 0 means "no limit"
+	int maxdepth;
+	/// current nesting level (0 = subelements of `var`), < 0 when done
+	int level;
+	/// number of matches so far
+	size_t count;
+	/// current subelement index for each level (malloc'ed)
+	size_t *k;
+	/// number of levels allocated for `k`
+	size_t capacity;
+} ChildIter;
+
+static int ChildIter_gc(lua_State *L) {
+	ChildIter *it = lua_touserdata(L, 1);
+	free(it->k);
+	it->k = NULL;
+	return 0;
+}
+
+/*
+ * The actual iterator function for children(), a C closure with upvalues:
+ * 1 = table of parents (tables for each level), 2 = tag, 3 = key, 4 = value,
+ * 5 = ChildIter state. Each invocation resumes the (depth first) traversal
+ * until the next match.
+ */
+static int children_next(lua_State *L) {
+	ChildIter *it = lua_touserdata(L, lua_upvalueindex(5));
+	while (it->level >= 0) {
+		int level = it->level;
+		if (it->maxdepth >= 0 && level + 1 > it->maxdepth)
+			lua_pushnil(L); // depth limit, don't enter subelements
+		else {
+			lua_rawgeti(L, lua_upvalueindex(1), level + 1); // current table
+			element_rawgeti(L, -1, ++it->k[level]);
+			lua_remove(L, -2);
+		}
+		if (lua_isnil(L, -1)) {
+			// no more subelements, return to parent level (or finish)
+			lua_pop(L, 1);
+			it->level--;
+			continue;
+		}
+		if (is_element(L, -1)) {
+			// prepare to descend into this subelement (on the next iteration)
+			if ((size_t)level + 1 >= it->capacity) {
+				size_t *k = realloc(it->k, 2 * it->capacity * sizeof(size_t));
+				if (!k) return luaL_error(L, "LuaXML: out of memory (children)");
+				it->k = k;
+				it->capacity *= 2;
+			}
+			it->k[++it->level] = 0;
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, lua_upvalueindex(1), it->level + 1);
+		}
+		if (is_match(L, -1, lua_upvalueindex(2), lua_upvalueindex(3),
+				lua_upvalueindex(4)))
+		{
+			if (lua_istable(L, -1)) make_xml_object(L, -1);
+			lua_pushinteger(L, ++it->count);
+			lua_insert(L, -2);
+			return 2; // (count, element)
+		}
+		lua_pop(L, 1);
+	}
+	return 0; // `nil` signals the end of iteration
+}
+
+/** iterate subelements ("XML children") as _key - value_ pairs.
+This function is meant to be called in a generic `for` loop, similar to what
+`ipairs(var)` would do. However you can easily specify additional criteria
+to `match` against here, possibly reducing the overhead needed to test for
+specific subelements.
+
+For the resulting `(k, v)` pairs, note that `k` is just a sequential number
+in the array of matched child elements, and has no direct relation to the
+actual "position" (subtag index) within each `v`'s parent object.
+
+The iteration is "lazy", i.e. it advances only as far as needed to produce
+the next match. Breaking out of the loop early thus saves the remaining work.
+It also means that modifications of `var` during the loop will affect any
+elements not visited yet.
+
+@function children
+
+@param var  the table (LuaXML object) to work on
+@tparam ?string tag  XML tag to be matched
+@tparam ?string key  attribute key to be matched
+@param value  (optional) attribute value to be matched
+
+@tparam ?number maxdepth
+maximum depth allowed, defaults to 1 (only immediate children).
+You can pass 0 or `true` to iterate _all_ children recursively.
+
+@return Lua iterator function - suitable for a `for` loop
+
+@see match
+
+@usage
+local xml = require("LuaXML")
+local foobar = xml.eval('<foo><a /><b bar="no" /><c bar="yes" /><a /></foo>')
+
+-- iterate over those children that have a "bar" attribute:
+for k, v in foobar:children(nil, "bar") do
+	print(k, v:tag(), v.bar)
+end
+-- will print
+-- 1       b       no
+-- 2       c       yes
+
+-- require "bar" to be "yes":
+for k, v in foobar:children(nil, "bar", "yes") do
+	print(k, v:tag(), v.bar)
+end
+-- will print
+-- 1       c       yes
+
+-- iterate "a" tags: (the first and fourth child will match)
+for k, v in foobar:children("a") do
+	print(k, v:tag(), v.bar)
+end
+-- will print
+-- 1       a       nil
+-- 2       a       nil
+*/
+int Xml_children(lua_State *L) {
+	lua_settop(L, 5);
+	int maxdepth; // default to 1, but enumerate all children for 0 or `true`
+	if (lua_isboolean(L, 5))
+		maxdepth = lua_toboolean(L, 5) ? -1 : 1;
+	else {
+		maxdepth = luaL_optint(L, 5, 1);
+		if (maxdepth == 0) maxdepth = -1;
+	}
+
+	lua_createtable(L, 4, 0); // upvalue #1, parents
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, -2, 1);
+	lua_pushvalue(L, 2); // tag
+	lua_pushvalue(L, 3); // key
+	lua_pushvalue(L, 4); // value
+	ChildIter *it = lua_newuserdata(L, sizeof(ChildIter));
+	it->k = NULL;
+	if (luaL_newmetatable(L, LUAXML_CHILDREN)) {
+		lua_pushcfunction(L, ChildIter_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	it->maxdepth = maxdepth;
+	it->level = is_element(L, 1) ? 0 : -1; // nothing to do for non-elements
+	it->count = 0;
+	it->capacity = 8;
+	it->k = malloc(it->capacity * sizeof(size_t));
+	if (!it->k) return luaL_error(L, "LuaXML: out of memory (children)");
+	it->k[0] = 0;
+
+	lua_pushcclosure(L, children_next, 5);
+	return 1;
+}
+
+/** recursively searches a Lua table for a subelement
+matching the provided tag and attribute. See the description of `match` for
+the logic involved with testing for` tag`, `key` and `value`.
+
+@function find
+@param var  the table to be searched in
+@tparam ?string tag  the XML tag to be found
+@tparam ?string key  the attribute key (= exact name) to be found
+@param value (optional)  the attribute value to be found
+@return  the first (sub-)table that satisfies the search condition,
+or `nil` for no match
+*/
+int Xml_find(lua_State *L) {
+	lua_settop(L, 4); // accept at most four parameters for this function
+
+	lua_newtable(L); // upon a match, this table will receive our result as t[1]
+	lua_insert(L, 1); // (move it before anything else)
+
+	lua_pushcfunction(L, Xml_iterate);
+	lua_insert(L, 2); // iterate is now stack arg #2, `var` at #3
+	lua_pushvalue(L, 1); // duplicate the table (for use as upvalue)
+	lua_pushcclosure(L, find_on_match, 1); // create a C closure
+	lua_insert(L, 4); // place the callback function (closure) at #4
+	// (`tag`, `key` and `value` have moved to #5, #6 and #7 respectively)
+	lua_pushboolean(L, true); // set "recursive" flag (#8)
+
+	// iterate(var, find_on_match, tag, key, value, true), discarding results
+	// (but if something matches, we expect that `find_on_match` sets t[1])
+	lua_call(L, 6, 0);
+	lua_rawgeti(L, 1, 1);
+	return 1; // returns result[1], which may be `nil` (if no match)
+}
+
+// Xml_walk() visitor for cache(), removes the cache entries of subelements.
+// `ud` points to the stack indices of the cache, parents and hashes tables.
+static bool uncache_visitor(lua_State *L, int index, int depth, void *ud) {
+	int *tables = ud;
+	if (lua_istable(L, index))
+		for (int i = 0; i < 3; i++) {
+			lua_pushvalue(L, index);
+			lua_pushnil(L);
+			lua_rawset(L, tables[i]);
+		}
+	return true;
+}
+
+/** enables (or disables) caching of `str` results for a LuaXML object.
+
+With caching enabled, `str` will remember the XML string for each (sub)element
+of `var`, and reuse it as long as the element isn't marked as modified. This
+makes repeated serialization of large documents cheap, if only small parts of
+them change in between. Note that there is no automatic change detection: you
+**must** call `touch` on each element that you modify (or that you add new
+subelements to), otherwise `str` will keep returning the previous result.
+(Subelements created with `append` are linked to their parent, so touching
+them covers the parent as well.)
+
+Caching assumes that `var` is a tree, i.e. each element has a single parent.
+It costs additional memory, as each element keeps a copy of its XML string.
+
+@function cache
+
+@param var  the table (LuaXML object) to enable caching for
+@tparam ?boolean enable  defaults to `true`. Pass `false` to turn off caching
+(and to discard all cached strings within `var`).
+
+@return var
+
+@usage
+local doc = xml.load("config.xml"):cache()
+local s = doc:str()
+doc:find("port")[1] = "8080"
+doc:find("port"):touch()
+s = doc:str() -- only re-renders the "port" element and its ancestors
+
+@see touch
+*/
+int Xml_cache(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 2);
+	bool enable = lua_isnone(L, 2) || lua_isnil(L, 2) || lua_toboolean(L, 2);
+	lua_settop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_STRCACHE); // #2
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_PARENTS); // #3
+	if (enable) {
+		lua_pushvalue(L, 1);
+		lua_rawget(L, 3);
+		bool linked = !lua_isnil(L, -1);
+		lua_pop(L, 1);
+		if (!linked) {
+			lua_pushvalue(L, 1);
+			lua_pushboolean(L, true); // (root element)
+			lua_rawset(L, 3);
+		}
+	} else {
+		lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_HASHES); // #4
+		int tables[3] = {2, 3, 4};
+		uncache_visitor(L, 1, 0, tables);
+		Xml_walk(L, 1, 0, -1, uncache_visitor, tables);
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/** marks a LuaXML object as modified, for the `str` cache.
+
+This discards the cached XML string of `var` and all its ancestors, so the next
+`str` call will re-create them. (The same goes for the subtree hashes of
+`diff`.) Calling `touch` for elements without caching is harmless (and has no
+effect).
+
+@function touch
+@param var  the table (LuaXML object) that was modified
+@return var
+@see cache
+*/
+int Xml_touch(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_STRCACHE); // #2
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_PARENTS); // #3
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_HASHES); // #4
+	lua_pushvalue(L, 1);
+	while (lua_istable(L, -1)) {
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, 2); // cache[element] = nil
+		lua_pushvalue(L, -1);
+		lua_pushnil(L);
+		lua_rawset(L, 4); // hashes[element] = nil
+		lua_rawget(L, 3); // replace element with its parent
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+//--- structural diff ---
+
+/*
+ * diff() compares trees by subtree hashes: 64-bit values that cover an
+ * element's tag, its attributes (regardless of their order) and the sequence
+ * of its subelements. Elements with equal hashes count as identical, so whole
+ * subtrees are skipped with a single comparison. The hashes of both trees are
+ * kept in an open-addressing map keyed by table address (a HashMap). Elements
+ * under cache() additionally keep their hash in the (weak) registry table
+ * LUAXML_HASHES, as an 8-byte string - touch() discards it together with the
+ * cached XML string.
+ */
+
+typedef struct {
+	const void *key; // (NULL = unused slot)
+	uint64_t hash;
+} HashSlot;
+
+typedef struct {
+	Buffer *slots; // HashSlot array, with (mask + 1) entries
+	size_t mask, count;
+	bool caching; // (for diff: are there any elements under cache()?)
+} HashMap;
+
+// a pair of matched subelement indices (0-based)
+typedef struct {
+	size_t a, b;
+} DiffMatch;
+
+// a range of subelements [a0, a1) and [b0, b1) that still needs alignment
+typedef struct {
+	size_t a0, a1, b0, b1;
+} DiffGap;
+
+// entry of the occurrence table for diff_anchors()
+typedef struct {
+	uint64_t hash;
+	size_t count_a, count_b, pos_a, pos_b;
+	bool used;
+} DiffCount;
+
+#define DIFF_LCS_LIMIT	(1 << 20) // max. table cells for an exact LCS alignment
+
+static inline uint64_t hash_mix(uint64_t h, uint64_t v) {
+	// (splitmix64 finalizer)
+	uint64_t x = h ^ (v + 0x9E3779B97F4A7C15ull);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+static uint64_t hash_string(const char *s, size_t len) {
+	uint64_t h = 0xCBF29CE484222325ull, chunk;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		memcpy(&chunk, s + i, 8);
+		h = (h ^ chunk) * 0x100000001B3ull;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++) h = (h ^ (unsigned char)s[i]) * 0x100000001B3ull;
+	return hash_mix(h, len);
+}
+
+static inline size_t hashmap_index(const void *key, size_t mask) {
+	uint64_t x = (uint64_t)(uintptr_t)key * 0x9E3779B97F4A7C15ull;
+	return (size_t)(x ^ (x >> 32)) & mask;
+}
+
+// initialize an (empty) map, leaving its buffer userdata on the Lua stack
+static void hashmap_init(lua_State *L, HashMap *map) {
+	map->slots = Buffer_push(L);
+	Buffer_reserve(L, map->slots, 1024 * sizeof(HashSlot));
+	memset(map->slots->data, 0, 1024 * sizeof(HashSlot));
+	map->mask = 1023;
+	map->count = 0;
+	map->caching = false;
+}
+
+static HashSlot *hashmap_find(HashMap *map, const void *key) {
+	HashSlot *slots = (HashSlot *)map->slots->data;
+	size_t i = hashmap_index(key, map->mask);
+	for (;; i = (i + 1) & map->mask) {
+		if (slots[i].key == key) return &slots[i];
+		if (!slots[i].key) return NULL;
+	}
+}
+
+static void hashmap_grow(lua_State *L, HashMap *map) {
+	size_t capacity = 2 * (map->mask + 1), i, k;
+	HashSlot *old = (HashSlot *)map->slots->data;
+	HashSlot *slots = calloc(capacity, sizeof(HashSlot));
+	if (!slots) luaL_error(L, "LuaXML: out of memory (diff)");
+	for (i = 0; i <= map->mask; i++)
+		if (old[i].key) {
+			k = hashmap_index(old[i].key, capacity - 1);
+			while (slots[k].key) k = (k + 1) & (capacity - 1);
+			slots[k] = old[i];
+		}
+	free(old);
+	map->slots->data = (char *)slots;
+	map->slots->capacity = capacity * sizeof(HashSlot);
+	map->mask = capacity - 1;
+}
+
+static void hashmap_set(lua_State *L, HashMap *map, const void *key,
+		uint64_t hash)
+{
+	if (2 * (map->count + 1) > map->mask + 1) hashmap_grow(L, map);
+	HashSlot *slots = (HashSlot *)map->slots->data;
+	size_t i = hashmap_index(key, map->mask);
+	for (; slots[i].key; i = (i + 1) & map->mask)
+		if (slots[i].key == key) {
+			slots[i].hash = hash;
+			return;
+		}
+	slots[i].key = key;
+	slots[i].hash = hash;
+	map->count++;
+}
+
+/* stack layout for Xml_diff() */
+enum {
+	DIFF_HASHES = 3, DIFF_PARENTS, DIFF_MAP, DIFF_OPS, DIFF_PENDING, DIFF_SEQ,
+	DIFF_MATCHES, DIFF_GAPS, DIFF_SCRATCH, DIFF_A, DIFF_B, DIFF_PATH
+};
+
+// per-element state of diff_hashTree()
+typedef struct {
+	uint64_t hash; // (so far)
+	size_t k, n; // current subelement, and their number
+	bool cached; // is the element under cache()?
+	bool inner; // does it have table subelements?
+} HashFrame;
+
+static uint64_t diff_hashTree(lua_State *L, int root, HashMap *map);
+
+// Hash the Lua value at stack index `index`: tables by their subtree hash from
+// `map` (hashing them first if needed), anything else by its string form - as
+// `str` would write it, so 1 and "1" are considered equal.
+static uint64_t diff_valueHash(lua_State *L, int index, HashMap *map) {
+	size_t len;
+	const char *s;
+	uint64_t h;
+	switch (lua_type(L, index)) {
+	case LUA_TTABLE:
+		return diff_hashTree(L, index, map);
+	case LUA_TSTRING:
+		s = lua_tolstring(L, index, &len);
+		return hash_string(s, len);
+	case LUA_TNUMBER:
+		lua_pushvalue(L, index); // (convert a copy)
+		s = lua_tolstring(L, -1, &len);
+		h = hash_string(s, len);
+		lua_pop(L, 1);
+		return h;
+	case LUA_TBOOLEAN:
+		return lua_toboolean(L, index) ? hash_string("true", 4)
+			: hash_string("false", 5);
+	default:
+		return hash_mix(lua_type(L, index), (uintptr_t)lua_topointer(L, index));
+	}
+}
+
+// Start the hash of the element at stack index `node`, with its tag and
+// attributes.
+static uint64_t diff_headHash(lua_State *L, int node, HashMap *map) {
+	lua_rawgeti(L, node, 0);
+	uint64_t h = hash_mix(0, diff_valueHash(L, -1, map)), attributes = 0;
+	lua_pop(L, 1);
+	size_t count = 0;
+	lua_pushnil(L);
+	while (lua_next(L, node)) {
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			// (the sum makes this independent of the attribute order)
+			attributes += hash_mix(diff_valueHash(L, -2, map),
+				diff_valueHash(L, -1, map));
+			count++;
+		}
+		lua_pop(L, 1);
+	}
+	return hash_mix(hash_mix(h, attributes), count);
+}
+
+// Check if the element at stack index `node` is under cache() (setting
+// `*cached`), and has a stored hash. If so, set `*hash` and return `true`.
+static bool diff_cachedHash(lua_State *L, int node, HashMap *map,
+		uint64_t *hash, bool *cached)
+{
+	*cached = false;
+	if (!map->caching) return false;
+	lua_pushvalue(L, node);
+	lua_rawget(L, DIFF_HASHES); // (only cached elements have an entry)
+	size_t len;
+	const char *s = lua_tolstring(L, -1, &len);
+	*cached = s && len == sizeof(uint64_t);
+	if (*cached) memcpy(hash, s, len);
+	lua_pop(L, 1);
+	if (*cached) return true;
+	lua_pushvalue(L, node);
+	lua_rawget(L, DIFF_PARENTS);
+	*cached = !lua_isnil(L, -1);
+	lua_pop(L, 1);
+	return false;
+}
+
+// Compute the subtree hash for the element at stack index `root`. The hashes
+// of elements that have table subelements get stored to `map` (the others are
+// cheap to recompute, if needed). Cached elements reuse their stored hash if
+// there is one (without visiting their subelements), and store a new one
+// otherwise.
+//
+// This is a post-order walk with an explicit stack, like Xml_walk(): parent
+// tables go into a Lua table, the partial hashes into a Buffer of HashFrames.
+// Like `str`, it expects a tree (i.e. no cycles).
+static uint64_t diff_hashTree(lua_State *L, int root, HashMap *map) {
+	uint64_t h;
+	bool cached;
+	if (root < 0) root += lua_gettop(L) + 1; // relative to absolute index
+	HashSlot *slot = hashmap_find(map, lua_topointer(L, root));
+	if (slot) return slot->hash;
+	if (diff_cachedHash(L, root, map, &h, &cached)) return h;
+	lua_newtable(L); // parents
+	int parents = lua_gettop(L);
+	Buffer *frames = Buffer_push(L);
+	lua_pushvalue(L, root);
+	int node = parents + 2;
+	size_t depth = 0;
+	Buffer_reserve(L, frames, sizeof(HashFrame));
+	HashFrame *frame = (HashFrame *)frames->data;
+	frame->hash = diff_headHash(L, node, map);
+	frame->k = 0;
+	frame->n = lua_rawlen(L, node);
+	frame->cached = cached;
+	frame->inner = false;
+	for (;;) {
+		frame = (HashFrame *)frames->data + depth;
+		if (frame->k < frame->n) {
+			lua_rawgeti(L, node, ++frame->k);
+			if (lua_istable(L, -1)) {
+				frame->inner = true;
+				if (frame->cached) { // link child to its parent
+					lua_pushvalue(L, -1);
+					lua_pushvalue(L, node);
+					lua_rawset(L, DIFF_PARENTS);
+				}
+				if (!diff_cachedHash(L, node + 1, map, &h, &cached)) {
+					// descend into the subelement
+					lua_pushvalue(L, node);
+					lua_rawseti(L, parents, ++depth);
+					lua_replace(L, node);
+					frames->size = depth * sizeof(HashFrame);
+					Buffer_reserve(L, frames, sizeof(HashFrame));
+					frame = (HashFrame *)frames->data + depth;
+					frame->k = 0;
+					frame->n = lua_rawlen(L, node);
+					frame->cached = cached;
+					frame->inner = false;
+					frame->hash = diff_headHash(L, node, map);
+					continue;
+				}
+			} else
+				h = diff_valueHash(L, -1, map);
+			frame->hash = hash_mix(frame->hash, h);
+			lua_pop(L, 1);
+		} else {
+			// element complete
+			h = hash_mix(frame->hash, frame->n);
+			if (frame->inner) {
+				hashmap_set(L, map, lua_topointer(L, node), h);
+				if (frame->cached) {
+					lua_pushvalue(L, node);
+					lua_pushlstring(L, (const char *)&h, sizeof(h));
+					lua_rawset(L, DIFF_HASHES);
+				}
+			}
+			if (depth == 0) break;
+			lua_rawgeti(L, parents, depth--);
+			lua_replace(L, node);
+			frame = (HashFrame *)frames->data + depth;
+			frame->hash = hash_mix(frame->hash, h);
+		}
+	}
+	lua_settop(L, parents - 1);
+	return h;
+}
+
+static int diff_compareMatch(const void *x, const void *y) {
+	const DiffMatch *a = x, *b = y;
+	return a->a < b->a ? -1 : a->a > b->a;
+}
+
+static void diff_addMatch(lua_State *L, Buffer *matches, size_t a, size_t b) {
+	DiffMatch match = {a, b};
+	Buffer_add(L, matches, (const char *)&match, sizeof(match));
+}
+
+// Align the gap with an exact longest common subsequence (dynamic programming
+// over its p * q cells).
+static void diff_lcs(lua_State *L, const uint64_t *ha, const uint64_t *hb,
+		DiffGap *g, Buffer *matches, Buffer *scratch)
+{
+	size_t p = g->a1 - g->a0, q = g->b1 - g->b0, i, j, w = q + 1;
+	scratch->size = 0;
+	Buffer_reserve(L, scratch, (p + 1) * w * sizeof(uint32_t));
+	uint32_t *len = (uint32_t *)scratch->data; // LCS of the suffixes (i, j)
+	for (j = 0; j <= q; j++) len[p * w + j] = 0;
+	for (i = p; i-- > 0;) {
+		len[i * w + q] = 0;
+		for (j = q; j-- > 0;) {
+			if (ha[g->a0 + i] == hb[g->b0 + j])
+				len[i * w + j] = len[(i + 1) * w + j + 1] + 1;
+			else {
+				uint32_t down = len[(i + 1) * w + j], right = len[i * w + j + 1];
+				len[i * w + j] = down > right ? down : right;
+			}
+		}
+	}
+	for (i = j = 0; i < p && j < q;) {
+		if (ha[g->a0 + i] == hb[g->b0 + j]) {
+			diff_addMatch(L, matches, g->a0 + i++, g->b0 + j++);
+		} else if (len[(i + 1) * w + j] >= len[i * w + j + 1])
+			i++;
+		else
+			j++;
+	}
+}
+
+// Align a gap that is too large for diff_lcs(), by matching up elements that
+// occur exactly once on each side (the longest increasing sequence of them, as
+// in "patience diff"). This adds those as matches, and the ranges in between
+// them as new gaps. Returns `false` if there was nothing to match.
+static bool diff_anchors(lua_State *L, const uint64_t *ha, const uint64_t *hb,
+		DiffGap *g, Buffer *matches, Buffer *gaps, Buffer *scratch)
+{
+	size_t p = g->a1 - g->a0, q = g->b1 - g->b0, size = 1024, i, k;
+	while (size < 2 * (p + q)) size *= 2;
+	scratch->size = 0;
+	Buffer_reserve(L, scratch, size * sizeof(DiffCount) + 3 * p * sizeof(size_t));
+	DiffCount *counts = (DiffCount *)scratch->data;
+	memset(counts, 0, size * sizeof(DiffCount));
+	for (i = g->a0; i < g->a1 + q; i++) {
+		bool left = i < g->a1;
+		size_t pos = left ? i : g->b0 + (i - g->a1);
+		uint64_t h = left ? ha[pos] : hb[pos];
+		for (k = hash_mix(0, h) & (size - 1); counts[k].used && counts[k].hash != h;)
+			k = (k + 1) & (size - 1);
+		counts[k].used = true;
+		counts[k].hash = h;
+		if (left) {
+			counts[k].count_a++;
+			counts[k].pos_a = pos;
+		} else {
+			counts[k].count_b++;
+			counts[k].pos_b = pos;
+		}
+	}
+	// unique pairs in the order of `a`, then their longest increasing
+	// subsequence by `b` position (patience sorting, with back links)
+	size_t *anchor = (size_t *)(counts + size), *tail = anchor + p, *prev = tail + p;
+	size_t n = 0, piles = 0;
+	for (i = g->a0; i < g->a1; i++) {
+		for (k = hash_mix(0, ha[i]) & (size - 1);
+			!counts[k].used || counts[k].hash != ha[i];)
+			k = (k + 1) & (size - 1);
+		if (counts[k].count_a == 1 && counts[k].count_b == 1) {
+			anchor[n] = k;
+			size_t lo = 0, hi = piles;
+			while (lo < hi) {
+				size_t mid = (lo + hi) / 2;
+				if (counts[anchor[tail[mid]]].pos_b < counts[k].pos_b) lo = mid + 1;
+				else hi = mid;
+			}
+			prev[n] = lo > 0 ? tail[lo - 1] : SIZE_MAX;
+			tail[lo] = n++;
+			if (lo == piles) piles++;
+		}
+	}
+	if (piles == 0) return false;
+	// collect the sequence (backwards), adding gaps in between
+	size_t a1 = g->a1, b1 = g->b1, a0 = g->a0, b0 = g->b0;
+	for (k = tail[piles - 1]; k != SIZE_MAX; k = prev[k]) {
+		DiffCount *c = counts + anchor[k];
+		DiffGap gap = {c->pos_a + 1, a1, c->pos_b + 1, b1};
+		if (gap.a0 < gap.a1 || gap.b0 < gap.b1)
+			Buffer_add(L, gaps, (const char *)&gap, sizeof(gap));
+		a1 = c->pos_a;
+		b1 = c->pos_b;
+		diff_addMatch(L, matches, a1, b1);
+	}
+	DiffGap gap = {a0, a1, b0, b1};
+	if (gap.a0 < gap.a1 || gap.b0 < gap.b1)
+		Buffer_add(L, gaps, (const char *)&gap, sizeof(gap));
+	return true;
+}
+
+// Find a common subsequence of the hash lists `ha` (n entries) and `hb` (m
+// entries), storing the matched index pairs to `matches` (sorted).
+static void diff_align(lua_State *L, const uint64_t *ha, size_t n,
+		const uint64_t *hb, size_t m, Buffer *matches, Buffer *gaps,
+		Buffer *scratch)
+{
+	matches->size = gaps->size = 0;
+	DiffGap g = {0, n, 0, m};
+	Buffer_add(L, gaps, (const char *)&g, sizeof(g));
+	while (gaps->size > 0) {
+		gaps->size -= sizeof(DiffGap);
+		memcpy(&g, gaps->data + gaps->size, sizeof(g));
+		// common prefix and suffix
+		while (g.a0 < g.a1 && g.b0 < g.b1 && ha[g.a0] == hb[g.b0])
+			diff_addMatch(L, matches, g.a0++, g.b0++);
+		while (g.a0 < g.a1 && g.b0 < g.b1 && ha[g.a1 - 1] == hb[g.b1 - 1])
+			diff_addMatch(L, matches, --g.a1, --g.b1);
+		size_t p = g.a1 - g.a0, q = g.b1 - g.b0;
+		if (p == 0 || q == 0) continue;
+		if (p <= DIFF_LCS_LIMIT / q)
+			diff_lcs(L, ha, hb, &g, matches, scratch);
+		else if (!diff_anchors(L, ha, hb, &g, matches, gaps, scratch))
+			continue; // (no common elements that we could find cheaply)
+	}
+	qsort(matches->data, matches->size / sizeof(DiffMatch), sizeof(DiffMatch),
+		diff_compareMatch);
+}
+
+// push a copy of the path (list) at stack index `path`, extended by `index`
+static void diff_pushPath(lua_State *L, int path, size_t index) {
+	size_t n = lua_rawlen(L, path), k;
+	lua_createtable(L, n + 1, 0);
+	for (k = 1; k <= n; k++) {
+		lua_rawgeti(L, path, k);
+		lua_rawseti(L, -2, k);
+	}
+	if (index > 0) {
+		lua_pushinteger(L, index);
+		lua_rawseti(L, -2, n + 1);
+	}
+}
+
+// Add an operation {op = op, path = path + {index}, value = value} to the list
+// at stack index `ops`, and leave it on the stack. (`value` may be 0 = none.)
+static void diff_addOp(lua_State *L, int ops, const char *op, int path,
+		size_t index, int value)
+{
+	lua_createtable(L, 0, 4);
+	lua_pushstring(L, op);
+	lua_setfield(L, -2, "op");
+	diff_pushPath(L, path, index);
+	lua_setfield(L, -2, "path");
+	if (value) {
+		lua_pushvalue(L, value);
+		lua_setfield(L, -2, "value");
+	}
+	lua_pushvalue(L, -1);
+	lua_rawseti(L, ops, lua_rawlen(L, ops) + 1);
+}
+
+// Compare the tags and attributes of the elements at stack indices `a` and
+// `b`, adding a "modify" operation for `path` if they differ.
+static void diff_attributes(lua_State *L, int a, int b, int path, int ops,
+		HashMap *map)
+{
+	lua_newtable(L);
+	int changes = lua_gettop(L);
+	bool modified = false;
+	lua_pushnil(L);
+	while (lua_next(L, b)) { // changed and new attributes
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			lua_pushvalue(L, -2);
+			lua_rawget(L, a);
+			if (lua_isnil(L, -1)
+				|| diff_valueHash(L, -1, map) != diff_valueHash(L, -2, map))
+			{
+				lua_pushvalue(L, -3);
+				lua_pushvalue(L, -3);
+				lua_rawset(L, changes);
+				modified = true;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, a)) { // removed attributes
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			lua_pushvalue(L, -2);
+			lua_rawget(L, b);
+			if (lua_isnil(L, -1)) {
+				lua_pushvalue(L, -3);
+				lua_pushboolean(L, false);
+				lua_rawset(L, changes);
+				modified = true;
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_rawgeti(L, a, 0);
+	lua_rawgeti(L, b, 0);
+	bool retag = !lua_rawequal(L, -1, -2);
+	if (modified || retag) {
+		diff_addOp(L, ops, "modify", path, 0, 0);
+		if (retag) {
+			lua_pushvalue(L, -2); // tag of b
+			lua_setfield(L, -2, "tag");
+		}
+		if (modified) {
+			lua_pushvalue(L, changes);
+			lua_setfield(L, -2, "attributes");
+		}
+	}
+	lua_settop(L, changes - 1);
+}
+
+// Can the values at stack indices `x` and `y` be diffed against each other
+// (instead of deleting one and inserting the other)? This is true for two
+// elements with the same tag, or two non-table values.
+static bool diff_compatible(lua_State *L, int x, int y) {
+	if (!lua_istable(L, x) || !lua_istable(L, y))
+		return !lua_istable(L, x) && !lua_istable(L, y);
+	lua_rawgeti(L, x, 0);
+	lua_rawgeti(L, y, 0);
+	bool result = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return result;
+}
+
+// Diff the subelement lists of `a` and `b` (at DIFF_A and DIFF_B), adding
+// operations for the unmatched ones. Pairs of differing elements that are to
+// be compared in depth get added to the list of pending pairs (in document
+// order, as they're taken from its end).
+static void diff_children(lua_State *L, HashMap *map, Buffer **buf,
+		size_t *pending)
+{
+	int a = DIFF_A, b = DIFF_B, path = DIFF_PATH, ops = DIFF_OPS;
+	size_t n = lua_rawlen(L, a), m = lua_rawlen(L, b), i, j, k;
+	Buffer *seq = buf[0], *matches = buf[1];
+	seq->size = 0;
+	Buffer_reserve(L, seq, (n + m) * sizeof(uint64_t));
+	uint64_t *ha = (uint64_t *)seq->data, *hb = ha + n;
+	for (i = 0; i < n; i++) {
+		lua_rawgeti(L, a, i + 1);
+		ha[i] = diff_valueHash(L, -1, map);
+		lua_pop(L, 1);
+	}
+	for (j = 0; j < m; j++) {
+		lua_rawgeti(L, b, j + 1);
+		hb[j] = diff_valueHash(L, -1, map);
+		lua_pop(L, 1);
+	}
+	diff_align(L, ha, n, hb, m, matches, buf[2], buf[3]);
+
+	// Walk both lists, with `pos` being the position in the (partially
+	// modified) list of `a` - which matches the position in `b`, for
+	// everything up to there.
+	size_t count = matches->size / sizeof(DiffMatch), pos = 0, first = *pending;
+	DiffMatch *match = (DiffMatch *)matches->data;
+	i = j = 0;
+	for (k = 0; k <= count; k++) {
+		size_t mi = k < count ? match[k].a : n, mj = k < count ? match[k].b : m;
+		while (i < mi || j < mj) {
+			lua_rawgeti(L, a, i + 1);
+			lua_rawgeti(L, b, j + 1);
+			int x = lua_gettop(L) - 1, y = x + 1;
+			if (i < mi && j < mj && diff_compatible(L, x, y)) {
+				pos++;
+				if (lua_istable(L, x)) {
+					lua_pushvalue(L, x);
+					lua_rawseti(L, DIFF_PENDING, 3 * *pending + 1);
+					lua_pushvalue(L, y);
+					lua_rawseti(L, DIFF_PENDING, 3 * *pending + 2);
+					diff_pushPath(L, path, pos);
+					lua_rawseti(L, DIFF_PENDING, 3 * *pending + 3);
+					++*pending;
+				} else
+					diff_addOp(L, ops, "modify", path, pos, y);
+				i++;
+				j++;
+			} else if (i < mi && (j >= mj || mi - i > mj - j)) {
+				diff_addOp(L, ops, "delete", path, pos + 1, x);
+				i++;
+			} else {
+				diff_addOp(L, ops, "insert", path, ++pos, y);
+				j++;
+			}
+			lua_settop(L, DIFF_PATH);
+		}
+		if (k < count) { // (identical)
+			pos++;
+			i++;
+			j++;
+		}
+	}
+	// reverse the newly added pairs
+	size_t lo = first, hi = *pending;
+	for (; hi > lo + 1; lo++, hi--)
+		for (k = 1; k <= 3; k++) {
+			lua_rawgeti(L, DIFF_PENDING, 3 * lo + k);
+			lua_rawgeti(L, DIFF_PENDING, 3 * (hi - 1) + k);
+			lua_rawseti(L, DIFF_PENDING, 3 * lo + k);
+			lua_rawseti(L, DIFF_PENDING, 3 * (hi - 1) + k);
+		}
+}
+
+/** compares two LuaXML objects, and lists their differences.
+
+The result is a list of operations that turn `a` into `b` when applied in
+order. Each one is a table with the fields
+
+- `op`: "insert", "delete" or "modify"
+- `path`: the list of subelement indices leading to the affected item, e.g.
+`{2, 5}` for `a[2][5]` (and `{}` for `a` itself). Paths refer to the state after
+all preceding operations; for "insert" and "modify" this is the position in `b`.
+- `value`: the inserted subelement (or string), the deleted one, or the new
+string for "modify" of a text item
+- `attributes`: for "modify" of an element, the changed attributes, with
+`false` for removed ones
+- `tag`: for "modify", the new tag (if it changed, which can only happen for
+the top-level elements - subelements with different tags get replaced).
+
+Elements are compared by 64-bit hashes of their tag, attributes (in any order)
+and subelements, so identical subtrees get skipped without visiting them again.
+The subelement lists are aligned by these hashes (as longest common subsequence,
+with unique elements as anchors for long lists), and remaining elements with
+the same tag are compared in depth. Values compare as `str` would write them, so
+the number 1 equals the string "1".
+
+For objects under `cache`, the hashes are stored too (and discarded by
+`touch`), so repeated diffs of large documents only rehash the modified parts.
+
+@function diff
+@param a  the original table (LuaXML object)
+@param b  the new table (LuaXML object)
+@treturn table  the list of operations (empty if `a` and `b` are equal)
 
 @usage
-print((xml.decode("&lt;-&gt;")) -- "<->"
+local old = xml.eval('<cfg><port>80</port><host name="a"/></cfg>')
+local new = xml.eval('<cfg><port>8080</port><host name="b"/><debug/></cfg>')
+for _, d in ipairs(xml.diff(old, new)) do
+	print(d.op, table.concat(d.path, "/"))
+end
+-- insert 3     (d.value is the <debug> element)
+-- modify 1/1   (d.value == "8080")
+-- modify 2     (d.attributes.name == "b")
+*/
+int Xml_diff(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_HASHES); // DIFF_HASHES
+	lua_getfield(L, LUA_REGISTRYINDEX, LUAXML_PARENTS); // DIFF_PARENTS
+	HashMap map;
+	hashmap_init(L, &map); // DIFF_MAP
+	lua_pushnil(L);
+	if (lua_next(L, DIFF_PARENTS)) {
+		map.caching = true;
+		lua_pop(L, 2);
+	}
+	lua_newtable(L); // DIFF_OPS
+	lua_newtable(L); // DIFF_PENDING, triples of a, b and path
+	Buffer *buf[4];
+	for (int i = 0; i < 4; i++)
+		buf[i] = Buffer_push(L); // DIFF_SEQ ... DIFF_SCRATCH
+
+	lua_pushvalue(L, 1);
+	lua_rawseti(L, DIFF_PENDING, 1);
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, DIFF_PENDING, 2);
+	lua_newtable(L);
+	lua_rawseti(L, DIFF_PENDING, 3);
+	size_t pending = 1;
+	while (pending > 0) {
+		pending--;
+		lua_rawgeti(L, DIFF_PENDING, 3 * pending + 1); // DIFF_A
+		lua_rawgeti(L, DIFF_PENDING, 3 * pending + 2); // DIFF_B
+		lua_rawgeti(L, DIFF_PENDING, 3 * pending + 3); // DIFF_PATH
+		if (diff_hashTree(L, DIFF_A, &map) != diff_hashTree(L, DIFF_B, &map)) {
+			diff_attributes(L, DIFF_A, DIFF_B, DIFF_PATH, DIFF_OPS, &map);
+			diff_children(L, &map, buf, &pending);
+		}
+		lua_settop(L, DIFF_SCRATCH);
+	}
+	lua_settop(L, DIFF_OPS);
+	return 1;
+}
 
-@function decode
-@tparam string str  string to be transformed
-@treturn string  the decoded string
-@see encode, registerCode
+//--- document profiles ---
+
+/*
+ * profile() runs the tokenizer over the input once, keeping only counters:
+ * per-name statistics in a hash table (ProfileName entries, with the names in
+ * a separate buffer), and a stack of the open elements. So the memory use
+ * depends on the number of distinct names and the nesting depth, but not on
+ * the size of the document. Distinct attribute values get counted with a
+ * HyperLogLog sketch (fixed size registers) per attribute name.
+ */
+#define PROFILE_HLL_BITS	12 // 4096 registers, ~1.6% standard error
+#define PROFILE_HLL_SIZE	(1 << PROFILE_HLL_BITS)
+
+// statistics of a tag or attribute name
+typedef struct {
+	uint64_t hash, count;
+	size_t name, len; // offset and length in the names buffer (len 0 = unused)
+	size_t hll; // (attributes) offset of the registers in the sketch buffer
+} ProfileName;
+
+typedef struct {
+	Buffer *slots, *names, *sketches;
+	size_t mask, count;
+} ProfileNames;
+
+// an open element
+typedef struct {
+	size_t start, name, len; // start position, and tag (in the names buffer)
+	uint64_t elements; // number of elements before this one
+} ProfileFrame;
+
+// initialize an (empty) table, leaving its three buffers on the Lua stack
+static void profile_init(lua_State *L, ProfileNames *t) {
+	t->slots = Buffer_push(L);
+	t->names = Buffer_push(L);
+	t->sketches = Buffer_push(L);
+	Buffer_reserve(L, t->slots, 64 * sizeof(ProfileName));
+	memset(t->slots->data, 0, 64 * sizeof(ProfileName));
+	t->mask = 63;
+	t->count = 0;
+}
+
+static void profile_grow(lua_State *L, ProfileNames *t) {
+	size_t capacity = 2 * (t->mask + 1), i, k;
+	ProfileName *old = (ProfileName *)t->slots->data;
+	ProfileName *slots = calloc(capacity, sizeof(ProfileName));
+	if (!slots) luaL_error(L, "LuaXML: out of memory (profile)");
+	for (i = 0; i <= t->mask; i++)
+		if (old[i].len) {
+			for (k = old[i].hash & (capacity - 1); slots[k].len; k = (k + 1) & (capacity - 1));
+			slots[k] = old[i];
+		}
+	free(old);
+	t->slots->data = (char *)slots;
+	t->slots->capacity = capacity * sizeof(ProfileName);
+	t->mask = capacity - 1;
+}
+
+// Find the entry for the name `s` (of length `len` > 0), adding it if needed.
+// The result stays valid until the next call.
+static ProfileName *profile_name(lua_State *L, ProfileNames *t, const char *s,
+		size_t len, bool attribute)
+{
+	uint64_t h = hash_string(s, len);
+	ProfileName *slots = (ProfileName *)t->slots->data;
+	size_t i = h & t->mask;
+	for (; slots[i].len; i = (i + 1) & t->mask)
+		if (slots[i].hash == h && slots[i].len == len
+			&& memcmp(t->names->data + slots[i].name, s, len) == 0)
+			return &slots[i];
+	if (2 * (t->count + 1) > t->mask + 1) {
+		profile_grow(L, t);
+		slots = (ProfileName *)t->slots->data;
+		for (i = h & t->mask; slots[i].len; i = (i + 1) & t->mask);
+	}
+	ProfileName *entry = &slots[i];
+	entry->hash = h;
+	entry->count = 0;
+	entry->name = t->names->size;
+	entry->len = len;
+	Buffer_add(L, t->names, s, len);
+	entry->hll = SIZE_MAX;
+	if (attribute) {
+		entry->hll = t->sketches->size;
+		Buffer_reserve(L, t->sketches, PROFILE_HLL_SIZE);
+		memset(t->sketches->data + entry->hll, 0, PROFILE_HLL_SIZE);
+		t->sketches->size += PROFILE_HLL_SIZE;
+	}
+	t->count++;
+	return entry;
+}
+
+static void profile_sketch_add(unsigned char *registers, uint64_t h) {
+	size_t index = h >> (64 - PROFILE_HLL_BITS);
+	uint64_t rest = h << PROFILE_HLL_BITS;
+	unsigned char rank = 1;
+	while (rank <= 64 - PROFILE_HLL_BITS && !(rest & 0x8000000000000000ull)) {
+		rank++;
+		rest <<= 1;
+	}
+	if (registers[index] < rank) registers[index] = rank;
+}
+
+static double profile_sketch_estimate(const unsigned char *registers) {
+	const double m = PROFILE_HLL_SIZE;
+	double sum = 0;
+	size_t zeros = 0, i;
+	for (i = 0; i < PROFILE_HLL_SIZE; i++) {
+		sum += 1.0 / (double)((uint64_t)1 << registers[i]);
+		if (registers[i] == 0) zeros++;
+	}
+	double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+	if (estimate <= 2.5 * m && zeros > 0)
+		estimate = m * log(m / zeros); // (linear counting for small numbers)
+	return floor(estimate + 0.5);
+}
+
+// count the entity / character references in `s`
+static size_t profile_entities(const char *s, size_t len) {
+	size_t count = 0;
+	const char *end = s + len;
+	while ((s = memchr(s, '&', end - s))) {
+		count++;
+		s++;
+	}
+	return count;
+}
+
+// set t[key] = value for the table on top of the stack
+static void profile_setnumber(lua_State *L, const char *key, double value) {
+	lua_pushnumber(L, value);
+	lua_setfield(L, -2, key);
+}
+
+static void profile_setinteger(lua_State *L, const char *key, uint64_t value) {
+	lua_pushinteger(L, (lua_Integer)value);
+	lua_setfield(L, -2, key);
+}
+
+/** collects statistics about the structure of an XML document, streaming.
+This makes a single pass over the input with the tokenizer, without creating
+any Lua tables for the elements - so it works for (compressed) files of any
+size, with constant memory use (apart from the per-name statistics). Like
+`load`, this only covers the root element. The result is a table with
+
+- `bytes`: the size of the input (uncompressed) up to the end of the root
+element, split into `text_bytes` (element content, as per the whitespace
+mode) and `markup_bytes` (everything else), and `text_ratio` (text / bytes)
+- `elements`: the number of elements, and `tags`: a table that maps each tag
+to its number of elements
+- `max_depth` and `avg_depth`: the maximum and average nesting level of the
+elements (the root element has level 1)
+- `attributes`: a table that maps each attribute name to a table with the
+number of occurrences (`count`) and (estimated, within a few percent) number
+of distinct values (`distinct`). `attribute_count` is the total number.
+- `entities`: the number of entity and character references (in text and
+attribute values, not in CDATA sections), and `entity_density`: the number of
+them per 1000 bytes of input
+- `largest`: the largest subtree below the root element, a table with its
+`tag`, source `offset` (0-based), size in `bytes`, number of `elements`
+(including itself) and `depth`. (`nil` if the root has no subelements.)
+
+@function profile
+@tparam string input  the name of the input file, or an XML string. (Files
+get decompressed as with `load`.)
+@tparam ?table options  `mode` is the whitespace handling mode (see `eval`)
+@treturn table  the statistics
+@usage
+local p = xml.profile("feed.xml.gz")
+print(p.elements, p.max_depth, p.tags.item, p.attributes.id.distinct)
+print(p.largest.tag, p.largest.bytes)
 */
-int Xml_decode(lua_State *L) {
+int Xml_profile(lua_State *L) {
 	size_t size;
-	luaL_checklstring(L, 1, &size); // make sure arg #1 is a string
-	Xml_pushDecode(L, lua_tostring(L, 1), size); // and convert it
+	const char *input = luaL_checklstring(L, 1, &size);
+	if (!lua_isnoneornil(L, 2)) luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+	int mode = WHITESPACE_TRIM;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "mode");
+		mode = luaL_optint(L, -1, WHITESPACE_TRIM);
+		lua_pop(L, 1);
+	}
+	ProfileNames tags, attributes;
+	profile_init(L, &tags);
+	profile_init(L, &attributes);
+	Buffer *frames = Buffer_push(L);
+	bool is_file = !memchr(input, '<', size);
+	Tokenizer *tok = Xml_tokenizer(L, input, size, is_file ? input : NULL,
+		mode, ENCODING_AUTO, COMPRESSION_AUTO);
+
+	uint64_t elements = 0, depths = 0, text = 0, entities = 0, attrs = 0;
+	size_t depth = 0, max_depth = 0, bytes = 0;
+	ProfileFrame largest = {0, 0, 0, 0};
+	size_t largest_bytes = 0, largest_depth = 0;
+	uint64_t largest_elements = 0;
+	const char *token;
+	while ((token = Tokenizer_next(tok))) {
+		if (*token == OPN) {
+			size_t start = Tokenizer_pos(tok) - 1; // (the tokenizer is past the '<')
+			if (!(token = Tokenizer_next(tok))) break;
+			ProfileName *tag = profile_name(L, &tags, token, tok->m_token_size, false);
+			tag->count++;
+			ProfileFrame frame = {start, tag->name, tag->len, elements};
+			elements++;
+			depths += ++depth;
+			if (depth > max_depth) max_depth = depth;
+			Buffer_add(L, frames, (const char *)&frame, sizeof(frame));
+			while ((token = Tokenizer_next(tok)) && *token != CLS && *token != ESC) {
+				size_t sepPos = find(token, tok->m_token_size, "=", 0);
+				if (sepPos == 0 || sepPos + 3 > tok->m_token_size) continue;
+				ProfileName *attr = profile_name(L, &attributes, token, sepPos, true);
+				attr->count++;
+				attrs++;
+				const char *value = token + sepPos + 2;
+				size_t len = tok->m_token_size - sepPos - 3;
+				profile_sketch_add((unsigned char *)attributes.sketches->data
+					+ attr->hll, hash_string(value, len));
+				entities += profile_entities(value, len);
+			}
+			if (token && *token == CLS) continue;
+			// (an empty element, or the end of input)
+		}
+		else if (*token != ESC) {
+			if (depth > 0 && (tok->mode != WHITESPACE_NORMALIZE
+				|| !is_lead_token(token)))
+			{
+				text += tok->m_token_size;
+				if (!tok->cdata) entities += profile_entities(token, tok->m_token_size);
+			}
+			continue;
+		}
+		if (depth == 0) continue;
+		// close the innermost element
+		ProfileFrame *frame = (ProfileFrame *)frames->data + --depth;
+		frames->size = depth * sizeof(ProfileFrame);
+		size_t end = Tokenizer_pos(tok);
+		if (depth > 0 && end - frame->start > largest_bytes) {
+			largest = *frame;
+			largest_bytes = end - frame->start;
+			largest_elements = elements - frame->elements;
+			largest_depth = depth + 1;
+		}
+		if (depth == 0) {
+			bytes = end;
+			break;
+		}
+	}
+	if (depth > 0) bytes = Tokenizer_pos(tok); // (incomplete input)
+	Xml_checkRead(L, tok);
+	Tokenizer_delete(tok);
+
+	lua_createtable(L, 0, 16);
+	profile_setinteger(L, "bytes", bytes);
+	profile_setinteger(L, "text_bytes", text);
+	profile_setinteger(L, "markup_bytes", bytes > text ? bytes - text : 0);
+	profile_setnumber(L, "text_ratio", bytes ? (double)text / bytes : 0);
+	profile_setinteger(L, "elements", elements);
+	profile_setinteger(L, "max_depth", max_depth);
+	profile_setnumber(L, "avg_depth", elements ? (double)depths / elements : 0);
+	profile_setinteger(L, "attribute_count", attrs);
+	profile_setinteger(L, "entities", entities);
+	profile_setnumber(L, "entity_density", bytes ? 1000.0 * entities / bytes : 0);
+
+	size_t i;
+	ProfileName *slot = (ProfileName *)tags.slots->data;
+	lua_createtable(L, 0, tags.count);
+	for (i = 0; i <= tags.mask; i++)
+		if (slot[i].len) {
+			lua_pushlstring(L, tags.names->data + slot[i].name, slot[i].len);
+			lua_pushinteger(L, (lua_Integer)slot[i].count);
+			lua_rawset(L, -3);
+		}
+	lua_setfield(L, -2, "tags");
+	slot = (ProfileName *)attributes.slots->data;
+	lua_createtable(L, 0, attributes.count);
+	for (i = 0; i <= attributes.mask; i++)
+		if (slot[i].len) {
+			lua_pushlstring(L, attributes.names->data + slot[i].name, slot[i].len);
+			lua_createtable(L, 0, 2);
+			profile_setinteger(L, "count", slot[i].count);
+			double distinct = profile_sketch_estimate((unsigned char *)
+				attributes.sketches->data + slot[i].hll);
+			// (the estimate can't exceed the number of values)
+			profile_setinteger(L, "distinct", distinct < slot[i].count
+				? (uint64_t)distinct : slot[i].count);
+			lua_rawset(L, -3);
+		}
+	lua_setfield(L, -2, "attributes");
+	if (largest_bytes > 0) {
+		lua_createtable(L, 0, 5);
+		lua_pushlstring(L, tags.names->data + largest.name, largest.len);
+		lua_setfield(L, -2, "tag");
+		profile_setinteger(L, "offset", largest.start);
+		profile_setinteger(L, "bytes", largest_bytes);
+		profile_setinteger(L, "elements", largest_elements);
+		profile_setinteger(L, "depth", largest_depth);
+		lua_setfield(L, -2, "largest");
+	}
 	return 1;
 }
 
-/** converts any Lua value to an XML string.
-@function str
+/*
+ * Snapshots are binary images of LuaXML trees, that can be memory-mapped
+ * (read-only) by many processes at once. The image consists of a header,
+ * followed by records aligned to 8 bytes. Values are referenced by 64-bit
+ * "refs": the offset of their record within the image, with the kind of
+ * value in the lower 3 bits. (Booleans keep their value in the upper bits.)
+ *
+ *	header:   "LuaXMLs1", uint32 byte order mark, uint32 version,
+ *	          uint64 image size, uint64 root ref
+ *	element:  uint32 attribute count, uint32 subelement count, uint64 tag ref,
+ *	          pairs of (name ref, value ref) for each attribute,
+ *	          refs for each subelement
+ *	string:   uint32 length, bytes, NUL
+ *	number:   double or int64
+ */
+#define LUAXML_SNAPSHOT	"LuaXML_Snapshot" // metatable for mapped snapshots
+#define LUAXML_PROXY	"LuaXML_Proxy" // metatable for snapshot elements
 
-@param value
-the value to be converted, normally a table (LuaXML object). However this
-function will 'encapsulate' other Lua values (of arbitrary type) in a way that
-should make them valid XML.
-<br>Note: Passing no `value` will cause the function to return `nil`.
+#define SNAPSHOT_MAGIC	"LuaXMLs1"
+#define SNAPSHOT_BOM	0x01020304 // (images are in native byte order)
+#define SNAPSHOT_HEADER	32
 
-@tparam ?number indent
-indentation level for 'pretty' output. Mainly for internal use, defaults to 0.
+enum {SNAP_ELEMENT, SNAP_STRING, SNAP_FLOAT, SNAP_INTEGER, SNAP_BOOLEAN, SNAP_NIL};
 
-@tparam ?string tag
-the tag to be used in case `value` doesn't already have an 'implicit' tag.
-Mainly for internal use.
+// pad the buffer (with zeros) to a multiple of 8 bytes
+static void snapshot_align(lua_State *L, Buffer *buf) {
+	while (buf->size & 7) Buffer_addchar(L, buf, 0);
+}
 
-@treturn string
-an XML string, or `nil` in case of errors.
+static void snapshot_set(Buffer *buf, size_t pos, uint64_t value) {
+	memcpy(buf->data + pos, &value, 8);
+}
+
+// add the string at stack index `index` (once), returns its ref
+static uint64_t snapshot_addstring(lua_State *L, Buffer *buf, int strings, int index) {
+	lua_pushvalue(L, index);
+	lua_rawget(L, strings);
+	uint64_t ref = (uint64_t)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	if (ref) return ref;
+
+	size_t len;
+	const char *s = lua_tolstring(L, index, &len);
+	if (len > UINT32_MAX) luaL_error(L, "LuaXML ERROR: string too long for snapshot");
+	snapshot_align(L, buf);
+	ref = buf->size | SNAP_STRING;
+	uint32_t len32 = len;
+	Buffer_add(L, buf, (const char *)&len32, 4);
+	Buffer_add(L, buf, s, len);
+	Buffer_addchar(L, buf, 0);
+	lua_pushvalue(L, index);
+	lua_pushnumber(L, ref);
+	lua_rawset(L, strings);
+	return ref;
+}
+
+/*
+ * Add the value at stack index `index`, returning its ref. For tables, this
+ * only reserves the (zero-filled) record, and appends the table to `pending`
+ * - its content gets written by snapshot_fill() later. Tables and strings
+ * are written only once, even if they occur repeatedly.
+ */
+static uint64_t snapshot_addvalue(lua_State *L, Buffer *buf, int refs, int pending,
+		int index)
+{
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	uint64_t ref;
+	switch (lua_type(L, index)) {
+	case LUA_TNIL:
+		return SNAP_NIL;
+	case LUA_TBOOLEAN:
+		return (uint64_t)lua_toboolean(L, index) << 3 | SNAP_BOOLEAN;
+	case LUA_TSTRING:
+		return snapshot_addstring(L, buf, refs, index);
+	case LUA_TNUMBER:
+		snapshot_align(L, buf);
+		ref = buf->size;
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, index)) {
+			int64_t i = lua_tointeger(L, index);
+			Buffer_add(L, buf, (const char *)&i, 8);
+			return ref | SNAP_INTEGER;
+		}
+#endif
+		{
+			double d = lua_tonumber(L, index);
+			Buffer_add(L, buf, (const char *)&d, 8);
+		}
+		return ref | SNAP_FLOAT;
+	case LUA_TTABLE:
+		lua_pushvalue(L, index);
+		lua_rawget(L, refs);
+		ref = (uint64_t)lua_tonumber(L, -1);
+		lua_pop(L, 1);
+		if (ref) return ref;
+		{
+			uint32_t count[2] = {0, lua_rawlen(L, index)};
+			lua_pushnil(L);
+			while (lua_next(L, index)) {
+				if (lua_type(L, -2) == LUA_TSTRING) count[0]++; // attribute
+				lua_pop(L, 1);
+			}
+			snapshot_align(L, buf);
+			ref = buf->size | SNAP_ELEMENT;
+			size_t size = 16 + 16 * (size_t)count[0] + 8 * (size_t)count[1];
+			Buffer_reserve(L, buf, size);
+			memset(buf->data + buf->size, 0, size);
+			memcpy(buf->data + buf->size, count, 8);
+			buf->size += size;
+		}
+		lua_pushvalue(L, index);
+		lua_pushnumber(L, ref);
+		lua_rawset(L, refs);
+		lua_pushvalue(L, index);
+		lua_rawseti(L, pending, lua_rawlen(L, pending) + 1);
+		return ref;
+	default:
+		return luaL_error(L, "LuaXML ERROR: can't snapshot %s values",
+			luaL_typename(L, index));
+	}
+}
+
+// write the content of the table at `index` (a pending one) into its record
+static void snapshot_fill(lua_State *L, Buffer *buf, int refs, int pending, int index) {
+	lua_pushvalue(L, index);
+	lua_rawget(L, refs);
+	size_t pos = (size_t)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	uint32_t count[2];
+	memcpy(count, buf->data + pos, 8);
+
+	push_TAG_key(L);
+	lua_rawget(L, index);
+	if (lua_type(L, -1) == LUA_TSTRING)
+		snapshot_set(buf, pos + 8, snapshot_addstring(L, buf, refs, -1));
+	lua_pop(L, 1);
+
+	size_t slot = pos + 16;
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			uint64_t name = snapshot_addstring(L, buf, refs, -2);
+			uint64_t value = snapshot_addvalue(L, buf, refs, pending, -1);
+			snapshot_set(buf, slot, name);
+			snapshot_set(buf, slot + 8, value);
+			slot += 16;
+		}
+		lua_pop(L, 1);
+	}
+	uint32_t i;
+	for (i = 1; i <= count[1]; i++) {
+		lua_rawgeti(L, index, i);
+		snapshot_set(buf, slot, snapshot_addvalue(L, buf, refs, pending, -1));
+		slot += 8;
+		lua_pop(L, 1);
+	}
+}
+
+/** writes a LuaXML object as snapshot file.
+A snapshot is a binary image of the XML tree, that other processes can
+`attach` to (memory-mapping the file read-only). This way, all of them share
+the same (physical) copy, and loading is instantaneous. The image can only be
+used on machines with the same byte order.
+
+Apart from tags, attributes and subelements, snapshots support string,
+number and boolean values. Tables that occur repeatedly (or recursively)
+get stored only once.
+
+@function snapshot
+@param var  the LuaXML object to be saved - or the name of an XML file, that
+gets `load`ed first
+@tparam string path  the name of the snapshot file to be written
+@treturn number  the size of the snapshot
 */
-int Xml_str(lua_State *L) {
-	// Note:
-	// Be very careful about mixing Lua stack usage and buffer access here.
-	// The stack *must* be (re)balanced before accessing "b", i.e. any output
-	// should only occur at the same Lua stack level as the previous one!
-	luaL_Buffer b;
+int Xml_snapshot(lua_State *L) {
+	const char *path = luaL_checkstring(L, 2);
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		lua_pushcfunction(L, Xml_load);
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 1);
+		lua_replace(L, 1);
+	}
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 2);
+	Buffer *buf = Buffer_push(L); // #3
+	lua_newtable(L); // #4, the refs of tables and strings
+	lua_newtable(L); // #5, pending tables
+
+	Buffer_reserve(L, buf, SNAPSHOT_HEADER);
+	memset(buf->data, 0, SNAPSHOT_HEADER);
+	memcpy(buf->data, SNAPSHOT_MAGIC, 8);
+	uint32_t header[2] = {SNAPSHOT_BOM, 1};
+	memcpy(buf->data + 8, header, 8);
+	buf->size = SNAPSHOT_HEADER;
+	snapshot_set(buf, 24, snapshot_addvalue(L, buf, 4, 5, 1));
+	int n;
+	while ((n = lua_rawlen(L, 5)) > 0) {
+		lua_rawgeti(L, 5, n);
+		lua_pushnil(L);
+		lua_rawseti(L, 5, n);
+		snapshot_fill(L, buf, 4, 5, 6);
+		lua_pop(L, 1);
+	}
+	snapshot_set(buf, 16, buf->size);
 
-	lua_settop(L, 3);
-	int type = lua_type(L, 1); // type of "value"
-	if (type == LUA_TNIL) return 0;
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return luaL_error(L, "LuaXML ERROR: \"%s\" file error!", path);
+	size_t written = fwrite(buf->data, 1, buf->size, file);
+	if (fclose(file) != 0 || written != buf->size)
+		return luaL_error(L, "LuaXML ERROR: error writing \"%s\"", path);
+	lua_pushinteger(L, buf->size);
+	return 1;
+}
 
-	if (type == LUA_TTABLE) {
-		push_TAG_key(L);
-		lua_rawget(L, 1); // retrieve tag entry from the table (may be `nil`)
+// a mapped snapshot
+typedef struct {
+	const char *data;
+	size_t size;
+	int mapped; // (otherwise `data` was malloc'ed)
+} Snapshot;
+
+// a snapshot element, its user value is a table {snapshot, proxy cache}
+typedef struct {
+	Snapshot *snapshot;
+	uint64_t offset;
+} Proxy;
+
+static int Snapshot_gc(lua_State *L) {
+	Snapshot *snap = lua_touserdata(L, 1);
+	if (snap->data) {
+#ifndef _WIN32
+		if (snap->mapped)
+			munmap((void *)snap->data, snap->size);
+		else
+#endif
+			free((void *)snap->data);
+	}
+	snap->data = NULL;
+	return 0;
+}
+
+// get a pointer to `size` bytes at `offset`, checking that they're valid
+static const char *snapshot_ptr(lua_State *L, Snapshot *snap, uint64_t offset,
+		uint64_t size)
+{
+	if (!snap->data || offset > snap->size || size > snap->size - offset)
+		luaL_error(L, "LuaXML ERROR: invalid snapshot data");
+	return snap->data + offset;
+}
 
-		// order of precedence: value[0], explicit tag string, Lua type name
-		const char *tag = lua_tostring(L, -1);
-		if (!tag) tag = lua_tostring(L, 3);
-		if (!tag) tag = lua_typename(L, type);
+static uint64_t snapshot_get(lua_State *L, Snapshot *snap, uint64_t offset) {
+	uint64_t value;
+	memcpy(&value, snapshot_ptr(L, snap, offset, 8), 8);
+	return value;
+}
 
-		// Four elements already on stack: value, indent, tag, value[0]
-		// Use a string (#5) to manage (concatenate) simple attributes
-		lua_pushliteral(L, "");
-		// And a table (#6) to take care of (collect) 'extended' attributes
-		lua_newtable(L);
-		size_t table_attr = 0;
+// get the attribute and subelement counts of the element at `offset`
+static void snapshot_counts(lua_State *L, Snapshot *snap, uint64_t offset,
+		uint32_t *count)
+{
+	memcpy(count, snapshot_ptr(L, snap, offset, 16), 8);
+	snapshot_ptr(L, snap, offset, 16 + 16 * (uint64_t)count[0] + 8 * (uint64_t)count[1]);
+}
+
+// get the string with the given ref (`len` may be NULL)
+static const char *snapshot_string(lua_State *L, Snapshot *snap, uint64_t ref,
+		uint32_t *len)
+{
+	uint64_t offset = ref & ~(uint64_t)7;
+	if ((ref & 7) != SNAP_STRING)
+		luaL_error(L, "LuaXML ERROR: invalid snapshot data");
+	uint32_t size;
+	memcpy(&size, snapshot_ptr(L, snap, offset, 4), 4);
+	if (len) *len = size;
+	return snapshot_ptr(L, snap, offset + 4, size);
+}
+
+// push the proxy for the element at `offset`, `env` is the proxy user value
+static void snapshot_pushproxy(lua_State *L, int env, uint64_t offset) {
+	lua_rawgeti(L, env, 2); // cache
+	lua_rawgeti(L, -1, (lua_Integer)offset);
+	if (lua_isnil(L, -1)) {
+		lua_pop(L, 1);
+		Proxy *proxy = lua_newuserdata(L, sizeof(Proxy));
+		lua_rawgeti(L, env, 1);
+		proxy->snapshot = lua_touserdata(L, -1);
+		proxy->offset = offset;
+		lua_pop(L, 1);
+		luaL_getmetatable(L, LUAXML_PROXY);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, env);
+		lua_setuservalue(L, -2);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, (lua_Integer)offset);
+	}
+	lua_remove(L, -2);
+}
 
-		luaL_buffinit(L, &b);
-		push_indentStr(L, lua_tointeger(L, 2));
-		luaL_addvalue(&b);
-		luaL_addchar(&b, '<');
-		luaL_addstring(&b, tag);
+// push the value with the given ref
+static void snapshot_pushvalue(lua_State *L, Snapshot *snap, int env, uint64_t ref) {
+	uint64_t offset = ref & ~(uint64_t)7;
+	uint32_t len;
+	const char *s;
+	switch (ref & 7) {
+	case SNAP_ELEMENT:
+		snapshot_pushproxy(L, env, offset);
+		break;
+	case SNAP_STRING:
+		s = snapshot_string(L, snap, ref, &len);
+		lua_pushlstring(L, s, len);
+		break;
+	case SNAP_FLOAT: {
+		double d;
+		memcpy(&d, snapshot_ptr(L, snap, offset, 8), 8);
+		lua_pushnumber(L, d);
+		break;
+	}
+	case SNAP_INTEGER: {
+		int64_t i;
+		memcpy(&i, snapshot_ptr(L, snap, offset, 8), 8);
+		lua_pushinteger(L, (lua_Integer)i);
+		break;
+	}
+	case SNAP_BOOLEAN:
+		lua_pushboolean(L, ref >> 3);
+		break;
+	default:
+		lua_pushnil(L);
+	}
+}
+
+// find the attribute `name` of the element at `offset`, returns its ref
+// (or SNAP_NIL if there's no such attribute)
+static uint64_t snapshot_attribute(lua_State *L, Snapshot *snap, uint64_t offset,
+		const char *name, size_t len)
+{
+	uint32_t count[2], i;
+	snapshot_counts(L, snap, offset, count);
+	for (i = 0; i < count[0]; i++) {
+		uint32_t size;
+		const char *s = snapshot_string(L, snap,
+			snapshot_get(L, snap, offset + 16 + 16 * (uint64_t)i), &size);
+		if (size == len && memcmp(s, name, len) == 0)
+			return snapshot_get(L, snap, offset + 24 + 16 * (uint64_t)i);
+	}
+	return SNAP_NIL;
+}
 
-		// Iterate over string keys (= attributes)
+/*
+ * Convert the proxy at stack index `index` to a LuaXML object (pushed onto
+ * the stack), up to the given depth - deeper elements remain proxies. This
+ * works iteratively, like push_clone(). Elements that occur repeatedly get
+ * converted only once (so cycles are preserved).
+ */
+static void proxy_totable(lua_State *L, int index, int maxdepth) {
+	Proxy *proxy = luaL_checkudata(L, index, LUAXML_PROXY);
+	Snapshot *snap = proxy->snapshot;
+	lua_getuservalue(L, index);
+	int env = lua_gettop(L);
+	lua_newtable(L); // pending pairs of (table, offset)
+	int pending = env + 1;
+	lua_newtable(L);
+	int result = lua_gettop(L);
+	lua_pushvalue(L, result);
+	lua_rawseti(L, pending, 1);
+	lua_pushnumber(L, proxy->offset);
+	lua_rawseti(L, pending, 2);
+	lua_newtable(L); // depths of pending tables
+	int depths = lua_gettop(L);
+	lua_pushvalue(L, result);
+	lua_pushinteger(L, 0);
+	lua_rawset(L, depths);
+	lua_newtable(L); // tables for offsets, to keep shared elements shared
+	int converted = lua_gettop(L);
+	lua_pushnumber(L, proxy->offset);
+	lua_pushvalue(L, result);
+	lua_rawset(L, converted);
+
+	int n;
+	while ((n = lua_rawlen(L, pending)) > 0) {
+		lua_rawgeti(L, pending, n - 1);
+		int table = lua_gettop(L);
+		lua_rawgeti(L, pending, n);
+		uint64_t offset = (uint64_t)lua_tonumber(L, -1);
+		lua_pop(L, 1);
 		lua_pushnil(L);
-		while (lua_next(L, 1)) {
-			// (k, v) pair on the stack
-			if (lua_type(L, -2) == LUA_TSTRING) {
-				// (the "_M" test here is to avoid recursion on module tables)
-				if (lua_istable(L, -1) && strcmp(lua_tostring(L, -2), "_M")) {
-					lua_pushcfunction(L, Xml_str);
-					lua_pushvalue(L, -2); // duplicate "v"
-					lua_pushinteger(L, lua_tointeger(L, 2) + 1); // indent + 1
-					lua_pushvalue(L, -4); // duplicate "k"
-					lua_call(L, 3, 1); // xml.str(v, indent + 1, k)
-					lua_rawseti(L, 6, ++table_attr); // append string to table
-				} else {
-					Xml_pushEncode(L, -1); // encode(tostring(v))
-					lua_pushfstring(L, "%s %s=\"%s\"", lua_tostring(L, 5),
-						lua_tostring(L, -3), lua_tostring(L, -1));
-					lua_replace(L, 5); // new attribute string
-					lua_pop(L, 1); // realign stack
-				}
-			}
-			lua_pop(L, 1); // pop <v>alue, leaving <k>ey for next iteration
-		}
-		// append "simple" attribute string to the output
-		if (lua_rawlen(L, 5) > 0) luaL_addstring(&b, lua_tostring(L, 5));
-
-		size_t count = lua_rawlen(L, 1); // number of "array" (sub)elements
-		if (count == 0 && table_attr == 0) {
-			// no sub-elements and no extended attr -> close tag and we're done
-			luaL_addlstring(&b, " />\n", 4);
-			luaL_pushresult(&b);
-			return 1;
+		lua_rawseti(L, pending, n);
+		lua_pushnil(L);
+		lua_rawseti(L, pending, n - 1);
+		lua_pushvalue(L, table);
+		lua_rawget(L, depths);
+		int depth = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+
+		uint32_t count[2], i;
+		snapshot_counts(L, snap, offset, count);
+		make_xml_object(L, table);
+		uint64_t tag = snapshot_get(L, snap, offset + 8);
+		if (tag) {
+			snapshot_pushvalue(L, snap, env, tag);
+			lua_rawseti(L, table, 0);
 		}
-		luaL_addchar(&b, '>'); // close opening tag
-		if (count == 1 && table_attr == 0) {
-			// single subelement, no extended attributes
-			lua_rawgeti(L, 1, 1); // value[1]
-			if (!lua_istable(L, -1)) {
-				// output as single string, then close tag
-				Xml_pushEncode(L, -1); // encode(tostring(value[1]))
-				lua_replace(L, -2);
-				luaL_addvalue(&b); // add and pop
-				luaL_addlstring(&b, "</", 2);
-				luaL_addstring(&b, tag);
-				luaL_addlstring(&b, ">\n", 2);
-				luaL_pushresult(&b);
-				return 1;
-			}
-			lua_pop(L, 1); // discard (table) value, to realign stack
+		uint64_t slot = offset + 16;
+		for (i = 0; i < count[0]; i++, slot += 16) {
+			snapshot_pushvalue(L, snap, env, snapshot_get(L, snap, slot));
+			snapshot_pushvalue(L, snap, env, snapshot_get(L, snap, slot + 8));
+			lua_rawset(L, table);
 		}
-		luaL_addchar(&b, '\n');
-
-		// Loop over all the sub-elements, placing each on a separate line
-		size_t k;
-		for (k = 1; k <= count; k++) {
-#if LUA_VERSION_NUM < 503
-			lua_rawgeti(L, 1, k);
-			type = lua_type(L, -1);
-#else
-			type = lua_rawgeti(L, 1, k); // (Lua 5.3 returns type directly)
-#endif
-			if (type == LUA_TSTRING) {
-				push_indentStr(L, lua_tointeger(L, 2) + 1); // indentation
-				Xml_pushEncode(L, -2);
-				lua_remove(L, -3);
-				lua_pushliteral(L, "\n");
-				lua_concat(L, 3);
-			} else {
-				lua_pushcfunction(L, Xml_str);
-				lua_insert(L, -2); // place function before value
-				lua_pushinteger(L, lua_tointeger(L, 2) + 1); // indent + 1
-				lua_call(L, 2, 1); // xml.str(v, indent + 1)
-			}
-			luaL_addvalue(&b); // add (string) to output, pop from stack
+		for (i = 1; i <= count[1]; i++, slot += 8) {
+			uint64_t ref = snapshot_get(L, snap, slot);
+			if ((ref & 7) == SNAP_ELEMENT && (maxdepth < 0 || depth < maxdepth)) {
+				lua_pushnumber(L, ref);
+				lua_rawget(L, converted);
+				if (lua_isnil(L, -1)) {
+					lua_pop(L, 1);
+					lua_newtable(L);
+					lua_pushnumber(L, ref);
+					lua_pushvalue(L, -2);
+					lua_rawset(L, converted);
+					lua_pushvalue(L, -1);
+					lua_rawseti(L, pending, lua_rawlen(L, pending) + 1);
+					lua_pushnumber(L, ref);
+					lua_rawseti(L, pending, lua_rawlen(L, pending) + 1);
+					lua_pushvalue(L, -1);
+					lua_pushinteger(L, depth + 1);
+					lua_rawset(L, depths);
+				}
+			} else
+				snapshot_pushvalue(L, snap, env, ref);
+			lua_rawseti(L, table, i);
 		}
+		lua_settop(L, converted);
+	}
+	lua_pushvalue(L, result);
+	lua_replace(L, env);
+	lua_settop(L, env);
+}
 
-		// Finally we'll take care of the "extended" (table-type) attributes.
-		// The output is appended after the regular sub-elements, in order
-		// not to affect their numbering.
-		// Just process the corresponding table, concatenating all entries:
-		for (k = 1; k <= table_attr; k++) {
-			lua_rawgeti(L, 6, k);
-			luaL_addvalue(&b);
-		}
+// proxy:totable([maxdepth])
+static int Proxy_totable(lua_State *L) {
+	proxy_totable(L, 1, luaL_optint(L, 2, -1));
+	return 1;
+}
 
-		// closing tag
-		push_indentStr(L, lua_tointeger(L, 2));
-		luaL_addvalue(&b);
-		luaL_addlstring(&b, "</", 2);
-		luaL_addstring(&b, tag);
-		luaL_addlstring(&b, ">\n", 2);
+// tests if the value at given index is a proxy
+static bool is_proxy(lua_State *L, int index) {
+	if (lua_type(L, index) != LUA_TUSERDATA || !lua_getmetatable(L, index))
+		return false;
+	luaL_getmetatable(L, LUAXML_PROXY);
+	bool result = lua_rawequal(L, -1, -2);
+	lua_pop(L, 2);
+	return result;
+}
 
-		luaL_pushresult(&b);
-		return 1;
+// Replace the key on top of the stack with the value of the proxy at stack
+// index `index` for it, like lua_rawget() does for tables: the tag (key 0),
+// subelements (1 .. n) or attributes (string keys). Methods don't count.
+static void proxy_rawget(lua_State *L, int index) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	Proxy *proxy = luaL_checkudata(L, index, LUAXML_PROXY);
+	uint64_t ref = SNAP_NIL;
+	if (lua_type(L, -1) == LUA_TNUMBER) {
+		lua_Number n = lua_tonumber(L, -1);
+		uint32_t count[2];
+		snapshot_counts(L, proxy->snapshot, proxy->offset, count);
+		if (n == 0)
+			ref = snapshot_get(L, proxy->snapshot, proxy->offset + 8);
+		else if (n >= 1 && n <= count[1] && n == (uint32_t)n)
+			ref = snapshot_get(L, proxy->snapshot, proxy->offset + 16
+				+ 16 * (uint64_t)count[0] + 8 * (uint64_t)(n - 1));
+	} else if (lua_type(L, -1) == LUA_TSTRING) {
+		size_t len;
+		const char *name = lua_tolstring(L, -1, &len);
+		ref = snapshot_attribute(L, proxy->snapshot, proxy->offset, name, len);
+	}
+	lua_pop(L, 1);
+	if (ref == 0) { // (no tag)
+		lua_pushnil(L);
+		return;
 	}
+	lua_getuservalue(L, index);
+	snapshot_pushvalue(L, proxy->snapshot, lua_gettop(L), ref);
+	lua_remove(L, -2);
+}
 
-	// Getting here means a "flat" Lua value, format to XML as a single string
-	const char *tag = lua_tostring(L, 3);
-	if (!tag) tag = lua_typename(L, type); // use either tag or the type name
-	luaL_buffinit(L, &b);
-	push_indentStr(L, lua_tointeger(L, 2));
-	luaL_addvalue(&b);
-	luaL_addchar(&b, '<');
-	luaL_addstring(&b, tag);
-	luaL_addchar(&b, '>');
-
-	Xml_pushEncode(L, 1); // encode(tostring(value))
-	luaL_addvalue(&b);
-
-	luaL_addlstring(&b, "</", 2);
-	luaL_addstring(&b, tag);
-	luaL_addlstring(&b, ">\n", 2);
-	luaL_pushresult(&b);
+static int Proxy_index(lua_State *L) {
+	lua_settop(L, 2);
+	lua_pushvalue(L, 2);
+	proxy_rawget(L, 1);
+	if (lua_isnil(L, -1) && lua_type(L, 2) == LUA_TSTRING) { // methods
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+	}
 	return 1;
 }
 
-/** match XML entity against given (optional) criteria.
-Passing `nil` for one of the` tag`, `key`, or `value` parameters means "don't
-care" (i.e. match anything for that particular aspect). So for example
-	var:match(nil, "text", nil)
-	-- or shorter, but identical:  var:match(nil, "text")
-will look for an XML attribute (name) "text" to be present in `var`, but won't
-consider its value or the tag of `var`.
+static int Proxy_newindex(lua_State *L) {
+	return luaL_error(L, "LuaXML ERROR: snapshot elements are read-only");
+}
 
-Note: If you want to test for a specific attribute `value`, so also have to
-supply a `key` - otherwise `value` will be ignored.
+static int Proxy_len(lua_State *L) {
+	Proxy *proxy = luaL_checkudata(L, 1, LUAXML_PROXY);
+	uint32_t count[2];
+	snapshot_counts(L, proxy->snapshot, proxy->offset, count);
+	lua_pushinteger(L, count[1]);
+	return 1;
+}
 
-@usage
--- each of these will either return `x`, or `nil` in case of no match
+static int Proxy_tostring(lua_State *L) {
+	lua_pushcfunction(L, Xml_str);
+	proxy_totable(L, 1, -1);
+	lua_call(L, 1, 1);
+	return 1;
+}
 
-x:match("foo") -- test for x:tag() == "foo"
-x:match(nil, "bar") -- test if x has a "bar" attribute
-x:match(nil, "foo", "bar") -- test if x has a "foo" attribute that equals "bar"
-x:match("foobar", "foo", "bar") -- test for "foobar" tag, and attr "foo" == "bar"
+// iterator for pairs(): the tag (key 0), subelements, then attributes
+static int Proxy_next(lua_State *L) {
+	Proxy *proxy = luaL_checkudata(L, 1, LUAXML_PROXY);
+	Snapshot *snap = proxy->snapshot;
+	lua_settop(L, 2);
+	lua_getuservalue(L, 1); // #3
+	uint32_t count[2], i = 0;
+	snapshot_counts(L, snap, proxy->offset, count);
+	uint64_t attrs = proxy->offset + 16;
+	if (lua_isnil(L, 2)) {
+		uint64_t tag = snapshot_get(L, snap, proxy->offset + 8);
+		if (tag) {
+			lua_pushinteger(L, 0);
+			snapshot_pushvalue(L, snap, 3, tag);
+			return 2;
+		}
+	} else if (lua_type(L, 2) == LUA_TNUMBER) {
+		lua_Number n = lua_tonumber(L, 2);
+		if (n < count[1]) {
+			lua_pushinteger(L, (lua_Integer)n + 1);
+			snapshot_pushvalue(L, snap, 3, snapshot_get(L, snap,
+				attrs + 16 * (uint64_t)count[0] + 8 * (uint64_t)n));
+			return 2;
+		}
+	} else {
+		// continue after the current attribute
+		size_t len;
+		const char *name = luaL_checklstring(L, 2, &len);
+		while (i < count[0]) {
+			uint32_t size;
+			const char *s = snapshot_string(L, snap,
+				snapshot_get(L, snap, attrs + 16 * (uint64_t)i++), &size);
+			if (size == len && memcmp(s, name, len) == 0) break;
+		}
+	}
+	if (lua_isnil(L, 2) && count[1] > 0) {
+		lua_pushinteger(L, 1);
+		snapshot_pushvalue(L, snap, 3, snapshot_get(L, snap,
+			attrs + 16 * (uint64_t)count[0]));
+		return 2;
+	}
+	if (i < count[0]) {
+		snapshot_pushvalue(L, snap, 3, snapshot_get(L, snap, attrs + 16 * (uint64_t)i));
+		snapshot_pushvalue(L, snap, 3, snapshot_get(L, snap, attrs + 16 * (uint64_t)i + 8));
+		return 2;
+	}
+	lua_pushnil(L);
+	return 1;
+}
 
-@function match
+static int Proxy_pairs(lua_State *L) {
+	luaL_checkudata(L, 1, LUAXML_PROXY);
+	lua_pushcfunction(L, Proxy_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
 
-@param var
-the variable to test, normally a Lua table or LuaXML object. (If `var` is not
-a table type, the test always fails.)
+/** attaches to a snapshot file.
+This maps the file (read-only) into memory, and returns a proxy for the root
+element. Proxies behave like read-only LuaXML objects: `proxy[0]` is the tag,
+`proxy[i]` the subelements (which are proxies themselves, or strings), other
+keys the attributes. `#proxy`, `ipairs` and `pairs` work as usual (the latter
+two on Lua 5.2+). Data gets read from the mapping only when accessed, so
+attaching takes virtually no time, and processes attached to the same file
+share its memory (the page cache).
+
+The read-only functions `tag`, `match`, `find`, `iterate`, `children` and
+`str` accept proxies (and are available as methods of them). Matched elements
+are proxies as well. To use other LuaXML functions, convert a proxy to a
+LuaXML object first: `proxy:totable([maxdepth])` returns a copy of the element,
+with subelements up to `maxdepth` levels converted too (default: all), deeper
+ones remain proxies.
+
+(On Windows, the file gets read into memory instead of being mapped.)
+
+@function attach
+@tparam string path  the name of the snapshot file, see `snapshot`
+@return  a proxy for the root element
+@usage
+-- in the parent process
+xml.snapshot("catalog.xml", "catalog.snapshot")
+-- in each of the worker processes
+local catalog = xml.attach("catalog.snapshot")
+for _, item in ipairs(catalog) do print(item.id) end
+*/
+int Xml_attach(lua_State *L) {
+	const char *path = luaL_checkstring(L, 1);
+	lua_settop(L, 1);
+	Snapshot *snap = lua_newuserdata(L, sizeof(Snapshot)); // #2
+	memset(snap, 0, sizeof(Snapshot));
+	luaL_getmetatable(L, LUAXML_SNAPSHOT);
+	lua_setmetatable(L, 2);
+
+	const char *error = NULL;
+#ifdef _WIN32
+	FILE *file = fopen(path, "rb");
+	if (file) {
+		fseek(file, 0, SEEK_END);
+		long size = ftell(file);
+		rewind(file);
+		char *data = size > 0 ? malloc(size) : NULL;
+		if (data && fread(data, 1, size, file) == (size_t)size) {
+			snap->data = data;
+			snap->size = size;
+		} else {
+			free(data);
+			error = "read error";
+		}
+		fclose(file);
+	} else
+		error = "file error or file not found";
+#else
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED) {
+			snap->data = data;
+			snap->size = st.st_size;
+			snap->mapped = 1;
+		} else
+			error = "can't map file";
+	} else
+		error = "file error or file not found";
+	if (fd >= 0) close(fd);
+#endif
+	if (error)
+		return luaL_error(L, "LuaXML ERROR: \"%s\" %s!", path, error);
+
+	uint32_t header[2];
+	if (snap->size < SNAPSHOT_HEADER || memcmp(snap->data, SNAPSHOT_MAGIC, 8) != 0)
+		return luaL_error(L, "LuaXML ERROR: \"%s\" isn't a snapshot", path);
+	memcpy(header, snap->data + 8, 8);
+	if (header[0] != SNAPSHOT_BOM || header[1] != 1
+			|| snapshot_get(L, snap, 16) != snap->size)
+		return luaL_error(L, "LuaXML ERROR: incompatible snapshot \"%s\"", path);
+
+	// proxy user value {snapshot, cache}, with weak values for the cache
+	lua_createtable(L, 2, 0); // #3
+	lua_pushvalue(L, 2);
+	lua_rawseti(L, 3, 1);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_rawseti(L, 3, 2);
+	snapshot_pushvalue(L, snap, 3, snapshot_get(L, snap, 24));
+	return 1;
+}
 
-@tparam ?string tag
-If set, has to match the XML `tag` (i.e. must be equal to the `tag(var, nil)`
-result)
+/*
+ * Dumps are a compact, portable binary encoding of LuaXML trees (stored in
+ * Lua strings). After a header ("LuaXMLd", version byte, Adler-32 checksum
+ * of the remaining data as little-endian uint32), a dump contains the root
+ * value, followed by the content of all tables - in the order they were
+ * first referenced. Numbers are unsigned LEB128 varints, unless noted.
+ *
+ *	value:   DUMP_FALSE | DUMP_TRUE
+ *	         DUMP_INTEGER (zigzag) varint
+ *	         DUMP_FLOAT 8 bytes (little-endian double)
+ *	         DUMP_STRING length bytes
+ *	         DUMP_TABLE | DUMP_ELEMENT attribute count, subelement count
+ *	         DUMP_REF table number (for tables that occurred before)
+ *	name:    0 (no tag) | 1 length bytes (new name) | n + 1 (n-th name)
+ *	table:   name (tag), then (name, value) pairs for the attributes,
+ *	         then values for the subelements
+ *
+ * DUMP_ELEMENT is used for tables that have the LuaXML metatable.
+ */
+#define DUMP_MAGIC	"LuaXMLd"
+#define DUMP_VERSION	1
+#define DUMP_HEADER	12
+
+enum {DUMP_FALSE, DUMP_TRUE, DUMP_INTEGER, DUMP_FLOAT, DUMP_STRING,
+	DUMP_TABLE, DUMP_ELEMENT, DUMP_REF};
+
+static uint32_t dump_adler32(const unsigned char *s, size_t size) {
+	uint32_t a = 1, b = 0;
+	while (size > 0) {
+		size_t n = size < 5552 ? size : 5552; // (max. without overflow)
+		size -= n;
+		while (n--) {
+			a += *s++;
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return b << 16 | a;
+}
 
-@tparam ?string key
-If set, a corresponding **attribute key** needs to be present (exact name match).
+static void dump_varint(lua_State *L, Buffer *buf, uint64_t value) {
+	Buffer_reserve(L, buf, 10);
+	while (value >= 0x80) {
+		buf->data[buf->size++] = (char)(value | 0x80);
+		value >>= 7;
+	}
+	buf->data[buf->size++] = (char)value;
+}
 
-@param value (optional)
-arbitrary Lua value. If set, the **attribute value** for `key` has to match it.
+static void dump_string(lua_State *L, Buffer *buf, int index) {
+	size_t len;
+	const char *s = lua_tolstring(L, index, &len);
+	dump_varint(L, buf, len);
+	Buffer_add(L, buf, s, len);
+}
 
-@return
-either `nil` for no match; or the `var` argument properly converted to a
-LuaXML object, equivalent to `xml.new(var)`.
+// add a (tag or attribute) name, `names` maps them to their numbers
+static void dump_name(lua_State *L, Buffer *buf, int names, int index) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	lua_pushvalue(L, index);
+	lua_rawget(L, names);
+	lua_Integer n = lua_tointeger(L, -1);
+	lua_pop(L, 1);
+	if (n > 0) {
+		dump_varint(L, buf, n + 1);
+		return;
+	}
+	Buffer_addchar(L, buf, 1);
+	dump_string(L, buf, index);
+	lua_pushvalue(L, index);
+	lua_pushinteger(L, lua_rawlen(L, names) + 1);
+	lua_rawset(L, names);
+	lua_pushinteger(L, lua_rawlen(L, names) + 1);
+	lua_pushvalue(L, index);
+	lua_rawset(L, names);
+}
 
-This allows you to either make direct use of the matched LuaXML object, or to
-use the return value in a boolean test (`if xml.match(...)`), which is a common
-Lua idiom.
-*/
-int Xml_match(lua_State *L) {
-	if (lua_type(L, 1) == LUA_TTABLE) {
-		if (!lua_isnoneornil(L, 2)) {
-			push_TAG_key(L);
-			lua_rawget(L, 1); // get the tag value from var
-			if (!lua_equal(L, -1, 2)) return 0; // tag mismatch, return `nil`
-			lua_pop(L, 1); // realign stack
-		}
-		if (lua_type(L, 3) == LUA_TSTRING) {
-			lua_pushvalue(L, 3); // duplicate attribute key
-			lua_rawget(L, 1); // try to get value from var
-			if (lua_isnil(L, -1)) return 0; // no such attribute
-			if (!lua_isnoneornil(L, 4)) {
-				if (!lua_equal(L, -1, 4)) return 0; // attribute value mismatch
+/*
+ * Add the value at stack index `index`. For tables, this adds their sizes
+ * only, and appends them to `tables` (mapping numbers to tables, and vice
+ * versa) - the content gets added later by dump_table().
+ */
+static void dump_value(lua_State *L, Buffer *buf, int tables, int index) {
+	if (index < 0) index += lua_gettop(L) + 1; // relative to absolute index
+	switch (lua_type(L, index)) {
+	case LUA_TBOOLEAN:
+		Buffer_addchar(L, buf, lua_toboolean(L, index) ? DUMP_TRUE : DUMP_FALSE);
+		return;
+	case LUA_TSTRING:
+		Buffer_addchar(L, buf, DUMP_STRING);
+		dump_string(L, buf, index);
+		return;
+	case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+		if (lua_isinteger(L, index)) {
+			int64_t i = lua_tointeger(L, index);
+			Buffer_addchar(L, buf, DUMP_INTEGER);
+			dump_varint(L, buf, (uint64_t)i << 1 ^ (uint64_t)(i >> 63));
+			return;
+		}
+#endif
+		{
+			double d = lua_tonumber(L, index);
+			uint64_t bits;
+			memcpy(&bits, &d, 8);
+			Buffer_reserve(L, buf, 9);
+			buf->data[buf->size++] = DUMP_FLOAT;
+			for (int i = 0; i < 8; i++, bits >>= 8)
+				buf->data[buf->size++] = (char)bits;
+		}
+		return;
+	case LUA_TTABLE:
+		lua_pushvalue(L, index);
+		lua_rawget(L, tables);
+		if (!lua_isnil(L, -1)) {
+			Buffer_addchar(L, buf, DUMP_REF);
+			dump_varint(L, buf, lua_tointeger(L, -1));
+			lua_pop(L, 1);
+			return;
+		}
+		lua_pop(L, 1);
+		{
+			size_t count = 0;
+			lua_pushnil(L);
+			while (lua_next(L, index)) {
+				if (lua_type(L, -2) == LUA_TSTRING) count++; // attribute
+				lua_pop(L, 1);
 			}
+			Buffer_addchar(L, buf, is_xml_object(L, index) ? DUMP_ELEMENT : DUMP_TABLE);
+			dump_varint(L, buf, count);
+			dump_varint(L, buf, lua_rawlen(L, index));
 		}
-		lua_settop(L, 1);
-		make_xml_object(L, 1);
-		return 1;
+		lua_Integer n = lua_rawlen(L, tables) + 1;
+		lua_pushvalue(L, index);
+		lua_rawseti(L, tables, n);
+		lua_pushvalue(L, index);
+		lua_pushinteger(L, n);
+		lua_rawset(L, tables);
+		return;
+	default:
+		luaL_error(L, "LuaXML ERROR: can't dump %s values", luaL_typename(L, index));
 	}
-	return 0;
 }
 
-/** iterates a LuaXML object,
-invoking a callback function for all matching (sub)elements.
+// add the content of the table at stack index `index`
+static void dump_table(lua_State *L, Buffer *buf, int names, int tables, int index) {
+	push_TAG_key(L);
+	lua_rawget(L, index);
+	if (lua_type(L, -1) == LUA_TSTRING)
+		dump_name(L, buf, names, -1);
+	else
+		Buffer_addchar(L, buf, 0);
+	lua_pop(L, 1);
 
-The iteration starts with the variable `var` itself (= default depth 0).
-A callback function `cb` gets invoked for each `match`, depending on the
-specified criteria. If the `r` flag is set, the process will
-repeat **recursively** for the subelements of `var` (at depth + 1). You can
-limit the scope by setting a maximum depth, or have the callback function
-explicitly request to stop the iteration (by returning `false`).
+	lua_pushnil(L);
+	while (lua_next(L, index)) {
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			dump_name(L, buf, names, -2);
+			dump_value(L, buf, tables, -1);
+		}
+		lua_pop(L, 1);
+	}
+	size_t n = lua_rawlen(L, index);
+	for (size_t i = 1; i <= n; i++) {
+		lua_rawgeti(L, index, i);
+		dump_value(L, buf, tables, -1);
+		lua_pop(L, 1);
+	}
+}
 
-@function iterate
+/** encodes a LuaXML object in a compact binary format.
+Restoring the object with `undump` is a lot faster than parsing the XML
+again, which makes dumps suitable for caching documents that change rarely.
+Dumps are portable between machines (and Lua versions), and protected by a
+checksum.
 
-@param var  the table (LuaXML object) to iterate
+Apart from tags, attributes and subelements, dumps support (nested) tables,
+strings, numbers and booleans. Tables that occur repeatedly (or recursively)
+get stored only once. Other keys than the ones LuaXML uses (see `new`) are
+ignored.
 
-@tparam function cb
-callback function. `callback(var, depth)` will be called for each matching
-element.<br>
-The function may return `false` to request a stop; if its result is
-any other value (including `nil`), the iteration will continue.
+@function dump
+@param var  the value (usually a LuaXML object) to be encoded
+@treturn string  the binary dump of `var`
+*/
+int Xml_dump(lua_State *L) {
+	luaL_checkany(L, 1);
+	lua_settop(L, 1);
+	Buffer *buf = Buffer_push(L); // #2
+	lua_newtable(L); // #3, names
+	lua_newtable(L); // #4, tables
+	Buffer_add(L, buf, DUMP_MAGIC "\0\0\0\0", DUMP_HEADER);
+	buf->data[7] = DUMP_VERSION;
+
+	dump_value(L, buf, 4, 1);
+	for (int n = 1; n <= (int)lua_rawlen(L, 4); n++) {
+		lua_rawgeti(L, 4, n);
+		dump_table(L, buf, 3, 4, 5);
+		lua_pop(L, 1);
+	}
+	uint32_t checksum = dump_adler32((unsigned char *)buf->data + DUMP_HEADER,
+		buf->size - DUMP_HEADER);
+	for (int i = 8; i < DUMP_HEADER; i++, checksum >>= 8)
+		buf->data[i] = (char)checksum;
+	Buffer_pushresult(L, buf);
+	return 1;
+}
 
-@tparam ?string tag  XML tag to be matched
-@tparam ?string key  attribute key to be matched
-@param value  (optional) attribute value to be matched
+// position within a dump being decoded
+typedef struct {
+	const unsigned char *pos, *end;
+	/// number of attributes and subelements that tables have claimed, but
+	/// that haven't been read yet
+	uint64_t pending;
+} DumpReader;
 
-@tparam ?boolean r
-recursive operation. If `true`, also iterate over the subelements of `var`
+static int undump_corrupt(lua_State *L) {
+	return luaL_error(L, "LuaXML ERROR: corrupt dump");
+}
 
-@tparam ?number max  maximum depth allowed
-@tparam ?number d  initial depth value, defaults to 0
+static uint64_t undump_varint(lua_State *L, DumpReader *r) {
+	uint64_t value = 0;
+	int shift = 0;
+	for (;;) {
+		if (r->pos >= r->end || shift > 63) undump_corrupt(L);
+		unsigned char c = *r->pos++;
+		value |= (uint64_t)(c & 0x7F) << shift;
+		if (c < 0x80) return value;
+		shift += 7;
+	}
+}
 
-@return
-The function returns two values: a counter representing the number of elements
-that were successfully matched (and processed), and a boolean completion flag.
-The latter is `true` for an exhaustive iteration, and `false` if was stopped
-from the callback.
+// get a length-prefixed string
+static const char *undump_string(lua_State *L, DumpReader *r, size_t *len) {
+	uint64_t size = undump_varint(L, r);
+	if (size > (uint64_t)(r->end - r->pos)) undump_corrupt(L);
+	const char *s = (const char *)r->pos;
+	r->pos += size;
+	*len = size;
+	return s;
+}
 
-@see match
-*/
-int Xml_iterate(lua_State *L) {
-	lua_settop(L, 8);
-	luaL_checktype(L, 2, LUA_TFUNCTION); // callback must be a function
-	int maxdepth = luaL_optint(L, 7, -1); // default (< 0) indicates "no limit"
-	int depth = lua_tointeger(L, 8);
-	int count = 0;
-	bool cont = true;
-	// examine "var" element first
-	lua_pushcfunction(L, Xml_match);
-	lua_pushvalue(L, 1); // var
-	lua_pushvalue(L, 3); // tag
-	lua_pushvalue(L, 4); // key
-	lua_pushvalue(L, 5); // value
-	lua_call(L, 4, 1);
-	if (!lua_isnil(L, -1)) { // "var" matches, invoke callback
-		count = 1;
-		lua_pushvalue(L, 2); // duplicate function
-		lua_insert(L, -2);
-		lua_pushinteger(L, depth);
-		lua_call(L, 2, 1);
-		lua_pushboolean(L, false);
-		cont = !lua_equal(L, -1, -2);
-		lua_pop(L, 2);
-	}
-	else lua_pop(L, 1);
-	if (cont && lua_toboolean(L, 6) && lua_type(L, 1) == LUA_TTABLE) {
-		// process "children" / sub-elements recursively
-		depth += 1;
-		if (maxdepth < 0 || depth <= maxdepth) {
-			int k = 0;
-			while (true) {
-				lua_pushcfunction(L, Xml_iterate);
-				lua_rawgeti(L, 1, ++k);
-				if (lua_isnil(L, -1)) break; // no element var[k], exit loop
-				lua_pushvalue(L, 2);
-				lua_pushvalue(L, 3);
-				lua_pushvalue(L, 4);
-				lua_pushvalue(L, 5);
-				lua_pushboolean(L, true);
-				lua_pushvalue(L, 7);
-				lua_pushinteger(L, depth);
-				lua_call(L, 8, 2); // done, continue = iterate(var[k], ...)
-				count += lua_tointeger(L, -2);
-				if (!lua_toboolean(L, -1)) {
-					lua_pushinteger(L, count);
-					lua_pushboolean(L, false);
-					return 2;
-				}
-				lua_pop(L, 2);
-			}
-		}
+// push a name, returns `false` (pushing nothing) for "no tag"
+static bool undump_name(lua_State *L, DumpReader *r, int names) {
+	uint64_t n = undump_varint(L, r);
+	size_t len;
+	const char *s;
+	switch (n) {
+	case 0:
+		return false;
+	case 1:
+		s = undump_string(L, r, &len);
+		lua_pushlstring(L, s, len);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, names, lua_rawlen(L, names) + 1);
+		return true;
+	default:
+		if (n - 1 > lua_rawlen(L, names)) undump_corrupt(L);
+		lua_rawgeti(L, names, n - 1);
+		return true;
 	}
-	lua_pushinteger(L, count);
-	lua_pushboolean(L, true);
-	return 2;
 }
 
-/** recursively searches a Lua table for a subelement
-matching the provided tag and attribute. See the description of `match` for
-the logic involved with testing for` tag`, `key` and `value`.
+/*
+ * Push a value. New tables get created (presized) here, and appended to
+ * `tables` - with their sizes kept in `sizes` (a buffer of uint32 pairs).
+ */
+static void undump_value(lua_State *L, DumpReader *r, int tables, Buffer *sizes) {
+	if (r->pos >= r->end) undump_corrupt(L);
+	int type = *r->pos++;
+	size_t len;
+	const char *s;
+	switch (type) {
+	case DUMP_FALSE:
+	case DUMP_TRUE:
+		lua_pushboolean(L, type == DUMP_TRUE);
+		return;
+	case DUMP_INTEGER: {
+		uint64_t u = undump_varint(L, r);
+		lua_pushinteger(L, (lua_Integer)(int64_t)(u >> 1 ^ -(u & 1)));
+		return;
+	}
+	case DUMP_FLOAT: {
+		if (r->end - r->pos < 8) undump_corrupt(L);
+		uint64_t bits = 0;
+		for (int i = 7; i >= 0; i--) bits = bits << 8 | r->pos[i];
+		r->pos += 8;
+		double d;
+		memcpy(&d, &bits, 8);
+		lua_pushnumber(L, d);
+		return;
+	}
+	case DUMP_STRING:
+		s = undump_string(L, r, &len);
+		lua_pushlstring(L, s, len);
+		return;
+	case DUMP_TABLE:
+	case DUMP_ELEMENT: {
+		uint64_t count[2];
+		count[0] = undump_varint(L, r);
+		count[1] = undump_varint(L, r);
+		// (each attribute or subelement takes at least one byte, including
+		// those of all the tables before - so presizing can't exceed the input)
+		uint64_t avail = r->end - r->pos;
+		if (r->pending > avail || count[0] > avail - r->pending
+			|| count[1] > avail - r->pending - count[0])
+			undump_corrupt(L);
+		r->pending += count[0] + count[1];
+		uint32_t size[2] = {count[0], count[1]};
+		Buffer_add(L, sizes, (const char *)size, sizeof(size));
+		lua_createtable(L, size[1], size[0] + (type == DUMP_ELEMENT));
+		if (type == DUMP_ELEMENT) make_xml_object(L, -1);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, tables, lua_rawlen(L, tables) + 1);
+		return;
+	}
+	case DUMP_REF: {
+		uint64_t n = undump_varint(L, r);
+		if (n < 1 || n > lua_rawlen(L, tables)) undump_corrupt(L);
+		lua_rawgeti(L, tables, n);
+		return;
+	}
+	default:
+		undump_corrupt(L);
+	}
+}
 
-@function find
-@param var  the table to be searched in
-@tparam ?string tag  the XML tag to be found
-@tparam ?string key  the attribute key (= exact name) to be found
-@param value (optional)  the attribute value to be found
-@return  the first (sub-)table that satisfies the search condition,
-or `nil` for no match
+/** restores a LuaXML object from its binary encoding.
+@function undump
+@tparam string bin  a dump, as returned by `dump`
+@return  a copy of the original value
+@see dump
 */
-int Xml_find(lua_State *L) {
-	lua_settop(L, 4); // accept at most four parameters for this function
-
-	lua_newtable(L); // upon a match, this table will receive our result as t[1]
-	lua_insert(L, 1); // (move it before anything else)
-
-	lua_pushcfunction(L, Xml_iterate);
-	lua_insert(L, 2); // iterate is now stack arg #2, `var` at #3
-	lua_pushvalue(L, 1); // duplicate the table (for use as upvalue)
-	lua_pushcclosure(L, find_on_match, 1); // create a C closure
-	lua_insert(L, 4); // place the callback function (closure) at #4
-	// (`tag`, `key` and `value` have moved to #5, #6 and #7 respectively)
-	lua_pushboolean(L, true); // set "recursive" flag (#8)
-
-	// iterate(var, find_on_match, tag, key, value, true), discarding results
-	// (but if something matches, we expect that `find_on_match` sets t[1])
-	lua_call(L, 6, 0);
-	lua_rawgeti(L, 1, 1);
-	return 1; // returns result[1], which may be `nil` (if no match)
+int Xml_undump(lua_State *L) {
+	size_t size;
+	const char *bin = luaL_checklstring(L, 1, &size);
+	lua_settop(L, 1);
+	if (size < DUMP_HEADER || memcmp(bin, DUMP_MAGIC, 7) != 0)
+		return luaL_error(L, "LuaXML ERROR: not a LuaXML dump");
+	if (bin[7] != DUMP_VERSION)
+		return luaL_error(L, "LuaXML ERROR: unsupported dump version %d", bin[7]);
+	DumpReader r = {(const unsigned char *)bin + DUMP_HEADER,
+		(const unsigned char *)bin + size, 0};
+	uint32_t checksum = 0;
+	for (int i = DUMP_HEADER - 1; i >= 8; i--)
+		checksum = checksum << 8 | (unsigned char)bin[i];
+	if (dump_adler32(r.pos, size - DUMP_HEADER) != checksum)
+		return luaL_error(L, "LuaXML ERROR: corrupt dump (checksum mismatch)");
+
+	lua_newtable(L); // #2, names
+	lua_newtable(L); // #3, tables
+	Buffer *sizes = Buffer_push(L); // #4
+	undump_value(L, &r, 3, sizes); // #5, the result
+	for (size_t n = 1; n <= lua_rawlen(L, 3); n++) {
+		uint32_t count[2];
+		memcpy(count, sizes->data + (n - 1) * sizeof(count), sizeof(count));
+		lua_rawgeti(L, 3, n); // #6
+		if (undump_name(L, &r, 2)) lua_rawseti(L, 6, 0);
+		for (uint32_t i = 0; i < count[0]; i++) {
+			r.pending--;
+			if (!undump_name(L, &r, 2)) undump_corrupt(L);
+			undump_value(L, &r, 3, sizes);
+			lua_rawset(L, 6);
+		}
+		for (uint32_t i = 1; i <= count[1]; i++) {
+			r.pending--;
+			undump_value(L, &r, 3, sizes);
+			lua_rawseti(L, 6, i);
+		}
+		lua_pop(L, 1);
+	}
+	if (r.pos != r.end) undump_corrupt(L);
+	return 1;
 }
 
 #ifdef __cplusplus
@@ -1173,17 +8316,39 @@ extern "C" {
 int _EXPORT luaopen_LuaXML_lib (lua_State* L) {
 	static const struct luaL_Reg funcs[] = {
 		{"append", Xml_append},
+		{"attach", Xml_attach},
+		{"cache", Xml_cache},
+		{"children", Xml_children},
+		{"clone", Xml_clone},
+		{"columns", Xml_columns},
 		{"decode", Xml_decode},
+		{"diff", Xml_diff},
+		{"document", Xml_document},
+		{"dump", Xml_dump},
 		{"encode", Xml_encode},
 		{"eval", Xml_eval},
 		{"find", Xml_find},
+		{"indexadd", Xml_indexadd},
+		{"indexby", Xml_indexby},
+		{"indexrebuild", Xml_indexrebuild},
 		{"iterate", Xml_iterate},
 		{"load", Xml_load},
 		{"match", Xml_match},
+		{"name", Xml_name},
 		{"new", Xml_new},
+		{"parsecache", Xml_parsecache},
+		{"parser", Xml_parser},
+		{"profile", Xml_profile},
 		{"registerCode", Xml_registerCode},
+		{"reparse", Xml_reparse},
+		{"sizeof", Xml_sizeof},
+		{"snapshot", Xml_snapshot},
 		{"str", Xml_str},
 		{"tag", Xml_tag},
+		{"touch", Xml_touch},
+		{"transform", Xml_transform},
+		{"undump", Xml_undump},
+		{"write", Xml_write},
 		{NULL, NULL}
 	};
 	luaL_newlib(L, funcs);
@@ -1198,6 +8363,73 @@ int _EXPORT luaopen_LuaXML_lib (lua_State* L) {
 	lua_rawset(L, -3); // set metamethod
 	lua_pop(L, 1); // drop value (metatable)
 
+	// weak tables keyed by elements: the serialization cache (see cache and
+	// touch), subtree hashes (see diff) and resolved names (see eval)
+	const char *weak[] = {LUAXML_STRCACHE, LUAXML_PARENTS, LUAXML_HASHES,
+		LUAXML_NAMES};
+	for (int i = 0; i < 4; i++) {
+		push_weaktable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, weak[i]);
+	}
+
+	// methods for resumable parsers (see parser)
+	luaL_newmetatable(L, LUAXML_PARSER);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, Parser_step);
+	lua_setfield(L, -2, "step");
+	lua_pop(L, 1);
+
+	// methods for editable documents (see document)
+	luaL_newmetatable(L, LUAXML_DOCUMENT);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, Document_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, Document_range);
+	lua_setfield(L, -2, "range");
+	lua_pushcfunction(L, Xml_reparse);
+	lua_setfield(L, -2, "reparse");
+	lua_pushcfunction(L, Document_root);
+	lua_setfield(L, -2, "root");
+	lua_pushcfunction(L, Document_text);
+	lua_setfield(L, -2, "text");
+	lua_pop(L, 1);
+
+	// metatables for snapshots, and their elements (see attach)
+	luaL_newmetatable(L, LUAXML_SNAPSHOT);
+	lua_pushcfunction(L, Snapshot_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+	luaL_newmetatable(L, LUAXML_PROXY);
+	lua_newtable(L); // methods, including the read-only ones of LuaXML objects
+	lua_pushcfunction(L, Proxy_totable);
+	lua_setfield(L, -2, "totable");
+	const luaL_Reg readonly[] = {
+		{"children", Xml_children},
+		{"find", Xml_find},
+		{"iterate", Xml_iterate},
+		{"match", Xml_match},
+		{"str", Xml_str},
+		{"tag", Xml_tag},
+		{NULL, NULL}
+	};
+	for (const luaL_Reg *f = readonly; f->name; f++) {
+		lua_pushcfunction(L, f->func);
+		lua_setfield(L, -2, f->name);
+	}
+	lua_pushcclosure(L, Proxy_index, 1);
+	lua_setfield(L, -2, "__index");
+	lua_pushcfunction(L, Proxy_newindex);
+	lua_setfield(L, -2, "__newindex");
+	lua_pushcfunction(L, Proxy_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, Proxy_pairs);
+	lua_setfield(L, -2, "__pairs");
+	lua_pushcfunction(L, Proxy_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
 	// expose API constants (via the module table)
 	lua_pushinteger(L, WHITESPACE_TRIM);
 	lua_setfield(L, -2, "WS_TRIM");
@@ -1217,7 +8449,7 @@ int _EXPORT luaopen_LuaXML_lib (lua_State* L) {
 	lua_setfield(L, -2, "\"");
 	lua_pushliteral(L, "&apos;");
 	lua_setfield(L, -2, "'");
-	sv_code_ref = luaL_ref(L, LUA_REGISTRYINDEX); // reference (and pop table)
+	lua_setfield(L, LUA_REGISTRYINDEX, LUAXML_CODES);
 
 	return 1; // return module (table)
 }
@@ -22,6 +22,13 @@ extern "C" {
 
 int _EXPORT luaopen_LuaXML_lib (lua_State* L);
 
+/* Parse `size` bytes of XML data at `p` (that don't have to be NUL-terminated)
+ * like xml.eval() does, but without copying them. `mode` is the whitespace
+ * handling mode (0 = WS_TRIM). Pushes the resulting LuaXML object, or nil, and
+ * returns 1. Errors are raised as Lua errors (use lua_pcall to catch them).
+ * The library must have been opened in `L` before (see luaopen_LuaXML_lib). */
+int _EXPORT luaxml_eval_buffer (lua_State *L, const char *p, size_t size, int mode);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
@@ -0,0 +1,155 @@
+/*
+ * Multi-threaded stress test: runs LuaXML in several independent Lua states
+ * at once, one per thread. Each state registers its own entity code, then
+ * repeatedly parses and serializes documents, checking the results - this
+ * includes parsing through the C API (luaxml_eval_buffer).
+ *
+ * usage: stresstest [threads [iterations]]
+ * (built and run by "make stress")
+ */
+#include "LuaXML_lib.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if LUA_VERSION_NUM < 502
+# define luaL_loadbufferx(L, s, sz, name, mode)	luaL_loadbuffer(L, s, sz, name)
+#endif
+
+static const char script[] =
+	"local xml, id, iterations, check = ...\n"
+	// a code that's specific to this state
+	"local code = '&state' .. id .. ';'\n"
+	"xml.registerCode('~', code)\n"
+	"for i = 1, iterations do\n"
+	"  local t = {}\n"
+	"  for k = 1, 50 do\n"
+	"    t[k] = string.format('<item id=\"%d\" state=\"%d\">a &lt; b ~ %d</item>', k, id, i)\n"
+	"  end\n"
+	"  local s = '<list>' .. table.concat(t) .. '</list>'\n"
+	"  local doc = xml.eval(s)\n"
+	"  assert(#doc == 50, 'wrong element count')\n"
+	"  assert(doc[7].state == tostring(id), 'wrong attribute')\n"
+	"  local str = doc:str()\n"
+	"  assert(str:find(code, 1, true), 'missing state specific code')\n"
+	"  assert(str:find('a &lt; b', 1, true), 'missing default code')\n"
+	"  assert(doc:str(0, nil, {threads = 2}) == str, 'parallel output differs')\n"
+	"  local copy = xml.eval(str)\n"
+	"  for k = 1, 50 do\n"
+	"    assert(copy[k][1] == doc[k][1] and copy[k].id == doc[k].id, 'round trip mismatch')\n"
+	"  end\n"
+	"  assert(xml.encode('<~>') == '&lt;' .. code .. '&gt;', 'wrong encoding')\n"
+	"  check(id, i)\n"
+	"end\n";
+
+// raise an error unless the field `key` of the table on top of the stack is
+// the string `expected`
+static void check_field(lua_State *L, int key, const char *expected) {
+	lua_rawgeti(L, -1, key);
+	const char *value = lua_tostring(L, -1);
+	if (!value || strcmp(value, expected) != 0)
+		luaL_error(L, "luaxml_eval_buffer: [%d] is '%s', expected '%s'",
+			key, value ? value : "(nil)", expected);
+	lua_pop(L, 1);
+}
+
+// check(id, i): parse a document with luaxml_eval_buffer(), from a buffer
+// that isn't NUL-terminated, and verify the resulting tree
+static int check_buffer(lua_State *L) {
+	int id = (int)luaL_checkinteger(L, 1), i = (int)luaL_checkinteger(L, 2);
+	char xml[128], text[32];
+	int len = snprintf(xml, sizeof(xml),
+		"<doc id=\"%d\"><a>%d</a><b/>a &amp; b</doc>", id, i);
+	xml[len] = '<'; // (garbage past `len` must be ignored)
+	luaxml_eval_buffer(L, xml, len, 0);
+	if (!lua_istable(L, -1))
+		return luaL_error(L, "luaxml_eval_buffer: no result");
+	if (lua_rawlen(L, -1) != 3)
+		return luaL_error(L, "luaxml_eval_buffer: wrong element count");
+	check_field(L, 0, "doc");
+	check_field(L, 3, "a & b");
+	lua_getfield(L, -1, "id");
+	snprintf(text, sizeof(text), "%d", id);
+	if (!lua_isstring(L, -1) || strcmp(lua_tostring(L, -1), text) != 0)
+		return luaL_error(L, "luaxml_eval_buffer: wrong attribute");
+	lua_pop(L, 1);
+	lua_rawgeti(L, -1, 1);
+	snprintf(text, sizeof(text), "%d", i);
+	check_field(L, 0, "a");
+	check_field(L, 1, text);
+	lua_pop(L, 1);
+	lua_rawgeti(L, -1, 2);
+	check_field(L, 0, "b");
+	return 0;
+}
+
+typedef struct {
+	lua_State *L;
+	int id, iterations;
+	const char *error;
+} Job;
+
+static void *run(void *arg) {
+	Job *job = arg;
+	lua_State *L = job->L;
+	if (luaL_loadbufferx(L, script, sizeof(script) - 1, "stress", NULL) != 0) {
+		job->error = lua_tostring(L, -1);
+		return NULL;
+	}
+	lua_pushvalue(L, 1); // module
+	lua_pushinteger(L, job->id);
+	lua_pushinteger(L, job->iterations);
+	lua_pushcfunction(L, check_buffer);
+	if (lua_pcall(L, 4, 0, 0) != 0)
+		job->error = lua_tostring(L, -1);
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	int threads = argc > 1 ? atoi(argv[1]) : 8;
+	int iterations = argc > 2 ? atoi(argv[2]) : 200;
+	if (threads < 1 || iterations < 1) {
+		fprintf(stderr, "usage: %s [threads [iterations]]\n", argv[0]);
+		return 2;
+	}
+	Job *jobs = calloc(threads, sizeof(Job));
+	pthread_t *ids = calloc(threads, sizeof(pthread_t));
+	int i, failed = 0;
+
+	// open all states first, so that each one's setup precedes the others' use
+	for (i = 0; i < threads; i++) {
+		lua_State *L = luaL_newstate();
+		luaL_openlibs(L);
+		// (vary the registry contents, as different host setups would do)
+		int k;
+		for (k = 0; k < i; k++) {
+			lua_newtable(L);
+			luaL_ref(L, LUA_REGISTRYINDEX);
+		}
+		lua_pushcfunction(L, luaopen_LuaXML_lib);
+		lua_call(L, 0, 1); // (the module table stays at stack index 1)
+		jobs[i].L = L;
+		jobs[i].id = i;
+		jobs[i].iterations = iterations;
+	}
+	for (i = 0; i < threads; i++)
+		if (pthread_create(&ids[i], NULL, run, &jobs[i]) != 0) {
+			fprintf(stderr, "failed to start thread %d\n", i);
+			return 1;
+		}
+	for (i = 0; i < threads; i++) {
+		pthread_join(ids[i], NULL);
+		if (jobs[i].error) {
+			fprintf(stderr, "state %d: %s\n", i, jobs[i].error);
+			failed++;
+		}
+		lua_close(jobs[i].L);
+	}
+	free(ids);
+	free(jobs);
+	printf("%d states x %d iterations: %s\n", threads, iterations,
+		failed ? "FAILED" : "OK");
+	return failed ? 1 : 0;
+}
@@ -74,6 +74,14 @@ function TestXml:test_basics()
 					{{[0]="bar"}, " x\t", [0]="foo"})
 	lu.assertEquals(xml.eval("<foo>\n  <bar/> x\t</foo>", xml.WS_PRESERVE),
 					{"\n  ", {[0]="bar"}, " x\t", [0]="foo"})
+	-- whitespace runs interrupted by comments or CDATA
+	foo = "<foo>\n <!-- c -->\n <bar/>\n <!-- c --> x <![CDATA[ y ]]>\n</foo>"
+	lu.assertEquals(xml.eval(foo, xml.WS_TRIM),
+					{{[0]="bar"}, "x", " y ", [0]="foo"})
+	lu.assertEquals(xml.eval(foo, xml.WS_NORMALIZE),
+					{{[0]="bar"}, "\n  x ", " y ", [0]="foo"})
+	lu.assertEquals(xml.eval(foo, xml.WS_PRESERVE),
+					{"\n \n ", {[0]="bar"}, "\n  x ", " y ", "\n", [0]="foo"})
 
 	-- CDATA
 	lu.assertEquals(xml.eval("<fu><![CDATA[]]></fu>"), {[0] = "fu"})
@@ -132,14 +140,712 @@ function TestXml:test_parse()
 
 	-- test match() / iterate() functions against known values
 	lu.assertEquals(test:find(nil, "id", "dopplerVelocity")[1], "330.0")
-	local func, t = test:find("resources"):children(nil, "mime", "audio/wav")
-	lu.assertEquals(#t, 3)
+	local count = 0
+	for k, v in test:find("resources"):children(nil, "mime", "audio/wav") do
+		count = count + 1
+		lu.assertEquals(k, count)
+		lu.assertEquals(v.mime, "audio/wav")
+	end
+	lu.assertEquals(count, 3)
 	-- verify number of elements with "float" tag
 	lu.assertEquals(test:iterate(function() end, "float", nil, nil, true), 14)
 	-- verify number of elements with "id" attribute
 	lu.assertEquals(test:iterate(function() end, nil, "id", nil, true), 58)
 	-- verify number of elements where "loop" attribute is "true"
 	lu.assertEquals(test:iterate(function() end, nil, "loop", "true", true), 4)
+
+	-- userdata with explicit length (io.stdout is merely some full userdata)
+	lu.assertNil(xml.eval(io.stdout, nil, 0))
+	lu.assertErrorMsgContains("invalid length", xml.eval, io.stdout, nil, 2^40)
+end
+
+function TestXml:test_children()
+	local foobar = xml.eval('<foo><a /><b bar="no"><a/></b><c bar="yes" /><a /></foo>')
+	local tags = {}
+	for k, v in foobar:children() do tags[k] = v:tag() end
+	lu.assertEquals(tags, {"a", "b", "c", "a"})
+	tags = {}
+	for k, v in foobar:children("a", nil, nil, true) do tags[k] = v end
+	lu.assertEquals(#tags, 3)
+	lu.assertIs(tags[2], foobar[2][1]) -- depth first, in document order
+	for k, v in foobar:children(nil, "bar", "yes", 0) do tags = v end
+	lu.assertIs(tags, foobar[3])
+	-- results are LuaXML objects, and breaking out of the loop is fine
+	for _, v in xml.children({{[0] = "x"}, {[0] = "y"}}) do
+		lu.assertEquals(v:tag(), "x")
+		break
+	end
+	-- non-table values have no children
+	for _ in xml.children("foo") do error("unexpected iteration") end
+end
+
+function TestXml:test_projection()
+	local foo = '<foo><bar a="<>">x<!-- </bar> --><bar/></bar><baz>y</baz><bar/></foo>'
+	lu.assertEquals(xml.eval(foo, nil, {drop = {"bar"}}),
+		{{"y", [0] = "baz"}, [0] = "foo"})
+	lu.assertEquals(xml.eval(foo, nil, {drop = {baz = true}}),
+		xml.eval('<foo><bar a="<>">x<bar/></bar><bar/></foo>'))
+	lu.assertNil(xml.eval(foo, nil, {drop = {"foo"}}))
+
+	-- `keep` retains the path to kept elements (tags and attributes only)
+	local test = xml.load("test.xml", nil, {keep = {"resource"}})
+	lu.assertEquals(test:tag(), "XperiML")
+	lu.assertEquals(test.version, "2.0")
+	lu.assertEquals(#test, 1)
+	lu.assertEquals(test[1]:tag(), "resources")
+	lu.assertEquals(#test[1], 10)
+	lu.assertEquals(test[1][6].name, "explo")
+	-- text content is retained only within kept elements
+	test = xml.load("test.xml", nil, {keep = {"float"}, drop = {"overlay"}})
+	lu.assertEquals(test:find(nil, "id", "farClipping")[1], "2000")
+	lu.assertEquals(#test:find("deviceWindow"), 2) -- (mouseRelative, mouseNeutral)
+	lu.assertNil(test:find("string"))
+end
+
+function TestXml:test_types()
+	local foo = '<foo a="1.5" b="0x10" c="true" d="x"><bar a="2" c="0">3</bar> 4 </foo>'
+	local types = {a = "number", b = "integer", c = "boolean", d = "number",
+		["bar/a"] = "string", ["bar/text"] = "integer"}
+	lu.assertEquals(xml.eval(foo, nil, {types = types}),
+		{{3, [0] = "bar", a = "2", c = false}, "4", [0] = "foo",
+		 a = 1.5, b = 16, c = true, d = "x"})
+	lu.assertIs(xml.eval(foo, xml.WS_PRESERVE, {types = {["foo/text"] = "number"}})[2], 4)
+	lu.assertIs(xml.eval(foo, nil, {types = {a = "integer"}}).a, "1.5")
+	lu.assertErrorMsgContains('invalid type "float"', xml.eval, foo, nil,
+		{types = {a = "float"}})
+end
+
+function TestXml:test_encoding()
+	local foo = '<foo a="\195\169">\228\184\173 \240\159\152\128</foo>'
+	local expected = xml.eval(foo)
+	local le, be = {}, {}
+	for _, c in ipairs({0x3C, 0x66, 0x6F, 0x6F, 0x20, 0x61, 0x3D, 0x22, 0xE9, 0x22,
+		0x3E, 0x4E2D, 0x20, 0xD83D, 0xDE00, 0x3C, 0x2F, 0x66, 0x6F, 0x6F, 0x3E})
+	do
+		local lo, hi = string.char(c % 256), string.char(math.floor(c / 256))
+		table.insert(le, lo .. hi)
+		table.insert(be, hi .. lo)
+	end
+	le, be = table.concat(le), table.concat(be)
+	lu.assertEquals(xml.eval("\255\254" .. le), expected)
+	lu.assertEquals(xml.eval("\254\255" .. be), expected)
+	lu.assertEquals(xml.eval(le), expected) -- (detected by the initial "<")
+	lu.assertEquals(xml.eval(be, nil, {encoding = "UTF-16BE"}), expected)
+
+	local f = io.open("t.xml", "wb")
+	f:write("\255\254" .. le)
+	f:close()
+	lu.assertEquals(xml.load("t.xml"), expected)
+	os.remove("t.xml")
+	lu.assertErrorMsgContains('unsupported encoding "latin1"', xml.eval, foo, nil,
+		{encoding = "latin1"})
+end
+
+function TestXml:test_strict()
+	local strict = {strict = true}
+	local foo = '<foo a="\195\169">\240\159\152\128</foo>'
+	lu.assertEquals(xml.eval(foo, nil, strict), xml.eval(foo))
+	-- invalid, overlong, surrogate, truncated (even after the root element),
+	-- with the offset of the first byte that makes the sequence invalid
+	for bad, pos in pairs({["\255"] = 0, ["\192\175"] = 0, ["\237\160\128"] = 1,
+		["\240\159"] = 2})
+	do
+		lu.assertNotNil(xml.eval(foo .. bad)) -- (lenient by default)
+		lu.assertErrorMsgContains("invalid UTF-8 (parser pos " .. #foo + pos .. ")",
+			xml.eval, foo .. bad, nil, strict)
+	end
+
+	local f = io.open("t.xml", "wb")
+	f:write(foo:sub(1, 8) .. "\128" .. foo:sub(9))
+	f:close()
+	lu.assertNotNil(xml.load("t.xml"))
+	lu.assertErrorMsgContains("invalid UTF-8 (parser pos 8)", xml.load, "t.xml", nil, strict)
+	os.remove("t.xml")
+end
+
+function TestXml:test_namespaces()
+	local SOAP = "http://schemas.xmlsoap.org/soap/envelope/"
+	local s = '<soap:Envelope xmlns:soap="' .. SOAP .. '" xmlns="urn:d">'
+		.. '<soap:Body><m:get xmlns:m="urn:m" m:id="5" n="1"><item xml:lang="en"/>'
+		.. '<raw xmlns=""><x/></raw></m:get><env:Fault xmlns:env="' .. SOAP .. '"/>'
+		.. '</soap:Body></soap:Envelope>'
+	local doc = xml.eval(s, nil, {namespaces = true})
+	lu.assertEquals(doc:tag(), "soap:Envelope") -- (qualified names are kept)
+	lu.assertEquals({doc:name()}, {SOAP, "Envelope"})
+	local get = doc[1][1]
+	lu.assertEquals({get:name()}, {"urn:m", "get"})
+	lu.assertEquals({get:name("m:id")}, {"urn:m", "id"})
+	lu.assertEquals({get:name("n")}, {nil, "n"})
+	lu.assertEquals({get[1]:name()}, {"urn:d", "item"}) -- default namespace
+	lu.assertEquals({get[1]:name("xml:lang")},
+		{"http://www.w3.org/XML/1998/namespace", "lang"})
+	lu.assertEquals({get[2]:name()}, {nil, "raw"}) -- (undeclared)
+	lu.assertEquals({get[2][1]:name()}, {nil, "x"})
+
+	-- matching by expanded names, whatever the prefix
+	lu.assertIs(doc:find("{" .. SOAP .. "}Body"), doc[1])
+	lu.assertIs(doc:find("{" .. SOAP .. "}Fault"), doc[1][2])
+	lu.assertIs(doc:find(nil, "{urn:m}id", "5"), get)
+	lu.assertIs(doc:find("{urn:d}item"), get[1])
+	lu.assertNil(doc:find("{}item"))
+	lu.assertIs(doc:find("{}x"), get[2][1])
+	lu.assertIs(get:match("{urn:m}get", "{}n"), get)
+	local count = 0
+	doc:iterate(function() count = count + 1 end, "{" .. SOAP .. "}Body",
+		nil, nil, true)
+	lu.assertEquals(count, 1)
+
+	-- without the option, nothing gets resolved
+	local plain = xml.eval(s)
+	lu.assertEquals({plain:name()}, {nil, "soap:Envelope"})
+	lu.assertNil(plain:find("{" .. SOAP .. "}Body"))
+	lu.assertEquals(xml.eval(doc:str()), plain)
+	lu.assertEquals(doc, plain) -- (no extra keys in the elements)
+	get:tag("other") -- (renaming drops the resolved name)
+	lu.assertEquals({get:name()}, {nil, "other"})
+	lu.assertEquals({get:name("m:id")}, {"urn:m", "id"})
+
+	lu.assertErrorMsgContains("undeclared namespace prefix 'a'", xml.eval,
+		"<a:b/>", nil, {namespaces = true})
+	local parser = xml.parser(s, nil, {namespaces = true})
+	local done, result
+	repeat done, result = parser:step(16) until done
+	lu.assertEquals({result[1][2]:name()}, {SOAP, "Fault"})
+end
+
+function TestXml:test_profile()
+	local s = '<a x="1"><b id="1">t &amp; u</b><b id="2"/>'
+		.. '<c><b id="1">xy</b><![CDATA[a&b]]></c></a><!-- after the root -->'
+	local p = xml.profile(s)
+	lu.assertEquals(p.bytes, s:find("<!--") - 1)
+	lu.assertEquals(p.elements, 5)
+	lu.assertEquals(p.tags, {a = 1, b = 3, c = 1})
+	lu.assertEquals(p.max_depth, 3)
+	lu.assertEquals(p.avg_depth, 2)
+	lu.assertEquals(p.attribute_count, 4)
+	lu.assertEquals(p.attributes, {x = {count = 1, distinct = 1},
+		id = {count = 3, distinct = 2}})
+	lu.assertEquals(p.text_bytes, #"t &amp; u" + #"xy" + #"a&b")
+	lu.assertEquals(p.markup_bytes, p.bytes - p.text_bytes)
+	lu.assertEquals(p.entities, 1) -- (not within CDATA)
+	lu.assertEquals(p.largest, {tag = "c", offset = s:find("<c>") - 1,
+		bytes = #'<c><b id="1">xy</b><![CDATA[a&b]]></c>', elements = 2, depth = 2})
+	lu.assertNil(xml.profile("<a>text</a>").largest)
+
+	-- a file, with estimated distinct counts
+	local t = {}
+	for i = 1, 2000 do
+		t[i] = string.format('<row id="%d" k="%d"/>', i % 1000, i % 7)
+	end
+	local f = io.open("t.xml", "wb")
+	f:write("<rows>" .. table.concat(t) .. "</rows>")
+	f:close()
+	p = xml.profile("t.xml")
+	os.remove("t.xml")
+	lu.assertEquals(p.tags, {rows = 1, row = 2000})
+	lu.assertEquals(p.attributes.k, {count = 2000, distinct = 7})
+	lu.assertTrue(math.abs(p.attributes.id.distinct - 1000) < 50)
+	lu.assertEquals(p.largest.bytes, #t[100]) -- (a row with a 3-digit id)
+	lu.assertErrorMsgContains("file not found", xml.profile, "no such file.xml")
+end
+
+function TestXml:test_parser()
+	local foo = '<foo a="1"><bar>x</bar><baz b="2"/><!-- c --><bar>y</bar></foo>'
+	local parser = xml.parser(foo, nil, {drop = {"baz"}})
+	local steps, done, result = 0
+	repeat
+		done, result = parser:step(4)
+		steps = steps + 1
+	until done
+	lu.assertTrue(steps > 5)
+	lu.assertEquals(result, xml.eval(foo, nil, {drop = {"baz"}}))
+	lu.assertEquals({parser:step()}, {true, result}) -- (stays complete)
+
+	-- within a coroutine
+	local co = coroutine.create(xml.evalyield)
+	local ok, yields = coroutine.resume(co, foo, nil, nil, 16), 0
+	while coroutine.status(co) == "suspended" do
+		ok, result = coroutine.resume(co)
+		yields = yields + 1
+	end
+	lu.assertTrue(ok)
+	lu.assertTrue(yields > 2)
+	lu.assertEquals(result, xml.eval(foo))
+	lu.assertEquals({xml.parser(""):step()}, {true}) -- (no root element)
+	lu.assertErrorMsgContains("must be positive", parser.step, parser, 0)
+end
+
+function TestXml:test_reparse()
+	local foo = '<?xml version="1.0"?>\n<list><item>1</item><item a="x">2<b/></item></list>'
+	local doc = xml.document(foo)
+	local list = doc:root()
+	local item1, item2 = list[1], list[2]
+	lu.assertEquals({doc:range(list)}, {22, 73})
+	lu.assertEquals({doc:range(item2)}, {42, 66})
+	lu.assertEquals({doc:range(item2[2])}, {55, 59})
+	lu.assertNil(doc:range({}))
+
+	-- changes within an element only reparse that one (in place)
+	local el, full = doc:reparse(34, 1, "42")
+	lu.assertIs(el, item1)
+	lu.assertFalse(full)
+	lu.assertEquals(item1, xml.eval("<item>42</item>"))
+	lu.assertEquals({doc:range(item2)}, {43, 67}) -- (following elements moved)
+	el, full = xml.reparse(doc, 52, 1, "yy")
+	lu.assertIs(el, item2)
+	lu.assertFalse(full)
+	lu.assertEquals(item2.a, "yy")
+	lu.assertIs(doc:root(), list)
+	lu.assertEquals(doc:text(),
+		'<?xml version="1.0"?>\n<list><item>42</item><item a="yy">2<b/></item></list>')
+	lu.assertEquals({doc:range(item2[2])}, {57, 61})
+
+	-- changing the structure parses everything again
+	el, full = doc:reparse(36, 7, "") -- (removes "</item>")
+	lu.assertTrue(full)
+	lu.assertIs(el, doc:root())
+	lu.assertEquals(el, xml.eval(doc:text()))
+	lu.assertEquals(#el, 1)
+	-- and so does an unbalanced change within an element
+	doc = xml.document('<a><b>x</b><c>y</c></a>')
+	el, full = doc:reparse(7, 0, "<d>")
+	lu.assertTrue(full)
+	lu.assertEquals(el, xml.eval('<a><b>x<d></b><c>y</c></a>'))
+
+	lu.assertErrorMsgContains("offset out of range", doc.reparse, doc, 100, 0)
+	lu.assertErrorMsgContains("invalid length", doc.reparse, doc, 20, 10)
+end
+
+function TestXml:test_transform_rules()
+	local foo = '<foo a="1" b="2"><bar>x &amp; y</bar><baz b="3"/><!-- c -->'
+		.. '<bar><n>1</n></bar><skip><bar/></skip>text</foo>'
+	local tmp = os.tmpname()
+	local function result()
+		local f = io.open(tmp)
+		local s = f:read("*a")
+		f:close()
+		return s
+	end
+
+	-- without rules, the output matches save()
+	xml.transform(foo, tmp, {})
+	lu.assertEquals(xml.load(tmp), xml.eval(foo))
+	lu.assertStrContains(result(), '<?xml version="1.0"?>\n<foo a="1" b="2">\n'
+		.. '\t<bar>x &amp; y</bar>\n\t<baz b="3" />\n')
+
+	local seen = {}
+	xml.transform(foo, tmp, {
+		drop = {"skip"},
+		rename = {bar = "item", foo = "root"},
+		attributes = {a = false, b = "c", ["baz/b"] = "d"},
+		callbacks = {n = function(n)
+			seen[#seen + 1] = n
+			n[1] = n[1] .. "!"
+		end},
+	}, {header = ""})
+	lu.assertEquals(result(), '<root c="2">\n\t<item>x &amp; y</item>\n'
+		.. '\t<baz d="3" />\n\t<item>\n\t\t<n>1!</n>\n\t</item>\n\ttext\n</root>\n')
+	lu.assertEquals(seen, {xml.new({"1!"}, "n")})
+
+	-- callbacks may also replace or drop elements
+	xml.transform(foo, tmp, {callbacks = {
+		bar = function(bar) if bar[1] == "x & y" then return false end end,
+		baz = function() return xml.new("new") end,
+	}})
+	lu.assertEquals(xml.load(tmp), xml.eval('<foo a="1" b="2"><new/>'
+		.. '<bar><n>1</n></bar><skip><bar/></skip>text</foo>'))
+	os.remove(tmp)
+
+	lu.assertErrorMsgContains('"rename" must be a table', xml.transform, foo, tmp,
+		{rename = "x"})
+end
+
+function TestXml:test_sizeof()
+	local foo = xml.eval('<foo a="1"><bar>x</bar><bar>x</bar></foo>')
+	local size = xml.sizeof(foo)
+	lu.assertTrue(size > 3 * xml.sizeof({}))
+	lu.assertEquals(xml.sizeof("abc"), xml.sizeof("xyz"))
+	lu.assertTrue(xml.sizeof("abcdef") > xml.sizeof("abc"))
+	lu.assertEquals(xml.sizeof(42), 0)
+	-- shared subelements count only once
+	local copy = foo:clone(0)
+	lu.assertTrue(xml.sizeof({foo, copy}) < 2 * size)
+
+	-- memory budget while parsing
+	local big = "<foo>" .. string.rep("<bar>some text</bar>", 1000) .. "</foo>"
+	lu.assertNotNil(xml.eval(big, nil, {maxmemory = 10 * xml.sizeof(xml.eval(big))}))
+	lu.assertErrorMsgContains("memory budget exceeded", xml.eval, big, nil,
+		{maxmemory = 10000})
+end
+
+function TestXml:test_snapshot()
+	local foo = xml.eval('<foo a="1" b="x"><bar>text</bar><baz/>more</foo>')
+	foo.n, foo.flag = 42, true
+	lu.assertTrue(xml.snapshot(foo, "t.snapshot") > 0)
+	local root = xml.attach("t.snapshot")
+	lu.assertEquals(type(root), "userdata")
+	lu.assertEquals(root[0], "foo")
+	lu.assertEquals(root.a, "1")
+	lu.assertEquals(root.n, 42)
+	lu.assertEquals(root.flag, true)
+	lu.assertNil(root.missing)
+	lu.assertEquals(#root, 3)
+	lu.assertEquals(root[1][0], "bar")
+	lu.assertEquals(root[1][1], "text")
+	lu.assertEquals(root[3], "more")
+	lu.assertNil(root[4])
+	lu.assertIs(root[1], root[1]) -- proxies get reused
+	lu.assertEquals(root:totable(), foo)
+	lu.assertEquals(type(root:totable(0)[1]), "userdata")
+	lu.assertEquals(tostring(root[1]), tostring(foo[1]))
+	lu.assertErrorMsgContains("read-only", function() root.a = "2" end)
+
+	-- the read-only API works on proxies, and results are proxies too
+	lu.assertEquals(root:tag(), "foo")
+	lu.assertEquals(xml.tag(root[1]), "bar")
+	lu.assertErrorMsgContains("read-only", xml.tag, root, "new")
+	lu.assertIs(xml.find(root, "bar"), root[1])
+	lu.assertIs(root:find(nil, "a", "1"), root)
+	lu.assertIs(root:match("foo", "b", "x"), root)
+	lu.assertNil(root:match("foo", "b", "y"))
+	lu.assertEquals(select(1, root:iterate(function() end, nil, nil, nil, true)), 3)
+	local tags = {}
+	for _, v in root:children() do tags[#tags + 1] = v:tag() end
+	lu.assertEquals(tags, {"bar", "baz"})
+	-- (compared as parsed, since the attribute order may differ)
+	local expected = xml.eval(foo:str())
+	lu.assertEquals(xml.eval(xml.str(root)), expected)
+	lu.assertEquals(xml.eval(root:str(1)), expected)
+	lu.assertEquals(xml.eval(xml.str(root:totable(0))), expected) -- nested proxies
+	lu.assertEquals(xml.eval(xml.str(root:totable(0), 0, nil, {threads = 2})),
+		expected)
+
+	-- snapshot of an XML file
+	local f = io.open("t.xml", "w")
+	f:write('<data><row id="1"/><row id="2"/></data>')
+	f:close()
+	xml.snapshot("t.xml", "t.snapshot")
+	root = xml.attach("t.snapshot")
+	lu.assertEquals(root:totable(), xml.load("t.xml"))
+	os.remove("t.xml")
+	os.remove("t.snapshot")
+	lu.assertErrorMsgContains("can't snapshot function", xml.snapshot, {print}, "t.snapshot")
+	os.remove("t.snapshot")
+	lu.assertErrorMsgContains("isn't a snapshot", xml.attach, "unittest.lua")
+end
+
+function TestXml:test_dump()
+	local foo = xml.eval('<foo a="1" b="x &amp; y"><bar>text</bar><bar n="2"/>more</foo>')
+	foo.n, foo.flag, foo.list = 42, false, {1.5, "x"}
+	local bin = xml.dump(foo)
+	local copy = xml.undump(bin)
+	lu.assertEquals(copy, foo)
+	lu.assertIs(getmetatable(copy[2]), getmetatable(foo))
+	lu.assertNil(getmetatable(copy.list))
+	foo.list[3] = foo
+	copy = xml.undump(xml.dump(foo))
+	lu.assertIs(copy.list[3], copy) -- shared tables stay shared
+	lu.assertEquals(xml.undump(xml.dump("abc")), "abc")
+
+	lu.assertErrorMsgContains("not a LuaXML dump", xml.undump, "<foo/>")
+	lu.assertErrorMsgContains("checksum mismatch", xml.undump,
+		bin:sub(1, -2) .. string.char((bin:byte(-1) + 1) % 256))
+	lu.assertErrorMsgContains("can't dump function", xml.dump, {print})
+
+	-- tables that (together) claim more entries than the input has bytes left
+	local function varint(n)
+		local s = ""
+		repeat
+			local b = n % 128
+			n = (n - b) / 128
+			s = s .. string.char(n > 0 and b + 128 or b)
+		until n == 0
+		return s
+	end
+	local claims = {string.char(5, 0) .. varint(1000) .. "\0"}
+	for i = 2, 1001 do claims[i] = string.char(5, 0) .. varint(1000) end
+	local payload = table.concat(claims)
+	local a, b = 1, 0 -- (Adler-32)
+	for i = 1, #payload do
+		a = (a + payload:byte(i)) % 65521
+		b = (b + a) % 65521
+	end
+	lu.assertErrorMsgContains("corrupt dump", xml.undump, "LuaXMLd\1"
+		.. string.char(a % 256, math.floor(a / 256), b % 256, math.floor(b / 256))
+		.. payload)
+end
+
+function TestXml:test_threads()
+	local root = xml.new("root")
+	for i = 1, 500 do
+		local row = root:append("row")
+		row.id, row.text = i, "a & b <" .. i .. ">"
+		row:append("name")[1] = "caf\195\169"
+		row[2] = i % 2 == 0 and 1.5 or "text"
+		if i % 3 == 0 then row.extended = {"x", true} end
+		if i % 5 == 0 then row[0] = i end
+	end
+	root[501] = false
+	local serial = xml.str(root, 1, "foo")
+	for _, threads in ipairs({2, 4, true}) do
+		lu.assertEquals(xml.str(root, 1, "foo", {threads = threads}), serial)
+	end
+	lu.assertEquals(xml.str(root[1], nil, nil, {threads = 2}), xml.str(root[1]))
+	lu.assertEquals(xml.str("text", nil, nil, {threads = 2}), xml.str("text"))
+end
+
+function TestXml:test_compression()
+	local foo = xml.eval('<foo a="1"><bar>text &amp; more</bar><baz/></foo>')
+	local magic = {gz = "\31\139", zst = "\40\181\47\253"}
+	for ext, name in pairs({gz = "gzip", zst = "zstd"}) do
+		local filename = "t.xml." .. ext
+		local ok, err = pcall(xml.save, foo, filename)
+		if ok then
+			local f = io.open(filename, "rb")
+			local data = f:read("*a")
+			f:close()
+			lu.assertEquals(data:sub(1, #magic[ext]), magic[ext])
+			lu.assertEquals(xml.load(filename), foo)
+			-- detection by content, not file name
+			os.rename(filename, "t.xml")
+			lu.assertEquals(xml.load("t.xml"), foo)
+			lu.assertEquals(xml.load("t.xml", nil, {compression = name}), foo)
+			-- truncated data
+			f = io.open("t.xml", "wb")
+			f:write(data:sub(1, #data - 8))
+			f:close()
+			lu.assertErrorMsgContains("error reading input", xml.load, "t.xml")
+			os.remove("t.xml")
+		else
+			lu.assertStrContains(err, name .. " support not available")
+		end
+	end
+	xml.save(foo, "t.xml.gz", nil, nil, nil, {compression = "none"})
+	lu.assertEquals(xml.load("t.xml.gz"), foo)
+	os.remove("t.xml.gz")
+	lu.assertErrorMsgContains('unsupported compression "bz2"', xml.load, "t.xml",
+		nil, {compression = "bz2"})
+end
+
+function TestXml:test_columns()
+	local foo = [==[<data><!-- rows -->
+	<row id="1" b="x &amp; y"><name>foo</name><name>bar</name><p v="2.5"/></row>
+	<other id="9"/><row id="2"/>
+	<row id="z">a<p v="q">b<![CDATA[<c>]]></p><row id="7"/></row>
+	</data>]==]
+	local fields = {"id", "@b", "name/text()", "p/v", "p/text()", "text()"}
+	local cols, n = xml.columns(foo, "row", fields, {id = "integer", ["p/v"] = "number"})
+	lu.assertEquals(n, 3)
+	lu.assertEquals(cols, {id = {1, 2, "z"}, ["@b"] = {"x & y"},
+		["name/text()"] = {"foo"}, ["p/v"] = {2.5, nil, "q"},
+		["p/text()"] = {[3] = "b<c>"}, ["text()"] = {[3] = "a"}})
+
+	-- (strings without '<' are file names)
+	local f = io.open("t.xml", "w")
+	f:write(foo)
+	f:close()
+	lu.assertEquals({xml.columns("t.xml", "row", {"id"})}, {{id = {"1", "2", "z"}}, 3})
+	os.remove("t.xml")
+	lu.assertErrorMsgContains("file error", xml.columns, "t.xml", "row", {"id"})
+	lu.assertErrorMsgContains('unsupported field "a/b/c"', xml.columns, foo, "row", {"a/b/c"})
+end
+
+function TestXml:test_clone()
+	local test = xml.load("test.xml")
+	local copy = test:clone()
+	lu.assertEquals(copy, test)
+	lu.assertNotIs(copy, test)
+	lu.assertNotIs(copy[2][1], test[2][1])
+	lu.assertIs(getmetatable(copy[2][1]), getmetatable(test))
+
+	-- limited depth shares deeper subelements
+	copy = test:clone(1)
+	lu.assertNotIs(copy[2], test[2])
+	lu.assertIs(copy[2][1], test[2][1])
+	lu.assertIs(test:clone(0)[2], test[2])
+
+	-- other table values are shared, plain tables become LuaXML objects
+	local foo = {{"bar"}, baz = {}, [0] = "foo"}
+	copy = xml.clone(foo)
+	lu.assertIs(copy.baz, foo.baz)
+	lu.assertEquals(copy:str(), '<foo>\n\t<table>bar</table>\n\t<baz />\n</foo>\n')
+end
+
+function TestXml:test_cache()
+	local test = xml.load("test.xml")
+	local expected = test:str()
+	lu.assertIs(test:cache(), test)
+	lu.assertEquals(test:str(), expected)
+	lu.assertEquals(test:str(), expected) -- (from cache)
+
+	local float = test:find("float", "id", "farClipping")
+	float[1] = "1234"
+	lu.assertEquals(test:str(), expected) -- modification wasn't marked
+	lu.assertIs(float:touch(), float)
+	expected = expected:gsub(">2000<", ">1234<")
+	lu.assertEquals(test:str(), expected)
+
+	-- subelements use the cache too, and may have a different indentation
+	local resources = test:find("resources")
+	resources:append("resource").name = "foo"
+	resources:touch()
+	lu.assertStrContains(test:str(), '\t\t<resource name="foo" />\n')
+	lu.assertStrContains(resources:str(), '\n\t<resource name="foo" />\n')
+	expected = test:str()
+	-- (cached strings only match their exact indentation)
+	local d = xml.eval("<r><a><b/></a></r>"):cache()
+	d:str()
+	d[1]:touch()
+	d[1]:str()
+	lu.assertEquals(d:str(4), xml.eval("<r><a><b/></a></r>"):str(4))
+	-- touching an appended element covers its (cached) parent
+	d[1]:append("c"):touch()
+	lu.assertStrContains(d:str(), "\t\t<c />\n")
+
+	-- cached strings use the current codes
+	xml.registerCode("~", "&tilde;")
+	local t = xml.new({"~"}, "t"):cache()
+	lu.assertEquals(t:str(), "<t>&tilde;</t>\n")
+	xml.registerCode("~", nil)
+	lu.assertEquals(t:str(), "<t>~</t>\n")
+
+	-- disabling discards the cached strings
+	test:cache(false)
+	lu.assertEquals(test:str(), expected)
+	float[1] = "2000"
+	lu.assertStrContains(test:str(), ">2000<")
+end
+
+function TestXml:test_diff()
+	local old = xml.eval('<cfg><port>80</port><host name="a" x="1"/><log/></cfg>')
+	local new = xml.eval('<cfg><port>8080</port><host y="2" name="b"/><debug/><log/></cfg>')
+	lu.assertEquals(xml.diff(old, xml.eval(old:str())), {})
+	lu.assertEquals(xml.diff(old, old), {})
+	local ops = xml.diff(old, new)
+	lu.assertEquals(#ops, 3)
+	lu.assertEquals(ops[1].op, "insert")
+	lu.assertEquals(ops[1].path, {3})
+	lu.assertIs(ops[1].value, new[3])
+	lu.assertEquals(ops[2], {op = "modify", path = {1, 1}, value = "8080"})
+	lu.assertEquals(ops[3], {op = "modify", path = {2},
+		attributes = {name = "b", x = false, y = "2"}})
+	ops = xml.diff(new, old)
+	lu.assertEquals(ops[1], {op = "delete", path = {3}, value = new[3]})
+
+	-- attribute order doesn't matter, values compare as strings
+	lu.assertEquals(xml.diff(xml.eval('<a x="1" y="2">3</a>'),
+		xml.new({y = "2", x = 1, 3}, "a")), {})
+	lu.assertEquals(xml.diff(xml.new("a"), xml.new("b")),
+		{{op = "modify", path = {}, tag = "b"}})
+	-- subelements with a different tag get replaced
+	ops = xml.diff(xml.eval("<a><b/></a>"), xml.eval("<a><c/></a>"))
+	lu.assertEquals({ops[1].op, ops[2].op}, {"insert", "delete"})
+	lu.assertEquals({ops[1].path, ops[2].path}, {{1}, {2}})
+
+	-- with caching, touch() marks elements for rehashing
+	old = xml.load("test.xml"):cache()
+	new = xml.load("test.xml")
+	lu.assertEquals(xml.diff(old, new), {})
+	local float = old:find("float", "id", "farClipping")
+	float[1] = "1234"
+	lu.assertEquals(xml.diff(old, new), {}) -- modification wasn't marked
+	float:touch()
+	ops = xml.diff(old, new)
+	lu.assertEquals(#ops, 1)
+	lu.assertEquals(ops[1].op, "modify")
+	lu.assertEquals(ops[1].value, "2000")
+	old:cache(false)
+end
+
+function TestXml:test_parsecache()
+	local foo = '<foo a="1"><bar>x</bar></foo>'
+	lu.assertEquals(xml.parsecache().budget, 0) -- disabled by default
+	-- (the budget covers the parsed tables plus keys, as per sizeof)
+	local entry = xml.sizeof(xml.eval(foo)) + xml.sizeof(foo)
+	local stats = xml.parsecache({budget = 2 * entry})
+	lu.assertEquals(stats.count, 0)
+
+	local first = xml.eval(foo)
+	local second = xml.eval(foo)
+	lu.assertEquals(second, first)
+	lu.assertNotIs(second, first) -- private copy
+	lu.assertIs(getmetatable(second[1]), getmetatable(first))
+	second[1][1] = "changed"
+	lu.assertEquals(xml.eval(foo)[1][1], "x")
+	xml.eval(foo, xml.WS_PRESERVE) -- (separate entry)
+	stats = xml.parsecache()
+	lu.assertEquals({stats.hits, stats.misses, stats.count}, {2, 2, 2})
+	lu.assertEquals(stats.size, 2 * entry)
+
+	-- least recently used entries get dropped to stay within the budget
+	xml.eval(foo .. " ")
+	stats = xml.parsecache()
+	lu.assertEquals(stats.count, 1)
+	lu.assertTrue(stats.size <= stats.budget)
+
+	-- registering codes invalidates the entries
+	local amp = '<r>&foo;</r>'
+	lu.assertEquals(xml.eval(amp)[1], "&foo;")
+	xml.registerCode("X", "&foo;")
+	lu.assertEquals(xml.parsecache().count, 0)
+	lu.assertEquals(xml.eval(amp)[1], "X")
+	xml.registerCode("X", nil)
+	lu.assertEquals(xml.eval(amp)[1], "&foo;")
+
+	-- shared mode, and files
+	xml.parsecache({shared = true})
+	local test = xml.load("test.xml")
+	lu.assertIs(xml.load("test.xml"), test)
+	lu.assertNotIs(xml.load("test.xml", xml.WS_PRESERVE), test)
+	lu.assertNotIs(xml.load("test.xml", nil, {drop = {"foo"}}), test)
+	lu.assertEquals(xml.parsecache().hits, 1)
+
+	xml.parsecache(false)
+	lu.assertNotIs(xml.load("test.xml"), test)
+	lu.assertEquals(xml.parsecache().count, 0)
+end
+
+function TestXml:test_indexby()
+	local test = xml.load("test.xml")
+
+	local idx = test:indexby("id")
+	lu.assertEquals(idx["dopplerVelocity"]:tag(), "float")
+	lu.assertEquals(idx["dopplerVelocity"][1], "330.0")
+	lu.assertEquals(idx["winTitle"], test:find(nil, "id", "winTitle"))
+	lu.assertNil(rawget(idx, "nonexistent"))
+	-- duplicate values map to a list of elements (in document order)
+	lu.assertNil(getmetatable(idx["0"]))
+	lu.assertEquals(#idx["0"], 6)
+	lu.assertEquals(idx["0"][1]:tag(), "deviceWindow")
+	lu.assertEquals(idx["0"][6]:tag(), "light")
+
+	-- restrict to certain tag
+	local resources = test:find("resources"):indexby("id", "resource")
+	lu.assertEquals(resources["6"].name, "veRner")
+	lu.assertNil(rawget(resources, "20")) -- a <container>, not <resource>
+
+	-- incremental update, and rebuild
+	local new = test:find("resources"):append("resource")
+	new.id = "42"
+	new:append("resource").id = "43"
+	lu.assertNil(resources["42"])
+	lu.assertIs(xml.indexadd(resources, new), resources)
+	lu.assertIs(resources["42"], new)
+	lu.assertIs(resources["43"], new[1])
+	resources["42"] = nil
+	lu.assertIs(xml.indexrebuild(resources), resources)
+	lu.assertIs(resources["42"], new)
+	lu.assertEquals(resources["6"]:tag(), "resource") -- (unique, not a list)
+
+	-- any attribute value is a key, without clashing with functions
+	local doc = xml.eval('<r><a k="add"/><a k="rebuild"/></r>')
+	idx = doc:indexby("k")
+	lu.assertIs(idx.add, doc[1])
+	doc:append("a").k = "indexadd"
+	xml.indexadd(idx, doc[3])
+	lu.assertIs(idx.indexadd, doc[3])
+	lu.assertIs(xml.indexrebuild(idx).rebuild, doc[2])
+	lu.assertErrorMsgContains("invalid index table", xml.indexrebuild, doc)
 end
 
 function TestXml:test_transform()
@@ -162,5 +868,161 @@ function TestXml:test_transform()
 	lu.assertEquals(test, expected)
 end
 
+-- Scaling tests: each public API gets run on inputs growing geometrically in
+-- a single dimension. We fit log(time) against log(n) and fail if the slope
+-- suggests growth beyond O(n log n) - quadratic behaviour shows up as ~2.
+-- As these take a while (and depend on timing), they only run if the
+-- LUAXML_SCALING environment variable is set - see "make scaling".
+
+TestScaling = {}
+
+function TestScaling:setUp()
+	self.tmpfile = os.tmpname()
+end
+
+function TestScaling:tearDown()
+	os.remove(self.tmpfile)
+end
+
+local SCALING_STEPS = 5 -- number of input sizes (each doubling the previous)
+local SCALING_SLOPE = 1.4 -- n log n stays well below this on our ranges
+
+-- CPU time for a single call of f(arg), best of several timed batches
+local function timeit(f, arg)
+	local best, reps = math.huge, 1
+	for _ = 1, 3 do
+		collectgarbage()
+		local t0, t1 = os.clock(), nil
+		repeat
+			for _ = 1, reps do f(arg) end
+			t1 = os.clock()
+			if t1 - t0 < 0.01 then reps = reps * 2; t0 = os.clock() end
+		until t1 - t0 >= 0.01
+		best = math.min(best, (t1 - t0) / reps)
+	end
+	return best
+end
+
+-- least squares slope of log(time) over log(n)
+local function slope(ns, ts)
+	local n, sx, sy, sxx, sxy = #ns, 0, 0, 0, 0
+	for i = 1, n do
+		local x, y = math.log(ns[i]), math.log(ts[i])
+		sx, sy, sxx, sxy = sx + x, sy + y, sxx + x * x, sxy + x * y
+	end
+	return (n * sxy - sx * sy) / (n * sxx - sx * sx)
+end
+
+-- `gen(n)` builds the input for size n, `ops` maps names to functions. An op
+-- may also be a table {func, size}, where `size(input)` returns the amount of
+-- work to scale against (e.g. the output length) instead of n.
+local function assertScaling(dimension, base, gen, ops)
+	local inputs, ns = {}, {}
+	for i = 1, SCALING_STEPS do
+		ns[i] = base * 2 ^ (i - 1)
+		inputs[i] = gen(ns[i])
+	end
+	for name, op in pairs(ops) do
+		local ts, sizes = {}, ns
+		if type(op) == "table" then
+			sizes = {}
+			for i = 1, SCALING_STEPS do sizes[i] = op[2](inputs[i]) end
+			op = op[1]
+		end
+		for i = 1, SCALING_STEPS do ts[i] = timeit(op, inputs[i]) end
+		local s = slope(sizes, ts)
+		if s > SCALING_SLOPE then
+			error(string.format("%s() grows as n^%.2f with %s (%s)",
+				name, s, dimension, table.concat(ts, ", ")), 2)
+		end
+	end
+end
+
+-- operations on XML strings
+local function string_ops()
+	local tmp = TestScaling.tmpfile
+	return {
+		eval = function(s) return xml.eval(s) end,
+		eval_normalize = function(s) return xml.eval(s, xml.WS_NORMALIZE) end,
+		eval_preserve = function(s) return xml.eval(s, xml.WS_PRESERVE) end,
+		load = function(s)
+			local f = io.open(tmp, "w"); f:write(s); f:close()
+			return xml.load(tmp)
+		end,
+		transform = function(s) return xml.transform(s, tmp, {}) end,
+	}
+end
+
+-- operations on parsed LuaXML objects
+local function object_ops()
+	return {
+		-- (output size may grow faster than n, e.g. indentation with depth)
+		str = {function(x) return x:str() end, function(x) return #x:str() end},
+		find = function(x) return x:find("nonexistent") end,
+		diff = function(x) return xml.diff(x, x) end,
+		iterate = function(x) return x:iterate(function() end, nil, nil, nil, true) end,
+		children = function(x)
+			for _ in x:children(nil, nil, nil, true) do end
+		end,
+	}
+end
+
+local function assertAllScaling(dimension, base, gen)
+	assertScaling(dimension, base, gen, string_ops())
+	assertScaling(dimension, base, function(n) return xml.eval(gen(n)) end,
+		object_ops())
+end
+
+function TestScaling:test_document_size()
+	assertAllScaling("document size", 250, function(n)
+		local t = {}
+		for i = 1, n do
+			t[i] = string.format('\n  <record id="%d">\n    <name>item %d</name>'
+				.. '\n    <value unit="m">%d.5</value>\n  </record>', i, i, i)
+		end
+		return "<records>" .. table.concat(t) .. "\n</records>"
+	end)
+end
+
+function TestScaling:test_depth()
+	assertAllScaling("nesting depth", 128, function(n)
+		return string.rep("<node>", n) .. "leaf" .. string.rep("</node>", n)
+	end)
+end
+
+function TestScaling:test_attributes()
+	assertAllScaling("attributes per element", 250, function(n)
+		local t = {}
+		for i = 1, n do t[i] = string.format(' attr%d="value %d"', i, i) end
+		return "<element" .. table.concat(t) .. " />"
+	end)
+end
+
+function TestScaling:test_children()
+	assertAllScaling("children per element", 1000, function(n)
+		return "<parent>" .. string.rep("<child>text</child>", n) .. "</parent>"
+	end)
+end
+
+function TestScaling:test_comments()
+	assertAllScaling("comment count", 1000, function(n)
+		return "<root>" .. string.rep("<!-- some comment --><e/>", n) .. "</root>"
+	end)
+end
+
+function TestScaling:test_entities()
+	assertAllScaling("entity density", 500, function(n)
+		return "<root>" .. string.rep("&lt;&#228;&amp;&#x20;&quot;", n) .. "</root>"
+	end)
+	assertScaling("entity density", 500, function(n)
+		return string.rep("&lt;&#228;&amp;&#x20;&quot;", n)
+	end, {decode = xml.decode})
+	assertScaling("entity density", 500, function(n)
+		return string.rep("<\228& \"", n)
+	end, {encode = xml.encode})
+end
+
+if not os.getenv("LUAXML_SCALING") then TestScaling = nil end
+
 -- run test suite with verbose output
 os.exit(lu.LuaUnit.run("-v"))